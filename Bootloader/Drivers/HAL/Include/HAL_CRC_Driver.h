@@ -4,6 +4,7 @@
 
 #include "stm32f4xx.h"                  // Device header
 #include "HAL_Common.h"
+#include "HAL_DMA_Driver.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,6 +16,10 @@ extern "C" {
 #define HAL_CRC_WRITE(x)  CRC->DR = x
 #define HAL_CRC_READ()    CRC->DR
 
+#define HAL_CRC_DMA_BUSY    0U  /*!< The DMA is still feeding the CRC unit   */
+#define HAL_CRC_DMA_DONE    1U  /*!< The CRC result is available             */
+#define HAL_CRC_DMA_ERROR   2U  /*!< The DMA stopped on a transfer error     */
+
 /*****************************************************************************/
 /*****************************************************************************/
 /*****************************************************************************/
@@ -41,6 +46,26 @@ uint32_t HAL_CRC_Calculate(uint32_t *pdata, uint32_t len);
  */
 uint32_t HAL_CRC_Accumulate(uint32_t *pdata, uint32_t len);
 
+/*! \brief Starts calculating the 32-bit CRC of the 32-bit data buffer with a
+ *  DMA2 memory to memory stream writing into the CRC data register. The CRC
+ *  unit is reset first. The CRC and DMA2 clocks have to be enabled and the
+ *  handle's Instance set beforehand, the rest of its Init is filled in here.
+ *
+ *  \param  *hdma       A DMA2 stream handle
+ *  \param  *pdata      The 32-bit data buffer
+ *  \param  len         Length of the buffer
+ */
+void HAL_CRC_Calculate_DMA(DMA_HandleTypeDef *hdma, const uint32_t *pdata, 
+                           uint32_t len);
+
+/*! \brief Polls the calculation started by HAL_CRC_Calculate_DMA and feeds
+ *  the next part of buffers longer than one DMA transfer.
+ *
+ *  \param  *pResult    The 32-bit CRC value, once the calculation is done
+ *  \retval uint8_t     HAL_CRC_DMA_BUSY, HAL_CRC_DMA_DONE or HAL_CRC_DMA_ERROR
+ */
+uint8_t HAL_CRC_DMA_Poll(uint32_t *pResult);
+
 #ifdef __cplusplus
 }
 #endif
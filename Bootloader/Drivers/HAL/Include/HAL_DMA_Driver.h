@@ -0,0 +1,127 @@
+/*! \file HAL_DMA_Driver.h */
+#ifndef _HAL_DMA_DRIVER_H_
+#define _HAL_DMA_DRIVER_H_
+
+#include "stm32f4xx.h"                  // Device header
+#include "HAL_Common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/*****************************************************************************/
+/*****************************************************************************/
+/*****************************************************************************/
+#define HAL_DMA_CHANNEL_0           0x0U
+#define HAL_DMA_CHANNEL_1           0x1U
+#define HAL_DMA_CHANNEL_2           0x2U
+#define HAL_DMA_CHANNEL_3           0x3U
+#define HAL_DMA_CHANNEL_4           0x4U
+#define HAL_DMA_CHANNEL_5           0x5U
+#define HAL_DMA_CHANNEL_6           0x6U
+#define HAL_DMA_CHANNEL_7           0x7U
+
+#define HAL_DMA_PERIPH_TO_MEMORY    0x0U    /*!< Peripheral to memory        */
+#define HAL_DMA_MEMORY_TO_PERIPH    0x1U    /*!< Memory to peripheral        */
+#define HAL_DMA_MEMORY_TO_MEMORY    0x2U    /*!< Memory to memory, DMA2 only */
+
+#define HAL_DMA_SIZE_BYTE           0x0U    /*!< 8  bit                      */
+#define HAL_DMA_SIZE_HALFWORD       0x1U    /*!< 16 bit                      */
+#define HAL_DMA_SIZE_WORD           0x2U    /*!< 32 bit                      */
+
+#define HAL_DMA_MODE_NORMAL         0x0U    /*!< Stops after NDTR items      */
+#define HAL_DMA_MODE_CIRCULAR       0x1U    /*!< Reloads NDTR and wraps      */
+
+#define HAL_DMA_PRIORITY_LOW        0x0U
+#define HAL_DMA_PRIORITY_MEDIUM     0x1U
+#define HAL_DMA_PRIORITY_HIGH       0x2U
+#define HAL_DMA_PRIORITY_VERY_HIGH  0x3U
+
+/* Stream event flags, normalized to the bit positions of stream 0 */
+#define HAL_DMA_FLAG_FE             0x01U   /*!< FIFO error                  */
+#define HAL_DMA_FLAG_DME            0x04U   /*!< Direct mode error           */
+#define HAL_DMA_FLAG_TE             0x08U   /*!< Transfer error              */
+#define HAL_DMA_FLAG_HT             0x10U   /*!< Half transfer               */
+#define HAL_DMA_FLAG_TC             0x20U   /*!< Transfer complete           */
+#define HAL_DMA_FLAG_ALL            0x3DU
+
+#define HAL_DMA_MAX_ITEMS           0xFFFFU /*!< Max NDTR value              */
+/*****************************************************************************/
+/*****************************************************************************/
+/*****************************************************************************/
+/*! \brief DMA stream configuration structure
+ */
+typedef struct
+{
+    uint32_t Channel;       /*!< Request channel of the stream               */
+    uint32_t Direction;     /*!< Peripheral to memory, memory to peripheral
+                                 or memory to memory                         */
+    uint32_t PeriphInc;     /*!< Increment the peripheral address: 1 or 0    */
+    uint32_t MemInc;        /*!< Increment the memory address: 1 or 0        */
+    uint32_t PeriphSize;    /*!< Size of the peripheral data items           */
+    uint32_t MemSize;       /*!< Size of the memory data items               */
+    uint32_t Mode;          /*!< Normal or circular mode                     */
+    uint32_t Priority;      /*!< Software priority of the stream             */
+} DMA_InitTypeDef;
+
+/*! \brief DMA stream handle
+ */
+typedef struct
+{
+    DMA_Stream_TypeDef  *Instance;  /*!< Stream registers base address       */
+    DMA_InitTypeDef     Init;       /*!< Stream configuration                */
+} DMA_HandleTypeDef;
+
+/*****************************************************************************/
+/*                       Driver Exposed HAL                                  */
+/*****************************************************************************/
+/*! \brief Configures the DMA stream from the handle's Init structure.
+ *  The stream is disabled and its event flags are cleared. The DMA clock
+ *  has to be enabled beforehand.
+ *
+ *  \param  *handle     The DMA stream handle
+ */
+void HAL_DMA_Init(DMA_HandleTypeDef *handle);
+
+/*! \brief Starts a transfer on the DMA stream.
+ *  For memory to memory transfers, srcAddress is programmed in the
+ *  peripheral address register as required by the hardware.
+ *
+ *  \param  *handle     The DMA stream handle
+ *  \param  srcAddress  The source address
+ *  \param  dstAddress  The destination address
+ *  \param  len         The number of data items, at most HAL_DMA_MAX_ITEMS
+ */
+void HAL_DMA_Start(DMA_HandleTypeDef *handle, uint32_t srcAddress,
+                   uint32_t dstAddress, uint32_t len);
+
+/*! \brief Disables the DMA stream and waits until it is stopped.
+ *
+ *  \param  *handle     The DMA stream handle
+ */
+void HAL_DMA_Abort(DMA_HandleTypeDef *handle);
+
+/*! \brief Returns the number of data items left to transfer (NDTR).
+ *
+ *  \param  *handle     The DMA stream handle
+ *  \retval uint32_t    The number of remaining data items
+ */
+uint32_t HAL_DMA_GetCounter(DMA_HandleTypeDef *handle);
+
+/*! \brief Returns the event flags of the stream.
+ *
+ *  \param  *handle     The DMA stream handle
+ *  \retval uint32_t    A combination of HAL_DMA_FLAG_x
+ */
+uint32_t HAL_DMA_GetFlags(DMA_HandleTypeDef *handle);
+
+/*! \brief Clears event flags of the stream.
+ *
+ *  \param  *handle     The DMA stream handle
+ *  \param  flags       A combination of HAL_DMA_FLAG_x
+ */
+void HAL_DMA_ClearFlags(DMA_HandleTypeDef *handle, uint32_t flags);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _HAL_DMA_DRIVER_H_ */
@@ -0,0 +1,40 @@
+/*! \file HAL_DWT_Driver.h */
+#ifndef _HAL_DWT_DRIVER_H_
+#define _HAL_DWT_DRIVER_H_
+
+#include "stm32f4xx.h"                  // Device header
+#include "HAL_Common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/*****************************************************************************/
+/*****************************************************************************/
+/*****************************************************************************/
+/*! \brief Reads the cycle counter. Differences of two readings are exact
+ *  across its wrap for intervals up to 2^32 cycles (42 s at 100 MHz) */
+#define HAL_DWT_CYCLES()            (DWT->CYCCNT)
+
+/*****************************************************************************/
+/*                       Driver Exposed HAL                                  */
+/*****************************************************************************/
+/*! \brief Enables the trace block and starts the cycle counter from 0.
+ */
+void HAL_DWT_Init(void);
+
+/*! \brief Stops the cycle counter and disables the trace block, before
+ *  handing the core to the application.
+ */
+void HAL_DWT_DeInit(void);
+
+/*! \brief Returns the cycles elapsed since a reading of HAL_DWT_CYCLES.
+ *
+ *  \param  start       The earlier reading
+ *  \retval uint32_t    The elapsed cycles
+ */
+uint32_t HAL_DWT_Elapsed(uint32_t start);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _HAL_DWT_DRIVER_H_ */
@@ -21,14 +21,31 @@ extern "C" {
 #define HAL_FLASH_SECTOR_5          0x5
 #define HAL_FLASH_SECTOR_6          0x6
 #define HAL_FLASH_SECTOR_7          0x7
+#define HAL_FLASH_SECTOR_COUNT      8U  /*!< 4x16 KB, 1x64 KB, 3x128 KB      */
     
 #define FLASH_TYPEPROGRAM_BYTE       (0x0 << FLASH_CR_PSIZE_Pos) /*!< 8  bit */
 #define FLASH_TYPEPROGRAM_HALFWORD   (0x1 << FLASH_CR_PSIZE_Pos) /*!< 16 bit */
 #define FLASH_TYPEPROGRAM_WORD       (0x2 << FLASH_CR_PSIZE_Pos) /*!< 32 bit */
 #define FLASH_TYPEPROGRAM_DOUBLEWORD (0x3 << FLASH_CR_PSIZE_Pos) /*!< 64 bit */
 
+#define HAL_FLASH_ERROR_NONE        0x0U
+#define HAL_FLASH_ERROR_WRP         FLASH_SR_WRPERR /*!< Write protection    */
+#define HAL_FLASH_ERROR_PGA         FLASH_SR_PGAERR /*!< Alignment           */
+#define HAL_FLASH_ERROR_PGP         FLASH_SR_PGPERR /*!< Parallelism         */
+#define HAL_FLASH_ERROR_PGS         FLASH_SR_PGSERR /*!< Sequence            */
+#define HAL_FLASH_ERROR_ALL         (HAL_FLASH_ERROR_WRP | HAL_FLASH_ERROR_PGA \
+                                   | HAL_FLASH_ERROR_PGP | HAL_FLASH_ERROR_PGS)
+
 #define FLASH_KEYR_1                0x45670123U
 #define FLASH_KEYR_2                0xCDEF89ABU
+
+/* Stores into the flash array, PG has to be set. The simulator replaces
+ * them with calls into its flash model (see Simulator/Include/stm32f4xx.h) */
+#ifndef HAL_FLASH_WRITE8
+#define HAL_FLASH_WRITE8(address, data)     (*(__IO uint8_t*)(address) = (data))
+#define HAL_FLASH_WRITE16(address, data)    (*(__IO uint16_t*)(address) = (data))
+#define HAL_FLASH_WRITE32(address, data)    (*(__IO uint32_t*)(address) = (data))
+#endif
 /*****************************************************************************/
 /*****************************************************************************/
 /*****************************************************************************/
@@ -43,6 +60,11 @@ typedef struct
 }Flash_EraseInitTypeDef;
     
     
+/*! \brief Cycles spent waiting for flash operations, counted with the
+ *  DWT cycle counter while it runs. Cleared by the user.
+ */
+extern uint32_t HAL_Flash_WaitCycles;
+
 /*****************************************************************************/
 /*                       Driver Exposed HAL                                  */
 /*****************************************************************************/
@@ -64,6 +86,28 @@ void HAL_Flash_Lock(void);
  */
 void HAL_Flash_Erase(Flash_EraseInitTypeDef *pEraseinit, uint32_t *sectorError);
 
+/*! \brief Starts erasing one sector and returns without waiting.
+ *  Any instruction fetch from flash stalls until the erase completes, the
+ *  flash stays unlocked until HAL_Flash_EraseSector_End is called.
+ *  
+ *  \param  sector      The sector number, below HAL_FLASH_SECTOR_COUNT
+ */
+void HAL_Flash_EraseSector_Start(uint32_t sector);
+
+/*! \brief Ends the erase started by HAL_Flash_EraseSector_Start. Waits if
+ *  the erase is still running.
+ *  
+ *  \retval uint32_t    HAL_FLASH_ERROR_NONE or the FLASH_SR error flags
+ *                      (HAL_FLASH_ERROR_x) that were raised
+ */
+uint32_t HAL_Flash_EraseSector_End(void);
+
+/*! \brief Returns whether a flash operation is running
+ *  
+ *  \retval uint8_t     1 while the flash is busy, 0 otherwise
+ */
+uint8_t HAL_Flash_IsBusy(void);
+
 /*! \brief Program byte, halfword, word, or double word at a specified address
  *  
  *  \param  typeProgram indicate the way to program at a specified address.
@@ -72,6 +116,36 @@ void HAL_Flash_Erase(Flash_EraseInitTypeDef *pEraseinit, uint32_t *sectorError);
  *  \param  data        spexifies the data to be programmed
  */
 void HAL_Flash_Program(uint32_t typeProgram, uint32_t address, uint8_t data);
+
+/*! \brief Programs a buffer of any length and alignment in one PG session.
+ *  The unaligned head and tail are programmed byte by byte, everything in
+ *  between with the requested parallelism. Programming stops at the first
+ *  error.
+ *  
+ *  \param  address     specifies the address to be programmed
+ *  \param  *src        the data to be programmed, no alignment required
+ *  \param  len         the number of bytes to be programmed
+ *  \param  psize       the parallelism, value can be of FLASH Type Program.
+ *                      WORD requires 2.7 to 3.6 V, DOUBLEWORD requires VPP.
+ *  \retval uint32_t    HAL_FLASH_ERROR_NONE or the FLASH_SR error flags
+ *                      (HAL_FLASH_ERROR_x) that were raised
+ */
+uint32_t HAL_Flash_ProgramBuffer(uint32_t address, const uint8_t *src, 
+                                 uint32_t len, uint32_t psize);
+
+/*! \brief Returns the start address of a flash sector
+ *  
+ *  \param  sector      The sector number, below HAL_FLASH_SECTOR_COUNT
+ *  \retval uint32_t    The address of the first byte of the sector
+ */
+uint32_t HAL_Flash_GetSectorAddress(uint32_t sector);
+
+/*! \brief Returns the size of a flash sector
+ *  
+ *  \param  sector      The sector number, below HAL_FLASH_SECTOR_COUNT
+ *  \retval uint32_t    The size of the sector in bytes
+ */
+uint32_t HAL_Flash_GetSectorSize(uint32_t sector);
     
 
 #ifdef __cplusplus
@@ -39,14 +39,49 @@ extern "C" {
 #define HAL_RCC_USART2_CLK_DISABLE()    RCC->APB1ENR &= ~RCC_APB1ENR_USART2EN
 #define HAL_RCC_USART6_CLK_DISABLE()    RCC->APB2ENR &= ~RCC_APB2ENR_USART6EN
 
+#define HAL_RCC_PWR_CLK_ENABLE()        RCC->APB1ENR |= RCC_APB1ENR_PWREN
+#define HAL_RCC_PWR_CLK_DISABLE()       RCC->APB1ENR &= ~RCC_APB1ENR_PWREN
+
+#define HAL_RCC_PLL_LOCK_TIMEOUT    0x10000U    /*!< Polls of PLLRDY/SWS     */
+
 /*****************************************************************************/
 /*****************************************************************************/
 /*****************************************************************************/
-
+/*! \brief System clock configuration: the PLL is fed by the HSI
+ *  SYSCLK = HSI / PLLM * PLLN / PLLP
+ */
+typedef struct
+{
+    uint32_t PLLM;              /*!< VCO input divider, 2 to 63. Keep the VCO
+                                     input between 1 and 2 MHz               */
+    uint32_t PLLN;              /*!< VCO multiplier, 50 to 432               */
+    uint32_t PLLP;              /*!< SYSCLK divider: 2, 4, 6 or 8            */
+    uint32_t PLLQ;              /*!< USB/SDIO divider, 2 to 15               */
+    uint32_t APB1Prescaler;     /*!< RCC_CFGR_PPRE1_DIVx, APB1 <= 50 MHz     */
+    uint32_t APB2Prescaler;     /*!< RCC_CFGR_PPRE2_DIVx, APB2 <= 100 MHz    */
+    uint32_t FlashLatency;      /*!< FLASH_ACR_LATENCY_xWS for SYSCLK        */
+} RCC_ClkInitTypeDef;
 
 /*****************************************************************************/
 /*                       Driver Exposed HAL                                  */
 /*****************************************************************************/
+/*! \brief Switches SYSCLK to the PLL and enables the flash accelerator.
+ *  Selects voltage scale 1, raises the flash wait states before the clock
+ *  and enables the ART instruction and data caches and the prefetch. The
+ *  AHB runs at SYSCLK. SystemCoreClock is updated.
+ *
+ *  \param  *init       The clock configuration
+ *  \retval uint32_t    HAL_OK, or HAL_FAIL when the PLL does not lock, in
+ *                      which case SYSCLK stays on the HSI
+ */
+uint32_t HAL_RCC_ClockConfig(RCC_ClkInitTypeDef *init);
+
+/*! \brief Restores the reset clock configuration: SYSCLK on the HSI, PLL
+ *  off, no bus prescalers, no flash wait states, flash accelerator off and
+ *  voltage scale 2. SystemCoreClock is updated.
+ */
+void HAL_RCC_DeInit(void);
+
 /*!
   * \brief  Returns the Presclaer for APB1
   * \retval uint8_t The prescaler value
@@ -0,0 +1,56 @@
+/*! \file HAL_SysTick_Driver.h */
+#ifndef _HAL_SYSTICK_DRIVER_H_
+#define _HAL_SYSTICK_DRIVER_H_
+
+#include "stm32f4xx.h"                  // Device header
+#include "HAL_Common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/*****************************************************************************/
+/*****************************************************************************/
+/*****************************************************************************/
+#define HAL_SYSTICK_RATE_HZ         1000U   /*!< One tick per millisecond    */
+
+/*****************************************************************************/
+/*                       Driver Exposed HAL                                  */
+/*****************************************************************************/
+/*! \brief Starts the millisecond time base from SystemCoreClock.
+ *  Call it again after SystemCoreClock changes.
+ */
+void HAL_SysTick_Init(void);
+
+/*! \brief Stops the time base, before handing the core to the application.
+ */
+void HAL_SysTick_DeInit(void);
+
+/*! \brief Returns the number of milliseconds since HAL_SysTick_Init.
+ *
+ *  \retval uint32_t    The tick count, wraps after 49 days
+ */
+uint32_t HAL_GetTick(void);
+
+/*! \brief Returns the deadline that expires in ms milliseconds.
+ *
+ *  \param  ms          The time to the deadline in milliseconds
+ *  \retval uint32_t    The deadline, for HAL_SysTick_IsExpired
+ */
+uint32_t HAL_SysTick_Deadline(uint32_t ms);
+
+/*! \brief Returns whether a deadline has passed. Works across the wrap of
+ *  the tick count for deadlines less than 24 days away.
+ *
+ *  \param  deadline    A deadline from HAL_SysTick_Deadline
+ *  \retval uint8_t     1 once the deadline has passed, 0 otherwise
+ */
+uint8_t HAL_SysTick_IsExpired(uint32_t deadline);
+
+/*! \brief The SysTick exception handler, counts the milliseconds.
+ */
+void SysTick_Handler(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _HAL_SYSTICK_DRIVER_H_ */
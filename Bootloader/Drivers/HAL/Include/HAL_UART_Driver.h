@@ -4,6 +4,7 @@
 
 #include "stm32f4xx.h"                  // Device header
 #include "HAL_Common.h"
+#include "HAL_DMA_Driver.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -20,6 +21,7 @@ extern "C" {
 #define HAL_UART_ERROR_DMA          ((uint32_t)0x00000010)   /*!< DMA transfer error  */
 #define HAL_UART_TIMEOUT            0x20                     /*!< UART timeout        */
 #define HAL_UART_INVALIDOP          0x30                     /*!< Invalid operation   */
+#define HAL_UART_BUSY               0x40                     /*!< Transfer ongoing    */
     
 #define HAL_UART_WORD8              0U
 #define HAL_UART_WORD9              1U
@@ -35,6 +37,8 @@ extern "C" {
 #define HAL_UART_OVERSAMPLING_8     1U
 #define HAL_UART_OVERSAMPLING_16    0U
 
+#define HAL_UART_BAUD_TOLERANCE     40U     /*!< Max deviation: 1/40 = 2.5%  */
+
 #define HAL_UART_MODE_RX            0x01U
 #define HAL_UART_MODE_TX            0x02U
 #define HAL_UART_MODE_TX_RX         0x03U
@@ -70,15 +74,25 @@ typedef struct
     USART_TypeDef       *Instance;      /*!< UART registers base address         */
     UART_InitTypeDef    Init;           /*!< UART communication parameters       */
     uint8_t             *pTxBuffPtr;    /*!<  Pointer to UART Tx transfer Buffer */
-    uint16_t            TxXferSize;     /*!< UART Tx Transfer size               */
-    uint16_t            TxXferCount;    /*!< UART Tx Transfer Counter            */
+    uint32_t            TxXferSize;     /*!< UART Tx Transfer size               */
+    uint32_t            TxXferCount;    /*!< UART Tx Transfer Counter            */
     uint8_t             *pRxBuffPtr;    /*!< Pointer to UART Rx transfer Buffer  */
-    uint16_t            RxXferSize;     /*!< UART Rx Transfer size               */
-    uint16_t            RxXferCount;    /*!< UART Rx Transfer Counter            */  
+    uint32_t            RxXferSize;     /*!< UART Rx Transfer size               */
+    uint32_t            RxXferCount;    /*!< UART Rx Transfer Counter            */  
     HAL_UARTState_t     RxState;        /*!< UART communication state            */
     HAL_UARTState_t     TxState;        /*!< UART communication state            */
     uint32_t            ErrorCode;      /*!< UART Error code                     */	
-    //TX_COMP_CB_t        *tx_cmp_cb ;    /*!< Application call back when tx completed */
+    DMA_HandleTypeDef   *hdmarx;        /*!< DMA stream of the Rx circular buffer*/
+    uint8_t             *pRxRingPtr;    /*!< Pointer to the Rx circular buffer   */
+    uint32_t            RxRingSize;     /*!< Size of the Rx circular buffer      */
+    uint32_t            RxRingTail;     /*!< Read index in the Rx circular buffer*/
+    DMA_HandleTypeDef   *hdmatx;        /*!< DMA stream of the Tx circular buffer*/
+    uint8_t             *pTxRingPtr;    /*!< Pointer to the Tx circular buffer   */
+    uint32_t            TxRingSize;     /*!< Size of the Tx circular buffer      */
+    volatile uint32_t   TxRingHead;     /*!< Write index in the Tx circular buffer*/
+    volatile uint32_t   TxRingTail;     /*!< First byte not sent yet             */
+    void                (*TxCpltCallback)(void); /*!< Called when the Tx circular
+                                                      buffer is sent, or 0   */
     //RX_COMP_CB_t        *rx_cmp_cb ;    /*!< Application callback when RX Completed */	
 }UART_HandleTypeDef;
 /*****************************************************************************/
@@ -92,7 +106,8 @@ typedef struct
 void HAL_UART_Init(UART_HandleTypeDef *handle);
 
 /*!
-  * \brief  API to do UART data Transmission in blocking mode
+  * \brief  API to do UART data Transmission in blocking mode. Not available
+  *         while the DMA transmission is started.
   * \param  *uart_handle : pointer to the handle structure of the UART Peripheral 
   * \param  *pBuffer : holds the pointer to the TX buffer 
   * \param  len : len of the data to be TXed
@@ -100,14 +115,16 @@ void HAL_UART_Init(UART_HandleTypeDef *handle);
   */
 void HAL_UART_Tx(UART_HandleTypeDef *handle, uint8_t *pBuffer, uint32_t len);
 
-
 /*!
- * \brief  API to do UART data Reception in block mode 
+ * \brief  API to do UART data Reception in block mode. Each byte is stored
+ *         straight into the caller's buffer, which keeps the bytes received
+ *         before a timeout.
  * \param  *handle : pointer to the handle structure of the UART peripheral  
  * \param  *buffer : holds the pointer to the RX buffer 
  * \param  len     : len of the data to be RXed
- * \param  timeout : timeout duration
- * \retval None
+ * \param  timeout : timeout for the whole reception in milliseconds
+ * \retval uint32_t : HAL_UART_ERROR_NONE, HAL_UART_TIMEOUT, HAL_UART_BUSY
+ *                    or HAL_UART_INVALIDOP
  */
 uint32_t HAL_UART_Rx(UART_HandleTypeDef *handle, uint8_t *buffer, uint32_t len, uint32_t timeout);
 
@@ -129,6 +146,159 @@ void HAL_UART_Tx_IT(UART_HandleTypeDef *handle, uint8_t *buffer, uint32_t len);
  */
 void HAL_UART_Rx_IT(UART_HandleTypeDef *handle,uint8_t *buffer, uint32_t len);
 
+/*!
+ * \brief  Checks whether a baud rate can be generated from the UART clock.
+ *         16x oversampling is preferred, 8x oversampling is used for the
+ *         rates it cannot reach.
+ * \param  *handle : pointer to the handle structure of the UART peripheral  
+ * \param  baud    : the baud rate to check
+ * \retval uint32_t : HAL_OK when the rate is within the baud rate
+ *                    tolerance, HAL_FAIL otherwise
+ */
+uint32_t HAL_UART_CheckBaudRate(UART_HandleTypeDef *handle, uint32_t baud);
+
+/*!
+ * \brief  Changes the baud rate of an initialized UART. The ongoing
+ *         transmission and the bytes queued for the DMA transmission are
+ *         completed first, reception is not interrupted.
+ *         16x oversampling is used when possible, 8x otherwise.
+ * \param  *handle : pointer to the handle structure of the UART peripheral  
+ * \param  baud    : the new baud rate
+ * \retval uint32_t : HAL_OK, or HAL_FAIL when the rate cannot be generated
+ */
+uint32_t HAL_UART_ChangeBaudRate(UART_HandleTypeDef *handle, uint32_t baud);
+
+/*!
+ * \brief  Starts streaming the received data into a circular buffer with DMA.
+ *         Reception then continues in hardware, independently of the CPU,
+ *         until HAL_UART_Rx_DMA_Stop is called. Blocking reception with
+ *         HAL_UART_Rx is not available in the meantime.
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \param  *hdma   : DMA stream handle with Instance, Init.Channel and
+ *                   Init.Priority set. The rest of Init is filled in here.
+ * \param  *ring   : holds the pointer to the circular buffer
+ * \param  size    : size of the circular buffer, at most HAL_DMA_MAX_ITEMS
+ * \retval None
+ */
+void HAL_UART_Rx_DMA_Start(UART_HandleTypeDef *handle, DMA_HandleTypeDef *hdma,
+                           uint8_t *ring, uint32_t size);
+
+/*!
+ * \brief  Stops the DMA reception into the circular buffer
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \retval None
+ */
+void HAL_UART_Rx_DMA_Stop(UART_HandleTypeDef *handle);
+
+/*!
+ * \brief  Returns the number of received bytes waiting in the circular buffer
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \retval uint32_t : the number of bytes available
+ */
+uint32_t HAL_UART_Rx_DMA_Available(UART_HandleTypeDef *handle);
+
+/*!
+ * \brief  Copies received bytes from the circular buffer without consuming
+ *         them
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \param  *buffer : holds the pointer to the destination buffer
+ * \param  len     : max number of bytes to copy
+ * \retval uint32_t : the number of bytes copied
+ */
+uint32_t HAL_UART_Rx_DMA_Peek(UART_HandleTypeDef *handle, uint8_t *buffer, uint32_t len);
+
+/*!
+ * \brief  Copies and consumes received bytes from the circular buffer
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \param  *buffer : holds the pointer to the destination buffer
+ * \param  len     : max number of bytes to read
+ * \retval uint32_t : the number of bytes read
+ */
+uint32_t HAL_UART_Rx_DMA_Read(UART_HandleTypeDef *handle, uint8_t *buffer, uint32_t len);
+
+/*!
+ * \brief  Returns the received bytes that follow each other in the circular
+ *         buffer, from the oldest one up to the newest or to the end of the
+ *         buffer, without copying or consuming them
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \param  **run   : set to the first byte of the run
+ * \retval uint32_t : the number of bytes in the run, 0 when none is waiting
+ */
+uint32_t HAL_UART_Rx_DMA_GetRun(UART_HandleTypeDef *handle, const uint8_t **run);
+
+/*!
+ * \brief  Consumes received bytes from the circular buffer without copying
+ *         them
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \param  len     : max number of bytes to consume
+ * \retval uint32_t : the number of bytes consumed
+ */
+uint32_t HAL_UART_Rx_DMA_Skip(UART_HandleTypeDef *handle, uint32_t len);
+
+/*!
+ * \brief  Discards every byte waiting in the circular buffer
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \retval None
+ */
+void HAL_UART_Rx_DMA_Flush(UART_HandleTypeDef *handle);
+
+/*!
+ * \brief  Starts the DMA transmission from a circular buffer. Bytes queued
+ *         with HAL_UART_Tx_DMA_Write are then sent in hardware while the
+ *         CPU goes on, and the transfer complete interrupt of the stream
+ *         starts the next run of the buffer: its handler has to call
+ *         HAL_UART_Tx_DMA_HandleIT. Set TxCpltCallback beforehand to be
+ *         told when the queued bytes are sent.
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \param  *hdma   : DMA stream handle with Instance, Init.Channel and
+ *                   Init.Priority set. The rest of Init is filled in here.
+ * \param  *ring   : holds the pointer to the circular buffer
+ * \param  size    : size of the circular buffer, at most HAL_DMA_MAX_ITEMS
+ * \retval None
+ */
+void HAL_UART_Tx_DMA_Start(UART_HandleTypeDef *handle, DMA_HandleTypeDef *hdma,
+                           uint8_t *ring, uint32_t size);
+
+/*!
+ * \brief  Stops the DMA transmission, the bytes not sent yet are dropped
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \retval None
+ */
+void HAL_UART_Tx_DMA_Stop(UART_HandleTypeDef *handle);
+
+/*!
+ * \brief  Returns the number of bytes that can be queued without waiting
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \retval uint32_t : the free space of the circular buffer
+ */
+uint32_t HAL_UART_Tx_DMA_Free(UART_HandleTypeDef *handle);
+
+/*!
+ * \brief  Copies bytes into the circular buffer and starts sending them.
+ *         Only waits when the buffer is full, for the bytes ahead to go.
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \param  *buffer : holds the pointer to the TX buffer, free on return
+ * \param  len     : len of the data to be TXed, less than the buffer size
+ * \retval uint32_t : HAL_UART_ERROR_NONE, or HAL_UART_INVALIDOP when len
+ *                    does not fit in the buffer
+ */
+uint32_t HAL_UART_Tx_DMA_Write(UART_HandleTypeDef *handle, const uint8_t *buffer, uint32_t len);
+
+/*!
+ * \brief  Waits until every queued byte has left the shift register
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \retval None
+ */
+void HAL_UART_Tx_DMA_Flush(UART_HandleTypeDef *handle);
+
+/*!
+ * \brief  Handles the interrupt of the DMA transmission stream: the run
+ *         that completed is released and the next one is started.
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \retval None
+ */
+void HAL_UART_Tx_DMA_HandleIT(UART_HandleTypeDef *handle);
+
 /**
   * @brief  This API handles UART interrupt request.
   * @param  huart: pointer to a uart_handle_t structure that contains
@@ -2,6 +2,29 @@
 
 uint8_t HAL_CRC_State;
 
+/*! \brief State of the DMA fed calculation
+ */
+static DMA_HandleTypeDef *pCrcDma;
+static uint32_t CrcDmaAddress;      /*!< Next word to feed to the CRC unit   */
+static uint32_t CrcDmaRemaining;    /*!< Number of words left to feed        */
+
+/*!
+  * \brief  Starts the next DMA transfer of at most HAL_DMA_MAX_ITEMS words.
+  */
+static void HAL_CRC_DMA_Next(void)
+{
+    uint32_t len = CrcDmaRemaining;
+    
+    if(len > HAL_DMA_MAX_ITEMS)
+    {
+        len = HAL_DMA_MAX_ITEMS;
+    }
+    
+    HAL_DMA_Start(pCrcDma, CrcDmaAddress, (uint32_t)(uintptr_t)&CRC->DR, len);
+    CrcDmaAddress += len * 4U;
+    CrcDmaRemaining -= len;
+}
+
 /*! \brief Calculates the 32-bit CRC of the 32-bit data buffer independently
  *  of the previousCRC value.
  *
@@ -48,3 +71,85 @@ uint32_t HAL_CRC_Accumulate(uint32_t *pdata, uint32_t len)
     HAL_CRC_State = HAL_READY;
     return HAL_CRC_READ();
 }
+
+/*! \brief Starts calculating the 32-bit CRC of the 32-bit data buffer with a
+ *  DMA2 memory to memory stream writing into the CRC data register. The CRC
+ *  unit is reset first. The CRC and DMA2 clocks have to be enabled and the
+ *  handle's Instance set beforehand, the rest of its Init is filled in here.
+ *
+ *  \param  *hdma       A DMA2 stream handle
+ *  \param  *pdata      The 32-bit data buffer
+ *  \param  len         Length of the buffer
+ */
+void HAL_CRC_Calculate_DMA(DMA_HandleTypeDef *hdma, const uint32_t *pdata, 
+                           uint32_t len)
+{
+    HAL_CRC_State = HAL_BUSY;
+    
+    // The source walks through the buffer, the destination is the fixed
+    // CRC data register. Memory to memory transfers take the source as the
+    // peripheral side.
+    hdma->Init.Channel = HAL_DMA_CHANNEL_0;
+    hdma->Init.Direction = HAL_DMA_MEMORY_TO_MEMORY;
+    hdma->Init.PeriphInc = 1;
+    hdma->Init.MemInc = 0;
+    hdma->Init.PeriphSize = HAL_DMA_SIZE_WORD;
+    hdma->Init.MemSize = HAL_DMA_SIZE_WORD;
+    hdma->Init.Mode = HAL_DMA_MODE_NORMAL;
+    hdma->Init.Priority = HAL_DMA_PRIORITY_LOW;
+    HAL_DMA_Init(hdma);
+    
+    pCrcDma = hdma;
+    CrcDmaAddress = (uint32_t)(uintptr_t)pdata;
+    CrcDmaRemaining = len;
+    
+    HAL_CRC_RESET();
+    
+    if(CrcDmaRemaining == 0)
+    {
+        HAL_CRC_State = HAL_READY;
+        return;
+    }
+    HAL_CRC_DMA_Next();
+}
+
+/*! \brief Polls the calculation started by HAL_CRC_Calculate_DMA and feeds
+ *  the next part of buffers longer than one DMA transfer.
+ *
+ *  \param  *pResult    The 32-bit CRC value, once the calculation is done
+ *  \retval uint8_t     HAL_CRC_DMA_BUSY, HAL_CRC_DMA_DONE or HAL_CRC_DMA_ERROR
+ */
+uint8_t HAL_CRC_DMA_Poll(uint32_t *pResult)
+{
+    uint32_t flags;
+    
+    if(HAL_CRC_State == HAL_READY)
+    {
+        *pResult = HAL_CRC_READ();
+        return HAL_CRC_DMA_DONE;
+    }
+    
+    flags = HAL_DMA_GetFlags(pCrcDma);
+    if(flags & HAL_DMA_FLAG_TE)
+    {
+        HAL_DMA_Abort(pCrcDma);
+        HAL_CRC_State = HAL_READY;
+        return HAL_CRC_DMA_ERROR;
+    }
+    
+    if((flags & HAL_DMA_FLAG_TC) == 0)
+    {
+        // The current transfer is still running
+        return HAL_CRC_DMA_BUSY;
+    }
+    
+    if(CrcDmaRemaining != 0)
+    {
+        HAL_CRC_DMA_Next();
+        return HAL_CRC_DMA_BUSY;
+    }
+    
+    HAL_CRC_State = HAL_READY;
+    *pResult = HAL_CRC_READ();
+    return HAL_CRC_DMA_DONE;
+}
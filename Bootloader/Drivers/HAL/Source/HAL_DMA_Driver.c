@@ -0,0 +1,158 @@
+#include "HAL_DMA_Driver.h"
+
+/*****************************************************************************/
+/*                       Helper Functions                                    */
+/*****************************************************************************/
+/*! \brief Bit offset of each stream's flags in the LISR/HISR registers
+ */
+static const uint8_t StreamFlagOffset[4] = {0U, 6U, 16U, 22U};
+
+/*!
+  * \brief  Returns the DMA controller the stream belongs to.
+  * \param  *handle : The DMA stream handle
+  * \retval DMA_TypeDef* The DMA controller
+  */
+static inline DMA_TypeDef *HAL_DMA_GetController(DMA_HandleTypeDef *handle)
+{
+    if((uint32_t)(uintptr_t)handle->Instance < DMA2_BASE)
+    {
+        return DMA1;
+    }
+    return DMA2;
+}
+
+/*!
+  * \brief  Returns the stream number (0 to 7) of the handle.
+  * \param  *handle : The DMA stream handle
+  * \retval uint32_t The stream number
+  */
+static inline uint32_t HAL_DMA_GetStreamNumber(DMA_HandleTypeDef *handle)
+{
+    uint32_t base = (uint32_t)(uintptr_t)HAL_DMA_GetController(handle);
+
+    return ((uint32_t)(uintptr_t)handle->Instance - (base + 0x10U)) / 0x18U;
+}
+
+/*****************************************************************************/
+/*                       Driver Exposed HAL                                  */
+/*****************************************************************************/
+/*! \brief Configures the DMA stream from the handle's Init structure.
+ *  The stream is disabled and its event flags are cleared. The DMA clock
+ *  has to be enabled beforehand.
+ *
+ *  \param  *handle     The DMA stream handle
+ */
+void HAL_DMA_Init(DMA_HandleTypeDef *handle)
+{
+    uint32_t cr;
+
+    HAL_DMA_Abort(handle);
+
+    cr  = handle->Init.Channel    << DMA_SxCR_CHSEL_Pos;
+    cr |= handle->Init.Priority   << DMA_SxCR_PL_Pos;
+    cr |= handle->Init.MemSize    << DMA_SxCR_MSIZE_Pos;
+    cr |= handle->Init.PeriphSize << DMA_SxCR_PSIZE_Pos;
+    cr |= handle->Init.MemInc     << DMA_SxCR_MINC_Pos;
+    cr |= handle->Init.PeriphInc  << DMA_SxCR_PINC_Pos;
+    cr |= handle->Init.Mode       << DMA_SxCR_CIRC_Pos;
+    cr |= handle->Init.Direction  << DMA_SxCR_DIR_Pos;
+    handle->Instance->CR = cr;
+
+    // Memory to memory transfers need the FIFO, everything else runs in
+    // direct mode
+    if(handle->Init.Direction == HAL_DMA_MEMORY_TO_MEMORY)
+    {
+        handle->Instance->FCR = DMA_SxFCR_DMDIS | DMA_SxFCR_FTH;
+    }
+    else
+    {
+        handle->Instance->FCR = 0;
+    }
+
+    HAL_DMA_ClearFlags(handle, HAL_DMA_FLAG_ALL);
+}
+
+/*! \brief Starts a transfer on the DMA stream.
+ *  For memory to memory transfers, srcAddress is programmed in the
+ *  peripheral address register as required by the hardware.
+ *
+ *  \param  *handle     The DMA stream handle
+ *  \param  srcAddress  The source address
+ *  \param  dstAddress  The destination address
+ *  \param  len         The number of data items, at most HAL_DMA_MAX_ITEMS
+ */
+void HAL_DMA_Start(DMA_HandleTypeDef *handle, uint32_t srcAddress,
+                   uint32_t dstAddress, uint32_t len)
+{
+    HAL_DMA_Abort(handle);
+    HAL_DMA_ClearFlags(handle, HAL_DMA_FLAG_ALL);
+
+    handle->Instance->NDTR = len;
+    if(handle->Init.Direction == HAL_DMA_MEMORY_TO_PERIPH)
+    {
+        handle->Instance->PAR  = dstAddress;
+        handle->Instance->M0AR = srcAddress;
+    }
+    else
+    {
+        handle->Instance->PAR  = srcAddress;
+        handle->Instance->M0AR = dstAddress;
+    }
+
+    handle->Instance->CR |= DMA_SxCR_EN;
+}
+
+/*! \brief Disables the DMA stream and waits until it is stopped.
+ *
+ *  \param  *handle     The DMA stream handle
+ */
+void HAL_DMA_Abort(DMA_HandleTypeDef *handle)
+{
+    handle->Instance->CR &= ~DMA_SxCR_EN;
+    while(handle->Instance->CR & DMA_SxCR_EN);
+}
+
+/*! \brief Returns the number of data items left to transfer (NDTR).
+ *
+ *  \param  *handle     The DMA stream handle
+ *  \retval uint32_t    The number of remaining data items
+ */
+uint32_t HAL_DMA_GetCounter(DMA_HandleTypeDef *handle)
+{
+    return handle->Instance->NDTR;
+}
+
+/*! \brief Returns the event flags of the stream.
+ *
+ *  \param  *handle     The DMA stream handle
+ *  \retval uint32_t    A combination of HAL_DMA_FLAG_x
+ */
+uint32_t HAL_DMA_GetFlags(DMA_HandleTypeDef *handle)
+{
+    DMA_TypeDef *dma = HAL_DMA_GetController(handle);
+    uint32_t stream = HAL_DMA_GetStreamNumber(handle);
+    uint32_t isr = (stream < 4U) ? dma->LISR : dma->HISR;
+
+    return (isr >> StreamFlagOffset[stream & 0x3U]) & HAL_DMA_FLAG_ALL;
+}
+
+/*! \brief Clears event flags of the stream.
+ *
+ *  \param  *handle     The DMA stream handle
+ *  \param  flags       A combination of HAL_DMA_FLAG_x
+ */
+void HAL_DMA_ClearFlags(DMA_HandleTypeDef *handle, uint32_t flags)
+{
+    DMA_TypeDef *dma = HAL_DMA_GetController(handle);
+    uint32_t stream = HAL_DMA_GetStreamNumber(handle);
+    uint32_t mask = (flags & HAL_DMA_FLAG_ALL) << StreamFlagOffset[stream & 0x3U];
+
+    if(stream < 4U)
+    {
+        dma->LIFCR = mask;
+    }
+    else
+    {
+        dma->HIFCR = mask;
+    }
+}
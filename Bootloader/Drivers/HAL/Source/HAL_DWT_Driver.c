@@ -0,0 +1,35 @@
+#include "HAL_DWT_Driver.h"
+
+/*****************************************************************************/
+/*                       Driver Exposed HAL                                  */
+/*****************************************************************************/
+/*! \brief Enables the trace block and starts the cycle counter from 0.
+ *  The counter runs at HCLK and keeps counting while a flash operation
+ *  stalls the core, so it also measures the time spent in those stalls.
+ */
+void HAL_DWT_Init(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+/*! \brief Stops the cycle counter and disables the trace block, before
+ *  handing the core to the application.
+ */
+void HAL_DWT_DeInit(void)
+{
+    DWT->CTRL &= ~DWT_CTRL_CYCCNTENA_Msk;
+    DWT->CYCCNT = 0;
+    CoreDebug->DEMCR &= ~CoreDebug_DEMCR_TRCENA_Msk;
+}
+
+/*! \brief Returns the cycles elapsed since a reading of HAL_DWT_CYCLES.
+ *
+ *  \param  start       The earlier reading
+ *  \retval uint32_t    The elapsed cycles
+ */
+uint32_t HAL_DWT_Elapsed(uint32_t start)
+{
+    return HAL_DWT_CYCLES() - start;
+}
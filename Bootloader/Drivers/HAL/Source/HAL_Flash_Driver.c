@@ -1,9 +1,53 @@
 #include "HAL_Flash_Driver.h"
 #include "HAL_RCC_Driver.h"
+#include "HAL_DWT_Driver.h"
+
+uint32_t HAL_Flash_WaitCycles;
 
 /*****************************************************************************/
 /*                       Helper Functions                                    */
 /*****************************************************************************/
+/*! \brief Size of each flash sector of the STM32F411xE
+ */
+static const uint32_t FlashSectorSize[HAL_FLASH_SECTOR_COUNT] =
+{
+    0x4000U, 0x4000U, 0x4000U, 0x4000U,     /* Sectors 0 to 3: 16 KB         */
+    0x10000U,                               /* Sector  4     : 64 KB         */
+    0x20000U, 0x20000U, 0x20000U            /* Sectors 5 to 7: 128 KB        */
+};
+
+/*! \brief Waits for the end of the ongoing flash operation, the wait is
+ *  added to HAL_Flash_WaitCycles
+ *  \retval uint32_t    The FLASH_SR error flags raised by the operation
+ */
+static inline uint32_t HAL_Flash_WaitForLastOperation(void)
+{
+    uint32_t start = HAL_DWT_CYCLES();
+    
+    while(FLASH->SR & FLASH_SR_BSY);
+    HAL_Flash_WaitCycles += HAL_DWT_CYCLES() - start;
+    
+    return FLASH->SR & HAL_FLASH_ERROR_ALL;
+}
+
+/*! \brief Sets the program parallelism (PSIZE)
+ *  \param  psize       Value can be of FLASH Type Program
+ */
+static inline void HAL_Flash_SetParallelism(uint32_t psize)
+{
+    FLASH->CR &= ~FLASH_CR_PSIZE;
+    FLASH->CR |= psize;
+}
+
+/*! \brief Reads a little endian word from a buffer of any alignment
+ *  \param  *src        the buffer
+ *  \retval uint32_t    the word
+ */
+static inline uint32_t HAL_Flash_GetWord(const uint8_t *src)
+{
+    return (uint32_t)src[0]         | ((uint32_t)src[1] << 8) 
+        | ((uint32_t)src[2] << 16) | ((uint32_t)src[3] << 24);
+}
 
 
 /*****************************************************************************/
@@ -34,40 +78,93 @@ void HAL_Flash_Lock(void)
  */
 void HAL_Flash_Erase(Flash_EraseInitTypeDef *pEraseInit, uint32_t *SectorError)
 {
-    uint8_t i;
-    uint8_t sectorNumber;
+    uint32_t i;
+    uint32_t sectorNumber;
+    
+    *SectorError = 0xFFFFFFFFU;
     
     // wait to make sure that no flash operation is ongoing
-    while(FLASH->SR & FLASH_SR_BSY);    
-    FLASH->CR |= pEraseInit->TypeErase;
+    HAL_Flash_WaitForLastOperation();
+    FLASH->SR = HAL_FLASH_ERROR_ALL;
     
     if(pEraseInit->TypeErase == HAL_FLASH_TYPEERASE_SECTOR)
     {
         // Check to make sure that that number of sectors to erase is valid
         if( (pEraseInit->NbSectors < 1) || 
-            (pEraseInit->NbSectors > (8 - pEraseInit->Sector)))
+            (pEraseInit->Sector >= HAL_FLASH_SECTOR_COUNT) ||
+            (pEraseInit->NbSectors > (HAL_FLASH_SECTOR_COUNT - pEraseInit->Sector)))
         {
             // Error
+            *SectorError = pEraseInit->Sector;
             return;
         }
         
         for(i = 0; i < pEraseInit->NbSectors; i++)
         {
             sectorNumber = pEraseInit->Sector + i;
-            FLASH->CR |= (sectorNumber << FLASH_CR_SNB_Pos);
-            FLASH->CR |= FLASH_CR_STRT; // Start Erase
-            while(FLASH->SR & FLASH_SR_BSY);    // Wait til finish
+            HAL_Flash_EraseSector_Start(sectorNumber);
+            if(HAL_Flash_EraseSector_End() != HAL_FLASH_ERROR_NONE)
+            {
+                *SectorError = sectorNumber;
+                break;
+            }
         }
     }
     else
     {
+        FLASH->CR |= pEraseInit->TypeErase;
         FLASH->CR |= FLASH_CR_STRT; // Start Erase
         // Wait until the operation is completed
-        while(FLASH->SR & FLASH_SR_BSY);    
+        if(HAL_Flash_WaitForLastOperation() != HAL_FLASH_ERROR_NONE)
+        {
+            *SectorError = 0;
+        }
     }
     
     // Clear erase bits
-    FLASH->CR &= ~(FLASH_CR_MER | FLASH_CR_SER);
+    FLASH->CR &= ~(FLASH_CR_MER | FLASH_CR_SER | FLASH_CR_SNB);
+}
+
+/*! \brief Starts erasing one sector and returns without waiting.
+ *  Any instruction fetch from flash stalls until the erase completes, the
+ *  flash stays unlocked until HAL_Flash_EraseSector_End is called.
+ *  
+ *  \param  sector      The sector number, below HAL_FLASH_SECTOR_COUNT
+ */
+void HAL_Flash_EraseSector_Start(uint32_t sector)
+{
+    HAL_Flash_WaitForLastOperation();
+    FLASH->SR = HAL_FLASH_ERROR_ALL;
+    
+    // Replace the sector number of the previous erase
+    FLASH->CR &= ~(FLASH_CR_MER | FLASH_CR_SNB);
+    FLASH->CR |= FLASH_CR_SER | (sector << FLASH_CR_SNB_Pos);
+    FLASH->CR |= FLASH_CR_STRT; // Start Erase
+}
+
+/*! \brief Ends the erase started by HAL_Flash_EraseSector_Start. Waits if
+ *  the erase is still running.
+ *  
+ *  \retval uint32_t    HAL_FLASH_ERROR_NONE or the FLASH_SR error flags
+ *                      (HAL_FLASH_ERROR_x) that were raised
+ */
+uint32_t HAL_Flash_EraseSector_End(void)
+{
+    uint32_t error = HAL_Flash_WaitForLastOperation();
+    
+    // Clear erase bits
+    FLASH->CR &= ~(FLASH_CR_SER | FLASH_CR_SNB);
+    
+    return error;
+}
+
+/*! \brief Returns whether a flash operation is running
+ *  
+ *  \retval uint8_t     1 while the flash is busy, 0 otherwise
+ */
+uint8_t HAL_Flash_IsBusy(void)
+{
+    return (FLASH->SR & FLASH_SR_BSY) ? 1 : 0;
 }
 
 /*! \brief Program byte, halfword, word, or double word at a specified address
@@ -80,11 +177,125 @@ void HAL_Flash_Erase(Flash_EraseInitTypeDef *pEraseInit, uint32_t *SectorError)
  */
 void HAL_Flash_Program(uint32_t typeProgram, uint32_t address, uint8_t data)
 {
+    (void)typeProgram;
+    
     while(FLASH->SR & FLASH_SR_BSY);    // Make sure flash is not busy
     
     FLASH->CR |= FLASH_CR_PG;           // Set Flashing Programming bit
     FLASH->CR |= FLASH_TYPEPROGRAM_BYTE;// Configure the PSIZE parallelism
-    *(__IO uint8_t*) address = data;
+    HAL_FLASH_WRITE8(address, data);
     while(FLASH->SR & FLASH_SR_BSY);    // Wait until flash operation is complete
     FLASH->CR &= ~FLASH_CR_PG;          // Disable flash programming
 }
+
+/*! \brief Programs a buffer of any length and alignment in one PG session.
+ *  The unaligned head and tail are programmed byte by byte, everything in
+ *  between with the requested parallelism. Programming stops at the first
+ *  error.
+ *  
+ *  \param  address     specifies the address to be programmed
+ *  \param  *src        the data to be programmed, no alignment required
+ *  \param  len         the number of bytes to be programmed
+ *  \param  psize       the parallelism, value can be of FLASH Type Program.
+ *                      WORD requires 2.7 to 3.6 V, DOUBLEWORD requires VPP.
+ *  \retval uint32_t    HAL_FLASH_ERROR_NONE or the FLASH_SR error flags
+ *                      (HAL_FLASH_ERROR_x) that were raised
+ */
+uint32_t HAL_Flash_ProgramBuffer(uint32_t address, const uint8_t *src, 
+                                 uint32_t len, uint32_t psize)
+{
+    uint32_t step = 1U << (psize >> FLASH_CR_PSIZE_Pos); // Bytes per write
+    uint32_t error;
+    
+    error = HAL_Flash_WaitForLastOperation();
+    FLASH->SR = error;                  // Clear errors of a previous operation
+    error = HAL_FLASH_ERROR_NONE;
+    
+    FLASH->CR |= FLASH_CR_PG;           // Set Flashing Programming bit
+    
+    // Unaligned head, one byte at a time
+    HAL_Flash_SetParallelism(FLASH_TYPEPROGRAM_BYTE);
+    while((len > 0) && ((address & (step - 1)) != 0) && (error == HAL_FLASH_ERROR_NONE))
+    {
+        HAL_FLASH_WRITE8(address, *src);
+        error = HAL_Flash_WaitForLastOperation();
+        address++;
+        src++;
+        len--;
+    }
+    
+    // Aligned body, step bytes at a time
+    HAL_Flash_SetParallelism(psize);
+    while((len >= step) && (error == HAL_FLASH_ERROR_NONE))
+    {
+        switch(psize)
+        {
+            case FLASH_TYPEPROGRAM_DOUBLEWORD:
+                HAL_FLASH_WRITE32(address, HAL_Flash_GetWord(src));
+                HAL_FLASH_WRITE32(address + 4, HAL_Flash_GetWord(src + 4));
+                break;
+            case FLASH_TYPEPROGRAM_WORD:
+                HAL_FLASH_WRITE32(address, HAL_Flash_GetWord(src));
+                break;
+            case FLASH_TYPEPROGRAM_HALFWORD:
+                HAL_FLASH_WRITE16(address, (uint16_t)(src[0] | (src[1] << 8)));
+                break;
+            default:
+                HAL_FLASH_WRITE8(address, *src);
+                break;
+        }
+        error = HAL_Flash_WaitForLastOperation();
+        address += step;
+        src += step;
+        len -= step;
+    }
+    
+    // Unaligned tail, one byte at a time
+    HAL_Flash_SetParallelism(FLASH_TYPEPROGRAM_BYTE);
+    while((len > 0) && (error == HAL_FLASH_ERROR_NONE))
+    {
+        HAL_FLASH_WRITE8(address, *src);
+        error = HAL_Flash_WaitForLastOperation();
+        address++;
+        src++;
+        len--;
+    }
+    
+    FLASH->CR &= ~FLASH_CR_PG;          // Disable flash programming
+    FLASH->SR = error;                  // Clear the reported errors
+    
+    return error;
+}
+
+/*! \brief Returns the start address of a flash sector
+ *  
+ *  \param  sector      The sector number, below HAL_FLASH_SECTOR_COUNT
+ *  \retval uint32_t    The address of the first byte of the sector
+ */
+uint32_t HAL_Flash_GetSectorAddress(uint32_t sector)
+{
+    uint32_t address = FLASH_BASE;
+    uint32_t i;
+    
+    for(i = 0; (i < sector) && (i < HAL_FLASH_SECTOR_COUNT); i++)
+    {
+        address += FlashSectorSize[i];
+    }
+    
+    return address;
+}
+
+/*! \brief Returns the size of a flash sector
+ *  
+ *  \param  sector      The sector number, below HAL_FLASH_SECTOR_COUNT
+ *  \retval uint32_t    The size of the sector in bytes
+ */
+uint32_t HAL_Flash_GetSectorSize(uint32_t sector)
+{
+    if(sector >= HAL_FLASH_SECTOR_COUNT)
+    {
+        return 0;
+    }
+    
+    return FlashSectorSize[sector];
+}
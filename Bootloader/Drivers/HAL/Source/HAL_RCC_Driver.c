@@ -8,7 +8,7 @@ const uint8_t APBPrescalerTable[8] = {1, 1, 1, 1, 2, 4, 8, 16};
   */
 uint8_t HAL_RCC_APB1_GetPrescaler(void)
 {
-    uint8_t tmp;
+    uint32_t tmp;
     tmp = RCC->CFGR & RCC_CFGR_PPRE1_Msk;
     tmp = tmp >> RCC_CFGR_PPRE1_Pos;
     
@@ -17,9 +17,88 @@ uint8_t HAL_RCC_APB1_GetPrescaler(void)
 
 uint8_t HAL_RCC_APB2_GetPrescaler(void)
 {
-    uint8_t tmp;
+    uint32_t tmp;
     tmp = RCC->CFGR & RCC_CFGR_PPRE2_Msk;
     tmp = tmp >> RCC_CFGR_PPRE2_Pos;
     
     return APBPrescalerTable[tmp];
 }
+
+/*! \brief Switches SYSCLK to the PLL and enables the flash accelerator.
+ *  Selects voltage scale 1, raises the flash wait states before the clock
+ *  and enables the ART instruction and data caches and the prefetch. The
+ *  AHB runs at SYSCLK. SystemCoreClock is updated.
+ *
+ *  \param  *init       The clock configuration
+ *  \retval uint32_t    HAL_OK, or HAL_FAIL when the PLL does not lock, in
+ *                      which case SYSCLK stays on the HSI
+ */
+uint32_t HAL_RCC_ClockConfig(RCC_ClkInitTypeDef *init)
+{
+    uint32_t timeout = HAL_RCC_PLL_LOCK_TIMEOUT;
+    
+    // Voltage scale 1 is needed above 84 MHz, it applies once the PLL is on
+    HAL_RCC_PWR_CLK_ENABLE();
+    PWR->CR |= PWR_CR_VOS;
+    
+    // The PLL can only be configured while it is off
+    RCC->CR &= ~RCC_CR_PLLON;
+    while(RCC->CR & RCC_CR_PLLRDY);
+    RCC->PLLCFGR = (init->PLLM << RCC_PLLCFGR_PLLM_Pos) |
+                   (init->PLLN << RCC_PLLCFGR_PLLN_Pos) |
+                   (((init->PLLP >> 1) - 1U) << RCC_PLLCFGR_PLLP_Pos) |
+                   (init->PLLQ << RCC_PLLCFGR_PLLQ_Pos) |
+                   RCC_PLLCFGR_PLLSRC_HSI;
+    RCC->CR |= RCC_CR_PLLON;
+    while((RCC->CR & RCC_CR_PLLRDY) == 0)
+    {
+        if(timeout-- == 0)
+        {
+            RCC->CR &= ~RCC_CR_PLLON;
+            HAL_RCC_PWR_CLK_DISABLE();
+            return HAL_FAIL;
+        }
+    }
+    
+    // More wait states before the clock goes up
+    FLASH->ACR = FLASH_ACR_ICEN | FLASH_ACR_DCEN | FLASH_ACR_PRFTEN | init->FlashLatency;
+    while((FLASH->ACR & FLASH_ACR_LATENCY) != init->FlashLatency);
+    
+    RCC->CFGR = (RCC->CFGR & ~(RCC_CFGR_HPRE | RCC_CFGR_PPRE1 | RCC_CFGR_PPRE2)) |
+                RCC_CFGR_HPRE_DIV1 | init->APB1Prescaler | init->APB2Prescaler;
+    RCC->CFGR = (RCC->CFGR & ~RCC_CFGR_SW) | RCC_CFGR_SW_PLL;
+    while((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_PLL);
+    
+    SystemCoreClockUpdate();
+    return HAL_OK;
+}
+
+/*! \brief Restores the reset clock configuration: SYSCLK on the HSI, PLL
+ *  off, no bus prescalers, no flash wait states, flash accelerator off and
+ *  voltage scale 2. SystemCoreClock is updated.
+ */
+void HAL_RCC_DeInit(void)
+{
+    RCC->CR |= RCC_CR_HSION;
+    while((RCC->CR & RCC_CR_HSIRDY) == 0);
+    
+    RCC->CFGR &= ~RCC_CFGR_SW;
+    while((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_HSI);
+    RCC->CFGR = 0;
+    
+    RCC->CR &= ~RCC_CR_PLLON;
+    while(RCC->CR & RCC_CR_PLLRDY);
+    RCC->PLLCFGR = 0x24003010U; // Reset value
+    
+    // Fewer wait states once the clock is down. The caches are flushed so
+    // that the application does not start with stale lines.
+    FLASH->ACR = FLASH_ACR_LATENCY_0WS;
+    FLASH->ACR = FLASH_ACR_ICRST | FLASH_ACR_DCRST;
+    FLASH->ACR = FLASH_ACR_LATENCY_0WS;
+    
+    HAL_RCC_PWR_CLK_ENABLE();
+    PWR->CR = (PWR->CR & ~PWR_CR_VOS) | PWR_CR_VOS_1;
+    HAL_RCC_PWR_CLK_DISABLE();
+    
+    SystemCoreClockUpdate();
+}
@@ -0,0 +1,66 @@
+#include "HAL_SysTick_Driver.h"
+
+/*! \brief Milliseconds since HAL_SysTick_Init
+ */
+static volatile uint32_t SysTickCount;
+
+/*****************************************************************************/
+/*                       Driver Exposed HAL                                  */
+/*****************************************************************************/
+/*! \brief Starts the millisecond time base from SystemCoreClock.
+ *  Call it again after SystemCoreClock changes.
+ *  The tick does not advance while a flash erase stalls the instruction
+ *  fetches of the exception, the deadlines of erases are only a safety net.
+ */
+void HAL_SysTick_Init(void)
+{
+    SysTick_Config(SystemCoreClock / HAL_SYSTICK_RATE_HZ);
+}
+
+/*! \brief Stops the time base, before handing the core to the application.
+ */
+void HAL_SysTick_DeInit(void)
+{
+    SysTick->CTRL = 0;
+    SysTick->LOAD = 0;
+    SysTick->VAL = 0;
+    SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+}
+
+/*! \brief Returns the number of milliseconds since HAL_SysTick_Init.
+ *
+ *  \retval uint32_t    The tick count, wraps after 49 days
+ */
+uint32_t HAL_GetTick(void)
+{
+    return SysTickCount;
+}
+
+/*! \brief Returns the deadline that expires in ms milliseconds.
+ *  One tick is added since the current one has already partly elapsed.
+ *
+ *  \param  ms          The time to the deadline in milliseconds
+ *  \retval uint32_t    The deadline, for HAL_SysTick_IsExpired
+ */
+uint32_t HAL_SysTick_Deadline(uint32_t ms)
+{
+    return SysTickCount + ms + 1U;
+}
+
+/*! \brief Returns whether a deadline has passed. Works across the wrap of
+ *  the tick count for deadlines less than 24 days away.
+ *
+ *  \param  deadline    A deadline from HAL_SysTick_Deadline
+ *  \retval uint8_t     1 once the deadline has passed, 0 otherwise
+ */
+uint8_t HAL_SysTick_IsExpired(uint32_t deadline)
+{
+    return ((int32_t)(SysTickCount - deadline) >= 0) ? 1 : 0;
+}
+
+/*! \brief The SysTick exception handler, counts the milliseconds.
+ */
+void SysTick_Handler(void)
+{
+    SysTickCount++;
+}
@@ -1,9 +1,26 @@
 #include "HAL_UART_Driver.h"
 #include "HAL_RCC_Driver.h"
+#include "HAL_SysTick_Driver.h"
+#include <string.h>
 
 /*****************************************************************************/
 /*                       Helper Functions                                    */
 /*****************************************************************************/
+/*!
+  * \brief  Returns the kernel clock of the UART peripheral.
+  * \param  *handle : pointer to the handle structure of the UART peripheral  
+  * \retval uint32_t : the clock frequency in Hz
+  */	
+static uint32_t HAL_UART_GetClock(UART_HandleTypeDef *handle)
+{
+    if(handle->Instance == USART2) //USART2 = APB1, USARt1 & USART6 = APB2
+    {
+        return SystemCoreClock / HAL_RCC_APB1_GetPrescaler();
+    }
+    
+    return SystemCoreClock / HAL_RCC_APB2_GetPrescaler();
+}
+
 /*!
   * \brief  Configures the Baud Rate for the UART peripheral.
   * \param  *handle : pointer to the handle structure of the UART peripheral  
@@ -19,22 +36,12 @@ static void HAL_UART_SetBaudRate(UART_HandleTypeDef *handle)
     /*                                                                  */
     /*------------------------------------------------------------------*/
     
-    uint32_t    fck;
-    uint8_t     bus_prescaler = 1;
+    uint32_t    fck = HAL_UART_GetClock(handle);
     uint32_t    baud = handle->Init.BaudRate;
     uint8_t     over8 = handle->Init.OverSampling;
     uint32_t    mantissa;
     uint32_t    fraction;
     uint32_t    mod;
-    if(handle->Instance == USART2) //USART2 = APB1, USARt1 & USART6 = APB2
-    {
-        bus_prescaler = HAL_RCC_APB1_GetPrescaler();
-    }
-    else
-    {
-        bus_prescaler = HAL_RCC_APB2_GetPrescaler();
-    }
-    fck = SystemCoreClock / bus_prescaler;
     
     // Determining mantissa of USARTDIV
     mantissa = fck / (baud * 8 * (2 - over8));
@@ -43,6 +50,14 @@ static void HAL_UART_SetBaudRate(UART_HandleTypeDef *handle)
     mod = fck % (baud * 8 * (2 - over8));
     fraction = (mod + (baud >> 1)) / baud ; 
     
+    // Carry a fraction rounded up to 1 into the mantissa. With OVER8 the
+    // fraction is 3 bits wide and bit 3 must be kept cleared.
+    if(fraction >= (8U * (2U - over8)))
+    {
+        mantissa++;
+        fraction = 0;
+    }
+    
     handle->Instance->BRR = 0;
     handle->Instance->BRR |= mantissa << USART_BRR_DIV_Mantissa_Pos;
     handle->Instance->BRR |= fraction << USART_BRR_DIV_Fraction_Pos;
@@ -164,6 +179,35 @@ static inline void HAL_UART_Disable_RXNE(UART_HandleTypeDef *handle)
     handle->Instance->CR1 &= ~USART_CR1_RXNEIE;
 }
 
+/*!
+  * \brief  Starts the DMA on the next contiguous run of the Tx circular
+  *         buffer, when one is waiting. Runs with the stream interrupt
+  *         masked, from the handler or from a critical section.
+  * \param  *handle : pointer to the handle structure of the UART peripheral  
+  * \retval None
+  */	
+static void HAL_UART_Tx_DMA_Next(UART_HandleTypeDef *handle)
+{
+    uint32_t head = handle->TxRingHead;
+    uint32_t tail = handle->TxRingTail;
+    
+    if(head == tail)
+    {
+        handle->TxXferSize = 0;
+        return;
+    }
+    
+    /* Up to the write index, or to the end of the buffer when it wrapped */
+    handle->TxXferSize = (head > tail) ? (head - tail) : (handle->TxRingSize - tail);
+    
+    /* TC is cleared before the DMA feeds DR, so it tells the end of this run.
+     * SR flags are rc_w0: a plain write clears TC alone, a read-modify-write
+     * would also clear an RXNE set after the read and lose the byte. */
+    handle->Instance->SR = ~USART_SR_TC;
+    HAL_DMA_Start(handle->hdmatx, (uint32_t)(uintptr_t)&handle->pTxRingPtr[tail], 
+                  (uint32_t)(uintptr_t)&handle->Instance->DR, handle->TxXferSize);
+}
+
 /*****************************************************************************/
 /*                       Driver Exposed HAL                                  */
 /*****************************************************************************/
@@ -225,51 +269,49 @@ void HAL_UART_Tx(UART_HandleTypeDef *handle, uint8_t *pBuffer, uint32_t len)
 }
 
 /*!
- * \brief  API to do UART data Reception in block mode 
+ * \brief  API to do UART data Reception in block mode. Each byte is stored
+ *         straight into the caller's buffer, which keeps the bytes received
+ *         before a timeout.
  * \param  *handle : pointer to the handle structure of the UART peripheral  
  * \param  *buffer : holds the pointer to the RX buffer 
  * \param  len     : len of the data to be RXed
- * \param  timeout : timeout duration
- * \retval None
+ * \param  timeout : timeout for the whole reception in milliseconds
+ * \retval uint32_t : HAL_UART_ERROR_NONE, HAL_UART_TIMEOUT, HAL_UART_BUSY
+ *                    or HAL_UART_INVALIDOP
  */
 uint32_t HAL_UART_Rx(UART_HandleTypeDef *handle, uint8_t *buffer, uint32_t len, uint32_t timeout)
 {
-    handle->RxXferCount = len;
-    handle->RxXferSize = len;
-    handle->pRxBuffPtr = buffer;
+    uint32_t deadline = HAL_SysTick_Deadline(timeout);
     
-    uint8_t msg[handle->RxXferSize];
-    uint8_t i = 0;
     /* Check to see if the state is Ready */
     if(handle->RxState != HAL_UART_STATE_READY) 
-        return HAL_BUSY;
+        return HAL_UART_BUSY;
 
     /* Now check to see if uart mode handles reception */
     if((handle->Init.Mode & HAL_UART_MODE_RX) == HAL_UART_MODE_RX)
     {
+        handle->pRxBuffPtr = buffer;
+        handle->RxXferSize = len;
+        handle->RxXferCount = len;
         handle->RxState = HAL_UART_STATE_BUSY_RX;
         /* Just in case, disable RXNEIE */
         HAL_UART_Disable_RXNE(handle);
         
-        
         /* Wait for the receive register to not be empty */
-        while(handle->RxXferCount--)
+        while(handle->RxXferCount > 0)
         {
             while((handle->Instance->SR & USART_SR_RXNE) == 0)
             {
-                if(timeout-- == 0)
+                if(HAL_SysTick_IsExpired(deadline) == 1)
                 {
                     handle->RxState = HAL_UART_STATE_READY;
                     return HAL_UART_TIMEOUT;
                 }
             }
-            msg[i++] = (uint8_t)handle->Instance->DR;
+            *handle->pRxBuffPtr++ = (uint8_t)handle->Instance->DR;
+            handle->RxXferCount--;
         }
         
-        for(i = 0; i < handle->RxXferSize; i++)
-        {
-            buffer[i] = msg[i];
-        }
         handle->RxState = HAL_UART_STATE_READY;
         
         return HAL_UART_ERROR_NONE;
@@ -278,4 +320,402 @@ uint32_t HAL_UART_Rx(UART_HandleTypeDef *handle, uint8_t *buffer, uint32_t len,
     {
         return HAL_UART_INVALIDOP;
     }
-}
\ No newline at end of file
+}
+
+/*!
+ * \brief  Checks whether a baud rate can be generated from the UART clock.
+ *         16x oversampling is preferred, 8x oversampling is used for the
+ *         rates it cannot reach.
+ * \param  *handle : pointer to the handle structure of the UART peripheral  
+ * \param  baud    : the baud rate to check
+ * \retval uint32_t : HAL_OK when the rate is within the baud rate
+ *                    tolerance, HAL_FAIL otherwise
+ */
+uint32_t HAL_UART_CheckBaudRate(UART_HandleTypeDef *handle, uint32_t baud)
+{
+    uint32_t fck = HAL_UART_GetClock(handle);
+    uint32_t over8 = HAL_UART_OVERSAMPLING_16;
+    uint32_t div;
+    uint32_t actual;
+    uint32_t deviation;
+    
+    if((baud == 0) || (baud > (fck / 8U)))
+    {
+        return HAL_FAIL;
+    }
+    if(baud > (fck / 16U))
+    {
+        over8 = HAL_UART_OVERSAMPLING_8;
+    }
+    
+    // USARTDIV in 1/16th or 1/8th, rounded to the nearest step
+    div = (fck + (baud >> 1)) / baud;
+    actual = fck / div;
+    deviation = (actual > baud) ? (actual - baud) : (baud - actual);
+    
+    if(((div >> (4U - over8)) == 0) || 
+       (deviation > (baud / HAL_UART_BAUD_TOLERANCE)))
+    {
+        return HAL_FAIL;
+    }
+    
+    return HAL_OK;
+}
+
+/*!
+ * \brief  Changes the baud rate of an initialized UART. The ongoing
+ *         transmission and the bytes queued for the DMA transmission are
+ *         completed first, reception is not interrupted.
+ *         16x oversampling is used when possible, 8x otherwise.
+ * \param  *handle : pointer to the handle structure of the UART peripheral  
+ * \param  baud    : the new baud rate
+ * \retval uint32_t : HAL_OK, or HAL_FAIL when the rate cannot be generated
+ */
+uint32_t HAL_UART_ChangeBaudRate(UART_HandleTypeDef *handle, uint32_t baud)
+{
+    if(HAL_UART_CheckBaudRate(handle, baud) != HAL_OK)
+    {
+        return HAL_FAIL;
+    }
+    
+    /* Let the last byte leave the shift register */
+    if(handle->hdmatx != 0)
+    {
+        HAL_UART_Tx_DMA_Flush(handle);
+    }
+    while(!(handle->Instance->SR & USART_SR_TC));
+    
+    HAL_UART_Disable(handle);
+    handle->Init.BaudRate = baud;
+    if(baud > (HAL_UART_GetClock(handle) / 16U))
+    {
+        handle->Init.OverSampling = HAL_UART_OVERSAMPLING_8;
+    }
+    else
+    {
+        handle->Init.OverSampling = HAL_UART_OVERSAMPLING_16;
+    }
+    HAL_UART_SetOverSampling(handle);
+    HAL_UART_SetBaudRate(handle);
+    HAL_UART_Enable(handle);
+    
+    return HAL_OK;
+}
+
+/*!
+ * \brief  Starts streaming the received data into a circular buffer with DMA.
+ *         Reception then continues in hardware, independently of the CPU,
+ *         until HAL_UART_Rx_DMA_Stop is called. Blocking reception with
+ *         HAL_UART_Rx is not available in the meantime.
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \param  *hdma   : DMA stream handle with Instance, Init.Channel and
+ *                   Init.Priority set. The rest of Init is filled in here.
+ * \param  *ring   : holds the pointer to the circular buffer
+ * \param  size    : size of the circular buffer, at most HAL_DMA_MAX_ITEMS
+ * \retval None
+ */
+void HAL_UART_Rx_DMA_Start(UART_HandleTypeDef *handle, DMA_HandleTypeDef *hdma,
+                           uint8_t *ring, uint32_t size)
+{
+    handle->hdmarx = hdma;
+    handle->pRxRingPtr = ring;
+    handle->RxRingSize = size;
+    handle->RxRingTail = 0;
+    
+    /* The DMA request replaces the RXNE interrupt */
+    HAL_UART_Disable_RXNE(handle);
+    
+    hdma->Init.Direction = HAL_DMA_PERIPH_TO_MEMORY;
+    hdma->Init.PeriphInc = 0;
+    hdma->Init.MemInc = 1;
+    hdma->Init.PeriphSize = HAL_DMA_SIZE_BYTE;
+    hdma->Init.MemSize = HAL_DMA_SIZE_BYTE;
+    hdma->Init.Mode = HAL_DMA_MODE_CIRCULAR;
+    HAL_DMA_Init(hdma);
+    
+    /* Drop any stale byte and clear the error flags: read SR then DR */
+    (void)handle->Instance->SR;
+    (void)handle->Instance->DR;
+    
+    HAL_DMA_Start(hdma, (uint32_t)(uintptr_t)&handle->Instance->DR, (uint32_t)(uintptr_t)ring, size);
+    handle->Instance->CR3 |= USART_CR3_DMAR;
+    
+    handle->RxState = HAL_UART_STATE_BUSY_RX;
+}
+
+/*!
+ * \brief  Stops the DMA reception into the circular buffer
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \retval None
+ */
+void HAL_UART_Rx_DMA_Stop(UART_HandleTypeDef *handle)
+{
+    handle->Instance->CR3 &= ~USART_CR3_DMAR;
+    HAL_DMA_Abort(handle->hdmarx);
+    
+    handle->RxState = HAL_UART_STATE_READY;
+}
+
+/*!
+ * \brief  Returns the number of received bytes waiting in the circular buffer
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \retval uint32_t : the number of bytes available
+ */
+uint32_t HAL_UART_Rx_DMA_Available(UART_HandleTypeDef *handle)
+{
+    uint32_t head = handle->RxRingSize - HAL_DMA_GetCounter(handle->hdmarx);
+    
+    /* NDTR reloads to the buffer size once it reaches the end */
+    if(head >= handle->RxRingSize)
+    {
+        head = 0;
+    }
+    
+    return (head + handle->RxRingSize - handle->RxRingTail) % handle->RxRingSize;
+}
+
+/*!
+ * \brief  Copies received bytes from the circular buffer without consuming
+ *         them
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \param  *buffer : holds the pointer to the destination buffer
+ * \param  len     : max number of bytes to copy
+ * \retval uint32_t : the number of bytes copied
+ */
+uint32_t HAL_UART_Rx_DMA_Peek(UART_HandleTypeDef *handle, uint8_t *buffer, uint32_t len)
+{
+    uint32_t available = HAL_UART_Rx_DMA_Available(handle);
+    uint32_t first = handle->RxRingSize - handle->RxRingTail;
+    
+    if(len > available)
+    {
+        len = available;
+    }
+    
+    /* The bytes up to the end of the circular buffer, then the wrapped ones */
+    if(first > len)
+    {
+        first = len;
+    }
+    memcpy(buffer, &handle->pRxRingPtr[handle->RxRingTail], first);
+    memcpy(&buffer[first], handle->pRxRingPtr, len - first);
+    
+    return len;
+}
+
+/*!
+ * \brief  Copies and consumes received bytes from the circular buffer
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \param  *buffer : holds the pointer to the destination buffer
+ * \param  len     : max number of bytes to read
+ * \retval uint32_t : the number of bytes read
+ */
+uint32_t HAL_UART_Rx_DMA_Read(UART_HandleTypeDef *handle, uint8_t *buffer, uint32_t len)
+{
+    len = HAL_UART_Rx_DMA_Peek(handle, buffer, len);
+    
+    return HAL_UART_Rx_DMA_Skip(handle, len);
+}
+
+/*!
+ * \brief  Returns the received bytes that follow each other in the circular
+ *         buffer, from the oldest one up to the newest or to the end of the
+ *         buffer, without copying or consuming them
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \param  **run   : set to the first byte of the run
+ * \retval uint32_t : the number of bytes in the run, 0 when none is waiting
+ */
+uint32_t HAL_UART_Rx_DMA_GetRun(UART_HandleTypeDef *handle, const uint8_t **run)
+{
+    uint32_t available = HAL_UART_Rx_DMA_Available(handle);
+    uint32_t first = handle->RxRingSize - handle->RxRingTail;
+    
+    *run = &handle->pRxRingPtr[handle->RxRingTail];
+    
+    /* The wrapped bytes are the next run */
+    return (available < first) ? available : first;
+}
+
+/*!
+ * \brief  Consumes received bytes from the circular buffer without copying
+ *         them
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \param  len     : max number of bytes to consume
+ * \retval uint32_t : the number of bytes consumed
+ */
+uint32_t HAL_UART_Rx_DMA_Skip(UART_HandleTypeDef *handle, uint32_t len)
+{
+    uint32_t available = HAL_UART_Rx_DMA_Available(handle);
+    
+    if(len > available)
+    {
+        len = available;
+    }
+    handle->RxRingTail = (handle->RxRingTail + len) % handle->RxRingSize;
+    
+    return len;
+}
+
+/*!
+ * \brief  Discards every byte waiting in the circular buffer
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \retval None
+ */
+void HAL_UART_Rx_DMA_Flush(UART_HandleTypeDef *handle)
+{
+    HAL_UART_Rx_DMA_Skip(handle, HAL_UART_Rx_DMA_Available(handle));
+}
+
+/*!
+ * \brief  Starts the DMA transmission from a circular buffer. Bytes queued
+ *         with HAL_UART_Tx_DMA_Write are then sent in hardware while the
+ *         CPU goes on, and the transfer complete interrupt of the stream
+ *         starts the next run of the buffer: its handler has to call
+ *         HAL_UART_Tx_DMA_HandleIT. Set TxCpltCallback beforehand to be
+ *         told when the queued bytes are sent.
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \param  *hdma   : DMA stream handle with Instance, Init.Channel and
+ *                   Init.Priority set. The rest of Init is filled in here.
+ * \param  *ring   : holds the pointer to the circular buffer
+ * \param  size    : size of the circular buffer, at most HAL_DMA_MAX_ITEMS
+ * \retval None
+ */
+void HAL_UART_Tx_DMA_Start(UART_HandleTypeDef *handle, DMA_HandleTypeDef *hdma,
+                           uint8_t *ring, uint32_t size)
+{
+    handle->hdmatx = hdma;
+    handle->pTxRingPtr = ring;
+    handle->TxRingSize = size;
+    handle->TxRingHead = 0;
+    handle->TxRingTail = 0;
+    handle->TxXferSize = 0;
+    
+    /* The DMA request replaces the TXE interrupt */
+    HAL_UART_Disable_TXE(handle);
+    
+    hdma->Init.Direction = HAL_DMA_MEMORY_TO_PERIPH;
+    hdma->Init.PeriphInc = 0;
+    hdma->Init.MemInc = 1;
+    hdma->Init.PeriphSize = HAL_DMA_SIZE_BYTE;
+    hdma->Init.MemSize = HAL_DMA_SIZE_BYTE;
+    hdma->Init.Mode = HAL_DMA_MODE_NORMAL;
+    HAL_DMA_Init(hdma);
+    
+    /* Written while the stream is disabled, kept by every start */
+    hdma->Instance->CR |= DMA_SxCR_TCIE | DMA_SxCR_TEIE;
+    handle->Instance->CR3 |= USART_CR3_DMAT;
+    
+    handle->TxState = HAL_UART_STATE_BUSY_TX;
+}
+
+/*!
+ * \brief  Stops the DMA transmission, the bytes not sent yet are dropped
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \retval None
+ */
+void HAL_UART_Tx_DMA_Stop(UART_HandleTypeDef *handle)
+{
+    handle->Instance->CR3 &= ~USART_CR3_DMAT;
+    HAL_DMA_Abort(handle->hdmatx);
+    handle->hdmatx->Instance->CR &= ~(DMA_SxCR_TCIE | DMA_SxCR_TEIE);
+    HAL_DMA_ClearFlags(handle->hdmatx, HAL_DMA_FLAG_ALL);
+    
+    handle->hdmatx = 0;
+    handle->TxXferSize = 0;
+    handle->TxState = HAL_UART_STATE_READY;
+}
+
+/*!
+ * \brief  Returns the number of bytes that can be queued without waiting
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \retval uint32_t : the free space of the circular buffer
+ */
+uint32_t HAL_UART_Tx_DMA_Free(UART_HandleTypeDef *handle)
+{
+    uint32_t used = (handle->TxRingHead + handle->TxRingSize - handle->TxRingTail) % handle->TxRingSize;
+    
+    /* One byte stays free, so a full buffer differs from an empty one */
+    return handle->TxRingSize - 1U - used;
+}
+
+/*!
+ * \brief  Copies bytes into the circular buffer and starts sending them.
+ *         Only waits when the buffer is full, for the bytes ahead to go.
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \param  *buffer : holds the pointer to the TX buffer, free on return
+ * \param  len     : len of the data to be TXed, less than the buffer size
+ * \retval uint32_t : HAL_UART_ERROR_NONE, or HAL_UART_INVALIDOP when len
+ *                    does not fit in the buffer
+ */
+uint32_t HAL_UART_Tx_DMA_Write(UART_HandleTypeDef *handle, const uint8_t *buffer, uint32_t len)
+{
+    uint32_t head = handle->TxRingHead;
+    uint32_t first = handle->TxRingSize - head;
+    uint32_t primask;
+    
+    if(len >= handle->TxRingSize)
+    {
+        return HAL_UART_INVALIDOP;
+    }
+    
+    /* The handler frees the bytes ahead as they are sent */
+    while(HAL_UART_Tx_DMA_Free(handle) < len);
+    
+    /* The bytes up to the end of the circular buffer, then the wrapped ones */
+    if(first > len)
+    {
+        first = len;
+    }
+    memcpy(&handle->pTxRingPtr[head], buffer, first);
+    memcpy(handle->pTxRingPtr, &buffer[first], len - first);
+    handle->TxRingHead = (head + len) % handle->TxRingSize;
+    
+    /* The handler starts the next run by itself, unless the DMA is idle */
+    primask = __get_PRIMASK();
+    __disable_irq();
+    if(handle->TxXferSize == 0)
+    {
+        HAL_UART_Tx_DMA_Next(handle);
+    }
+    __set_PRIMASK(primask);
+    
+    return HAL_UART_ERROR_NONE;
+}
+
+/*!
+ * \brief  Waits until every queued byte has left the shift register
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \retval None
+ */
+void HAL_UART_Tx_DMA_Flush(UART_HandleTypeDef *handle)
+{
+    /* The tail reaches the head once the last run is sent to DR */
+    while(handle->TxRingTail != handle->TxRingHead);
+    while(!(handle->Instance->SR & USART_SR_TC));
+}
+
+/*!
+ * \brief  Handles the interrupt of the DMA transmission stream: the run
+ *         that completed is released and the next one is started.
+ * \param  *handle : pointer to the handle structure of the UART peripheral
+ * \retval None
+ */
+void HAL_UART_Tx_DMA_HandleIT(UART_HandleTypeDef *handle)
+{
+    uint32_t flags = HAL_DMA_GetFlags(handle->hdmatx);
+    
+    HAL_DMA_ClearFlags(handle->hdmatx, flags);
+    if((flags & (HAL_DMA_FLAG_TC | HAL_DMA_FLAG_TE)) == 0)
+    {
+        return;
+    }
+    
+    /* A transfer error drops the run: the host sees a short reply */
+    handle->TxRingTail = (handle->TxRingTail + handle->TxXferSize) % handle->TxRingSize;
+    HAL_UART_Tx_DMA_Next(handle);
+    
+    if((handle->TxXferSize == 0) && (handle->TxCpltCallback != 0))
+    {
+        handle->TxCpltCallback();
+    }
+}
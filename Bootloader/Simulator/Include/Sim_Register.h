@@ -0,0 +1,56 @@
+/*! \file   Sim_Register.h
+ *  \brief  Memory mapped registers of the simulated STM32F411
+ *  The device and core headers are built with every register declared as a
+ *  SimReg. The register objects sit at their real addresses, so the
+ *  firmware's address arithmetic is unchanged, and every access goes
+ *  through the peripheral models.
+ */
+#ifndef _SIM_REGISTER_H_
+#define _SIM_REGISTER_H_
+
+#include <stdint.h>
+
+/*! \brief Reads a register through its peripheral model
+ *
+ *  \param  *reg        The register
+ *  \param  size        The access size in bytes
+ *  \retval uint32_t    The value read
+ */
+uint32_t Sim_Read(const void *reg, uint32_t size);
+
+/*! \brief Writes a register through its peripheral model
+ *
+ *  \param  *reg        The register
+ *  \param  value       The value to write
+ *  \param  size        The access size in bytes
+ */
+void Sim_Write(void *reg, uint32_t value, uint32_t size);
+
+/*! \brief A memory mapped register. Reads and writes, including each half
+ *  of a read-modify-write, are single accesses as on the target.
+ */
+template<typename T> struct SimReg
+{
+    T Value;    /*!< The stored value, only used by the models               */
+
+    operator T() const
+    {
+        return (T)Sim_Read(this, sizeof(T));
+    }
+    SimReg &operator=(T value)
+    {
+        Sim_Write(this, value, sizeof(T));
+        return *this;
+    }
+    SimReg &operator=(const SimReg &other)
+    {
+        return *this = (T)other;
+    }
+    SimReg &operator|=(T value) { return *this = (T)(*this | value); }
+    SimReg &operator&=(T value) { return *this = (T)(*this & value); }
+    SimReg &operator^=(T value) { return *this = (T)(*this ^ value); }
+    SimReg &operator+=(T value) { return *this = (T)(*this + value); }
+    SimReg &operator-=(T value) { return *this = (T)(*this - value); }
+};
+
+#endif /* _SIM_REGISTER_H_ */
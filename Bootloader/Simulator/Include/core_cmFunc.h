@@ -0,0 +1,26 @@
+/*! \file   core_cmFunc.h
+ *  \brief  Cortex-M core register intrinsics of the simulator build
+ *  Replaces the CMSIS header, which is included from core_cm4.h. PRIMASK
+ *  gates the exceptions of the models. Setting the main stack pointer is
+ *  how the bootloader hands over to the application, so __set_MSP ends
+ *  the simulation.
+ */
+#ifndef __CORE_CMFUNC_H
+#define __CORE_CMFUNC_H
+
+#include <stdint.h>
+
+/*! \brief Sets PRIMASK, exceptions are taken again once it is cleared */
+void Sim_Core_SetPrimask(uint32_t primask);
+/*! \brief Returns PRIMASK */
+uint32_t Sim_Core_GetPrimask(void);
+/*! \brief Reports the jump to the application and ends the simulation */
+void Sim_Core_Jump(uint32_t msp) __attribute__((noreturn));
+
+static inline void __enable_irq(void) { Sim_Core_SetPrimask(0); }
+static inline void __disable_irq(void) { Sim_Core_SetPrimask(1U); }
+static inline uint32_t __get_PRIMASK(void) { return Sim_Core_GetPrimask(); }
+static inline void __set_PRIMASK(uint32_t primask) { Sim_Core_SetPrimask(primask & 1U); }
+static inline void __set_MSP(uint32_t topOfMainStack) { Sim_Core_Jump(topOfMainStack); }
+
+#endif /* __CORE_CMFUNC_H */
@@ -0,0 +1,50 @@
+/*! \file   core_cmInstr.h
+ *  \brief  Cortex-M instruction intrinsics of the simulator build
+ *  Replaces the CMSIS header, which is included from core_cm4.h. The
+ *  barriers have nothing to order on the host, WFI waits for the next
+ *  exception of the models.
+ */
+#ifndef __CORE_CMINSTR_H
+#define __CORE_CMINSTR_H
+
+#include <stdint.h>
+
+/*! \brief Sleeps until an exception is pending */
+void Sim_Core_WaitForInterrupt(void);
+
+static inline void __NOP(void) {}
+static inline void __ISB(void) { __sync_synchronize(); }
+static inline void __DSB(void) { __sync_synchronize(); }
+static inline void __DMB(void) { __sync_synchronize(); }
+static inline void __WFI(void) { Sim_Core_WaitForInterrupt(); }
+static inline void __WFE(void) { Sim_Core_WaitForInterrupt(); }
+static inline void __SEV(void) {}
+
+static inline uint32_t __REV(uint32_t value)
+{
+    return __builtin_bswap32(value);
+}
+
+static inline uint32_t __REV16(uint32_t value)
+{
+    return ((value & 0x00FF00FFU) << 8) | ((value >> 8) & 0x00FF00FFU);
+}
+
+static inline uint32_t __RBIT(uint32_t value)
+{
+    uint32_t result = 0;
+    uint32_t i;
+    
+    for(i = 0; i < 32U; i++)
+    {
+        result = (result << 1) | ((value >> i) & 1U);
+    }
+    return result;
+}
+
+static inline uint8_t __CLZ(uint32_t value)
+{
+    return (value == 0) ? 32U : (uint8_t)__builtin_clz(value);
+}
+
+#endif /* __CORE_CMINSTR_H */
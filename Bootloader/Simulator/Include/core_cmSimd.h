@@ -0,0 +1,7 @@
+/*! \file   core_cmSimd.h
+ *  \brief  Replaces the CMSIS SIMD intrinsics, which the firmware does not
+ *  use, in the simulator build.
+ */
+#ifndef __CORE_CMSIMD_H
+#define __CORE_CMSIMD_H
+#endif /* __CORE_CMSIMD_H */
@@ -0,0 +1,56 @@
+/*! \file   stm32f4xx.h
+ *  \brief  Device header of the simulator build
+ *  Includes the CMSIS device header generated by the Makefile, with every
+ *  register declared as a SimReg, and redirects the core intrinsics and
+ *  the flash array stores to the models.
+ */
+#ifndef _SIM_STM32F4XX_H_
+#define _SIM_STM32F4XX_H_
+
+#include "Sim_Register.h"
+#include_next "stm32f4xx.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief Programs the flash array through the flash model
+ *
+ *  \param  address     The address in the flash array
+ *  \param  data        The data, its size is set by the access
+ *  \param  size        The access size in bytes
+ */
+void Sim_Flash_Program(uint32_t address, uint32_t data, uint32_t size);
+
+#define HAL_FLASH_WRITE8(address, data)     Sim_Flash_Program((address), (uint8_t)(data), 1U)
+#define HAL_FLASH_WRITE16(address, data)    Sim_Flash_Program((address), (uint16_t)(data), 2U)
+#define HAL_FLASH_WRITE32(address, data)    Sim_Flash_Program((address), (uint32_t)(data), 4U)
+
+/* Exception handlers the models can raise. The declarations give the
+ * firmware's definitions C linkage, so that the weak references of the
+ * simulator resolve to them. */
+void SysTick_Handler(void);
+void FLASH_IRQHandler(void);
+void DMA1_Stream0_IRQHandler(void);
+void DMA1_Stream1_IRQHandler(void);
+void DMA1_Stream2_IRQHandler(void);
+void DMA1_Stream3_IRQHandler(void);
+void DMA1_Stream4_IRQHandler(void);
+void DMA1_Stream5_IRQHandler(void);
+void DMA1_Stream6_IRQHandler(void);
+void DMA1_Stream7_IRQHandler(void);
+void DMA2_Stream0_IRQHandler(void);
+void DMA2_Stream1_IRQHandler(void);
+void DMA2_Stream2_IRQHandler(void);
+void DMA2_Stream3_IRQHandler(void);
+void DMA2_Stream4_IRQHandler(void);
+void DMA2_Stream5_IRQHandler(void);
+void DMA2_Stream6_IRQHandler(void);
+void DMA2_Stream7_IRQHandler(void);
+void USART2_IRQHandler(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SIM_STM32F4XX_H_ */
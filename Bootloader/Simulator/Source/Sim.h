@@ -0,0 +1,145 @@
+/*! \file   Sim.h
+ *  \brief  Internal interface between the simulator models
+ */
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include "stm32f4xx.h"                  // Device header
+#include <stdint.h>
+
+/*****************************************************************************/
+/*****************************************************************************/
+/*****************************************************************************/
+#define SIM_NS_PER_S            1000000000ULL
+#define SIM_NS_PER_US           1000ULL
+
+#define SIM_FLASH_SIZE          0x80000U    /*!< 512 KB                      */
+#define SIM_PERIPH_SIZE         0x80000U    /*!< APB1, APB2 and AHB1         */
+#define SIM_CORE_BASE           0xE0000000U /*!< Private peripheral bus      */
+#define SIM_CORE_SIZE           0x100000U
+
+#define SIM_HSI_VALUE           16000000U
+#define SIM_HSE_VALUE           8000000U    /*!< ST-LINK MCO on the Nucleo   */
+
+/*****************************************************************************/
+/*****************************************************************************/
+/*****************************************************************************/
+/*! \brief Command line options
+ */
+typedef struct
+{
+    const char *FlashPath;      /*!< Flash image file, or 0 for a blank one  */
+    const char *LinkPath;       /*!< Symlink to the serial port, or 0        */
+    uint32_t    ButtonPressed;  /*!< B1 held down at reset                   */
+    uint32_t    Bkp0r;          /*!< RTC->BKP0R at reset                     */
+    double      FlashTimeScale; /*!< Factor on the flash operation times     */
+    uint32_t    AnyBaud;        /*!< Ignore the host's baud rate             */
+} SIM_OPTIONS;
+
+extern SIM_OPTIONS Sim_Options;
+
+/*****************************************************************************/
+/*                       Sim_Main                                            */
+/*****************************************************************************/
+void Sim_Log(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void Sim_Fatal(const char *format, ...) __attribute__((format(printf, 1, 2), noreturn));
+uint8_t *Sim_FlashArray(void);
+
+/*****************************************************************************/
+/*                       Sim_Bus                                             */
+/*****************************************************************************/
+uint64_t Sim_Now(void);
+void     Sim_Bus_Activity(void);
+uint32_t Sim_Bus_Read(uint32_t address, uint32_t size);
+void     Sim_Bus_Write(uint32_t address, uint32_t value, uint32_t size);
+void     Sim_Bus_Reset(void);
+void     Sim_Bus_Advance(void);
+void     Sim_Bus_Enter(void);
+void     Sim_Bus_Leave(void);
+void     Sim_Bus_Poll(void);
+void     Sim_Bus_Sleep(uint64_t ns);
+
+/*! \brief Returns the address of a register as the firmware sees it */
+template<typename T> static inline uint32_t Sim_Address(const SimReg<T> &reg)
+{
+    return (uint32_t)(uintptr_t)&reg;
+}
+
+/*! \brief Reads memory or a register without going through a model */
+static inline uint32_t Sim_RawRead(uint32_t address, uint32_t size)
+{
+    switch(size)
+    {
+        case 1:  return *(volatile uint8_t *)(uintptr_t)address;
+        case 2:  return *(volatile uint16_t *)(uintptr_t)address;
+        default: return *(volatile uint32_t *)(uintptr_t)address;
+    }
+}
+
+/*! \brief Writes memory or a register without going through a model */
+static inline void Sim_RawWrite(uint32_t address, uint32_t value, uint32_t size)
+{
+    switch(size)
+    {
+        case 1:  *(volatile uint8_t *)(uintptr_t)address = (uint8_t)value; break;
+        case 2:  *(volatile uint16_t *)(uintptr_t)address = (uint16_t)value; break;
+        default: *(volatile uint32_t *)(uintptr_t)address = value; break;
+    }
+}
+
+/*****************************************************************************/
+/*                       Sim_Core: SysTick, SCB, NVIC and exceptions         */
+/*****************************************************************************/
+void     Sim_Core_Reset(void);
+void     Sim_Core_Run(uint64_t now);
+uint32_t Sim_Core_Read(uint32_t address, uint32_t size);
+void     Sim_Core_Write(uint32_t address, uint32_t value, uint32_t size);
+void     Sim_Core_Deliver(void);
+uint32_t Sim_Core_InHandler(void);
+
+/*****************************************************************************/
+/*                       Sim_System: RCC, PWR, RTC, GPIO and CRC             */
+/*****************************************************************************/
+void     Sim_System_Reset(void);
+uint32_t Sim_System_Read(uint32_t address, uint32_t size);
+void     Sim_System_Write(uint32_t address, uint32_t value, uint32_t size);
+uint32_t Sim_System_GetHclk(void);
+uint32_t Sim_System_GetPclk1(void);
+uint32_t Sim_System_GetPclk2(void);
+
+/*****************************************************************************/
+/*                       Sim_Flash                                           */
+/*****************************************************************************/
+void     Sim_Flash_Reset(void);
+void     Sim_Flash_Run(uint64_t now);
+uint32_t Sim_Flash_Read(uint32_t address, uint32_t size);
+void     Sim_Flash_Write(uint32_t address, uint32_t value, uint32_t size);
+void     Sim_Flash_Store(uint32_t address, uint32_t data, uint32_t size);
+void     Sim_Flash_CheckClock(void);
+uint32_t Sim_Flash_IrqLevel(uint32_t unused);
+
+/*****************************************************************************/
+/*                       Sim_Usart                                           */
+/*****************************************************************************/
+void     Sim_Usart_Open(int fd, int slave);
+void     Sim_Usart_Drain(void);
+void     Sim_Usart_Reset(void);
+void     Sim_Usart_Run(uint64_t now);
+uint32_t Sim_Usart_Read(uint32_t address, uint32_t size);
+void     Sim_Usart_Write(uint32_t address, uint32_t value, uint32_t size);
+uint32_t Sim_Usart_IrqLevel(uint32_t unused);
+
+/*****************************************************************************/
+/*                       Sim_Dma                                             */
+/*****************************************************************************/
+#define SIM_DMA_STREAMS         16U     /*!< DMA1 streams 0-7, DMA2 8-15     */
+
+void     Sim_Dma_Reset(uint32_t controller);
+void     Sim_Dma_Run(uint64_t now);
+uint32_t Sim_Dma_Read(uint32_t address, uint32_t size);
+void     Sim_Dma_Write(uint32_t address, uint32_t value, uint32_t size);
+uint32_t Sim_Dma_IrqLevel(uint32_t stream);
+uint32_t Sim_Dma_PeriphToMemory(uint32_t stream, uint32_t channel, uint32_t data);
+uint32_t Sim_Dma_MemoryToPeriph(uint32_t stream, uint32_t channel, uint32_t *data);
+
+#endif /* _SIM_H_ */
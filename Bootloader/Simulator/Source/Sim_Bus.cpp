@@ -0,0 +1,286 @@
+/*! \file   Sim_Bus.cpp
+ *  \brief  Routes the register accesses of the firmware to the models
+ *  Every access first advances the models to the current time, so the
+ *  peripherals run in real time next to the firmware. Pending exceptions
+ *  are taken once the access is done, like between two instructions.
+ */
+#include "Sim.h"
+#include <stddef.h>
+#include <signal.h>
+#include <time.h>
+
+/*****************************************************************************/
+/*****************************************************************************/
+/*****************************************************************************/
+/*! \brief Accesses without any model activity before the firmware is
+ *  considered to be polling, it then sleeps between the accesses */
+#define SIM_IDLE_ACCESSES       1000U
+#define SIM_IDLE_SLEEP_NS       (20U * SIM_NS_PER_US)
+
+#define SIM_NO_CLOCK            0xFFFFFFFFU
+
+/*! \brief A peripheral register block and its model
+ */
+typedef struct
+{
+    const char *Name;
+    uint32_t    Base;
+    uint32_t    Size;
+    uint32_t    (*Read)(uint32_t address, uint32_t size);
+    void        (*Write)(uint32_t address, uint32_t value, uint32_t size);
+    uint32_t    ClockRegister;  /*!< Offset of the enable register in RCC    */
+    uint32_t    ClockMask;      /*!< Enable bit, the block is not accessible
+                                     while it is cleared                     */
+} SIM_PERIPHERAL;
+
+#define SIM_AHB1ENR     offsetof(RCC_TypeDef, AHB1ENR)
+#define SIM_APB1ENR     offsetof(RCC_TypeDef, APB1ENR)
+
+static const SIM_PERIPHERAL Peripherals[] =
+{
+    {"USART2", USART2_BASE,  0x400U, Sim_Usart_Read,  Sim_Usart_Write,  SIM_APB1ENR, RCC_APB1ENR_USART2EN},
+    {"PWR",    PWR_BASE,     0x400U, Sim_System_Read, Sim_System_Write, SIM_APB1ENR, RCC_APB1ENR_PWREN   },
+    {"RTC",    RTC_BASE,     0x400U, Sim_System_Read, Sim_System_Write, SIM_NO_CLOCK, 0                  },
+    {"GPIOA",  GPIOA_BASE,   0x400U, Sim_System_Read, Sim_System_Write, SIM_AHB1ENR, RCC_AHB1ENR_GPIOAEN },
+    {"GPIOB",  GPIOB_BASE,   0x400U, Sim_System_Read, Sim_System_Write, SIM_AHB1ENR, RCC_AHB1ENR_GPIOBEN },
+    {"GPIOC",  GPIOC_BASE,   0x400U, Sim_System_Read, Sim_System_Write, SIM_AHB1ENR, RCC_AHB1ENR_GPIOCEN },
+    {"GPIOD",  GPIOD_BASE,   0x400U, Sim_System_Read, Sim_System_Write, SIM_AHB1ENR, RCC_AHB1ENR_GPIODEN },
+    {"GPIOE",  GPIOE_BASE,   0x400U, Sim_System_Read, Sim_System_Write, SIM_AHB1ENR, RCC_AHB1ENR_GPIOEEN },
+    {"GPIOH",  GPIOH_BASE,   0x400U, Sim_System_Read, Sim_System_Write, SIM_AHB1ENR, RCC_AHB1ENR_GPIOHEN },
+    {"CRC",    CRC_BASE,     0x400U, Sim_System_Read, Sim_System_Write, SIM_AHB1ENR, RCC_AHB1ENR_CRCEN   },
+    {"RCC",    RCC_BASE,     0x400U, Sim_System_Read, Sim_System_Write, SIM_NO_CLOCK, 0                  },
+    {"FLASH",  FLASH_R_BASE, 0x400U, Sim_Flash_Read,  Sim_Flash_Write,  SIM_NO_CLOCK, 0                  },
+    {"DMA1",   DMA1_BASE,    0x400U, Sim_Dma_Read,    Sim_Dma_Write,    SIM_AHB1ENR, RCC_AHB1ENR_DMA1EN  },
+    {"DMA2",   DMA2_BASE,    0x400U, Sim_Dma_Read,    Sim_Dma_Write,    SIM_AHB1ENR, RCC_AHB1ENR_DMA2EN  },
+    {"core",   SIM_CORE_BASE, SIM_CORE_SIZE, Sim_Core_Read, Sim_Core_Write, SIM_NO_CLOCK, 0              },
+};
+
+#define SIM_PERIPHERAL_COUNT    (sizeof(Peripherals) / sizeof(Peripherals[0]))
+
+static struct timespec StartTime;
+static volatile sig_atomic_t Busy;      /*!< A model is being accessed       */
+static uint32_t IdleAccesses;
+static uint8_t ClockWarned[SIM_PERIPHERAL_COUNT];
+
+/*****************************************************************************/
+/*                       Helper Functions                                    */
+/*****************************************************************************/
+/*! \brief Returns the model of an address, or 0 for plain memory and the
+ *  registers that are not modelled
+ */
+static const SIM_PERIPHERAL *Sim_Bus_Find(uint32_t address)
+{
+    uint32_t i;
+
+    for(i = 0; i < SIM_PERIPHERAL_COUNT; i++)
+    {
+        if((address - Peripherals[i].Base) < Peripherals[i].Size)
+        {
+            return &Peripherals[i];
+        }
+    }
+    return 0;
+}
+
+/*! \brief Returns whether the clock of a peripheral is enabled. Reads of a
+ *  peripheral without clock return 0 and writes are lost, as on the target.
+ */
+static uint32_t Sim_Bus_IsClocked(const SIM_PERIPHERAL *periph)
+{
+    uint32_t index = (uint32_t)(periph - Peripherals);
+
+    if(periph->ClockRegister == SIM_NO_CLOCK)
+    {
+        return 1;
+    }
+    if(Sim_RawRead(RCC_BASE + periph->ClockRegister, 4) & periph->ClockMask)
+    {
+        return 1;
+    }
+    if(ClockWarned[index] == 0)
+    {
+        ClockWarned[index] = 1;
+        Sim_Log("%s accessed with its clock disabled", periph->Name);
+    }
+    return 0;
+}
+
+/*****************************************************************************/
+/*                       Model Interface                                     */
+/*****************************************************************************/
+/*! \brief Returns the time since the start of the simulation
+ *
+ *  \retval uint64_t    The time in nanoseconds
+ */
+uint64_t Sim_Now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - StartTime.tv_sec) * SIM_NS_PER_S +
+           (uint64_t)now.tv_nsec - (uint64_t)StartTime.tv_nsec;
+}
+
+/*! \brief Tells that a model changed state, the firmware is not idle
+ */
+void Sim_Bus_Activity(void)
+{
+    IdleAccesses = 0;
+}
+
+/*! \brief Reads from the bus on behalf of a model, without advancing time
+ *
+ *  \param  address     The address
+ *  \param  size        The access size in bytes
+ *  \retval uint32_t    The value read
+ */
+uint32_t Sim_Bus_Read(uint32_t address, uint32_t size)
+{
+    const SIM_PERIPHERAL *periph = Sim_Bus_Find(address);
+
+    if(periph == 0)
+    {
+        return Sim_RawRead(address, size);
+    }
+    if(Sim_Bus_IsClocked(periph) == 0)
+    {
+        return 0;
+    }
+    return periph->Read(address, size);
+}
+
+/*! \brief Writes to the bus on behalf of a model, without advancing time.
+ *  Writes into the flash array program it.
+ *
+ *  \param  address     The address
+ *  \param  value       The value to write
+ *  \param  size        The access size in bytes
+ */
+void Sim_Bus_Write(uint32_t address, uint32_t value, uint32_t size)
+{
+    const SIM_PERIPHERAL *periph = Sim_Bus_Find(address);
+
+    if((address - FLASH_BASE) < SIM_FLASH_SIZE)
+    {
+        Sim_Flash_Store(address, value, size);
+        return;
+    }
+    if(periph == 0)
+    {
+        Sim_RawWrite(address, value, size);
+        return;
+    }
+    if(Sim_Bus_IsClocked(periph) != 0)
+    {
+        periph->Write(address, value, size);
+    }
+}
+
+/*! \brief Puts every model in its reset state and starts the clock
+ */
+void Sim_Bus_Reset(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &StartTime);
+    Sim_System_Reset();
+    Sim_Flash_Reset();
+    Sim_Dma_Reset(0);
+    Sim_Dma_Reset(1U);
+    Sim_Usart_Reset();
+    Sim_Core_Reset();
+}
+
+/*! \brief Advances every model to the current time
+ */
+void Sim_Bus_Advance(void)
+{
+    uint64_t now = Sim_Now();
+
+    Sim_Flash_Run(now);
+    Sim_Dma_Run(now);
+    Sim_Usart_Run(now);
+    Sim_Core_Run(now);
+}
+
+/*! \brief Starts an access of the firmware to the models
+ */
+void Sim_Bus_Enter(void)
+{
+    Busy = 1;
+    Sim_Bus_Advance();
+}
+
+/*! \brief Ends an access of the firmware to the models. Takes the pending
+ *  exceptions, and sleeps a little when the firmware is only polling.
+ */
+void Sim_Bus_Leave(void)
+{
+    Busy = 0;
+    Sim_Core_Deliver();
+
+    if(++IdleAccesses > SIM_IDLE_ACCESSES)
+    {
+        Sim_Bus_Sleep(SIM_IDLE_SLEEP_NS);
+    }
+}
+
+/*! \brief Periodic poll from the timer signal. Lets the models run and
+ *  raise exceptions while the firmware does not access any register.
+ */
+void Sim_Bus_Poll(void)
+{
+    if((Busy != 0) || (Sim_Core_InHandler() != 0))
+    {
+        return;
+    }
+    Busy = 1;
+    Sim_Bus_Advance();
+    Busy = 0;
+    Sim_Core_Deliver();
+}
+
+/*! \brief Sleeps, a signal may end the sleep early
+ *
+ *  \param  ns          The time to sleep in nanoseconds
+ */
+void Sim_Bus_Sleep(uint64_t ns)
+{
+    struct timespec delay;
+
+    delay.tv_sec = (time_t)(ns / SIM_NS_PER_S);
+    delay.tv_nsec = (long)(ns % SIM_NS_PER_S);
+    nanosleep(&delay, 0);
+}
+
+/*****************************************************************************/
+/*                       Firmware Interface                                  */
+/*****************************************************************************/
+/*! \brief Reads a register through its peripheral model
+ *
+ *  \param  *reg        The register
+ *  \param  size        The access size in bytes
+ *  \retval uint32_t    The value read
+ */
+uint32_t Sim_Read(const void *reg, uint32_t size)
+{
+    uint32_t value;
+
+    Sim_Bus_Enter();
+    value = Sim_Bus_Read((uint32_t)(uintptr_t)reg, size);
+    Sim_Bus_Leave();
+
+    return value;
+}
+
+/*! \brief Writes a register through its peripheral model
+ *
+ *  \param  *reg        The register
+ *  \param  value       The value to write
+ *  \param  size        The access size in bytes
+ */
+void Sim_Write(void *reg, uint32_t value, uint32_t size)
+{
+    Sim_Bus_Enter();
+    Sim_Bus_Write((uint32_t)(uintptr_t)reg, value, size);
+    Sim_Bus_Activity();
+    Sim_Bus_Leave();
+}
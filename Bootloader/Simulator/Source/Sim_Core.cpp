@@ -0,0 +1,449 @@
+/*! \file   Sim_Core.cpp
+ *  \brief  Cortex-M4 core model: SysTick, SCB, NVIC, the DWT cycle counter
+ *  and the exceptions
+ *  Exceptions are taken between register accesses and from the timer
+ *  signal, by calling the firmware's handler on the firmware thread. They
+ *  do not nest: a handler runs to completion before the next one is taken,
+ *  the pending one with the highest priority first.
+ */
+#include "Sim.h"
+#include <signal.h>
+#include <stdlib.h>
+
+#pragma weak SysTick_Handler
+#pragma weak FLASH_IRQHandler
+#pragma weak DMA1_Stream0_IRQHandler
+#pragma weak DMA1_Stream1_IRQHandler
+#pragma weak DMA1_Stream2_IRQHandler
+#pragma weak DMA1_Stream3_IRQHandler
+#pragma weak DMA1_Stream4_IRQHandler
+#pragma weak DMA1_Stream5_IRQHandler
+#pragma weak DMA1_Stream6_IRQHandler
+#pragma weak DMA1_Stream7_IRQHandler
+#pragma weak DMA2_Stream0_IRQHandler
+#pragma weak DMA2_Stream1_IRQHandler
+#pragma weak DMA2_Stream2_IRQHandler
+#pragma weak DMA2_Stream3_IRQHandler
+#pragma weak DMA2_Stream4_IRQHandler
+#pragma weak DMA2_Stream5_IRQHandler
+#pragma weak DMA2_Stream6_IRQHandler
+#pragma weak DMA2_Stream7_IRQHandler
+#pragma weak USART2_IRQHandler
+
+/*****************************************************************************/
+/*****************************************************************************/
+/*****************************************************************************/
+#define SIM_CPUID               0x410FC241U /*!< Cortex-M4 r0p1              */
+#define SIM_AIRCR_VECTKEY       0x05FAU
+#define SIM_AIRCR_VECTKEYSTAT   0xFA05U
+#define SIM_NVIC_REGISTERS      8U
+#define SIM_NO_IRQ              0xFFFFFFFFU
+#define SIM_DWT_CTRL            0x40000000U /*!< NUMCOMP = 4, all disabled   */
+
+/*! \brief An interrupt line of a model
+ */
+typedef struct
+{
+    const char  *Name;
+    IRQn_Type   Irq;
+    void        (*Handler)(void);       /*!< 0 when the firmware has none    */
+    uint32_t    (*Level)(uint32_t arg); /*!< Returns 1 while the line is set */
+    uint32_t    Arg;
+} SIM_IRQ;
+
+static const SIM_IRQ IrqTable[] =
+{
+    {"FLASH",        FLASH_IRQn,        FLASH_IRQHandler,        Sim_Flash_IrqLevel, 0  },
+    {"DMA1_Stream0", DMA1_Stream0_IRQn, DMA1_Stream0_IRQHandler, Sim_Dma_IrqLevel,   0  },
+    {"DMA1_Stream1", DMA1_Stream1_IRQn, DMA1_Stream1_IRQHandler, Sim_Dma_IrqLevel,   1  },
+    {"DMA1_Stream2", DMA1_Stream2_IRQn, DMA1_Stream2_IRQHandler, Sim_Dma_IrqLevel,   2  },
+    {"DMA1_Stream3", DMA1_Stream3_IRQn, DMA1_Stream3_IRQHandler, Sim_Dma_IrqLevel,   3  },
+    {"DMA1_Stream4", DMA1_Stream4_IRQn, DMA1_Stream4_IRQHandler, Sim_Dma_IrqLevel,   4  },
+    {"DMA1_Stream5", DMA1_Stream5_IRQn, DMA1_Stream5_IRQHandler, Sim_Dma_IrqLevel,   5  },
+    {"DMA1_Stream6", DMA1_Stream6_IRQn, DMA1_Stream6_IRQHandler, Sim_Dma_IrqLevel,   6  },
+    {"USART2",       USART2_IRQn,       USART2_IRQHandler,       Sim_Usart_IrqLevel, 0  },
+    {"DMA1_Stream7", DMA1_Stream7_IRQn, DMA1_Stream7_IRQHandler, Sim_Dma_IrqLevel,   7  },
+    {"DMA2_Stream0", DMA2_Stream0_IRQn, DMA2_Stream0_IRQHandler, Sim_Dma_IrqLevel,   8  },
+    {"DMA2_Stream1", DMA2_Stream1_IRQn, DMA2_Stream1_IRQHandler, Sim_Dma_IrqLevel,   9  },
+    {"DMA2_Stream2", DMA2_Stream2_IRQn, DMA2_Stream2_IRQHandler, Sim_Dma_IrqLevel,   10 },
+    {"DMA2_Stream3", DMA2_Stream3_IRQn, DMA2_Stream3_IRQHandler, Sim_Dma_IrqLevel,   11 },
+    {"DMA2_Stream4", DMA2_Stream4_IRQn, DMA2_Stream4_IRQHandler, Sim_Dma_IrqLevel,   12 },
+    {"DMA2_Stream5", DMA2_Stream5_IRQn, DMA2_Stream5_IRQHandler, Sim_Dma_IrqLevel,   13 },
+    {"DMA2_Stream6", DMA2_Stream6_IRQn, DMA2_Stream6_IRQHandler, Sim_Dma_IrqLevel,   14 },
+    {"DMA2_Stream7", DMA2_Stream7_IRQn, DMA2_Stream7_IRQHandler, Sim_Dma_IrqLevel,   15 },
+};
+
+#define SIM_IRQ_COUNT           (sizeof(IrqTable) / sizeof(IrqTable[0]))
+#define SIM_SYSTICK             SIM_IRQ_COUNT   /*!< Index of the SysTick    */
+
+static volatile sig_atomic_t Primask;
+static volatile sig_atomic_t InHandler;
+
+static uint32_t NvicEnabled[SIM_NVIC_REGISTERS];
+static uint32_t NvicPending[SIM_NVIC_REGISTERS];
+
+static uint64_t SysTickNext;        /*!< Time of the next reload             */
+static uint32_t SysTickPending;     /*!< Exceptions not taken yet            */
+
+static uint64_t DwtTime;            /*!< Time CYCCNT was last brought up to  */
+
+/*****************************************************************************/
+/*                       Helper Functions                                    */
+/*****************************************************************************/
+/*! \brief Returns the time between two SysTick reloads
+ */
+static uint64_t Sim_Core_SysTickPeriod(void)
+{
+    uint64_t clock = Sim_System_GetHclk();
+
+    if((SysTick->CTRL.Value & SysTick_CTRL_CLKSOURCE_Msk) == 0)
+    {
+        clock /= 8U;
+    }
+    return ((uint64_t)(SysTick->LOAD.Value & SysTick_LOAD_RELOAD_Msk) + 1U) *
+           SIM_NS_PER_S / clock;
+}
+
+/*! \brief Returns whether an interrupt is enabled and pending
+ */
+static uint32_t Sim_Core_IsPending(const SIM_IRQ *irq)
+{
+    uint32_t n = (uint32_t)irq->Irq;
+    uint32_t mask = 1U << (n & 0x1FU);
+
+    if((NvicEnabled[n >> 5] & mask) == 0)
+    {
+        return 0;
+    }
+    return ((NvicPending[n >> 5] & mask) != 0) || (irq->Level(irq->Arg) != 0);
+}
+
+/*! \brief Returns the pending exception to take next, SIM_SYSTICK, an index
+ *  in IrqTable or SIM_NO_IRQ
+ */
+static uint32_t Sim_Core_NextException(void)
+{
+    uint32_t next = SIM_NO_IRQ;
+    uint32_t priority = 0x100U;
+    uint32_t i;
+
+    if(SysTickPending != 0)
+    {
+        next = SIM_SYSTICK;
+        priority = SCB->SHP[11].Value;
+    }
+    for(i = 0; i < SIM_IRQ_COUNT; i++)
+    {
+        if((NVIC->IP[IrqTable[i].Irq].Value < priority) && Sim_Core_IsPending(&IrqTable[i]))
+        {
+            next = i;
+            priority = NVIC->IP[IrqTable[i].Irq].Value;
+        }
+    }
+    return next;
+}
+
+/*! \brief Brings DWT->CYCCNT up to the current time while it counts. The
+ *  counter follows the wall clock at HCLK, as the firmware's own execution
+ *  time is not modelled.
+ */
+static void Sim_Core_DwtUpdate(void)
+{
+    uint64_t now = Sim_Now();
+    uint64_t hclk = Sim_System_GetHclk();
+    uint64_t cycles;
+
+    if(((CoreDebug->DEMCR.Value & CoreDebug_DEMCR_TRCENA_Msk) == 0) ||
+       ((DWT->CTRL.Value & DWT_CTRL_CYCCNTENA_Msk) == 0))
+    {
+        DwtTime = now;
+        return;
+    }
+    cycles = (now - DwtTime) * hclk / SIM_NS_PER_S;
+    DWT->CYCCNT.Value += (uint32_t)cycles;
+    DwtTime += cycles * SIM_NS_PER_S / hclk;
+}
+
+/*****************************************************************************/
+/*                       Model Interface                                     */
+/*****************************************************************************/
+/*! \brief Puts the core registers in their reset state
+ */
+void Sim_Core_Reset(void)
+{
+    uint32_t i;
+
+    SysTick->CTRL.Value = 0;
+    SysTick->LOAD.Value = 0;
+    SysTick->VAL.Value = 0;
+    SysTick->CALIB.Value = 0;
+    SCB->CPUID.Value = SIM_CPUID;
+    SCB->AIRCR.Value = SIM_AIRCR_VECTKEYSTAT << SCB_AIRCR_VECTKEY_Pos;
+    CoreDebug->DEMCR.Value = 0;
+    DWT->CTRL.Value = SIM_DWT_CTRL;
+    DWT->CYCCNT.Value = 0;
+    DwtTime = Sim_Now();
+    for(i = 0; i < SIM_NVIC_REGISTERS; i++)
+    {
+        NvicEnabled[i] = 0;
+        NvicPending[i] = 0;
+    }
+    SysTickPending = 0;
+    Primask = 0;
+}
+
+/*! \brief Counts the SysTick reloads up to the current time. Every reload
+ *  raises its own exception, so that the tick count follows the wall clock
+ *  even when the host was late.
+ *
+ *  \param  now         The current time
+ */
+void Sim_Core_Run(uint64_t now)
+{
+    if((SysTick->CTRL.Value & SysTick_CTRL_ENABLE_Msk) == 0)
+    {
+        return;
+    }
+    while(now >= SysTickNext)
+    {
+        SysTickNext += Sim_Core_SysTickPeriod();
+        SysTick->CTRL.Value |= SysTick_CTRL_COUNTFLAG_Msk;
+        if(SysTick->CTRL.Value & SysTick_CTRL_TICKINT_Msk)
+        {
+            SysTickPending++;
+        }
+        Sim_Bus_Activity();
+    }
+}
+
+/*! \brief Reads a register of the private peripheral bus
+ */
+uint32_t Sim_Core_Read(uint32_t address, uint32_t size)
+{
+    uint32_t value = Sim_RawRead(address, size);
+    uint64_t now;
+
+    if(address == Sim_Address(SysTick->CTRL))
+    {
+        // COUNTFLAG clears on read
+        SysTick->CTRL.Value &= ~SysTick_CTRL_COUNTFLAG_Msk;
+    }
+    else if(address == Sim_Address(SysTick->VAL))
+    {
+        if(SysTick->CTRL.Value & SysTick_CTRL_ENABLE_Msk)
+        {
+            now = Sim_Now();
+            value = (uint32_t)((SysTickNext - now) * (SysTick->LOAD.Value + 1U) /
+                               Sim_Core_SysTickPeriod());
+        }
+    }
+    else if(address == Sim_Address(SCB->ICSR))
+    {
+        value &= ~SCB_ICSR_PENDSTSET_Msk;
+        if(SysTickPending != 0)
+        {
+            value |= SCB_ICSR_PENDSTSET_Msk;
+        }
+    }
+    else if((address - Sim_Address(NVIC->ISER[0])) < sizeof(NVIC->ISER))
+    {
+        value = NvicEnabled[(address - Sim_Address(NVIC->ISER[0])) / 4U];
+    }
+    else if((address - Sim_Address(NVIC->ICER[0])) < sizeof(NVIC->ICER))
+    {
+        value = NvicEnabled[(address - Sim_Address(NVIC->ICER[0])) / 4U];
+    }
+    else if((address - Sim_Address(NVIC->ISPR[0])) < sizeof(NVIC->ISPR))
+    {
+        value = NvicPending[(address - Sim_Address(NVIC->ISPR[0])) / 4U];
+    }
+    else if((address - Sim_Address(NVIC->ICPR[0])) < sizeof(NVIC->ICPR))
+    {
+        value = NvicPending[(address - Sim_Address(NVIC->ICPR[0])) / 4U];
+    }
+    else if(address == Sim_Address(DWT->CYCCNT))
+    {
+        Sim_Core_DwtUpdate();
+        value = DWT->CYCCNT.Value;
+    }
+    return value;
+}
+
+/*! \brief Writes a register of the private peripheral bus
+ */
+void Sim_Core_Write(uint32_t address, uint32_t value, uint32_t size)
+{
+    uint32_t enabled = SysTick->CTRL.Value & SysTick_CTRL_ENABLE_Msk;
+
+    if(address == Sim_Address(SysTick->CTRL))
+    {
+        SysTick->CTRL.Value = (SysTick->CTRL.Value & SysTick_CTRL_COUNTFLAG_Msk) |
+                              (value & ~SysTick_CTRL_COUNTFLAG_Msk);
+        if((enabled == 0) && (value & SysTick_CTRL_ENABLE_Msk))
+        {
+            SysTickNext = Sim_Now() + Sim_Core_SysTickPeriod();
+        }
+    }
+    else if(address == Sim_Address(SysTick->VAL))
+    {
+        // Any write clears the counter, it reloads on the next clock
+        SysTick->VAL.Value = 0;
+        SysTick->CTRL.Value &= ~SysTick_CTRL_COUNTFLAG_Msk;
+        SysTickNext = Sim_Now() + Sim_Core_SysTickPeriod();
+    }
+    else if(address == Sim_Address(SysTick->CALIB))
+    {
+        // Read only
+    }
+    else if(address == Sim_Address(SCB->ICSR))
+    {
+        if(value & SCB_ICSR_PENDSTSET_Msk)
+        {
+            SysTickPending++;
+        }
+        if(value & SCB_ICSR_PENDSTCLR_Msk)
+        {
+            SysTickPending = 0;
+        }
+    }
+    else if(address == Sim_Address(SCB->AIRCR))
+    {
+        if((value >> SCB_AIRCR_VECTKEY_Pos) != SIM_AIRCR_VECTKEY)
+        {
+            return;
+        }
+        if(value & SCB_AIRCR_SYSRESETREQ_Msk)
+        {
+            Sim_Log("system reset requested, stopping");
+            exit(EXIT_SUCCESS);
+        }
+        SCB->AIRCR.Value = (SIM_AIRCR_VECTKEYSTAT << SCB_AIRCR_VECTKEY_Pos) |
+                           (value & ~SCB_AIRCR_VECTKEY_Msk);
+    }
+    else if(address == Sim_Address(SCB->CPUID))
+    {
+        // Read only
+    }
+    else if((address - Sim_Address(NVIC->ISER[0])) < sizeof(NVIC->ISER))
+    {
+        NvicEnabled[(address - Sim_Address(NVIC->ISER[0])) / 4U] |= value;
+    }
+    else if((address - Sim_Address(NVIC->ICER[0])) < sizeof(NVIC->ICER))
+    {
+        NvicEnabled[(address - Sim_Address(NVIC->ICER[0])) / 4U] &= ~value;
+    }
+    else if((address - Sim_Address(NVIC->ISPR[0])) < sizeof(NVIC->ISPR))
+    {
+        NvicPending[(address - Sim_Address(NVIC->ISPR[0])) / 4U] |= value;
+    }
+    else if((address - Sim_Address(NVIC->ICPR[0])) < sizeof(NVIC->ICPR))
+    {
+        NvicPending[(address - Sim_Address(NVIC->ICPR[0])) / 4U] &= ~value;
+    }
+    else if((address == Sim_Address(DWT->CTRL)) || (address == Sim_Address(DWT->CYCCNT)) ||
+            (address == Sim_Address(CoreDebug->DEMCR)))
+    {
+        // The counter runs up to the write with the former settings
+        Sim_Core_DwtUpdate();
+        Sim_RawWrite(address, value, size);
+    }
+    else if(address == Sim_Address(NVIC->STIR))
+    {
+        value &= 0x1FFU;
+        NvicPending[value >> 5] |= 1U << (value & 0x1FU);
+    }
+    else
+    {
+        Sim_RawWrite(address, value, size);
+    }
+}
+
+/*! \brief Takes the pending exceptions, unless PRIMASK is set or a handler
+ *  is already running
+ */
+void Sim_Core_Deliver(void)
+{
+    uint32_t next;
+    const SIM_IRQ *irq;
+
+    if((Primask != 0) || (InHandler != 0))
+    {
+        return;
+    }
+    InHandler = 1;
+    for(next = Sim_Core_NextException(); next != SIM_NO_IRQ; next = Sim_Core_NextException())
+    {
+        if(next == SIM_SYSTICK)
+        {
+            SysTickPending--;
+            if(SysTick_Handler == 0)
+            {
+                Sim_Fatal("SysTick exception without a SysTick_Handler");
+            }
+            SysTick_Handler();
+            continue;
+        }
+
+        irq = &IrqTable[next];
+        NvicPending[(uint32_t)irq->Irq >> 5] &= ~(1U << ((uint32_t)irq->Irq & 0x1FU));
+        if(irq->Handler == 0)
+        {
+            Sim_Fatal("%s interrupt without a %s_IRQHandler", irq->Name, irq->Name);
+        }
+        irq->Handler();
+    }
+    InHandler = 0;
+}
+
+/*! \brief Returns whether an exception handler is running
+ */
+uint32_t Sim_Core_InHandler(void)
+{
+    return InHandler;
+}
+
+/*****************************************************************************/
+/*                       Firmware Interface                                  */
+/*****************************************************************************/
+/*! \brief Sets PRIMASK, exceptions are taken again once it is cleared
+ */
+void Sim_Core_SetPrimask(uint32_t primask)
+{
+    Primask = (sig_atomic_t)primask;
+    if(primask == 0)
+    {
+        Sim_Bus_Enter();
+        Sim_Bus_Leave();
+    }
+}
+
+/*! \brief Returns PRIMASK
+ */
+uint32_t Sim_Core_GetPrimask(void)
+{
+    return (uint32_t)Primask;
+}
+
+/*! \brief Sleeps until an exception is pending, then takes it
+ */
+void Sim_Core_WaitForInterrupt(void)
+{
+    Sim_Bus_Enter();
+    while(Sim_Core_NextException() == SIM_NO_IRQ)
+    {
+        Sim_Bus_Sleep(20U * SIM_NS_PER_US);
+        Sim_Bus_Advance();
+    }
+    Sim_Bus_Leave();
+}
+
+/*! \brief Reports the jump to the application and ends the simulation,
+ *  once the host has the last replies
+ */
+void Sim_Core_Jump(uint32_t msp)
+{
+    Sim_Log("jump to the application, MSP 0x%08X", (unsigned)msp);
+    Sim_Bus_Enter();
+    Sim_Usart_Drain();
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,363 @@
+/*! \file   Sim_Dma.cpp
+ *  \brief  DMA1 and DMA2 model
+ *  Peripheral streams move one item per request of their peripheral model.
+ *  Memory to memory streams run on their own at about one item every six
+ *  HCLK cycles, through the bus so a write into a register reaches its
+ *  model. The FIFO is not modelled, an item is written as soon as read.
+ */
+#include "Sim.h"
+
+/*****************************************************************************/
+/*****************************************************************************/
+/*****************************************************************************/
+#define SIM_DMA_CYCLES_PER_ITEM 6U
+
+#define SIM_DMA_DIR_P2M         0U
+#define SIM_DMA_DIR_M2P         1U
+#define SIM_DMA_DIR_M2M         2U
+
+#define SIM_DMA_FLAG_FE         0x01U
+#define SIM_DMA_FLAG_DME        0x04U
+#define SIM_DMA_FLAG_TE         0x08U
+#define SIM_DMA_FLAG_HT         0x10U
+#define SIM_DMA_FLAG_TC         0x20U
+
+/*! \brief Bit offset of each stream's flags in the LISR/HISR registers
+ */
+static const uint8_t StreamFlagOffset[4] = {0U, 6U, 16U, 22U};
+
+/*! \brief Internal state of a stream, latched when it is enabled
+ */
+typedef struct
+{
+    uint32_t Periph;        /*!< Current peripheral (or source) address      */
+    uint32_t Memory;        /*!< Current memory (or destination) address     */
+    uint32_t Reload;        /*!< NDTR when enabled, for the circular mode    */
+    uint64_t NextItem;      /*!< Memory to memory: time of the next item     */
+} SIM_DMA_STREAM;
+
+static SIM_DMA_STREAM Streams[SIM_DMA_STREAMS];
+
+/*****************************************************************************/
+/*                       Helper Functions                                    */
+/*****************************************************************************/
+/*! \brief Returns the controller of a stream index
+ */
+static DMA_TypeDef *Sim_Dma_GetController(uint32_t stream)
+{
+    return (stream < 8U) ? DMA1 : DMA2;
+}
+
+/*! \brief Returns the registers of a stream index
+ */
+static DMA_Stream_TypeDef *Sim_Dma_GetStream(uint32_t stream)
+{
+    uint32_t base = (uint32_t)(uintptr_t)Sim_Dma_GetController(stream);
+
+    return (DMA_Stream_TypeDef *)(uintptr_t)(base + 0x10U + ((stream & 0x7U) * 0x18U));
+}
+
+/*! \brief Returns the stream index of a register address, or
+ *  SIM_DMA_STREAMS for the flag registers
+ */
+static uint32_t Sim_Dma_FindStream(uint32_t address)
+{
+    uint32_t controller = (address >= DMA2_BASE) ? 1U : 0;
+    uint32_t offset = address - (controller ? DMA2_BASE : DMA1_BASE);
+
+    if((offset < 0x10U) || (offset >= (0x10U + (8U * 0x18U))))
+    {
+        return SIM_DMA_STREAMS;
+    }
+    return (controller * 8U) + ((offset - 0x10U) / 0x18U);
+}
+
+/*! \brief Returns the flag register, LISR or HISR, of a stream
+ */
+static SimReg<uint32_t> *Sim_Dma_GetIsr(uint32_t stream)
+{
+    DMA_TypeDef *dma = Sim_Dma_GetController(stream);
+
+    return ((stream & 0x7U) < 4U) ? &dma->LISR : &dma->HISR;
+}
+
+/*! \brief Sets event flags of a stream
+ */
+static void Sim_Dma_SetFlags(uint32_t stream, uint32_t flags)
+{
+    Sim_Dma_GetIsr(stream)->Value |= flags << StreamFlagOffset[stream & 0x3U];
+    Sim_Bus_Activity();
+}
+
+/*! \brief Returns the event flags of a stream
+ */
+static uint32_t Sim_Dma_GetFlags(uint32_t stream)
+{
+    return (Sim_Dma_GetIsr(stream)->Value >> StreamFlagOffset[stream & 0x3U]) & 0x3DU;
+}
+
+/*! \brief Returns the size in bytes of the PSIZE or MSIZE field
+ */
+static uint32_t Sim_Dma_GetSize(uint32_t cr, uint32_t pos)
+{
+    return 1U << ((cr >> pos) & 0x3U);
+}
+
+/*! \brief Latches the addresses and the counter when a stream is enabled
+ */
+static void Sim_Dma_Start(uint32_t stream)
+{
+    DMA_Stream_TypeDef *regs = Sim_Dma_GetStream(stream);
+    uint32_t dir = (regs->CR.Value & DMA_SxCR_DIR) >> DMA_SxCR_DIR_Pos;
+
+    if((dir == SIM_DMA_DIR_M2M) && (stream < 8U))
+    {
+        Sim_Log("memory to memory transfer on DMA1 Stream %u", (unsigned)stream);
+        regs->CR.Value &= ~DMA_SxCR_EN;
+        Sim_Dma_SetFlags(stream, SIM_DMA_FLAG_TE);
+        return;
+    }
+    if(regs->NDTR.Value == 0)
+    {
+        regs->CR.Value &= ~DMA_SxCR_EN;
+        return;
+    }
+    Streams[stream].Periph = regs->PAR.Value;
+    Streams[stream].Memory = regs->M0AR.Value;
+    Streams[stream].Reload = regs->NDTR.Value;
+    Streams[stream].NextItem = Sim_Now();
+}
+
+/*! \brief Counts a transferred item: half and full transfer events, then
+ *  the stream either reloads in circular mode or stops
+ */
+static void Sim_Dma_Count(uint32_t stream)
+{
+    DMA_Stream_TypeDef *regs = Sim_Dma_GetStream(stream);
+    SIM_DMA_STREAM *state = &Streams[stream];
+    uint32_t cr = regs->CR.Value;
+    uint32_t ndtr = regs->NDTR.Value - 1U;
+
+    if(cr & DMA_SxCR_MINC)
+    {
+        state->Memory += Sim_Dma_GetSize(cr, DMA_SxCR_MSIZE_Pos);
+    }
+    if(cr & DMA_SxCR_PINC)
+    {
+        state->Periph += Sim_Dma_GetSize(cr, DMA_SxCR_PSIZE_Pos);
+    }
+
+    if(ndtr == (state->Reload / 2U))
+    {
+        Sim_Dma_SetFlags(stream, SIM_DMA_FLAG_HT);
+    }
+    if(ndtr == 0)
+    {
+        Sim_Dma_SetFlags(stream, SIM_DMA_FLAG_TC);
+        if(cr & DMA_SxCR_CIRC)
+        {
+            ndtr = state->Reload;
+            state->Periph = regs->PAR.Value;
+            state->Memory = regs->M0AR.Value;
+        }
+        else
+        {
+            regs->CR.Value &= ~DMA_SxCR_EN;
+        }
+    }
+    regs->NDTR.Value = ndtr;
+}
+
+/*! \brief Returns whether a stream serves the given request
+ */
+static uint32_t Sim_Dma_IsRequested(uint32_t stream, uint32_t channel, uint32_t dir)
+{
+    uint32_t cr = Sim_Dma_GetStream(stream)->CR.Value;
+
+    return ((cr & DMA_SxCR_EN) &&
+            (((cr & DMA_SxCR_CHSEL) >> DMA_SxCR_CHSEL_Pos) == channel) &&
+            (((cr & DMA_SxCR_DIR) >> DMA_SxCR_DIR_Pos) == dir)) ? 1U : 0;
+}
+
+/*****************************************************************************/
+/*                       Model Interface                                     */
+/*****************************************************************************/
+/*! \brief Puts a DMA controller in its reset state
+ *
+ *  \param  controller  0 for DMA1, 1 for DMA2
+ */
+void Sim_Dma_Reset(uint32_t controller)
+{
+    DMA_TypeDef *dma = controller ? DMA2 : DMA1;
+    DMA_Stream_TypeDef *regs;
+    uint32_t i;
+
+    dma->LISR.Value = 0;
+    dma->HISR.Value = 0;
+    dma->LIFCR.Value = 0;
+    dma->HIFCR.Value = 0;
+    for(i = controller * 8U; i < ((controller + 1U) * 8U); i++)
+    {
+        regs = Sim_Dma_GetStream(i);
+        regs->CR.Value = 0;
+        regs->NDTR.Value = 0;
+        regs->PAR.Value = 0;
+        regs->M0AR.Value = 0;
+        regs->M1AR.Value = 0;
+        regs->FCR.Value = DMA_SxFCR_FTH_0;
+    }
+}
+
+/*! \brief Runs the memory to memory streams up to the given time
+ *
+ *  \param  now         The current time
+ */
+void Sim_Dma_Run(uint64_t now)
+{
+    DMA_Stream_TypeDef *regs;
+    SIM_DMA_STREAM *state;
+    uint64_t period;
+    uint32_t stream;
+    uint32_t cr;
+    uint32_t data;
+
+    period = ((uint64_t)SIM_DMA_CYCLES_PER_ITEM * SIM_NS_PER_S) / Sim_System_GetHclk();
+    if(period == 0)
+    {
+        period = 1;
+    }
+
+    for(stream = 8U; stream < SIM_DMA_STREAMS; stream++)
+    {
+        regs = Sim_Dma_GetStream(stream);
+        state = &Streams[stream];
+        while(((cr = regs->CR.Value) & DMA_SxCR_EN) &&
+              (((cr & DMA_SxCR_DIR) >> DMA_SxCR_DIR_Pos) == SIM_DMA_DIR_M2M) &&
+              (state->NextItem <= now))
+        {
+            data = Sim_Bus_Read(state->Periph, Sim_Dma_GetSize(cr, DMA_SxCR_PSIZE_Pos));
+            Sim_Bus_Write(state->Memory, data, Sim_Dma_GetSize(cr, DMA_SxCR_MSIZE_Pos));
+            state->NextItem += period;
+            Sim_Dma_Count(stream);
+        }
+    }
+}
+
+/*! \brief Reads a register of a DMA controller, the clear registers read 0
+ */
+uint32_t Sim_Dma_Read(uint32_t address, uint32_t size)
+{
+    DMA_TypeDef *dma = (address >= DMA2_BASE) ? DMA2 : DMA1;
+
+    if((address == Sim_Address(dma->LIFCR)) || (address == Sim_Address(dma->HIFCR)))
+    {
+        return 0;
+    }
+    return Sim_RawRead(address, size);
+}
+
+/*! \brief Writes a register of a DMA controller. While a stream is
+ *  enabled only its EN bit can be changed.
+ */
+void Sim_Dma_Write(uint32_t address, uint32_t value, uint32_t size)
+{
+    DMA_TypeDef *dma = (address >= DMA2_BASE) ? DMA2 : DMA1;
+    uint32_t stream = Sim_Dma_FindStream(address);
+    DMA_Stream_TypeDef *regs;
+    uint32_t cr;
+
+    if(address == Sim_Address(dma->LIFCR))
+    {
+        dma->LISR.Value &= ~value;
+        return;
+    }
+    if(address == Sim_Address(dma->HIFCR))
+    {
+        dma->HISR.Value &= ~value;
+        return;
+    }
+    if(stream == SIM_DMA_STREAMS)
+    {
+        // LISR and HISR are read only
+        return;
+    }
+
+    regs = Sim_Dma_GetStream(stream);
+    cr = regs->CR.Value;
+    if(address == Sim_Address(regs->CR))
+    {
+        if(cr & DMA_SxCR_EN)
+        {
+            regs->CR.Value = (cr & ~DMA_SxCR_EN) | (value & DMA_SxCR_EN);
+            return;
+        }
+        regs->CR.Value = value;
+        if(value & DMA_SxCR_EN)
+        {
+            Sim_Dma_Start(stream);
+        }
+    }
+    else if((cr & DMA_SxCR_EN) == 0)
+    {
+        Sim_RawWrite(address, value, size);
+    }
+}
+
+/*! \brief Returns the level of a stream's interrupt line
+ *
+ *  \param  stream      The stream index, DMA1 0-7 and DMA2 8-15
+ */
+uint32_t Sim_Dma_IrqLevel(uint32_t stream)
+{
+    DMA_Stream_TypeDef *regs = Sim_Dma_GetStream(stream);
+    uint32_t flags = Sim_Dma_GetFlags(stream);
+    uint32_t cr = regs->CR.Value;
+
+    return (((cr & DMA_SxCR_TCIE) && (flags & SIM_DMA_FLAG_TC)) ||
+            ((cr & DMA_SxCR_HTIE) && (flags & SIM_DMA_FLAG_HT)) ||
+            ((cr & DMA_SxCR_TEIE) && (flags & SIM_DMA_FLAG_TE)) ||
+            ((cr & DMA_SxCR_DMEIE) && (flags & SIM_DMA_FLAG_DME)) ||
+            ((regs->FCR.Value & DMA_SxFCR_FEIE) && (flags & SIM_DMA_FLAG_FE))) ? 1U : 0;
+}
+
+/*! \brief A peripheral hands a received item to its stream
+ *
+ *  \param  stream      The stream index, DMA1 0-7 and DMA2 8-15
+ *  \param  channel     The channel of the request
+ *  \param  data        The item
+ *  \retval uint32_t    1 when the stream took the item
+ */
+uint32_t Sim_Dma_PeriphToMemory(uint32_t stream, uint32_t channel, uint32_t data)
+{
+    uint32_t cr;
+
+    if(Sim_Dma_IsRequested(stream, channel, SIM_DMA_DIR_P2M) == 0)
+    {
+        return 0;
+    }
+    cr = Sim_Dma_GetStream(stream)->CR.Value;
+    Sim_Bus_Write(Streams[stream].Memory, data, Sim_Dma_GetSize(cr, DMA_SxCR_MSIZE_Pos));
+    Sim_Dma_Count(stream);
+    return 1;
+}
+
+/*! \brief A peripheral requests the next item to send from its stream
+ *
+ *  \param  stream      The stream index, DMA1 0-7 and DMA2 8-15
+ *  \param  channel     The channel of the request
+ *  \param  *data       Receives the item
+ *  \retval uint32_t    1 when the stream gave an item
+ */
+uint32_t Sim_Dma_MemoryToPeriph(uint32_t stream, uint32_t channel, uint32_t *data)
+{
+    uint32_t cr;
+
+    if(Sim_Dma_IsRequested(stream, channel, SIM_DMA_DIR_M2P) == 0)
+    {
+        return 0;
+    }
+    cr = Sim_Dma_GetStream(stream)->CR.Value;
+    *data = Sim_Bus_Read(Streams[stream].Memory, Sim_Dma_GetSize(cr, DMA_SxCR_MSIZE_Pos));
+    Sim_Dma_Count(stream);
+    return 1;
+}
@@ -0,0 +1,361 @@
+/*! \file   Sim_Flash.cpp
+ *  \brief  Flash interface model of the STM32F411xE
+ *  The array is NOR flash: programming only clears bits and an erase sets
+ *  a whole sector back to 0xFF. Program and erase take the typical times
+ *  of the datasheet for the selected parallelism. The firmware reads the
+ *  array directly, so a read during an erase returns the old content
+ *  instead of stalling, and a stray store into the array faults.
+ */
+#include "Sim.h"
+
+/*****************************************************************************/
+/*****************************************************************************/
+/*****************************************************************************/
+#define SIM_FLASH_SECTORS       8U
+#define SIM_FLASH_CR_ERRIE      (1U << 25)
+#define SIM_FLASH_CR_RESET      FLASH_CR_LOCK
+#define SIM_FLASH_OPTCR_RESET   0x0FFFAAEDU
+#define SIM_FLASH_PROGRAM_NS    (16U * SIM_NS_PER_US)   /*!< tPROG, typical  */
+#define SIM_FLASH_ERRORS        (FLASH_SR_SOP | FLASH_SR_WRPERR | FLASH_SR_PGAERR | \
+                                 FLASH_SR_PGPERR | FLASH_SR_PGSERR | FLASH_SR_RDERR)
+#define SIM_FLASH_PROGRAM_ERRORS (FLASH_SR_WRPERR | FLASH_SR_PGAERR | \
+                                  FLASH_SR_PGPERR | FLASH_SR_PGSERR)
+
+/*! \brief Wait states needed up to each HCLK frequency from 2.7 to 3.6 V
+ */
+static const uint32_t LatencyLimit[] = {30000000U, 64000000U, 90000000U, 100000000U};
+
+/*! \brief Highest HCLK of the voltage scales 3, 2 and 1 (VOS = 1, 2, 3)
+ */
+static const uint32_t VoltageScaleLimit[4] = {0, 64000000U, 84000000U, 100000000U};
+
+typedef enum
+{
+    OPERATION_NONE,
+    OPERATION_PROGRAM,
+    OPERATION_ERASE,
+} OPERATION;
+
+/*! \brief A sector and its typical erase time for x8, x16, x32 and x64
+ */
+typedef struct
+{
+    uint32_t Offset;
+    uint32_t Size;
+    uint32_t EraseMs[4];
+} SIM_FLASH_SECTOR;
+
+static const SIM_FLASH_SECTOR Sectors[SIM_FLASH_SECTORS] =
+{
+    {0x00000U, 0x04000U, {400U, 300U, 250U, 250U}},
+    {0x04000U, 0x04000U, {400U, 300U, 250U, 250U}},
+    {0x08000U, 0x04000U, {400U, 300U, 250U, 250U}},
+    {0x0C000U, 0x04000U, {400U, 300U, 250U, 250U}},
+    {0x10000U, 0x10000U, {1200U, 700U, 550U, 550U}},
+    {0x20000U, 0x20000U, {2000U, 1100U, 1000U, 1000U}},
+    {0x40000U, 0x20000U, {2000U, 1100U, 1000U, 1000U}},
+    {0x60000U, 0x20000U, {2000U, 1100U, 1000U, 1000U}},
+};
+
+/*! \brief Typical mass erase time for x8, x16, x32 and x64 */
+static const uint32_t MassEraseMs[4] = {8000U, 5500U, 4000U, 4000U};
+
+static OPERATION Operation;
+static uint64_t  BusyUntil;         /*!< End of the running operation        */
+static uint32_t  EraseFirst;        /*!< Sectors of the running erase        */
+static uint32_t  EraseCount;
+static uint32_t  KeyIndex;          /*!< Keys of the unlock sequence written */
+static uint32_t  KeyLocked;         /*!< Wrong key, locked until reset       */
+
+/*****************************************************************************/
+/*                       Helper Functions                                    */
+/*****************************************************************************/
+/*! \brief Returns the PSIZE field of FLASH_CR
+ */
+static uint32_t Sim_Flash_GetPsize(void)
+{
+    return (FLASH->CR.Value & FLASH_CR_PSIZE) >> FLASH_CR_PSIZE_Pos;
+}
+
+/*! \brief Starts an operation, BSY is set until it is done
+ */
+static void Sim_Flash_Start(OPERATION operation, uint64_t ns)
+{
+    Operation = operation;
+    BusyUntil = Sim_Now() + (uint64_t)((double)ns * Sim_Options.FlashTimeScale);
+    FLASH->SR.Value |= FLASH_SR_BSY;
+}
+
+/*! \brief Starts a sector or mass erase on STRT
+ */
+static void Sim_Flash_StartErase(uint32_t cr)
+{
+    uint32_t psize = Sim_Flash_GetPsize();
+    uint32_t sector = (cr & FLASH_CR_SNB) >> FLASH_CR_SNB_Pos;
+
+    if(cr & FLASH_CR_MER)
+    {
+        EraseFirst = 0;
+        EraseCount = SIM_FLASH_SECTORS;
+        Sim_Flash_Start(OPERATION_ERASE, MassEraseMs[psize] * 1000000ULL);
+    }
+    else if(cr & FLASH_CR_SER)
+    {
+        if(sector >= SIM_FLASH_SECTORS)
+        {
+            FLASH->SR.Value |= FLASH_SR_PGSERR;
+            return;
+        }
+        EraseFirst = sector;
+        EraseCount = 1;
+        Sim_Flash_Start(OPERATION_ERASE, Sectors[sector].EraseMs[psize] * 1000000ULL);
+    }
+}
+
+/*****************************************************************************/
+/*                       Model Interface                                     */
+/*****************************************************************************/
+/*! \brief Puts the flash interface in its reset state, the array is kept
+ */
+void Sim_Flash_Reset(void)
+{
+    FLASH->ACR.Value = 0;
+    FLASH->SR.Value = 0;
+    FLASH->CR.Value = SIM_FLASH_CR_RESET;
+    FLASH->OPTCR.Value = SIM_FLASH_OPTCR_RESET;
+    Operation = OPERATION_NONE;
+    KeyIndex = 0;
+    KeyLocked = 0;
+}
+
+/*! \brief Ends the running operation once its time has passed
+ *
+ *  \param  now         The current time
+ */
+void Sim_Flash_Run(uint64_t now)
+{
+    uint8_t *array = Sim_FlashArray();
+    uint32_t i;
+    uint32_t j;
+
+    if((Operation == OPERATION_NONE) || (now < BusyUntil))
+    {
+        return;
+    }
+
+    if(Operation == OPERATION_ERASE)
+    {
+        for(i = EraseFirst; i < (EraseFirst + EraseCount); i++)
+        {
+            for(j = 0; j < Sectors[i].Size; j++)
+            {
+                array[Sectors[i].Offset + j] = 0xFFU;
+            }
+        }
+        FLASH->CR.Value &= ~FLASH_CR_STRT;
+    }
+
+    Operation = OPERATION_NONE;
+    FLASH->SR.Value &= ~FLASH_SR_BSY;
+    if(FLASH->CR.Value & FLASH_CR_EOPIE)
+    {
+        FLASH->SR.Value |= FLASH_SR_EOP;
+    }
+    Sim_Bus_Activity();
+}
+
+/*! \brief Reads a register of the flash interface
+ */
+uint32_t Sim_Flash_Read(uint32_t address, uint32_t size)
+{
+    if((address == Sim_Address(FLASH->KEYR)) || (address == Sim_Address(FLASH->OPTKEYR)))
+    {
+        return 0;
+    }
+    return Sim_RawRead(address, size);
+}
+
+/*! \brief Writes a register of the flash interface
+ */
+void Sim_Flash_Write(uint32_t address, uint32_t value, uint32_t size)
+{
+    uint32_t cr = FLASH->CR.Value;
+
+    if(address == Sim_Address(FLASH->ACR))
+    {
+        FLASH->ACR.Value = value & ~(FLASH_ACR_ICRST | FLASH_ACR_DCRST);
+        Sim_Flash_CheckClock();
+    }
+    else if(address == Sim_Address(FLASH->KEYR))
+    {
+        if(((cr & FLASH_CR_LOCK) == 0) || (KeyLocked != 0))
+        {
+            return;
+        }
+        if((KeyIndex == 0) && (value == 0x45670123U))
+        {
+            KeyIndex = 1;
+        }
+        else if((KeyIndex == 1U) && (value == 0xCDEF89ABU))
+        {
+            KeyIndex = 0;
+            FLASH->CR.Value &= ~FLASH_CR_LOCK;
+        }
+        else
+        {
+            KeyLocked = 1;
+            Sim_Log("wrong FLASH_KEYR sequence, FLASH_CR stays locked until reset");
+        }
+    }
+    else if(address == Sim_Address(FLASH->SR))
+    {
+        FLASH->SR.Value &= ~(value & (SIM_FLASH_ERRORS | FLASH_SR_EOP));
+    }
+    else if(address == Sim_Address(FLASH->CR))
+    {
+        if(cr & FLASH_CR_LOCK)
+        {
+            return;
+        }
+        if(Operation != OPERATION_NONE)
+        {
+            // Keep STRT while busy, a new start is ignored
+            value = (value & ~FLASH_CR_STRT) | (cr & FLASH_CR_STRT);
+        }
+        FLASH->CR.Value = value;
+        if((Operation == OPERATION_NONE) && (value & FLASH_CR_STRT))
+        {
+            Sim_Flash_StartErase(value);
+        }
+    }
+    else if(address == Sim_Address(FLASH->OPTKEYR))
+    {
+        // Option bytes are not simulated
+    }
+    else
+    {
+        Sim_RawWrite(address, value, size);
+    }
+}
+
+/*! \brief Programs the flash array on a store of the firmware or a DMA.
+ *  The program errors of the reference manual are raised and nothing is
+ *  programmed: PGSERR without PG, during an erase or with a previous
+ *  error not cleared, PGPERR when the access size is not PSIZE, PGAERR
+ *  when the address is not aligned to it.
+ *
+ *  \param  address     The address in the flash array
+ *  \param  data        The data
+ *  \param  size        The access size in bytes
+ */
+void Sim_Flash_Store(uint32_t address, uint32_t data, uint32_t size)
+{
+    uint8_t *array = Sim_FlashArray();
+    uint32_t offset = address - FLASH_BASE;
+    uint32_t cr = FLASH->CR.Value;
+    uint32_t psize = 1U << Sim_Flash_GetPsize();
+    uint32_t i;
+
+    if(offset >= SIM_FLASH_SIZE)
+    {
+        Sim_Fatal("flash store outside of the array at 0x%08X", (unsigned)address);
+    }
+
+    if(((cr & FLASH_CR_PG) == 0) || (cr & (FLASH_CR_SER | FLASH_CR_MER)) ||
+       (Operation == OPERATION_ERASE) || (FLASH->SR.Value & SIM_FLASH_PROGRAM_ERRORS))
+    {
+        FLASH->SR.Value |= FLASH_SR_PGSERR;
+        return;
+    }
+    // x64 is programmed with two word stores
+    if(size != ((psize > 4U) ? 4U : psize))
+    {
+        FLASH->SR.Value |= FLASH_SR_PGPERR;
+        return;
+    }
+    if(offset & (size - 1U))
+    {
+        FLASH->SR.Value |= FLASH_SR_PGAERR;
+        return;
+    }
+
+    for(i = 0; i < size; i++)
+    {
+        array[offset + i] &= (uint8_t)(data >> (8U * i));
+    }
+    Sim_Flash_Start(OPERATION_PROGRAM, SIM_FLASH_PROGRAM_NS);
+}
+
+/*! \brief Checks HCLK against the flash wait states and the voltage scale.
+ *  Running faster than they allow is fatal: the target would read wrong
+ *  instructions.
+ */
+void Sim_Flash_CheckClock(void)
+{
+    uint32_t hclk = Sim_System_GetHclk();
+    uint32_t latency = FLASH->ACR.Value & FLASH_ACR_LATENCY;
+    uint32_t vos = (PWR->CR.Value & PWR_CR_VOS) >> PWR_CR_VOS_Pos;
+    uint32_t needed = 0;
+
+    while((needed < (sizeof(LatencyLimit) / sizeof(LatencyLimit[0]))) &&
+          (hclk > LatencyLimit[needed]))
+    {
+        needed++;
+    }
+    if(needed >= (sizeof(LatencyLimit) / sizeof(LatencyLimit[0])))
+    {
+        Sim_Fatal("HCLK %u Hz is above the 100 MHz maximum", (unsigned)hclk);
+    }
+    if(latency < needed)
+    {
+        Sim_Fatal("HCLK %u Hz needs %u flash wait states, FLASH_ACR has %u",
+                  (unsigned)hclk, (unsigned)needed, (unsigned)latency);
+    }
+    if(hclk > VoltageScaleLimit[vos])
+    {
+        Sim_Fatal("HCLK %u Hz is above the limit of voltage scale %u",
+                  (unsigned)hclk, (unsigned)(4U - vos));
+    }
+}
+
+/*! \brief Returns the level of the FLASH interrupt line
+ */
+uint32_t Sim_Flash_IrqLevel(uint32_t unused)
+{
+    (void)unused;
+    if((FLASH->CR.Value & FLASH_CR_EOPIE) && (FLASH->SR.Value & FLASH_SR_EOP))
+    {
+        return 1;
+    }
+    if((FLASH->CR.Value & SIM_FLASH_CR_ERRIE) && (FLASH->SR.Value & FLASH_SR_SOP))
+    {
+        return 1;
+    }
+    return 0;
+}
+
+/*****************************************************************************/
+/*                       Firmware Interface                                  */
+/*****************************************************************************/
+/*! \brief Programs the flash array through the flash model. A store while
+ *  the flash is busy stalls until the running operation is done.
+ *
+ *  \param  address     The address in the flash array
+ *  \param  data        The data, its size is set by the access
+ *  \param  size        The access size in bytes
+ */
+void Sim_Flash_Program(uint32_t address, uint32_t data, uint32_t size)
+{
+    Sim_Bus_Enter();
+    while(Operation != OPERATION_NONE)
+    {
+        if(Operation == OPERATION_ERASE)
+        {
+            Sim_Bus_Sleep(100U * SIM_NS_PER_US);
+        }
+        Sim_Bus_Advance();
+    }
+    Sim_Flash_Store(address, data, size);
+    Sim_Bus_Activity();
+    Sim_Bus_Leave();
+}
@@ -0,0 +1,385 @@
+/*! \file   Sim_Main.cpp
+ *  \brief  Entry point of the bootloader simulator
+ *  Maps the flash array and the register blocks at their STM32F411 addresses,
+ *  opens the pseudo terminal standing for the ST-LINK virtual COM port, then
+ *  runs the bootloader on its own thread. A timer signal on that thread lets
+ *  the models raise interrupts while the firmware only touches RAM.
+ */
+#include "Sim.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+/*****************************************************************************/
+/*****************************************************************************/
+/*****************************************************************************/
+#define SIM_STACK_SIZE          0x100000U   /*!< Firmware thread stack       */
+#define SIM_POLL_NS             (250U * SIM_NS_PER_US)
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE     0x100000
+#endif
+
+/*! \brief The bootloader's main, renamed by the Makefile */
+int Bootloader_Main(void);
+
+SIM_OPTIONS Sim_Options =
+{
+    0,          // FlashPath
+    0,          // LinkPath
+    1U,         // ButtonPressed
+    0,          // Bkp0r
+    1.0,        // FlashTimeScale
+    0,          // AnyBaud
+};
+
+static uint8_t *FlashAlias;     /*!< Writable view of the flash array        */
+static int      PtyMaster = -1;
+static int      PtySlave = -1;
+
+static const struct option LongOptions[] =
+{
+    {"flash",            required_argument, 0, 'f'},
+    {"link",             required_argument, 0, 'l'},
+    {"no-button",        no_argument,       0, 'n'},
+    {"bkp0r",            required_argument, 0, 'b'},
+    {"flash-time-scale", required_argument, 0, 's'},
+    {"any-baud",         no_argument,       0, 'a'},
+    {"help",             no_argument,       0, 'h'},
+    {0,                  0,                 0, 0  },
+};
+
+/*****************************************************************************/
+/*                       Helper Functions                                    */
+/*****************************************************************************/
+static void Sim_Usage(const char *name)
+{
+    printf("Usage: %s [options]\n"
+           "Runs the bootloader against simulated STM32F411 peripherals.\n"
+           "USART2 is a pseudo terminal, its path is printed at start.\n"
+           "\n"
+           "  -f, --flash FILE            flash image, 512 KB, created blank if missing\n"
+           "                              (default: a blank flash discarded at exit)\n"
+           "  -l, --link PATH             symlink to the pseudo terminal\n"
+           "  -n, --no-button             B1 released at reset, the application runs\n"
+           "                              unless RTC->BKP0R requests an update\n"
+           "  -b, --bkp0r VALUE           RTC->BKP0R at reset\n"
+           "  -s, --flash-time-scale F    factor on the flash program and erase times\n"
+           "  -a, --any-baud              accept any host baud rate\n"
+           "  -h, --help                  this help\n",
+           name);
+}
+
+static void Sim_ParseOptions(int argc, char **argv)
+{
+    int option;
+
+    while((option = getopt_long(argc, argv, "f:l:nb:s:ah", LongOptions, 0)) != -1)
+    {
+        switch(option)
+        {
+            case 'f':
+                Sim_Options.FlashPath = optarg;
+                break;
+            case 'l':
+                Sim_Options.LinkPath = optarg;
+                break;
+            case 'n':
+                Sim_Options.ButtonPressed = 0;
+                break;
+            case 'b':
+                Sim_Options.Bkp0r = (uint32_t)strtoul(optarg, 0, 0);
+                break;
+            case 's':
+                Sim_Options.FlashTimeScale = strtod(optarg, 0);
+                break;
+            case 'a':
+                Sim_Options.AnyBaud = 1;
+                break;
+            case 'h':
+                Sim_Usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                Sim_Usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*! \brief Maps a region at its exact target address
+ */
+static void *Sim_MapFixed(uint32_t address, uint32_t size, int prot, int flags, int fd)
+{
+    void *map = mmap((void *)(uintptr_t)address, size, prot,
+                     flags | MAP_FIXED_NOREPLACE, fd, 0);
+
+    if(map != (void *)(uintptr_t)address)
+    {
+        Sim_Fatal("cannot map 0x%08X: %s", (unsigned)address,
+                  (map == MAP_FAILED) ? strerror(errno) : "address in use");
+    }
+    return map;
+}
+
+/*! \brief Opens the flash image, or a blank one in memory. A new image is
+ *  filled with the erased state.
+ */
+static int Sim_OpenFlash(void)
+{
+    struct stat st;
+    int fd;
+
+    if(Sim_Options.FlashPath == 0)
+    {
+        fd = (int)syscall(SYS_memfd_create, "flash", 0);
+    }
+    else
+    {
+        fd = open(Sim_Options.FlashPath, O_RDWR | O_CREAT, 0644);
+    }
+    if((fd < 0) || (fstat(fd, &st) != 0))
+    {
+        Sim_Fatal("cannot open the flash image: %s", strerror(errno));
+    }
+    if(st.st_size == 0)
+    {
+        if(ftruncate(fd, SIM_FLASH_SIZE) != 0)
+        {
+            Sim_Fatal("cannot size the flash image: %s", strerror(errno));
+        }
+        FlashAlias = (uint8_t *)mmap(0, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(FlashAlias != MAP_FAILED)
+        {
+            memset(FlashAlias, 0xFF, SIM_FLASH_SIZE);
+        }
+    }
+    else if(st.st_size != SIM_FLASH_SIZE)
+    {
+        Sim_Fatal("the flash image has to be %u bytes", (unsigned)SIM_FLASH_SIZE);
+    }
+    else
+    {
+        FlashAlias = (uint8_t *)mmap(0, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if(FlashAlias == MAP_FAILED)
+    {
+        Sim_Fatal("cannot map the flash image: %s", strerror(errno));
+    }
+    return fd;
+}
+
+/*! \brief Maps the flash array read only, stores go through the flash
+ *  model, and the register blocks as plain memory the models keep up to
+ *  date
+ */
+static void Sim_MapMemory(void)
+{
+    int fd = Sim_OpenFlash();
+
+    Sim_MapFixed(FLASH_BASE, SIM_FLASH_SIZE, PROT_READ, MAP_SHARED, fd);
+    close(fd);
+    Sim_MapFixed(PERIPH_BASE, SIM_PERIPH_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1);
+    Sim_MapFixed(SIM_CORE_BASE, SIM_CORE_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1);
+}
+
+static void Sim_RemoveLink(void)
+{
+    if(Sim_Options.LinkPath != 0)
+    {
+        unlink(Sim_Options.LinkPath);
+    }
+}
+
+static void Sim_OnSignal(int sig)
+{
+    Sim_RemoveLink();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/*! \brief Opens the pseudo terminal. The slave stays open so the master
+ *  does not see a hangup between two host sessions.
+ */
+static void Sim_OpenPty(void)
+{
+    struct termios tio;
+    const char *name;
+
+    PtyMaster = posix_openpt(O_RDWR | O_NOCTTY);
+    if((PtyMaster < 0) || (grantpt(PtyMaster) != 0) || (unlockpt(PtyMaster) != 0) ||
+       ((name = ptsname(PtyMaster)) == 0))
+    {
+        Sim_Fatal("cannot open a pseudo terminal: %s", strerror(errno));
+    }
+    PtySlave = open(name, O_RDWR | O_NOCTTY);
+    if((PtySlave < 0) || (tcgetattr(PtySlave, &tio) != 0))
+    {
+        Sim_Fatal("cannot open %s: %s", name, strerror(errno));
+    }
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, B115200);
+    cfsetospeed(&tio, B115200);
+    tcsetattr(PtySlave, TCSANOW, &tio);
+    fcntl(PtyMaster, F_SETFL, fcntl(PtyMaster, F_GETFL) | O_NONBLOCK);
+
+    printf("Serial port: %s\n", name);
+    if(Sim_Options.LinkPath != 0)
+    {
+        unlink(Sim_Options.LinkPath);
+        if(symlink(name, Sim_Options.LinkPath) != 0)
+        {
+            Sim_Fatal("cannot link %s: %s", Sim_Options.LinkPath, strerror(errno));
+        }
+        printf("Linked to:   %s\n", Sim_Options.LinkPath);
+        atexit(Sim_RemoveLink);
+        signal(SIGINT, Sim_OnSignal);
+        signal(SIGTERM, Sim_OnSignal);
+        signal(SIGHUP, Sim_OnSignal);
+    }
+    fflush(stdout);
+}
+
+static void Sim_OnPoll(int sig)
+{
+    int savedErrno = errno;
+
+    (void)sig;
+    Sim_Bus_Poll();
+    errno = savedErrno;
+}
+
+/*! \brief Starts the poll timer, its signal is delivered to the calling
+ *  thread only. The thread inherits the mask of main, which blocks the
+ *  signal, so it is unblocked here.
+ */
+static void Sim_StartPoll(void)
+{
+    struct sigaction action;
+    struct sigevent event;
+    struct itimerspec period;
+    sigset_t unblocked;
+    timer_t timer;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = Sim_OnPoll;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGALRM, &action, 0);
+
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGALRM;
+    event._sigev_un._tid = (pid_t)syscall(SYS_gettid);
+    if(timer_create(CLOCK_MONOTONIC, &event, &timer) != 0)
+    {
+        Sim_Fatal("cannot create the poll timer: %s", strerror(errno));
+    }
+
+    period.it_interval.tv_sec = 0;
+    period.it_interval.tv_nsec = (long)SIM_POLL_NS;
+    period.it_value = period.it_interval;
+    timer_settime(timer, 0, &period, 0);
+
+    sigemptyset(&unblocked);
+    sigaddset(&unblocked, SIGALRM);
+    pthread_sigmask(SIG_UNBLOCK, &unblocked, 0);
+}
+
+/*! \brief The firmware thread, runs the bootloader from reset
+ */
+static void *Sim_Firmware(void *arg)
+{
+    (void)arg;
+    Sim_StartPoll();
+    Bootloader_Main();
+    Sim_Log("main returned");
+    exit(EXIT_FAILURE);
+}
+
+/*****************************************************************************/
+/*                       Model Interface                                     */
+/*****************************************************************************/
+void Sim_Log(const char *format, ...)
+{
+    va_list args;
+
+    fprintf(stderr, "[%10.6f] ", (double)Sim_Now() / (double)SIM_NS_PER_S);
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+void Sim_Fatal(const char *format, ...)
+{
+    va_list args;
+
+    fputs("fatal: ", stderr);
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+    exit(EXIT_FAILURE);
+}
+
+/*! \brief Returns a writable view of the flash array for the flash model
+ */
+uint8_t *Sim_FlashArray(void)
+{
+    return FlashAlias;
+}
+
+/*****************************************************************************/
+/*****************************************************************************/
+/*****************************************************************************/
+int main(int argc, char **argv)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t blocked;
+    void *stack;
+
+    Sim_ParseOptions(argc, argv);
+    Sim_MapMemory();
+    Sim_OpenPty();
+    Sim_Bus_Reset();
+    Sim_Usart_Open(PtyMaster, PtySlave);
+
+    // The firmware stores stack addresses in uint32_t, so its stack has to
+    // be below 4 GB like the rest of its memory
+    stack = mmap(0, SIM_STACK_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+    if(stack == MAP_FAILED)
+    {
+        Sim_Fatal("cannot map the firmware stack: %s", strerror(errno));
+    }
+
+    // Only the firmware thread takes the poll signal
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &blocked, 0);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, stack, SIM_STACK_SIZE);
+    if(pthread_create(&thread, &attr, Sim_Firmware, 0) != 0)
+    {
+        Sim_Fatal("cannot start the firmware thread");
+    }
+    pthread_join(thread, 0);
+
+    return EXIT_SUCCESS;
+}
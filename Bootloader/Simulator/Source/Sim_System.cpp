@@ -0,0 +1,387 @@
+/*! \file   Sim_System.cpp
+ *  \brief  RCC, PWR, RTC backup registers, GPIO and CRC models
+ *  The oscillators and the PLL are ready as soon as they are enabled. The
+ *  clock tree is computed from the registers, independently of
+ *  SystemCoreClock, and every clock switch is checked against the flash
+ *  wait states and the voltage scale.
+ */
+#include "Sim.h"
+
+/*****************************************************************************/
+/*****************************************************************************/
+/*****************************************************************************/
+#define SIM_RCC_CR_RESET        0x00000083U /*!< HSI on and ready, trim 16   */
+#define SIM_RCC_PLLCFGR_RESET   0x24003010U
+#define SIM_RCC_CSR_RESET       0x0E000000U
+#define SIM_PWR_CR_RESET        0x00008000U /*!< Voltage scale 2             */
+
+#define SIM_GPIO_PORTS          8U      /*!< GPIOA to GPIOH, 0x400 apart     */
+
+#define SIM_CRC_POLYNOMIAL      0x04C11DB7U
+
+/*! \brief Reset values of MODER and PUPDR, the debug pins are configured
+ */
+static const uint32_t GpioModerReset[SIM_GPIO_PORTS] = {0x0C000000U, 0x00000280U};
+static const uint32_t GpioPupdrReset[SIM_GPIO_PORTS] = {0x64000000U, 0x00000100U};
+
+/*****************************************************************************/
+/*                       Helper Functions                                    */
+/*****************************************************************************/
+/*! \brief Returns the GPIO port of an address
+ */
+static GPIO_TypeDef *Sim_System_GetPort(uint32_t address, uint32_t *index)
+{
+    *index = (address - GPIOA_BASE) / 0x400U;
+    return (GPIO_TypeDef *)(uintptr_t)(GPIOA_BASE + *index * 0x400U);
+}
+
+/*! \brief Puts a GPIO port in its reset state
+ */
+static void Sim_System_ResetPort(uint32_t index)
+{
+    GPIO_TypeDef *port = (GPIO_TypeDef *)(uintptr_t)(GPIOA_BASE + index * 0x400U);
+
+    port->MODER.Value = GpioModerReset[index];
+    port->OTYPER.Value = 0;
+    port->OSPEEDR.Value = (index == 0) ? 0x0C000000U : ((index == 1U) ? 0x000000C0U : 0);
+    port->PUPDR.Value = GpioPupdrReset[index];
+    port->ODR.Value = 0;
+    port->BSRR.Value = 0;
+    port->LCKR.Value = 0;
+    port->AFR[0].Value = 0;
+    port->AFR[1].Value = 0;
+}
+
+/*! \brief Returns the level of the input pins of a port. Outputs read back
+ *  their ODR bit, the others the level driven from outside or their pull.
+ *  Only B1 on PC13 (pulled up, low while held) and the idle USART2 RX line
+ *  on PA3 are driven from outside.
+ */
+static uint32_t Sim_System_GetIdr(GPIO_TypeDef *port, uint32_t index)
+{
+    uint32_t idr = 0;
+    uint32_t pin;
+    uint32_t mode;
+    uint32_t pull;
+
+    for(pin = 0; pin < 16U; pin++)
+    {
+        mode = (port->MODER.Value >> (2U * pin)) & 0x3U;
+        pull = (port->PUPDR.Value >> (2U * pin)) & 0x3U;
+        if(mode == 0x1U)
+        {
+            idr |= port->ODR.Value & (1U << pin);
+        }
+        else if(pull == 0x1U)
+        {
+            idr |= 1U << pin;
+        }
+    }
+
+    if(index == 2U)
+    {
+        if(Sim_Options.ButtonPressed != 0)
+        {
+            idr &= ~GPIO_IDR_ID13;
+        }
+        else
+        {
+            idr |= GPIO_IDR_ID13;
+        }
+    }
+    else if(index == 0)
+    {
+        idr |= GPIO_IDR_ID3;
+    }
+    return idr;
+}
+
+/*! \brief Feeds one word to the CRC unit
+ */
+static void Sim_System_CrcWrite(uint32_t data)
+{
+    uint32_t crc = CRC->DR.Value ^ data;
+    uint32_t i;
+
+    for(i = 0; i < 32U; i++)
+    {
+        crc = (crc & 0x80000000U) ? ((crc << 1) ^ SIM_CRC_POLYNOMIAL) : (crc << 1);
+    }
+    CRC->DR.Value = crc;
+}
+
+/*! \brief Returns the frequency of SYSCLK from the switch status
+ */
+static uint32_t Sim_System_GetSysclk(void)
+{
+    uint32_t pllcfgr = RCC->PLLCFGR.Value;
+    uint64_t input;
+    uint32_t m, n, p;
+
+    switch(RCC->CFGR.Value & RCC_CFGR_SWS)
+    {
+        case RCC_CFGR_SWS_HSE:
+            return SIM_HSE_VALUE;
+        case RCC_CFGR_SWS_PLL:
+            input = (pllcfgr & RCC_PLLCFGR_PLLSRC) ? SIM_HSE_VALUE : SIM_HSI_VALUE;
+            m = (pllcfgr & RCC_PLLCFGR_PLLM) >> RCC_PLLCFGR_PLLM_Pos;
+            n = (pllcfgr & RCC_PLLCFGR_PLLN) >> RCC_PLLCFGR_PLLN_Pos;
+            p = (((pllcfgr & RCC_PLLCFGR_PLLP) >> RCC_PLLCFGR_PLLP_Pos) + 1U) * 2U;
+            if(m < 2U)
+            {
+                Sim_Fatal("PLLM %u is invalid", (unsigned)m);
+            }
+            return (uint32_t)(input * n / m / p);
+        default:
+            return SIM_HSI_VALUE;
+    }
+}
+
+/*! \brief Applies a write to RCC_CR: the oscillators and PLLs are ready
+ *  as soon as they are on
+ */
+static void Sim_System_WriteRccCr(uint32_t value)
+{
+    uint32_t ready = RCC_CR_HSIRDY | RCC_CR_HSERDY | RCC_CR_PLLRDY | RCC_CR_PLLI2SRDY;
+
+    value &= ~ready;
+    if(value & RCC_CR_HSION)    value |= RCC_CR_HSIRDY;
+    if(value & RCC_CR_HSEON)    value |= RCC_CR_HSERDY;
+    if(value & RCC_CR_PLLON)    value |= RCC_CR_PLLRDY;
+    if(value & RCC_CR_PLLI2SON) value |= RCC_CR_PLLI2SRDY;
+
+    if(((RCC->CFGR.Value & RCC_CFGR_SWS) == RCC_CFGR_SWS_PLL) && ((value & RCC_CR_PLLON) == 0))
+    {
+        // The PLL cannot be stopped while it clocks the system
+        value |= RCC_CR_PLLON | RCC_CR_PLLRDY;
+    }
+    RCC->CR.Value = value;
+}
+
+/*! \brief Applies a write to RCC_CFGR: the switch status follows the
+ *  switch once the selected clock is ready
+ */
+static void Sim_System_WriteRccCfgr(uint32_t value)
+{
+    static const uint32_t ReadyFlag[4] = {RCC_CR_HSIRDY, RCC_CR_HSERDY, RCC_CR_PLLRDY, 0};
+    uint32_t sw = value & RCC_CFGR_SW;
+    uint32_t sws = RCC->CFGR.Value & RCC_CFGR_SWS;
+
+    if((ReadyFlag[sw] != 0) && (RCC->CR.Value & ReadyFlag[sw]))
+    {
+        sws = sw << RCC_CFGR_SWS_Pos;
+    }
+    RCC->CFGR.Value = (value & ~RCC_CFGR_SWS) | sws;
+    Sim_Flash_CheckClock();
+}
+
+/*! \brief Resets the peripherals whose reset bits are set
+ */
+static void Sim_System_ResetPeripherals(uint32_t address, uint32_t value)
+{
+    uint32_t i;
+
+    if(address == Sim_Address(RCC->AHB1RSTR))
+    {
+        for(i = 0; i < SIM_GPIO_PORTS; i++)
+        {
+            if(value & (1U << i))
+            {
+                Sim_System_ResetPort(i);
+            }
+        }
+        if(value & RCC_AHB1RSTR_CRCRST)
+        {
+            CRC->DR.Value = 0xFFFFFFFFU;
+            CRC->IDR.Value = 0;
+        }
+        if(value & RCC_AHB1RSTR_DMA1RST)
+        {
+            Sim_Dma_Reset(0);
+        }
+        if(value & RCC_AHB1RSTR_DMA2RST)
+        {
+            Sim_Dma_Reset(1U);
+        }
+    }
+    else if(address == Sim_Address(RCC->APB1RSTR))
+    {
+        if(value & RCC_APB1RSTR_USART2RST)
+        {
+            Sim_Usart_Reset();
+        }
+        if(value & RCC_APB1RSTR_PWRRST)
+        {
+            PWR->CR.Value = SIM_PWR_CR_RESET;
+        }
+    }
+}
+
+/*****************************************************************************/
+/*                       Model Interface                                     */
+/*****************************************************************************/
+/*! \brief Puts RCC, PWR, the GPIO ports and the CRC unit in their reset
+ *  state and loads the backup register given on the command line
+ */
+void Sim_System_Reset(void)
+{
+    uint32_t i;
+
+    RCC->CR.Value = SIM_RCC_CR_RESET;
+    RCC->PLLCFGR.Value = SIM_RCC_PLLCFGR_RESET;
+    RCC->CFGR.Value = 0;
+    RCC->CSR.Value = SIM_RCC_CSR_RESET;
+
+    PWR->CR.Value = SIM_PWR_CR_RESET;
+    PWR->CSR.Value = PWR_CSR_VOSRDY;
+    RTC->BKP0R.Value = Sim_Options.Bkp0r;
+
+    for(i = 0; i < SIM_GPIO_PORTS; i++)
+    {
+        Sim_System_ResetPort(i);
+    }
+
+    CRC->DR.Value = 0xFFFFFFFFU;
+}
+
+/*! \brief Reads a register of RCC, PWR, RTC, a GPIO port or the CRC unit
+ */
+uint32_t Sim_System_Read(uint32_t address, uint32_t size)
+{
+    GPIO_TypeDef *port;
+    uint32_t index;
+
+    if((address - GPIOA_BASE) < (SIM_GPIO_PORTS * 0x400U))
+    {
+        port = Sim_System_GetPort(address, &index);
+        if(address == Sim_Address(port->IDR))
+        {
+            return Sim_System_GetIdr(port, index);
+        }
+        if(address == Sim_Address(port->BSRR))
+        {
+            return 0;
+        }
+    }
+    else if(address == Sim_Address(CRC->CR))
+    {
+        return 0;
+    }
+    return Sim_RawRead(address, size);
+}
+
+/*! \brief Writes a register of RCC, PWR, RTC, a GPIO port or the CRC unit
+ */
+void Sim_System_Write(uint32_t address, uint32_t value, uint32_t size)
+{
+    GPIO_TypeDef *port;
+    uint32_t index;
+
+    if((address - GPIOA_BASE) < (SIM_GPIO_PORTS * 0x400U))
+    {
+        port = Sim_System_GetPort(address, &index);
+        if(address == Sim_Address(port->BSRR))
+        {
+            port->ODR.Value &= ~(value >> 16);
+            port->ODR.Value |= value & 0xFFFFU;
+        }
+        else if(address != Sim_Address(port->IDR))
+        {
+            Sim_RawWrite(address, value, size);
+        }
+    }
+    else if(address == Sim_Address(CRC->DR))
+    {
+        Sim_System_CrcWrite(value);
+    }
+    else if(address == Sim_Address(CRC->CR))
+    {
+        if(value & CRC_CR_RESET)
+        {
+            CRC->DR.Value = 0xFFFFFFFFU;
+        }
+    }
+    else if(address == Sim_Address(RCC->CR))
+    {
+        Sim_System_WriteRccCr(value);
+    }
+    else if(address == Sim_Address(RCC->CFGR))
+    {
+        Sim_System_WriteRccCfgr(value);
+    }
+    else if(address == Sim_Address(RCC->PLLCFGR))
+    {
+        // Only written while the PLL is off
+        if((RCC->CR.Value & RCC_CR_PLLON) == 0)
+        {
+            RCC->PLLCFGR.Value = value;
+        }
+    }
+    else if((address == Sim_Address(RCC->AHB1RSTR)) || (address == Sim_Address(RCC->APB1RSTR)))
+    {
+        Sim_RawWrite(address, value, size);
+        Sim_System_ResetPeripherals(address, value);
+    }
+    else if(address == Sim_Address(PWR->CR))
+    {
+        PWR->CR.Value = value;
+        Sim_Flash_CheckClock();
+    }
+    else if(address == Sim_Address(PWR->CSR))
+    {
+        PWR->CSR.Value = (PWR->CSR.Value & ~PWR_CSR_EWUP) | (value & PWR_CSR_EWUP);
+    }
+    else if((address - Sim_Address(RTC->BKP0R)) < (20U * 4U))
+    {
+        // The backup domain is write protected until DBP is set
+        if(PWR->CR.Value & PWR_CR_DBP)
+        {
+            Sim_RawWrite(address, value, size);
+        }
+    }
+    else
+    {
+        Sim_RawWrite(address, value, size);
+    }
+}
+
+/*! \brief Returns the AHB clock
+ */
+uint32_t Sim_System_GetHclk(void)
+{
+    static const uint8_t AhbShift[8] = {1, 2, 3, 4, 6, 7, 8, 9};
+    uint32_t hpre = (RCC->CFGR.Value & RCC_CFGR_HPRE) >> RCC_CFGR_HPRE_Pos;
+    uint32_t sysclk = Sim_System_GetSysclk();
+
+    if(hpre & 0x8U)
+    {
+        return sysclk >> AhbShift[hpre & 0x7U];
+    }
+    return sysclk;
+}
+
+/*! \brief Returns the APB1 clock
+ */
+uint32_t Sim_System_GetPclk1(void)
+{
+    uint32_t ppre = (RCC->CFGR.Value & RCC_CFGR_PPRE1) >> RCC_CFGR_PPRE1_Pos;
+
+    if(ppre & 0x4U)
+    {
+        return Sim_System_GetHclk() >> ((ppre & 0x3U) + 1U);
+    }
+    return Sim_System_GetHclk();
+}
+
+/*! \brief Returns the APB2 clock
+ */
+uint32_t Sim_System_GetPclk2(void)
+{
+    uint32_t ppre = (RCC->CFGR.Value & RCC_CFGR_PPRE2) >> RCC_CFGR_PPRE2_Pos;
+
+    if(ppre & 0x4U)
+    {
+        return Sim_System_GetHclk() >> ((ppre & 0x3U) + 1U);
+    }
+    return Sim_System_GetHclk();
+}
@@ -0,0 +1,465 @@
+/*! \file   Sim_Usart.cpp
+ *  \brief  USART2 model connected to the pseudo terminal of the host
+ *  Bytes move at the baud rate programmed in BRR, one frame time each, so
+ *  the firmware sees the same pacing as on the target. A byte sent by the
+ *  host at a speed more than 3% away from the programmed one arrives
+ *  garbled with a framing error, like a wrong baud rate on real hardware.
+ */
+#include "Sim.h"
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+// The termios delay masks hide the USART control registers
+#undef CR1
+#undef CR2
+#undef CR3
+
+/*****************************************************************************/
+/*****************************************************************************/
+/*****************************************************************************/
+#define SIM_USART_QUEUE_SIZE    4096U
+#define SIM_USART_SR_RESET      (USART_SR_TXE | USART_SR_TC)
+#define SIM_USART_SR_RC_W0      (USART_SR_RXNE | USART_SR_TC | USART_SR_LBD | USART_SR_CTS)
+#define SIM_USART_SR_ERRORS     (USART_SR_PE | USART_SR_FE | USART_SR_NE | USART_SR_ORE)
+#define SIM_USART_TOLERANCE     0.03
+#define SIM_USART_DRAIN_MS      1000    /*!< Longest wait for the host to read
+                                             the last bytes                  */
+
+#define SIM_USART_RX_STREAM     5U      /*!< DMA1 Stream 5, channel 4        */
+#define SIM_USART_TX_STREAM     6U      /*!< DMA1 Stream 6, channel 4        */
+#define SIM_USART_DMA_CHANNEL   4U
+
+/*! \brief Host speeds of the termios B constants
+ */
+typedef struct
+{
+    speed_t  Constant;
+    uint32_t Baud;
+} SIM_SPEED;
+
+static const SIM_SPEED Speeds[] =
+{
+    {B9600, 9600U},       {B19200, 19200U},     {B38400, 38400U},
+    {B57600, 57600U},     {B115200, 115200U},   {B230400, 230400U},
+    {B460800, 460800U},   {B500000, 500000U},   {B576000, 576000U},
+    {B921600, 921600U},   {B1000000, 1000000U}, {B1152000, 1152000U},
+    {B1500000, 1500000U}, {B2000000, 2000000U}, {B2500000, 2500000U},
+    {B3000000, 3000000U}, {B3500000, 3500000U}, {B4000000, 4000000U},
+};
+
+static int      Fd = -1;
+static int      SlaveFd = -1;   /*!< Tells the bytes the host has not read   */
+
+static uint8_t  RxQueue[SIM_USART_QUEUE_SIZE];  /*!< Sent by the host       */
+static uint32_t RxHead;
+static uint32_t RxCount;
+static uint64_t RxDone;         /*!< End of the byte on the line, 0 if none  */
+static uint64_t RxLineFree;     /*!< End of the last received byte           */
+static uint32_t RxIdlePending;  /*!< IDLE is set once the line stays free    */
+static uint32_t RxWarnedBaud;   /*!< Speed mismatch already logged           */
+
+static uint32_t TxShifting;     /*!< A byte is in the shift register         */
+static uint8_t  TxShift;
+static uint64_t TxDone;         /*!< End of the byte in the shift register   */
+static uint32_t TxHolding;      /*!< A byte waits in DR                      */
+static uint8_t  TxHold;
+static uint8_t  TxOut[SIM_USART_QUEUE_SIZE];    /*!< Not written to the host */
+static uint32_t TxOutCount;
+
+/*****************************************************************************/
+/*                       Helper Functions                                    */
+/*****************************************************************************/
+/*! \brief Returns the baud rate programmed in BRR, 0 when disabled
+ */
+static uint32_t Sim_Usart_GetBaud(void)
+{
+    uint32_t brr = USART2->BRR.Value;
+    uint32_t div = brr;
+
+    if(((USART2->CR1.Value & USART_CR1_UE) == 0) || (brr == 0))
+    {
+        return 0;
+    }
+    if(USART2->CR1.Value & USART_CR1_OVER8)
+    {
+        div = ((brr >> 4) * 8U) + (brr & 0x7U);
+    }
+    return (div != 0) ? (Sim_System_GetPclk1() / div) : 0;
+}
+
+/*! \brief Returns the time of one frame: start bit, data bits and stop bits
+ */
+static uint64_t Sim_Usart_GetFrameTime(uint32_t baud)
+{
+    static const double StopBits[4] = {1.0, 0.5, 2.0, 1.5};
+    double bits = (USART2->CR1.Value & USART_CR1_M) ? 10.0 : 9.0;
+
+    bits += StopBits[(USART2->CR2.Value & USART_CR2_STOP) >> USART_CR2_STOP_Pos];
+    return (uint64_t)((bits * (double)SIM_NS_PER_S) / (double)baud);
+}
+
+/*! \brief Returns the speed the host set on the pseudo terminal, 0 when
+ *  it is not a standard one
+ */
+static uint32_t Sim_Usart_GetHostBaud(void)
+{
+    struct termios tio;
+    speed_t speed;
+    uint32_t i;
+
+    if(tcgetattr(Fd, &tio) != 0)
+    {
+        return 0;
+    }
+    speed = cfgetospeed(&tio);
+    for(i = 0; i < (sizeof(Speeds) / sizeof(Speeds[0])); i++)
+    {
+        if(Speeds[i].Constant == speed)
+        {
+            return Speeds[i].Baud;
+        }
+    }
+    return 0;
+}
+
+/*! \brief Returns whether the host sends at the programmed baud rate
+ */
+static uint32_t Sim_Usart_BaudMatches(uint32_t baud)
+{
+    uint32_t host;
+    double error;
+
+    if(Sim_Options.AnyBaud != 0)
+    {
+        return 1;
+    }
+    host = Sim_Usart_GetHostBaud();
+    error = ((double)host - (double)baud) / (double)baud;
+    if((error <= SIM_USART_TOLERANCE) && (error >= -SIM_USART_TOLERANCE))
+    {
+        RxWarnedBaud = 0;
+        return 1;
+    }
+    if(RxWarnedBaud == 0)
+    {
+        RxWarnedBaud = 1;
+        Sim_Log("host sends at %u baud, USART2 expects %u: framing errors",
+                (unsigned)host, (unsigned)baud);
+    }
+    return 0;
+}
+
+/*! \brief Moves the bytes sent by the host into the receive queue
+ */
+static void Sim_Usart_Fetch(void)
+{
+    uint8_t buffer[256];
+    uint32_t space = SIM_USART_QUEUE_SIZE - RxCount;
+    uint32_t i;
+    ssize_t len;
+
+    if(space > sizeof(buffer))
+    {
+        space = sizeof(buffer);
+    }
+    if((Fd < 0) || (space == 0))
+    {
+        return;
+    }
+    len = read(Fd, buffer, space);
+    for(i = 0; (len > 0) && (i < (uint32_t)len); i++)
+    {
+        RxQueue[(RxHead + RxCount) % SIM_USART_QUEUE_SIZE] = buffer[i];
+        RxCount++;
+    }
+}
+
+/*! \brief A byte was received: it goes to the DMA with DMAR, otherwise to
+ *  DR, and an overrun is raised if the previous one was not read.
+ */
+static void Sim_Usart_Receive(uint8_t data, uint32_t framingError)
+{
+    if(framingError != 0)
+    {
+        USART2->SR.Value |= USART_SR_FE;
+    }
+    if((USART2->CR3.Value & USART_CR3_DMAR) &&
+       (Sim_Dma_PeriphToMemory(SIM_USART_RX_STREAM, SIM_USART_DMA_CHANNEL, data) != 0))
+    {
+        return;
+    }
+    if(USART2->SR.Value & USART_SR_RXNE)
+    {
+        USART2->SR.Value |= USART_SR_ORE;
+        return;
+    }
+    USART2->DR.Value = data;
+    USART2->SR.Value |= USART_SR_RXNE;
+}
+
+/*! \brief Runs the receiver up to the given time
+ */
+static void Sim_Usart_RunRx(uint64_t now, uint32_t baud)
+{
+    uint64_t frame;
+    uint8_t data;
+
+    Sim_Usart_Fetch();
+    if((baud == 0) || ((USART2->CR1.Value & USART_CR1_RE) == 0))
+    {
+        // Lost, nobody listens on the line
+        RxHead = (RxHead + RxCount) % SIM_USART_QUEUE_SIZE;
+        RxCount = 0;
+        RxDone = 0;
+        return;
+    }
+
+    frame = Sim_Usart_GetFrameTime(baud);
+    while(RxCount > 0)
+    {
+        if(RxDone == 0)
+        {
+            RxDone = now + frame;
+        }
+        if(now < RxDone)
+        {
+            break;
+        }
+        data = RxQueue[RxHead];
+        RxHead = (RxHead + 1U) % SIM_USART_QUEUE_SIZE;
+        RxCount--;
+        if(Sim_Usart_BaudMatches(baud) != 0)
+        {
+            Sim_Usart_Receive(data, 0);
+        }
+        else
+        {
+            Sim_Usart_Receive((uint8_t)(data ^ 0x5AU), 1U);
+        }
+        RxLineFree = RxDone;
+        RxIdlePending = 1;
+        RxDone = (RxCount > 0) ? (RxDone + frame) : 0;
+        Sim_Bus_Activity();
+    }
+
+    if((RxIdlePending != 0) && (RxCount == 0) && (now >= (RxLineFree + frame)))
+    {
+        RxIdlePending = 0;
+        USART2->SR.Value |= USART_SR_IDLE;
+        Sim_Bus_Activity();
+    }
+}
+
+/*! \brief Writes the transmitted bytes to the host. Returns 0 while the
+ *  host does not read and the output is full.
+ */
+static uint32_t Sim_Usart_Flush(void)
+{
+    ssize_t len;
+
+    if((TxOutCount == 0) || (Fd < 0))
+    {
+        return 1;
+    }
+    len = write(Fd, TxOut, TxOutCount);
+    if(len > 0)
+    {
+        TxOutCount -= (uint32_t)len;
+        memmove(TxOut, &TxOut[len], TxOutCount);
+    }
+    return (TxOutCount < SIM_USART_QUEUE_SIZE) ? 1U : 0;
+}
+
+/*! \brief Runs the transmitter up to the given time
+ */
+static void Sim_Usart_RunTx(uint64_t now, uint32_t baud)
+{
+    uint32_t data;
+    uint64_t frame;
+
+    if((baud == 0) || ((USART2->CR1.Value & USART_CR1_TE) == 0))
+    {
+        return;
+    }
+    frame = Sim_Usart_GetFrameTime(baud);
+
+    for(;;)
+    {
+        if((TxHolding == 0) && (USART2->CR3.Value & USART_CR3_DMAT) &&
+           (Sim_Dma_MemoryToPeriph(SIM_USART_TX_STREAM, SIM_USART_DMA_CHANNEL, &data) != 0))
+        {
+            TxHold = (uint8_t)data;
+            TxHolding = 1;
+            USART2->SR.Value &= ~(USART_SR_TXE | USART_SR_TC);
+        }
+        if(TxShifting != 0)
+        {
+            if((now < TxDone) || (Sim_Usart_Flush() == 0))
+            {
+                break;
+            }
+            TxOut[TxOutCount++] = TxShift;
+            TxShifting = 0;
+            Sim_Bus_Activity();
+        }
+        if(TxHolding == 0)
+        {
+            if((USART2->SR.Value & USART_SR_TC) == 0)
+            {
+                USART2->SR.Value |= USART_SR_TC;
+                Sim_Bus_Activity();
+            }
+            break;
+        }
+        // The holding register moves to the shift register, the frame
+        // starts when the line is free
+        TxShift = TxHold;
+        TxHolding = 0;
+        TxShifting = 1;
+        TxDone = ((TxDone > (now - frame)) && (TxDone < now)) ? (TxDone + frame) : (now + frame);
+        USART2->SR.Value |= USART_SR_TXE;
+    }
+    Sim_Usart_Flush();
+}
+
+/*****************************************************************************/
+/*                       Model Interface                                     */
+/*****************************************************************************/
+/*! \brief Connects the USART to the host
+ *
+ *  \param  fd          The non-blocking pseudo terminal master
+ *  \param  slave       The pseudo terminal slave kept open by the simulator
+ */
+void Sim_Usart_Open(int fd, int slave)
+{
+    Fd = fd;
+    SlaveFd = slave;
+}
+
+/*! \brief Hands the bytes sent by the firmware to the host before the
+ *  simulation ends. Closing the master hangs up the slave, which drops the
+ *  bytes the host has not read yet, so the host is given up to
+ *  SIM_USART_DRAIN_MS to read them.
+ */
+void Sim_Usart_Drain(void)
+{
+    struct pollfd pfd;
+    int unread = 0;
+    int waited;
+
+    if(Fd < 0)
+    {
+        return;
+    }
+
+    pfd.fd = Fd;
+    pfd.events = POLLOUT;
+    for(waited = 0; (TxOutCount != 0) && (waited < SIM_USART_DRAIN_MS); waited++)
+    {
+        poll(&pfd, 1, 1);
+        Sim_Usart_Flush();
+    }
+    tcdrain(Fd);
+
+    for(waited = 0; waited < SIM_USART_DRAIN_MS; waited++)
+    {
+        if((SlaveFd < 0) || (ioctl(SlaveFd, FIONREAD, &unread) != 0) || (unread == 0))
+        {
+            break;
+        }
+        usleep(1000);
+    }
+}
+
+/*! \brief Puts USART2 in its reset state, bytes on the way are lost
+ */
+void Sim_Usart_Reset(void)
+{
+    USART2->SR.Value = SIM_USART_SR_RESET;
+    USART2->DR.Value = 0;
+    USART2->BRR.Value = 0;
+    USART2->CR1.Value = 0;
+    USART2->CR2.Value = 0;
+    USART2->CR3.Value = 0;
+    USART2->GTPR.Value = 0;
+    RxCount = 0;
+    RxDone = 0;
+    RxIdlePending = 0;
+    TxShifting = 0;
+    TxHolding = 0;
+}
+
+/*! \brief Moves the bytes on the line up to the given time
+ *
+ *  \param  now         The current time
+ */
+void Sim_Usart_Run(uint64_t now)
+{
+    uint32_t baud = Sim_Usart_GetBaud();
+
+    Sim_Usart_RunRx(now, baud);
+    Sim_Usart_RunTx(now, baud);
+}
+
+/*! \brief Reads a register of USART2. Reading SR then DR clears the
+ *  error flags and IDLE. The firmware discards that DR read, which C++
+ *  does not turn into an access, so IDLE is cleared once SR reports it.
+ */
+uint32_t Sim_Usart_Read(uint32_t address, uint32_t size)
+{
+    uint32_t value = Sim_RawRead(address, size);
+
+    if(address == Sim_Address(USART2->SR))
+    {
+        USART2->SR.Value &= ~USART_SR_IDLE;
+    }
+    else if(address == Sim_Address(USART2->DR))
+    {
+        USART2->SR.Value &= ~(USART_SR_RXNE | USART_SR_IDLE | SIM_USART_SR_ERRORS);
+        value &= 0x1FFU;
+    }
+    return value;
+}
+
+/*! \brief Writes a register of USART2
+ */
+void Sim_Usart_Write(uint32_t address, uint32_t value, uint32_t size)
+{
+    if(address == Sim_Address(USART2->SR))
+    {
+        USART2->SR.Value &= value | ~SIM_USART_SR_RC_W0;
+    }
+    else if(address == Sim_Address(USART2->DR))
+    {
+        if((USART2->CR1.Value & (USART_CR1_UE | USART_CR1_TE)) != (USART_CR1_UE | USART_CR1_TE))
+        {
+            return;
+        }
+        // A write while TXE is cleared overwrites the waiting byte
+        TxHold = (uint8_t)value;
+        TxHolding = 1;
+        USART2->SR.Value &= ~(USART_SR_TXE | USART_SR_TC);
+        Sim_Usart_RunTx(Sim_Now(), Sim_Usart_GetBaud());
+    }
+    else
+    {
+        Sim_RawWrite(address, value, size);
+    }
+}
+
+/*! \brief Returns the level of the USART2 interrupt line
+ */
+uint32_t Sim_Usart_IrqLevel(uint32_t unused)
+{
+    uint32_t sr = USART2->SR.Value;
+    uint32_t cr1 = USART2->CR1.Value;
+
+    (void)unused;
+    return (((cr1 & USART_CR1_RXNEIE) && (sr & (USART_SR_RXNE | USART_SR_ORE))) ||
+            ((cr1 & USART_CR1_TXEIE) && (sr & USART_SR_TXE)) ||
+            ((cr1 & USART_CR1_TCIE) && (sr & USART_SR_TC)) ||
+            ((cr1 & USART_CR1_IDLEIE) && (sr & USART_SR_IDLE))) ? 1U : 0;
+}
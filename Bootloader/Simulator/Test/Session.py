@@ -0,0 +1,242 @@
+#!/usr/bin/env python3
+"""Scripted flash sessions against the simulator, for regression testing.
+
+Each session starts the simulator on a blank flash, hooks up, erases slot A,
+writes an image in windows, checks it and expects the jump to the
+application. The framed session runs the same steps over SET_FRAMING and
+corrupts one window frame on the way, which the target has to NACK alone.
+
+    python3 Test/Session.py build/BootloaderSim
+"""
+import os
+import random
+import select
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+ACK = 0x06
+NACK = 0x16
+
+ERASE = 0x43
+WRITE_WINDOW = 0x33
+CHECK = 0x51
+SET_FRAMING = 0x72
+
+SLOT_A = 0x08008000
+SECTOR_2 = 2
+IMAGE_SIZE = 12288  # more than the 8 KB RX ring of the target, so it wraps
+FRAME_SIZE = 256
+WINDOW_FRAMES = 8
+
+
+def checksum(data):
+    value = 0
+    for b in data:
+        value ^= b
+    return value
+
+
+def stm32_crc(data):
+    """CRC of the STM32 CRC unit over little endian words"""
+    crc = 0xFFFFFFFF
+    for (word,) in struct.iter_unpack('<I', data):
+        crc ^= word
+        for _ in range(32):
+            crc = ((crc << 1) ^ 0x04C11DB7) if crc & 0x80000000 else (crc << 1)
+            crc &= 0xFFFFFFFF
+    return crc
+
+
+def crc16(data):
+    """CRC-16/CCITT-FALSE of the frame layer"""
+    crc = 0xFFFF
+    for b in data:
+        x = ((crc >> 8) ^ b) & 0xFF
+        x ^= x >> 4
+        crc = ((crc << 8) ^ (x << 12) ^ (x << 5) ^ x) & 0xFFFF
+    return crc
+
+
+def cobs_encode(data):
+    out = bytearray()
+    block = bytearray()
+    for b in data:
+        if b != 0:
+            block.append(b)
+        if b == 0 or len(block) == 254:
+            out.append(len(block) + 1)
+            out += block
+            block = bytearray()
+    out.append(len(block) + 1)
+    out += block
+    return bytes(out)
+
+
+def cobs_decode(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        i += 1
+        if code == 0 or i + code - 1 > len(data):
+            return None
+        out += data[i:i + code - 1]
+        i += code - 1
+        if code < 0xFF and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+class Target:
+    """The simulator and its serial port"""
+
+    def __init__(self, sim, flash):
+        self.proc = subprocess.Popen([sim, '--flash', flash], stdout=subprocess.PIPE,
+                                     stderr=subprocess.STDOUT)
+        port = self.proc.stdout.readline().decode().split(': ')[1].strip()
+        # The simulator sets the pty raw: a tcsetattr here would flush the
+        # first bytes of the target
+        self.fd = os.open(port, os.O_RDWR | os.O_NOCTTY)
+        self.framed = False
+        self.rx = b''
+        self.messages = b''
+
+    def write(self, data, corrupt=False):
+        if self.framed:
+            body = struct.pack('<H', len(data)) + data
+            frame = bytearray(b'\0' + cobs_encode(body + struct.pack('<H', crc16(body))) + b'\0')
+            if corrupt:
+                frame[len(frame) // 2] ^= 0x55
+            data = bytes(frame)
+        os.write(self.fd, data)
+
+    def read_raw(self, count, timeout):
+        out = b''
+        end = time.time() + timeout
+        while len(out) < count and time.time() < end:
+            ready, _, _ = select.select([self.fd], [], [], 0.05)
+            if ready:
+                try:
+                    out += os.read(self.fd, count - len(out))
+                except OSError:
+                    break
+        return out
+
+    def read(self, count, timeout=5.0):
+        if not self.framed:
+            return self.read_raw(count, timeout)
+        end = time.time() + timeout
+        while len(self.messages) < count and time.time() < end:
+            self.rx += self.read_raw(1, 0.05)
+            while b'\0' in self.rx:
+                encoded, self.rx = self.rx.split(b'\0', 1)
+                if not encoded:
+                    continue
+                frame = cobs_decode(encoded)
+                if (frame is None or len(frame) < 4 or
+                        struct.unpack_from('<H', frame)[0] != len(frame) - 4 or
+                        struct.unpack_from('<H', frame, len(frame) - 2)[0] != crc16(frame[:-2])):
+                    raise AssertionError('reply frame failed its check')
+                self.messages += frame[2:-2]
+        out, self.messages = self.messages[:count], self.messages[count:]
+        return out
+
+    def command(self, command):
+        self.write(bytes([command, checksum([command])]))
+        return self.read(2)
+
+    def finish(self):
+        try:
+            self.proc.wait(timeout=10)
+        except subprocess.TimeoutExpired:
+            self.proc.kill()
+            self.proc.wait()
+        os.close(self.fd)
+        return self.proc.stdout.read().decode()
+
+
+def expect(what, got, wanted):
+    if got != wanted:
+        raise AssertionError(f'{what}: got {got.hex()}, expected {wanted.hex()}')
+
+
+def make_image():
+    """A vector table for slot A and random code, ending with its CRC so the
+    CRC over the whole image is 0"""
+    rng = random.Random(16)
+    image = struct.pack('<II', 0x20018000, SLOT_A + 0x101)
+    image += bytes(rng.getrandbits(8) for _ in range(IMAGE_SIZE - len(image) - 4))
+    return image + struct.pack('<I', stm32_crc(image))
+
+
+def session(sim, framed):
+    image = make_image()
+    with tempfile.NamedTemporaryFile(suffix='.bin') as flash:
+        flash.write(b'\xff' * 0x80000)
+        flash.flush()
+        target = Target(sim, flash.name)
+
+        expect('hookup', target.read_raw(2, 5.0), bytes([ACK, ACK]))
+        target.write(bytes([ACK, ACK]))
+        if framed:
+            expect('set framing', target.command(SET_FRAMING), bytes([ACK, ACK]))
+            target.framed = True
+
+        expect('erase command', target.command(ERASE), bytes([ACK, ACK]))
+        request = bytes([1, SECTOR_2])
+        target.write(request + bytes([checksum(request)]))
+        expect('erase', target.read(2), bytes([ACK, ACK]))
+
+        frames = [(i, SLOT_A + i * FRAME_SIZE, image[i * FRAME_SIZE:(i + 1) * FRAME_SIZE])
+                  for i in range(len(image) // FRAME_SIZE)]
+        corrupt = 3 if framed else -1
+        while frames:
+            window = frames[:WINDOW_FRAMES]
+            target.write(bytes([WRITE_WINDOW, checksum([WRITE_WINDOW]),
+                                len(window), checksum([len(window)])]))
+            for k, (seq, address, data) in enumerate(window):
+                frame = bytes([seq & 0xFF]) + struct.pack('<IB', address, len(data) - 1) + data
+                target.write(frame + bytes([checksum(frame)]), corrupt=(k == corrupt))
+            expect('window', target.read(2), bytes([ACK, ACK]))
+            reply = target.read(3)
+            nacked = (1 << corrupt) if corrupt >= 0 else 0
+            if (len(reply) != 3 or reply[0] != (NACK if nacked else ACK) or
+                    reply[1] != nacked or reply[2] != checksum(reply[:2])):
+                raise AssertionError(f'window reply {reply.hex()}')
+            corrupt = -1
+            frames = [f for k, f in enumerate(window) if reply[1] & (1 << k)] + frames[len(window):]
+
+        expect('check command', target.command(CHECK), bytes([ACK, ACK]))
+        for address in (SLOT_A, SLOT_A + len(image)):
+            request = struct.pack('<I', address)
+            target.write(request + bytes([checksum(request)]))
+            expect('check range', target.read(2), bytes([ACK, ACK]))
+        expect('check', target.read(2), bytes([ACK, ACK]))
+
+        log = target.finish()
+        if 'jump to the application' not in log or target.proc.returncode != 0:
+            raise AssertionError('no jump to the application:\n' + log)
+        written = open(flash.name, 'rb').read()[SLOT_A - 0x08000000:][:len(image)]
+        if written != image:
+            raise AssertionError('flash does not hold the image')
+
+
+def main():
+    sim = sys.argv[1] if len(sys.argv) > 1 else 'build/BootloaderSim'
+    failed = 0
+    for name, framed in (('unframed', False), ('framed', True)):
+        start = time.time()
+        try:
+            session(sim, framed)
+            print(f'{name} session: ok ({time.time() - start:.1f} s)')
+        except AssertionError as error:
+            print(f'{name} session: FAILED, {error}')
+            failed += 1
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -23,14 +23,334 @@
 #include "HAL_CRC_Driver.h"
 #include "HAL_UART_Driver.h"
 #include "HAL_Flash_Driver.h"
+#include "HAL_DMA_Driver.h"
+#include "HAL_SysTick_Driver.h"
+#include "HAL_DWT_Driver.h"
+#include <string.h>
 
-#define BOOT_FLAG_ADDRESS           0x08004000U
-#define APPLICATION_START_ADDRESS   0x08008000U
-#define TIMEOUT_VALUE               SystemCoreClock/4
+#define BOOT_FLAG_REGISTER          (RTC->BKP0R)
+#define BOOT_FLAG_UPDATE            0x55504454U /*!< "UPDT": stay for an update */
+#define BOOT_BUTTON_PORT            GPIOC       /*!< User button B1, active low */
+#define BOOT_BUTTON_PIN             GPIO_PIN_13
+#define APPLICATION_RAM_END         (SRAM_BASE + 0x20000U)  /*!< 128 KB */
+#define DEFAULT_BAUD_RATE           115200U
+
+/* Boot metadata: a log of slot tokens in sector 1, see BOOT_RECORD      */
+#define BOOT_METADATA_ADDRESS       0x08004000U
+#define BOOT_METADATA_END           0x08008000U
+#define BOOT_METADATA_SECTOR        HAL_FLASH_SECTOR_1
+#define BOOT_RECORD_VERIFIED        0x44465256U /*!< "VRFD": image checked   */
+#define BOOT_RECORD_INVALIDATED     0x44564E49U /*!< "INVD": slot modified   */
+#define BOOT_RECORD_ERASED          0xFFFFFFFFU
+#define SLOT_NONE                   0xFFFFFFFFU
+
+/* Image header: the start of a slot, in front of the vector table, see  */
+/* IMAGE_HEADER                                                           */
+#define IMAGE_HEADER_MAGIC          0x48474D49U /*!< "IMGH"                  */
+#define IMAGE_VECTOR_ALIGN          0x200U      /*!< VTOR alignment of the
+                                                     vector table            */
 
 #define ACK     0x06U
 #define NACK    0x16U
 
+/* Deadlines of the command processor states, in milliseconds. The host  */
+/* reads them with the GET_TIMEOUTS command                               */
+#define HOOKUP_TIMEOUT_MS           1000U   /*!< Host hookup window          */
+#define RX_TIMEOUT_MS               1000U   /*!< Rest of a started message   */
+#define ERASE_TIMEOUT_MS            4000U   /*!< One sector, worst case      */
+#define CRC_TIMEOUT_MS              1000U   /*!< One CRC computation         */
+#define BAUD_CONFIRM_TIMEOUT_MS     250U    /*!< Handshake at the new rate   */
+#define NO_TIMEOUT                  0U
+
+/*! \brief Flash program parallelism. x32 is valid from 2.7 to 3.6 V */
+#define FLASH_PROGRAM_PSIZE         FLASH_TYPEPROGRAM_WORD
+
+#define WRITE_BULK_HEADER_SIZE      5U      /*!< Address (4) + length - 1 (1) */
+#define WRITE_BULK_MAX_BYTES        256U    /*!< Max data bytes per bulk frame*/
+
+#define RX_RING_SIZE                8192U   /*!< DMA receive circular buffer */
+#define TX_RING_SIZE                2048U   /*!< DMA transmit circular buffer:
+                                                 a read frame and replies    */
+
+#define WRITE_WINDOW_MAX_FRAMES     8U      /*!< Max frames in flight        */
+#define WRITE_WINDOW_HEADER_SIZE    (1U + WRITE_BULK_HEADER_SIZE) /*!< + seq */
+
+#define LZ4_BLOCK_SIZE              1024U   /*!< Max decompressed block size */
+#define LZ4_MAX_COMPRESSED_SIZE     (LZ4_BLOCK_SIZE + (LZ4_BLOCK_SIZE / 255U) + 16U)
+#define LZ4_HEADER_SIZE             9U      /*!< Seq (1) + Address (4) +
+                                                 Compressed (2) + Raw (2)    */
+#define LZ4_FRAME_SIZE              (LZ4_HEADER_SIZE + \
+                                     LZ4_MAX_COMPRESSED_SIZE + 1U)
+#define LZ4_ERROR                   0xFFFFFFFFU
+
+/* Delta frames have the layout of LZ4 frames, with a patch against the  */
+/* active slot in place of the LZ4 block, see Delta_Apply                 */
+#define DELTA_OP_COPY               0x00U   /*!< Bytes of the active slot    */
+#define DELTA_OP_COPY_RELOC         0x01U   /*!< Words of the active slot,
+                                                 relocated to the new slot   */
+#define DELTA_OP_ADD                0x02U   /*!< Bytes of the patch          */
+#define DELTA_OP_SIZE               3U      /*!< Op (1) + Length (2)         */
+#define DELTA_ERROR                 0xFFFFFFFFU
+
+#define READ_FRAME_SIZE             1024U   /*!< Max data bytes per read frame*/
+
+/*! \brief Size of the message buffer: the largest message is a compressed
+ *  frame */
+#define RX_BUFFER_SIZE              LZ4_FRAME_SIZE
+
+/* Frame layer, selected by the host with SET_FRAMING. Each frame is     */
+/* | 0x00 | COBS(Length (2) | Payload | CRC-16 (2)) | 0x00 |, the CRC is  */
+/* CRC-16/CCITT-FALSE of the length and payload, see Link_Receive         */
+#define LINK_DELIMITER              0x00U
+#define LINK_COBS_FULL              0xFFU   /*!< Code of a block of 254 bytes
+                                                 not followed by a zero      */
+#define LINK_HEADER_SIZE            2U      /*!< Length of the payload       */
+#define LINK_CRC_SIZE               2U
+#define LINK_FRAME_SIZE             (LINK_HEADER_SIZE + RX_BUFFER_SIZE + LINK_CRC_SIZE)
+
+/*! \brief RxLength of the states whose length is set by the previous step */
+#define RX_LENGTH_VARIABLE          0xFFFFFFFFU
+
+/* Phase profiling. Bin i of a histogram counts the durations below      */
+/* STATS_FIRST_BIN_US x 4^i microseconds, the last bin all longer ones    */
+#define STATS_HISTOGRAM_BINS        8U
+#define STATS_FIRST_BIN_US          16U
+#define STATS_PHASE_SIZE            (20U + (4U * STATS_HISTOGRAM_BINS))
+#define STATS_REPLY_SIZE            (17U + (STATS_PHASE_SIZE * STATS_PHASE_COUNT))
+
+/*****************************************************************************/
+/*                          Private Types                                    */
+/*****************************************************************************/
+typedef enum
+{
+    ERASE = 0x43,
+    WRITE = 0x31,
+    WRITE_BULK = 0x32,
+    WRITE_WINDOW = 0x33,
+    WRITE_LZ4 = 0x34,
+    WRITE_DELTA = 0x35,
+    CHECK = 0x51,
+    SECTOR_CRC = 0x52,
+    JUMP  = 0xA1,
+    SET_BAUD = 0x71,
+    GET_TIMEOUTS = 0x11,
+    GET_STATS = 0x12,
+    GET_SLOTS = 0x13,
+    READ = 0x21,
+    SET_FRAMING = 0x72,
+} COMMANDS;
+
+/*! \brief States of the command processor
+ */
+typedef enum
+{
+    STATE_HOOKUP,               /*!< Waiting for the host's hookup ACK       */
+    STATE_COMMAND,              /*!< Waiting for a command                   */
+    STATE_ERASE_REQUEST,        /*!< Waiting for the sectors to erase        */
+    STATE_ERASE_SECTOR,         /*!< A sector erase is running               */
+    STATE_WRITE_ADDRESS,        /*!< Write: waiting for the address          */
+    STATE_WRITE_LENGTH,         /*!< Write: waiting for the length           */
+    STATE_WRITE_DATA,           /*!< Write: waiting for the data             */
+    STATE_BULK_HEADER,          /*!< Bulk write: waiting for the header      */
+    STATE_BULK_DATA,            /*!< Bulk write: waiting for the data        */
+    STATE_WINDOW_HEADER,        /*!< Write window: waiting for the header    */
+    STATE_FRAME_HEADER,         /*!< Write window: waiting for a frame header*/
+    STATE_FRAME_DATA,           /*!< Write window: waiting for frame data    */
+    STATE_LZ4_WINDOW_HEADER,    /*!< LZ4 window: waiting for the header      */
+    STATE_LZ4_FRAME_HEADER,     /*!< LZ4 window: waiting for a frame header  */
+    STATE_LZ4_FRAME_DATA,       /*!< LZ4 window: waiting for the LZ4 block   */
+    STATE_DELTA_WINDOW_HEADER,  /*!< Delta window: waiting for the header    */
+    STATE_DELTA_FRAME_HEADER,   /*!< Delta window: waiting for a frame header*/
+    STATE_DELTA_FRAME_DATA,     /*!< Delta window: waiting for the patch     */
+    STATE_CHECK_START,          /*!< Check: waiting for the start address    */
+    STATE_CHECK_END,            /*!< Check: waiting for the end address      */
+    STATE_CHECK_CRC,            /*!< Check: the CRC is running               */
+    STATE_SECTOR_CRC_REQUEST,   /*!< Sector CRC: waiting for the sectors     */
+    STATE_SECTOR_CRC,           /*!< Sector CRC: a CRC is running            */
+    STATE_BAUD_REQUEST,         /*!< Set baud: waiting for the baud rate     */
+    STATE_BAUD_CONFIRM,         /*!< Set baud: waiting for the handshake     */
+    STATE_JUMP,                 /*!< Jump to the application                 */
+    STATE_GET_TIMEOUTS,         /*!< Report the protocol timeouts            */
+    STATE_GET_STATS,            /*!< Stats: waiting for the clear flag       */
+    STATE_GET_SLOTS,            /*!< Report the application slots            */
+    STATE_READ_REQUEST,         /*!< Read: waiting for the range             */
+    STATE_READ_FRAME,           /*!< Read: the CRC of a frame is running     */
+    STATE_SET_FRAMING,          /*!< Switch to the frame layer               */
+    STATE_COUNT
+} STATE;
+
+/*! \brief Describes a state of the command processor.
+ *  The processor waits until RxLength bytes are received into pRxBuffer at
+ *  RxOffset, then runs Step, which returns the next state. States that
+ *  receive nothing (RxLength 0) run Step on every pass until it returns
+ *  another state, which lets long operations progress as resumable steps.
+ *  Timeout runs instead when the state does not complete within TimeoutMs,
+ *  and Lost when the frame of its message fails its check.
+ */
+typedef struct
+{
+    uint32_t RxOffset;          /*!< Where the bytes go in pRxBuffer         */
+    uint32_t RxLength;          /*!< Bytes to receive, or RX_LENGTH_VARIABLE */
+    uint32_t TimeoutMs;         /*!< Deadline of the state, or NO_TIMEOUT    */
+    STATE    (*Step)(void);     /*!< Processes the state                     */
+    STATE    (*Timeout)(void);  /*!< Handles a missed deadline               */
+    STATE    (*Lost)(void);     /*!< Handles a message lost in a bad frame   */
+} STATE_ENTRY;
+
+/*! \brief Maps a command to the first state of its processing
+ */
+typedef struct
+{
+    uint8_t  Command;
+    STATE    State;
+} COMMAND_ENTRY;
+
+/*! \brief Progress of the command being processed
+ */
+typedef struct
+{
+    uint32_t RxLength;          /*!< Length of the next RX_LENGTH_VARIABLE
+                                     state                                   */
+    uint32_t Address;           /*!< Start address of the command            */
+    uint32_t NumBytes;          /*!< Data bytes of the current message       */
+    uint32_t Sector;            /*!< Sector being processed                  */
+    uint32_t EndSector;         /*!< First sector after the last one         */
+    uint32_t NumFrames;         /*!< Frames announced in the window header   */
+    uint32_t Frame;             /*!< Index of the frame in the window        */
+    uint8_t  NackBitmap;        /*!< Rejected frames of the window           */
+    uint32_t ReplyLength;       /*!< Bytes of pReply filled so far           */
+    uint32_t FrameStart;        /*!< Cycles when the frame was awaited       */
+    uint32_t OperationStart;    /*!< Cycles when the erase or CRC started    */
+    uint32_t Slot;              /*!< Slot holding the checked range          */
+    uint32_t ExpectedCrc;       /*!< CRC of a good checked range             */
+    STATE    FrameState;        /*!< State receiving the frames of a window  */
+} COMMAND_CONTEXT;
+
+/*! \brief The application slots. Each slot holds a complete application
+ *  linked for its start address: an update is written to the slot that is
+ *  not running, so the running application stays bootable until the new
+ *  one is checked and committed.
+ */
+typedef enum
+{
+    SLOT_A,                     /*!< Sectors 2 to 4, 96 KB                   */
+    SLOT_B,                     /*!< Sectors 5 to 7, 384 KB                  */
+    SLOT_COUNT
+} SLOT;
+
+/*! \brief Describes an application slot
+ */
+typedef struct
+{
+    uint32_t Start;             /*!< Address of the image header, or of the
+                                     vector table of an image without one    */
+    uint32_t End;               /*!< First address after the slot            */
+} SLOT_ENTRY;
+
+/*! \brief A record of the boot metadata log.
+ *  Records are appended to the metadata sector and never modified, the
+ *  newest record of a slot is its token. A verified token is recorded when
+ *  CHECK passes on the slot, and the verified slot with the newest
+ *  generation is booted. An invalidated token is recorded before the slot
+ *  is first erased or programmed. Magic is programmed last, so a single
+ *  word write commits the record, and a record torn by a reset is skipped.
+ */
+typedef struct
+{
+    uint32_t Generation;        /*!< One more than the previous record       */
+    uint32_t Slot;              /*!< The slot of the token                   */
+    uint32_t Length;            /*!< Bytes of the checked image              */
+    uint32_t Crc;               /*!< Last word of the image: its CRC         */
+    uint32_t Check;             /*!< ~(Generation ^ Slot ^ Length ^ Crc)     */
+    uint32_t Magic;             /*!< BOOT_RECORD_VERIFIED or
+                                     BOOT_RECORD_INVALIDATED                 */
+} BOOT_RECORD;
+
+/*! \brief The header at the start of an application image, filled in by
+ *  the post-link tool. The vector table follows at HeaderSize, so an image
+ *  can be validated from its header alone, in one bounded pass. A slot
+ *  that does not start with the magic holds an image without a header,
+ *  which starts with its vector table.
+ */
+typedef struct
+{
+    uint32_t Magic;             /*!< IMAGE_HEADER_MAGIC                      */
+    uint32_t HeaderSize;        /*!< Offset of the vector table              */
+    uint32_t Version;           /*!< Application version                     */
+    uint32_t Length;            /*!< Bytes of the image, header included     */
+    uint32_t Crc;               /*!< CRC of the bytes after the header       */
+    uint32_t EntryPoint;        /*!< Reset handler                           */
+    uint32_t LoadAddress;       /*!< Slot start the image is linked for      */
+    uint32_t HeaderCrc;         /*!< CRC of the words above                  */
+} IMAGE_HEADER;
+
+/*! \brief State of the token of a slot
+ */
+typedef enum
+{
+    TOKEN_MISSING,              /*!< The slot has no record                  */
+    TOKEN_VERIFIED,             /*!< Unchanged since the image was checked   */
+    TOKEN_INVALIDATED,          /*!< Modified since                          */
+} TOKEN_STATE;
+
+/*! \brief The token of a slot, from its newest record
+ */
+typedef struct
+{
+    TOKEN_STATE State;
+    uint32_t    Generation;     /*!< 0 when the token is missing             */
+    uint32_t    Length;
+    uint32_t    Crc;
+} SLOT_TOKEN;
+
+/*! \brief Phases of the bootloader profiled with the DWT cycle counter
+ */
+typedef enum
+{
+    STATS_HOOKUP,               /*!< Hello ACK to the host's hookup ACK      */
+    STATS_ERASE,                /*!< One sector erase                        */
+    STATS_RECEIVE,              /*!< One write frame, first byte awaited to
+                                     checksum received                       */
+    STATS_PROGRAM,              /*!< Programming one write frame             */
+    STATS_CRC,                  /*!< One CRC computation                     */
+    STATS_PHASE_COUNT
+} STATS_PHASE;
+
+/*! \brief Durations of one phase, in core cycles
+ */
+typedef struct
+{
+    uint32_t Count;
+    uint64_t TotalCycles;
+    uint32_t MinCycles;
+    uint32_t MaxCycles;
+    uint32_t Histogram[STATS_HISTOGRAM_BINS];
+} PHASE_STATS;
+
+/*! \brief Outcome of receiving a message
+ */
+typedef enum
+{
+    LINK_PENDING,               /*!< Not received yet                        */
+    LINK_RECEIVED,              /*!< The message is in the buffer            */
+    LINK_LOST,                  /*!< Its frame failed the length or CRC check*/
+} LINK_STATUS;
+
+/*! \brief State of the frame layer. The received frame is decoded as its
+ *  bytes arrive, then its messages are taken one by one by the states.
+ */
+typedef struct
+{
+    uint8_t  Framed;            /*!< Messages travel in frames               */
+    uint32_t RxLength;          /*!< Bytes decoded of the received frame     */
+    uint8_t  RxCode;            /*!< COBS code of the block being decoded    */
+    uint32_t RxLeft;            /*!< Bytes left in the block being decoded   */
+    uint32_t PayloadNext;       /*!< Next message in the decoded frame       */
+    uint32_t PayloadLeft;       /*!< Bytes of the frame not taken yet        */
+    uint32_t TxLength;          /*!< Bytes in the block being encoded        */
+    uint16_t TxCrc;             /*!< CRC of the frame being sent             */
+} LINK_CONTEXT;
+
 /*****************************************************************************/
 /*                          Private Variables                                */
 /*****************************************************************************/
@@ -40,15 +360,89 @@ static UART_HandleTypeDef UartHandle;
 
 /*! \brief Buffer for received messages
  */
-static uint8_t pRxBuffer[32];
+static uint8_t pRxBuffer[RX_BUFFER_SIZE];
+
+/*! \brief Buffer for replies built over several steps. The largest reply
+ *  is the stats, followed by its checksum
+ */
+static uint8_t pReply[STATS_REPLY_SIZE + 1U];
+
+/*! \brief The frame being received, decoded
+ */
+static uint8_t pLinkFrame[LINK_FRAME_SIZE];
+
+/*! \brief The COBS block being sent: its code, then up to 254 bytes
+ */
+static uint8_t pLinkBlock[LINK_COBS_FULL];
+
+/*! \brief State of the frame layer
+ */
+static LINK_CONTEXT Link;
+
+/*! \brief Decompression window: one decompressed block on its way to flash
+ */
+static uint8_t pDecompressBuffer[LZ4_BLOCK_SIZE];
+
+/*! \brief The DMA stream feeding the receive circular buffer
+ */
+static DMA_HandleTypeDef DmaRxHandle;
+
+/*! \brief The DMA stream draining the transmit circular buffer
+ */
+static DMA_HandleTypeDef DmaTxHandle;
+
+/*! \brief The DMA stream feeding the CRC unit from flash
+ */
+static DMA_HandleTypeDef DmaCrcHandle;
+
+/*! \brief Circular buffer the UART receives into, filled by DMA
+ */
+static uint8_t pRxRing[RX_RING_SIZE];
+
+/*! \brief Circular buffer of the replies on their way to the host, sent by
+ *  DMA
+ */
+static uint8_t pTxRing[TX_RING_SIZE];
+
+/*! \brief The current state of the command processor and its deadline
+ */
+static STATE State;
+static uint32_t StateDeadline;
+
+/*! \brief Progress of the command being processed
+ */
+static COMMAND_CONTEXT Command;
+
+/*! \brief Profile of the bootloader phases, kept until GET_STATS clears it
+ */
+static PHASE_STATS Stats[STATS_PHASE_COUNT];
+
+/*! \brief Cycles spent in passes that found nothing to do
+ */
+static uint64_t StatsIdleCycles;
+
+/*! \brief Cycles when the current state was entered
+ */
+static uint32_t StateEnterCycles;
+
+/*! \brief The boot metadata read by Slot_Load: the token of each slot,
+ *  the newest generation and where the next record goes
+ */
+static SLOT_TOKEN Tokens[SLOT_COUNT];
+static uint32_t Generation;
+static uint32_t NextRecordAddress;
+
+/*! \brief The slot the bootloader would start, which updates cannot touch
+ */
+static uint32_t ActiveSlot;
 
+/*! \brief Outcome of programming one frame of a write window
+ */
 typedef enum
 {
-    ERASE = 0x43,
-    WRITE = 0x31,
-    CHECK = 0x51,
-    JUMP  = 0xA1,
-} COMMANDS;
+    FRAME_OK,       /*!< Frame programmed                                    */
+    FRAME_REJECTED, /*!< Bad checksum, bad content or programming error      */
+} FRAME_STATUS;
 
 /*****************************************************************************/
 /*                     Private Function Prototypes                           */
@@ -57,11 +451,22 @@ typedef enum
  */
 static void JumpToApplication(void);
 
+/*! \brief Returns whether the bootloader has to wait for the host.
+ *
+ *  \retval uint8_t     1 to wait for the host, 0 to start the application
+ */
+static uint8_t IsUpdateRequested(void);
+
 /*! \brief  Initializes the bootloader for host communication.
  *          Communication will be done through the UART peripheral.
  */
 static void Bootloader_Init(void);
 
+/*! \brief Puts back the clocks and the peripherals used by the bootloader
+ *  in their reset state.
+ */
+static void Bootloader_DeInit(void);
+
 /*! \brief Sends an ACKnowledge byte to the host.
  *  
  *  \param  *UartHandle The UART handle
@@ -87,365 +492,3067 @@ static void Send_NACK(UART_HandleTypeDef *UartHandle);
  */
 static uint8_t CheckChecksum(uint8_t *pBuffer, uint32_t len);
 
-/*! \brief Erase flash function
+/*! \brief Calculates the checksum of a message to be sent to the host.
+ *  Uses the same scheme as CheckChecksum, so appending the result to the
+ *  message makes it validate.
+ *  
+ *  \param  *pBuffer    The buffer where the message is stored.
+ *  \param  len         The length of the message;
+ *  \retval uint8_t     The checksum
  */
-static void Erase(void);
+static uint8_t CalculateChecksum(uint8_t *pBuffer, uint32_t len);
 
-/*! \brief Write flash function
+/*! \brief Receives the next message of a state, from the ring or from the
+ *  received frames.
+ *
+ *  \param  *buffer     Where the message goes
+ *  \param  length      The length of the message
+ *  \retval LINK_STATUS Whether the message was received
  */
-static void Write(void);
+static LINK_STATUS Link_Receive(uint8_t *buffer, uint32_t length);
 
-/*! \brief Check flashed image
+/*! \brief Decodes the received bytes up to the end of the next frame
+ *
+ *  \retval LINK_STATUS LINK_RECEIVED when a good frame is decoded
  */
-static void Check(void);
+static LINK_STATUS Link_Decode(void);
 
-int main(void)
+/*! \brief Checks the frame decoded up to its delimiter
+ *
+ *  \retval LINK_STATUS LINK_RECEIVED when its messages can be taken
+ */
+static LINK_STATUS Link_EndFrame(void);
+
+/*! \brief Drops the messages left in the current frame
+ */
+static void Link_DropFrame(void);
+
+/*! \brief Drops a partial message: the rest of the frame, or the bytes in
+ *  the ring when messages are not framed
+ */
+static void Link_Flush(void);
+
+/*! \brief Restarts the reception, after the line changed
+ */
+static void Link_Reset(void);
+
+/*! \brief Sends a message to the host, in a frame of its own when framed
+ *
+ *  \param  *buffer     The message
+ *  \param  length      The length of the message
+ */
+static void Link_Send(const uint8_t *buffer, uint32_t length);
+
+/*! \brief Sends a message built from several parts: Link_Begin, then
+ *  Link_Put for each part, then Link_End
+ *
+ *  \param  length      The length of the message
+ */
+static void Link_Begin(uint32_t length);
+static void Link_Put(const uint8_t *buffer, uint32_t length);
+static void Link_End(void);
+
+/*! \brief Returns the bytes a message takes on the line, at most
+ *
+ *  \param  length      The length of the message
+ *  \retval uint32_t    The bytes written to the transmit ring
+ */
+static uint32_t Link_LineBytes(uint32_t length);
+
+/*! \brief Updates a CRC-16/CCITT-FALSE with one byte
+ *
+ *  \param  crc         The CRC so far, 0xFFFF for the first byte
+ *  \param  byte        The byte
+ *  \retval uint16_t    The updated CRC
+ */
+static uint16_t Link_Crc16(uint16_t crc, uint8_t byte);
+
+/*! \brief Checks that a range to program lies in a slot that is not
+ *  active.
+ *
+ *  \param  address     The first address of the range
+ *  \param  len         The length of the range
+ *  \retval uint8_t     1 if the range can be programmed, 0 otherwise
+ */
+static uint8_t IsWritableRange(uint32_t address, uint32_t len);
+
+/*! \brief Reads the boot metadata log.
+ */
+static void Slot_Load(void);
+
+/*! \brief Returns the slot to start: the bootable slot with the newest
+ *  token.
+ *
+ *  \retval uint32_t    The slot, or SLOT_NONE
+ */
+static uint32_t Slot_Select(void);
+
+/*! \brief Orders two slots for Slot_Select.
+ *
+ *  \param  slot        The slot
+ *  \param  other       The slot to compare with
+ *  \retval uint8_t     1 if slot is to be tried before other, 0 otherwise
+ */
+static uint8_t Slot_IsNewer(uint32_t slot, uint32_t other);
+
+/*! \brief Checks that a slot can be started.
+ *
+ *  \param  slot        The slot
+ *  \retval uint8_t     1 if the slot can be started, 0 otherwise
+ */
+static uint8_t Slot_IsBootable(uint32_t slot);
+
+/*! \brief Checks the vector table of a slot, and its image header if it
+ *  has one.
+ *
+ *  \param  slot        The slot
+ *  \retval uint8_t     1 if the slot holds an application, 0 otherwise
+ */
+static uint8_t Slot_IsValid(uint32_t slot);
+
+/*! \brief Returns the address of the vector table of a slot.
+ *
+ *  \param  slot        The slot
+ *  \retval uint32_t    The address of the vector table
+ */
+static uint32_t Slot_GetVectorTable(uint32_t slot);
+
+/*! \brief Returns the image header of a slot.
+ *
+ *  \param  slot        The slot
+ *  \retval IMAGE_HEADER* The header, or 0 when the slot has no valid header
+ */
+static const IMAGE_HEADER *Image_GetHeader(uint32_t slot);
+
+/*! \brief Checks the CRC of the image described by a header.
+ *
+ *  \param  *pHeader    The header
+ *  \retval uint8_t     1 if the image matches its header, 0 otherwise
+ */
+static uint8_t Image_Verify(const IMAGE_HEADER *pHeader);
+
+/*! \brief Records a verified token for a checked slot, which makes it the
+ *  slot to boot.
+ *
+ *  \param  slot        The slot
+ *  \param  length      The length of the checked image
+ *  \retval uint8_t     1 if the token is committed, 0 otherwise
+ */
+static uint8_t Slot_Commit(uint32_t slot, uint32_t length);
+
+/*! \brief Records an invalidated token for a slot about to be modified.
+ *  The flash must be unlocked.
+ *
+ *  \param  slot        The slot, or SLOT_NONE
+ *  \retval uint32_t    The error code
+ */
+static uint32_t Slot_Invalidate(uint32_t slot);
+
+/*! \brief Appends the token of a slot to the boot metadata. The flash must
+ *  be unlocked.
+ *
+ *  \param  slot        The slot
+ *  \param  state       TOKEN_VERIFIED or TOKEN_INVALIDATED
+ *  \param  length      The length of the image
+ *  \param  crc         The CRC of the image
+ *  \retval uint32_t    The error code
+ */
+static uint32_t Slot_Record(uint32_t slot, TOKEN_STATE state, uint32_t length, uint32_t crc);
+
+/*! \brief Programs one record at NextRecordAddress. The flash must be
+ *  unlocked.
+ *
+ *  \param  slot        The slot
+ *  \param  *pToken     The token of the slot
+ *  \retval uint32_t    The error code
+ */
+static uint32_t Record_Program(uint32_t slot, const SLOT_TOKEN *pToken);
+
+/*! \brief Returns the slot holding a range of flash.
+ *
+ *  \param  address     The first address of the range
+ *  \param  len         The length of the range
+ *  \retval uint32_t    The slot, or SLOT_NONE
+ */
+static uint32_t Slot_Find(uint32_t address, uint32_t len);
+
+/*! \brief Programs one write frame and profiles it. The token of the slot
+ *  is invalidated first. The flash must be unlocked.
+ *
+ *  \param  address     The first address to program
+ *  \param  *pData      The data
+ *  \param  len         The length of the data
+ *  \retval uint32_t    The error code
+ */
+static uint32_t ProgramFrame(uint32_t address, const uint8_t *pData, uint32_t len);
+
+/*! \brief Adds one duration to the profile of a phase.
+ *
+ *  \param  phase       The phase
+ *  \param  start       HAL_DWT_CYCLES when the phase started
+ */
+static void Stats_Record(STATS_PHASE phase, uint32_t start);
+
+/*! \brief Clears the profile.
+ */
+static void Stats_Clear(void);
+
+/*! \brief Switches the command processor to a state and starts its deadline.
+ *
+ *  \param  next        The new state
+ */
+static void State_Enter(STATE next);
+
+/*! \brief Runs one pass of the command processor: at most one step of the
+ *  current state.
+ */
+static void State_Run(void);
+
+/*! \brief Default timeout: drops the partial message and NACKs it.
+ */
+static STATE Timeout_Default(void);
+
+/*! \brief Hookup state functions
+ */
+static STATE Step_Hookup(void);
+static STATE Timeout_Hookup(void);
+
+/*! \brief Decodes a command and ACKs it
+ */
+static STATE Step_Command(void);
+
+/*! \brief Erase state functions
+ */
+static STATE Step_EraseRequest(void);
+static STATE Step_EraseSector(void);
+static STATE Timeout_EraseSector(void);
+
+/*! \brief Write state functions
+ */
+static STATE Step_WriteAddress(void);
+static STATE Step_WriteLength(void);
+static STATE Step_WriteData(void);
+
+/*! \brief Bulk write state functions
+ */
+static STATE Step_BulkHeader(void);
+static STATE Step_BulkData(void);
+
+/*! \brief Windowed write state functions
+ */
+static STATE Step_WindowHeader(void);
+static STATE Step_FrameHeader(void);
+static STATE Step_FrameData(void);
+static STATE Step_Lz4WindowHeader(void);
+static STATE Step_Lz4FrameHeader(void);
+static STATE Step_Lz4FrameData(void);
+static STATE Step_DeltaWindowHeader(void);
+static STATE Step_DeltaFrameHeader(void);
+static STATE Step_DeltaFrameData(void);
+static STATE Timeout_Frame(void);
+static STATE Lost_Frame(void);
+
+/*! \brief Starts a write window from its header
+ *
+ *  \param  frameState  The state receiving the frames of the window
+ *  \retval STATE       The next state
+ */
+static STATE Window_Start(STATE frameState);
+
+/*! \brief Accounts for one frame of a write window
+ *
+ *  \param  status      The outcome for the frame
+ *  \param  frameState  The state receiving the next frame
+ *  \retval STATE       The next state
+ */
+static STATE Window_FrameDone(FRAME_STATUS status, STATE frameState);
+
+/*! \brief Ends a write window and sends its reply
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Window_Reply(void);
+
+/*! \brief Decompresses one LZ4 block (raw block format, no frame header).
+ *
+ *  \param  *pSrc       The compressed block
+ *  \param  srcLen      The length of the compressed block
+ *  \param  *pDst       The destination buffer
+ *  \param  dstLen      The size of the destination buffer
+ *  \retval uint32_t    The decompressed length or LZ4_ERROR
+ */
+static uint32_t Lz4_Decompress(const uint8_t *pSrc, uint32_t srcLen, 
+                               uint8_t *pDst, uint32_t dstLen);
+
+/*! \brief Rebuilds one block of a new image from a patch against the image
+ *  of a base slot.
+ *
+ *  \param  *pSrc       The patch
+ *  \param  srcLen      The length of the patch
+ *  \param  *pDst       The destination buffer
+ *  \param  dstLen      The size of the destination buffer
+ *  \param  baseSlot    The slot holding the base image
+ *  \param  newSlot     The slot the block is programmed to
+ *  \retval uint32_t    The length of the block or DELTA_ERROR
+ */
+static uint32_t Delta_Apply(const uint8_t *pSrc, uint32_t srcLen, uint8_t *pDst, 
+                            uint32_t dstLen, uint32_t baseSlot, uint32_t newSlot);
+
+/*! \brief Check state functions
+ */
+static STATE Step_CheckStart(void);
+static STATE Step_CheckEnd(void);
+static STATE Step_CheckCrc(void);
+static STATE Timeout_CheckCrc(void);
+
+/*! \brief Sector CRC state functions
+ */
+static STATE Step_SectorCrcRequest(void);
+static STATE Step_SectorCrc(void);
+static STATE Timeout_SectorCrc(void);
+
+/*! \brief Sends the sector CRC reply
+ *
+ *  \retval STATE       The next state
+ */
+static STATE SectorCrc_Reply(void);
+
+/*! \brief Read state functions
+ */
+static STATE Step_ReadRequest(void);
+static STATE Step_ReadFrame(void);
+static STATE Timeout_ReadFrame(void);
+
+/*! \brief Starts the CRC of the next read frame
+ */
+static void Read_StartFrame(void);
+
+/*! \brief Baud rate negotiation state functions
+ */
+static STATE Step_BaudRequest(void);
+static STATE Step_BaudConfirm(void);
+static STATE Timeout_BaudConfirm(void);
+
+/*! \brief Selects the frame layer for the rest of the session
+ */
+static STATE Step_SetFraming(void);
+
+/*! \brief Jumps to the application, or returns to the command state when
+ *  there is none
+ */
+static STATE Step_Jump(void);
+
+/*! \brief Reports the protocol timeouts
+ */
+static STATE Step_GetTimeouts(void);
+
+/*! \brief Reports the profile of the bootloader phases
+ */
+static STATE Step_GetStats(void);
+
+/*! \brief Reports the application slots
+ */
+static STATE Step_GetSlots(void);
+
+/*! \brief Appends a little endian word to pReply
+ *
+ *  \param  len         Bytes of pReply filled so far
+ *  \param  value       The word
+ *  \retval uint32_t    Bytes of pReply filled with the word
+ */
+static uint32_t Reply_PutWord(uint32_t len, uint32_t value);
+
+/*****************************************************************************/
+/*                          State Tables                                     */
+/*****************************************************************************/
+/*! \brief The states of the command processor, indexed by STATE
+ */
+static const STATE_ENTRY StateTable[STATE_COUNT] =
+{
+    /* RxOffset                 RxLength                TimeoutMs                Step                   Timeout              Lost                */
+    {0,                         2,                      HOOKUP_TIMEOUT_MS,       Step_Hookup,           Timeout_Hookup,      Timeout_Hookup      }, /* STATE_HOOKUP             */
+    {0,                         2,                      NO_TIMEOUT,              Step_Command,          Timeout_Default,     Timeout_Default     }, /* STATE_COMMAND            */
+    {0,                         3,                      RX_TIMEOUT_MS,           Step_EraseRequest,     Timeout_Default,     Timeout_Default     }, /* STATE_ERASE_REQUEST      */
+    {0,                         0,                      ERASE_TIMEOUT_MS,        Step_EraseSector,      Timeout_EraseSector, Timeout_Default     }, /* STATE_ERASE_SECTOR       */
+    {0,                         5,                      RX_TIMEOUT_MS,           Step_WriteAddress,     Timeout_Default,     Timeout_Default     }, /* STATE_WRITE_ADDRESS      */
+    {0,                         2,                      RX_TIMEOUT_MS,           Step_WriteLength,      Timeout_Default,     Timeout_Default     }, /* STATE_WRITE_LENGTH       */
+    {0,                         RX_LENGTH_VARIABLE,     RX_TIMEOUT_MS,           Step_WriteData,        Timeout_Default,     Timeout_Default     }, /* STATE_WRITE_DATA         */
+    {0,                         WRITE_BULK_HEADER_SIZE, RX_TIMEOUT_MS,           Step_BulkHeader,       Timeout_Default,     Timeout_Default     }, /* STATE_BULK_HEADER        */
+    {WRITE_BULK_HEADER_SIZE,    RX_LENGTH_VARIABLE,     RX_TIMEOUT_MS,           Step_BulkData,         Timeout_Default,     Timeout_Default     }, /* STATE_BULK_DATA          */
+    {0,                         2,                      RX_TIMEOUT_MS,           Step_WindowHeader,     Timeout_Default,     Timeout_Default     }, /* STATE_WINDOW_HEADER      */
+    {0,                         WRITE_WINDOW_HEADER_SIZE, RX_TIMEOUT_MS,         Step_FrameHeader,      Timeout_Frame,       Lost_Frame          }, /* STATE_FRAME_HEADER       */
+    {WRITE_WINDOW_HEADER_SIZE,  RX_LENGTH_VARIABLE,     RX_TIMEOUT_MS,           Step_FrameData,        Timeout_Frame,       Lost_Frame          }, /* STATE_FRAME_DATA         */
+    {0,                         2,                      RX_TIMEOUT_MS,           Step_Lz4WindowHeader,  Timeout_Default,     Timeout_Default     }, /* STATE_LZ4_WINDOW_HEADER  */
+    {0,                         LZ4_HEADER_SIZE,        RX_TIMEOUT_MS,           Step_Lz4FrameHeader,   Timeout_Frame,       Lost_Frame          }, /* STATE_LZ4_FRAME_HEADER   */
+    {LZ4_HEADER_SIZE,           RX_LENGTH_VARIABLE,     RX_TIMEOUT_MS,           Step_Lz4FrameData,     Timeout_Frame,       Lost_Frame          }, /* STATE_LZ4_FRAME_DATA     */
+    {0,                         2,                      RX_TIMEOUT_MS,           Step_DeltaWindowHeader,Timeout_Default,     Timeout_Default     }, /* STATE_DELTA_WINDOW_HEADER*/
+    {0,                         LZ4_HEADER_SIZE,        RX_TIMEOUT_MS,           Step_DeltaFrameHeader, Timeout_Frame,       Lost_Frame          }, /* STATE_DELTA_FRAME_HEADER */
+    {LZ4_HEADER_SIZE,           RX_LENGTH_VARIABLE,     RX_TIMEOUT_MS,           Step_DeltaFrameData,   Timeout_Frame,       Lost_Frame          }, /* STATE_DELTA_FRAME_DATA   */
+    {0,                         5,                      RX_TIMEOUT_MS,           Step_CheckStart,       Timeout_Default,     Timeout_Default     }, /* STATE_CHECK_START        */
+    {0,                         5,                      RX_TIMEOUT_MS,           Step_CheckEnd,         Timeout_Default,     Timeout_Default     }, /* STATE_CHECK_END          */
+    {0,                         0,                      CRC_TIMEOUT_MS,          Step_CheckCrc,         Timeout_CheckCrc,    Timeout_Default     }, /* STATE_CHECK_CRC          */
+    {0,                         3,                      RX_TIMEOUT_MS,           Step_SectorCrcRequest, Timeout_Default,     Timeout_Default     }, /* STATE_SECTOR_CRC_REQUEST */
+    {0,                         0,                      CRC_TIMEOUT_MS,          Step_SectorCrc,        Timeout_SectorCrc,   Timeout_Default     }, /* STATE_SECTOR_CRC         */
+    {0,                         5,                      RX_TIMEOUT_MS,           Step_BaudRequest,      Timeout_Default,     Timeout_Default     }, /* STATE_BAUD_REQUEST       */
+    {0,                         2,                      BAUD_CONFIRM_TIMEOUT_MS, Step_BaudConfirm,      Timeout_BaudConfirm, Timeout_BaudConfirm }, /* STATE_BAUD_CONFIRM       */
+    {0,                         0,                      NO_TIMEOUT,              Step_Jump,             Timeout_Default,     Timeout_Default     }, /* STATE_JUMP               */
+    {0,                         0,                      NO_TIMEOUT,              Step_GetTimeouts,      Timeout_Default,     Timeout_Default     }, /* STATE_GET_TIMEOUTS       */
+    {0,                         2,                      RX_TIMEOUT_MS,           Step_GetStats,         Timeout_Default,     Timeout_Default     }, /* STATE_GET_STATS          */
+    {0,                         0,                      NO_TIMEOUT,              Step_GetSlots,         Timeout_Default,     Timeout_Default     }, /* STATE_GET_SLOTS          */
+    {0,                         9,                      RX_TIMEOUT_MS,           Step_ReadRequest,      Timeout_Default,     Timeout_Default     }, /* STATE_READ_REQUEST       */
+    {0,                         0,                      CRC_TIMEOUT_MS,          Step_ReadFrame,        Timeout_ReadFrame,   Timeout_Default     }, /* STATE_READ_FRAME         */
+    {0,                         0,                      NO_TIMEOUT,              Step_SetFraming,       Timeout_Default,     Timeout_Default     }, /* STATE_SET_FRAMING        */
+};
+
+/*! \brief The supported commands and the first state of each
+ */
+static const COMMAND_ENTRY CommandTable[] =
+{
+    {ERASE,         STATE_ERASE_REQUEST     },
+    {WRITE,         STATE_WRITE_ADDRESS     },
+    {WRITE_BULK,    STATE_BULK_HEADER       },
+    {WRITE_WINDOW,  STATE_WINDOW_HEADER     },
+    {WRITE_LZ4,     STATE_LZ4_WINDOW_HEADER },
+    {WRITE_DELTA,   STATE_DELTA_WINDOW_HEADER },
+    {CHECK,         STATE_CHECK_START       },
+    {SECTOR_CRC,    STATE_SECTOR_CRC_REQUEST},
+    {JUMP,          STATE_JUMP              },
+    {SET_BAUD,      STATE_BAUD_REQUEST      },
+    {GET_TIMEOUTS,  STATE_GET_TIMEOUTS      },
+    {GET_STATS,     STATE_GET_STATS         },
+    {GET_SLOTS,     STATE_GET_SLOTS         },
+    {READ,          STATE_READ_REQUEST      },
+    {SET_FRAMING,   STATE_SET_FRAMING       },
+};
+
+/*! \brief The application slots, indexed by SLOT
+ */
+static const SLOT_ENTRY SlotTable[SLOT_COUNT] =
+{
+    /* Start        End                                                        */
+    {0x08008000U,   0x08020000U     }, /* SLOT_A: sectors 2 to 4                 */
+    {0x08020000U,   FLASH_END + 1U  }, /* SLOT_B: sectors 5 to 7                 */
+};
+
+/*! \brief The protocol timeouts reported by GET_TIMEOUTS, in milliseconds
+ */
+static const uint16_t ProtocolTimeouts[] =
+{
+    HOOKUP_TIMEOUT_MS,
+    RX_TIMEOUT_MS,
+    ERASE_TIMEOUT_MS,
+    CRC_TIMEOUT_MS,
+    BAUD_CONFIRM_TIMEOUT_MS,
+};
+
+int main(void)
 {
     SystemCoreClockUpdate();
+    
+    /* Fast boot: without an update request, a valid application */
+    /* is started before any peripheral is set up. Otherwise, or */
+    /* when there is no valid application, wait for the host     */
+    if(IsUpdateRequested() == 0)
+    {
+        JumpToApplication();
+    }
+    
     Bootloader_Init();
     
-    /* Hookup Host and Target                           */
-    /* First send an ACK. Host should reply with ACK    */
-    /* If no valid ACK is received within TIMEOUT_VALUE */
-    /* then jump to main application                    */
-    Send_ACK(&UartHandle);
-    if(HAL_UART_Rx(&UartHandle, pRxBuffer, 2, TIMEOUT_VALUE) == HAL_UART_TIMEOUT)
+    /* The slot that would be started is kept as it is, updates  */
+    /* go to the other one                                       */
+    ActiveSlot = Slot_Select();
+    
+    /* Hookup Host and Target                                */
+    /* First send an ACK. Host should reply with ACK         */
+    /* If no valid ACK is received within HOOKUP_TIMEOUT_MS  */
+    /* then jump to main application                         */
+    Send_ACK(&UartHandle);
+    State_Enter(STATE_HOOKUP);
+    
+    /* Every command is processed as a sequence of states    */
+    /* fed by the receive ring. No step waits for the host,  */
+    /* and long operations progress one bounded step at a    */
+    /* time, so every state keeps its deadline               */
+	for(;;)
+	{
+        State_Run();
+	}
+    
+	return 0;
+}
+
+/*! \brief Switches the command processor to a state and starts its deadline.
+ *
+ *  \param  next        The new state
+ */
+static void State_Enter(STATE next)
+{
+    State = next;
+    StateEnterCycles = HAL_DWT_CYCLES();
+    if(StateTable[next].TimeoutMs != NO_TIMEOUT)
+    {
+        StateDeadline = HAL_SysTick_Deadline(StateTable[next].TimeoutMs);
+    }
+}
+
+/*! \brief Runs one pass of the command processor: at most one step of the
+ *  current state.
+ *  A receiving state runs its step once its message is received, then the
+ *  next state is entered even when it is the same one. A polled state runs
+ *  its step on every pass and keeps its deadline while the step returns the
+ *  same state.
+ */
+static void State_Run(void)
+{
+    const STATE_ENTRY *entry = &StateTable[State];
+    uint32_t rxLength = entry->RxLength;
+    uint32_t passStart = HAL_DWT_CYCLES();
+    LINK_STATUS status;
+    STATE next;
+    
+    if(rxLength == RX_LENGTH_VARIABLE)
+    {
+        rxLength = Command.RxLength;
+    }
+    
+    if(rxLength == 0)
+    {
+        next = entry->Step();
+        if(next != State)
+        {
+            State_Enter(next);
+            return;
+        }
+    }
+    else
+    {
+        status = Link_Receive(&pRxBuffer[entry->RxOffset], rxLength);
+        if(status == LINK_RECEIVED)
+        {
+            State_Enter(entry->Step());
+            return;
+        }
+        if(status == LINK_LOST)
+        {
+            State_Enter(entry->Lost());
+            return;
+        }
+        
+        // Waiting for the host
+        StatsIdleCycles += HAL_DWT_Elapsed(passStart);
+    }
+    
+    if((entry->TimeoutMs != NO_TIMEOUT) && (HAL_SysTick_IsExpired(StateDeadline) == 1))
+    {
+        State_Enter(entry->Timeout());
+    }
+}
+
+/*! \brief Jumps to the application of the slot chosen by Slot_Select.
+ *  Returns when no slot holds an application.
+ */
+static void JumpToApplication(void)
+{
+    uint32_t slot = Slot_Select();
+    
+    if(slot != SLOT_NONE)
+    {
+        /* The last replies go out before the transmit interrupt stops */
+        if(UartHandle.hdmatx != 0)
+        {
+            HAL_UART_Tx_DMA_Flush(&UartHandle);
+            NVIC_DisableIRQ(DMA1_Stream6_IRQn);
+            HAL_UART_Tx_DMA_Stop(&UartHandle);
+        }
+        
+        /* First, disable all IRQs */
+        __disable_irq();
+        HAL_SysTick_DeInit();
+
+        /* Stop the DMA reception so it does not write into the application RAM */
+        /* The fast boot jumps before the reception is started                  */
+        if(UartHandle.hdmarx != 0)
+        {
+            HAL_UART_Rx_DMA_Stop(&UartHandle);
+        }
+        
+        /* The application starts from the reset clocks and peripherals */
+        Bootloader_DeInit();
+
+        /* Get the main application start address */
+        uint32_t vectors = Slot_GetVectorTable(slot);
+        uint32_t jump_address = *(__IO uint32_t *)(vectors + 4);
+
+        /* Set the main stack pointer to to the application start address */
+        __set_MSP(*(__IO uint32_t *)vectors);
+
+        // Create function pointer for the main application
+        void (*pmain_app)(void) = (void (*)(void))(jump_address);
+
+        // Now jump to the main application
+        pmain_app();
+    }
+    
+}
+
+/*! \brief Returns whether the bootloader has to wait for the host.
+ *  An update is requested when the application wrote BOOT_FLAG_UPDATE to
+ *  the RTC backup register BKP0R before a software reset, or when the user
+ *  button is held at reset, which recovers an application that cannot
+ *  request it. The backup register survives resets but not a power loss,
+ *  and the flag is cleared here so that it is taken once.
+ *
+ *  \retval uint8_t     1 to wait for the host, 0 to start the application
+ */
+static uint8_t IsUpdateRequested(void)
+{
+    GPIO_InitTypeDef gpio_button;
+    uint8_t requested = 0;
+    
+    HAL_RCC_PWR_CLK_ENABLE();
+    if(BOOT_FLAG_REGISTER == BOOT_FLAG_UPDATE)
+    {
+        requested = 1;
+        
+        // Clearing the flag needs write access to the backup domain
+        PWR->CR |= PWR_CR_DBP;
+        BOOT_FLAG_REGISTER = 0;
+        PWR->CR &= ~PWR_CR_DBP;
+    }
+    HAL_RCC_PWR_CLK_DISABLE();
+    
+    // B1 has an external pull-up
+    gpio_button.Pin = BOOT_BUTTON_PIN;
+    gpio_button.Mode = GPIO_MODE_INPUT;
+    gpio_button.Pull = GPIO_PULL_NONE;
+    gpio_button.Speed = GPIO_SPEED_LOW;
+    gpio_button.Alternate = 0;
+    
+    HAL_RCC_GPIOC_CLK_ENABLE();
+    HAL_GPIO_Init(BOOT_BUTTON_PORT, &gpio_button);
+    if(HAL_GPIO_ReadPin(BOOT_BUTTON_PORT, BOOT_BUTTON_PIN) == 0)
+    {
+        requested = 1;
+    }
+    HAL_RCC_GPIOC_CLK_DISABLE();
+    
+    return requested;
+}
+
+/*! \brief  Initializes the bootloader for host communication.
+ *          Communication will be done through the UART peripheral.
+ */
+static void Bootloader_Init(void)
+{
+    GPIO_InitTypeDef gpio_uart;
+    RCC_ClkInitTypeDef clk;
+    
+    /* SYSCLK = 16 MHz HSI / 8 * 100 / 2 = 100 MHz, APB1 = 50 MHz        */
+    /* 3 wait states from 90 to 100 MHz at 2.7 - 3.6 V. When the PLL     */
+    /* does not lock, the bootloader keeps running from the HSI          */
+    clk.PLLM = 8;
+    clk.PLLN = 100;
+    clk.PLLP = 2;
+    clk.PLLQ = 4;
+    clk.APB1Prescaler = RCC_CFGR_PPRE1_DIV2;
+    clk.APB2Prescaler = RCC_CFGR_PPRE2_DIV1;
+    clk.FlashLatency = FLASH_ACR_LATENCY_3WS;
+    HAL_RCC_ClockConfig(&clk);
+    
+    gpio_uart.Pin = GPIO_PIN_2 | GPIO_PIN_3;
+    gpio_uart.Mode = GPIO_MODE_AF_PP;
+    gpio_uart.Pull = GPIO_PULL_NONE;
+    gpio_uart.Speed = GPIO_SPEED_LOW;
+    gpio_uart.Alternate = GPIO_AF7_USART2;
+    
+    HAL_RCC_GPIOA_CLK_ENABLE();
+    HAL_GPIO_Init(GPIOA, &gpio_uart);
+    
+    UartHandle.Init.BaudRate = DEFAULT_BAUD_RATE;
+    UartHandle.Init.Mode = HAL_UART_MODE_TX_RX;
+    UartHandle.Init.OverSampling = HAL_UART_OVERSAMPLING_16;
+    UartHandle.Init.Parity = HAL_UART_PARITY_NONE;
+    UartHandle.Init.StopBits = HAL_UART_STOP_1;
+    UartHandle.Init.WordLength = HAL_UART_WORD8;
+    UartHandle.Instance = USART2;
+    
+    HAL_RCC_USART2_CLK_ENABLE();
+    HAL_UART_Init(&UartHandle);
+    
+    /* USART2_RX is on DMA1 Stream 5, channel 4                          */
+    /* Reception runs in hardware, so no byte is lost while the CPU is   */
+    /* busy programming the flash or computing a CRC                     */
+    DmaRxHandle.Instance = DMA1_Stream5;
+    DmaRxHandle.Init.Channel = HAL_DMA_CHANNEL_4;
+    DmaRxHandle.Init.Priority = HAL_DMA_PRIORITY_HIGH;
+    
+    HAL_RCC_DMA1_CLK_ENABLE();
+    HAL_UART_Rx_DMA_Start(&UartHandle, &DmaRxHandle, pRxRing, RX_RING_SIZE);
+    
+    /* USART2_TX is on DMA1 Stream 6, channel 4                          */
+    /* Replies are queued and sent in hardware, so the next frame is     */
+    /* programmed while the ACK of the previous one is on the line       */
+    DmaTxHandle.Instance = DMA1_Stream6;
+    DmaTxHandle.Init.Channel = HAL_DMA_CHANNEL_4;
+    DmaTxHandle.Init.Priority = HAL_DMA_PRIORITY_MEDIUM;
+    
+    HAL_UART_Tx_DMA_Start(&UartHandle, &DmaTxHandle, pTxRing, TX_RING_SIZE);
+    NVIC_EnableIRQ(DMA1_Stream6_IRQn);
+    
+    /* Millisecond time base of the state deadlines */
+    HAL_SysTick_Init();
+    
+    /* Cycle counter of the phase profile */
+    HAL_DWT_Init();
+}
+
+/*! \brief Puts back the clocks and the peripherals used by the bootloader
+ *  in their reset state.
+ */
+static void Bootloader_DeInit(void)
+{
+    RCC->AHB1RSTR |= RCC_AHB1RSTR_GPIOARST | RCC_AHB1RSTR_CRCRST |
+                     RCC_AHB1RSTR_DMA1RST | RCC_AHB1RSTR_DMA2RST;
+    RCC->AHB1RSTR &= ~(RCC_AHB1RSTR_GPIOARST | RCC_AHB1RSTR_CRCRST |
+                       RCC_AHB1RSTR_DMA1RST | RCC_AHB1RSTR_DMA2RST);
+    RCC->APB1RSTR |= RCC_APB1RSTR_USART2RST;
+    RCC->APB1RSTR &= ~RCC_APB1RSTR_USART2RST;
+    
+    HAL_RCC_USART2_CLK_DISABLE();
+    HAL_RCC_DMA1_CLK_DISABLE();
+    HAL_RCC_DMA2_CLK_DISABLE();
+    HAL_RCC_CRC_CLK_DISABLE();
+    HAL_RCC_GPIOA_CLK_DISABLE();
+    
+    HAL_DWT_DeInit();
+    HAL_RCC_DeInit();
+}
+
+/*! \brief USART2_TX DMA stream interrupt: a run of the transmit circular
+ *  buffer is sent, the next one starts.
+ */
+void DMA1_Stream6_IRQHandler(void)
+{
+    HAL_UART_Tx_DMA_HandleIT(&UartHandle);
+}
+
+/*! \brief Sends an ACKnowledge byte to the host.
+ *  
+ *  \param  *UartHandle The UART handle
+ */
+static void Send_ACK(UART_HandleTypeDef *handle)
+{
+    uint8_t msg[2] = {ACK, ACK};
+    
+    (void)handle;
+    Link_Send(msg, 2);
+}
+
+/*! \brief Sends an NACKnowledge byte to the host.
+ *  
+ *  \param  *UartHandle The UART handle
+ */
+static void Send_NACK(UART_HandleTypeDef *handle)
+{
+    uint8_t msg[2] = {NACK, NACK};
+    
+    (void)handle;
+    Link_Send(msg, 2);
+}
+
+/*! \brief Validates the checksum of the message.
+ *  Validates the received message through a simple checksum.
+ *
+ *  Each byte of the message (including the received checksum) is XOR'd with 
+ *  the previously calculated checksum value. The result should be 0x00.
+ *  Note: The first byte of the message is XOR'd with an initial value of 0xFF
+ *  
+ *  \param  *pBuffer    The buffer where the message is stored.
+ *  \param  len         The length of the message;
+ *  \retval uint8_t     The result of the validation. 1 = OK. 0 = FAIL
+ */
+static uint8_t CheckChecksum(uint8_t *pBuffer, uint32_t len)
+{
+    uint8_t initial = 0xFF;
+    uint8_t result = 0x7F; /* some random result value */
+    
+    result = initial ^ *pBuffer++;
+    len--;
+    while(len--)
+    {
+        result ^= *pBuffer++;
+    }
+    
+    result ^= 0xFF;
+    
+    if(result == 0x00)
+    {
+        return 1;
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+/*! \brief Calculates the checksum of a message to be sent to the host.
+ *  Uses the same scheme as CheckChecksum, so appending the result to the
+ *  message makes it validate.
+ *  
+ *  \param  *pBuffer    The buffer where the message is stored.
+ *  \param  len         The length of the message;
+ *  \retval uint8_t     The checksum
+ */
+static uint8_t CalculateChecksum(uint8_t *pBuffer, uint32_t len)
+{
+    uint8_t checksum = 0xFF;
+    
+    while(len--)
+    {
+        checksum ^= *pBuffer++;
+    }
+    
+    return checksum ^ 0xFF;
+}
+
+/*! \brief Receives the next message of a state.
+ *  Unframed, the message is the next bytes of the ring. Framed, it is the
+ *  next bytes of the received frame: a frame holds one or more whole
+ *  messages, and a message never spans two frames. A frame that fails its
+ *  check is dropped whole, so the message is lost but the next frame is
+ *  received as usual: one bad byte no longer shifts every later message.
+ *
+ *  \param  *buffer     Where the message goes
+ *  \param  length      The length of the message
+ *  \retval LINK_STATUS Whether the message was received
+ */
+static LINK_STATUS Link_Receive(uint8_t *buffer, uint32_t length)
+{
+    LINK_STATUS status;
+    
+    if(Link.Framed == 0)
+    {
+        if(HAL_UART_Rx_DMA_Available(&UartHandle) < length)
+        {
+            return LINK_PENDING;
+        }
+        HAL_UART_Rx_DMA_Read(&UartHandle, buffer, length);
+        return LINK_RECEIVED;
+    }
+    
+    // The next frame is decoded once every message of the current one is taken
+    if(Link.PayloadLeft == 0)
+    {
+        status = Link_Decode();
+        if(status != LINK_RECEIVED)
+        {
+            return status;
+        }
+    }
+    
+    if(Link.PayloadLeft < length)
+    {
+        Link_DropFrame();
+        return LINK_LOST;
+    }
+    memcpy(buffer, &pLinkFrame[Link.PayloadNext], length);
+    Link.PayloadNext += length;
+    Link.PayloadLeft -= length;
+    return LINK_RECEIVED;
+}
+
+/*! \brief Decodes the received bytes up to the end of the next frame.
+ *  The bytes are decoded as they arrive, so a frame is checked as soon as
+ *  its delimiter is received. They are decoded in place from the ring, one
+ *  run of contiguous bytes at a time, and only the decoded frame is copied.
+ *  The bytes after the delimiter stay in the ring for the next frame.
+ *
+ *  \retval LINK_STATUS LINK_RECEIVED when a good frame is decoded
+ */
+static LINK_STATUS Link_Decode(void)
+{
+    const uint8_t *run;
+    uint32_t count;
+    uint32_t i;
+    LINK_STATUS status;
+    
+    while((count = HAL_UART_Rx_DMA_GetRun(&UartHandle, &run)) != 0)
+    {
+        for(i = 0; (i < count) && (run[i] != LINK_DELIMITER); i++)
+        {
+            if(Link.RxLeft == 0)
+            {
+                // A code byte. The block before it ends with a zero, unless it
+                // is full or the first of the frame
+                if(Link.RxCode != LINK_COBS_FULL)
+                {
+                    if(Link.RxLength < LINK_FRAME_SIZE)
+                    {
+                        pLinkFrame[Link.RxLength] = 0;
+                    }
+                    Link.RxLength++;
+                }
+                Link.RxCode = run[i];
+                Link.RxLeft = run[i] - 1U;
+            }
+            else
+            {
+                // Too long a frame is decoded to its end, then dropped
+                if(Link.RxLength < LINK_FRAME_SIZE)
+                {
+                    pLinkFrame[Link.RxLength] = run[i];
+                }
+                Link.RxLength++;
+                Link.RxLeft--;
+            }
+        }
+        
+        if(i == count)
+        {
+            HAL_UART_Rx_DMA_Skip(&UartHandle, count);
+            continue;
+        }
+        
+        // Up to the delimiter included
+        HAL_UART_Rx_DMA_Skip(&UartHandle, i + 1U);
+        status = Link_EndFrame();
+        if(status != LINK_PENDING)
+        {
+            return status;
+        }
+    }
+    
+    return LINK_PENDING;
+}
+
+/*! \brief Checks the frame decoded up to its delimiter: the COBS blocks
+ *  are complete, and the length and CRC match. Delimiters in a row, such as
+ *  the one opening every frame, are no frame at all.
+ *
+ *  \retval LINK_STATUS LINK_RECEIVED when its messages can be taken,
+ *                      LINK_PENDING for an empty frame
+ */
+static LINK_STATUS Link_EndFrame(void)
+{
+    uint32_t length = Link.RxLength;
+    uint32_t complete = (Link.RxLeft == 0) ? 1U : 0;
+    uint16_t crc = 0xFFFF;
+    uint32_t payload;
+    uint32_t i;
+    
+    Link.RxLength = 0;
+    Link.RxLeft = 0;
+    Link.RxCode = LINK_COBS_FULL;
+    
+    if((length == 0) && (complete != 0))
+    {
+        return LINK_PENDING;
+    }
+    if((complete == 0) || (length < (LINK_HEADER_SIZE + LINK_CRC_SIZE)) || 
+       (length > LINK_FRAME_SIZE))
+    {
+        return LINK_LOST;
+    }
+    
+    payload = pLinkFrame[0] + (pLinkFrame[1] << 8);
+    for(i = 0; i < (length - LINK_CRC_SIZE); i++)
+    {
+        crc = Link_Crc16(crc, pLinkFrame[i]);
+    }
+    if((payload != (length - LINK_HEADER_SIZE - LINK_CRC_SIZE)) ||
+       (crc != (pLinkFrame[length - 2U] + (pLinkFrame[length - 1U] << 8))))
+    {
+        return LINK_LOST;
+    }
+    
+    Link.PayloadNext = LINK_HEADER_SIZE;
+    Link.PayloadLeft = payload;
+    return (payload == 0) ? LINK_PENDING : LINK_RECEIVED;
+}
+
+/*! \brief Drops the messages left in the current frame. Nothing is left
+ *  when messages are not framed.
+ */
+static void Link_DropFrame(void)
+{
+    Link.PayloadLeft = 0;
+}
+
+/*! \brief Drops a partial message. Framed, the message cannot extend past
+ *  its frame, so the frames after it are kept.
+ */
+static void Link_Flush(void)
+{
+    if(Link.Framed == 0)
+    {
+        HAL_UART_Rx_DMA_Flush(&UartHandle);
+    }
+    Link_DropFrame();
+}
+
+/*! \brief Restarts the reception after the line changed: the ring and the
+ *  partial frame are dropped.
+ */
+static void Link_Reset(void)
+{
+    HAL_UART_Rx_DMA_Flush(&UartHandle);
+    Link.RxLength = 0;
+    Link.RxLeft = 0;
+    Link.RxCode = LINK_COBS_FULL;
+    Link_DropFrame();
+}
+
+/*! \brief Sends a message to the host, in a frame of its own when framed
+ *
+ *  \param  *buffer     The message
+ *  \param  length      The length of the message
+ */
+static void Link_Send(const uint8_t *buffer, uint32_t length)
+{
+    Link_Begin(length);
+    Link_Put(buffer, length);
+    Link_End();
+}
+
+/*! \brief Opens the frame of a message: the delimiter that ends any noise
+ *  before it, then the length.
+ *
+ *  \param  length      The length of the message
+ */
+static void Link_Begin(uint32_t length)
+{
+    uint8_t header[LINK_HEADER_SIZE];
+    uint8_t delimiter = LINK_DELIMITER;
+    
+    if(Link.Framed == 0)
+    {
+        return;
+    }
+    
+    HAL_UART_Tx_DMA_Write(&UartHandle, &delimiter, 1);
+    Link.TxLength = 1;
+    Link.TxCrc = 0xFFFF;
+    header[0] = (uint8_t)length;
+    header[1] = (uint8_t)(length >> 8);
+    Link_Put(header, LINK_HEADER_SIZE);
+}
+
+/*! \brief Sends a part of a message, COBS encoded when framed. Each block
+ *  is written to the transmit ring once it ends with a zero or is full.
+ *
+ *  \param  *buffer     The part
+ *  \param  length      The length of the part
+ */
+static void Link_Put(const uint8_t *buffer, uint32_t length)
+{
+    uint32_t i;
+    
+    if(Link.Framed == 0)
+    {
+        HAL_UART_Tx_DMA_Write(&UartHandle, buffer, length);
+        return;
+    }
+    
+    for(i = 0; i < length; i++)
+    {
+        Link.TxCrc = Link_Crc16(Link.TxCrc, buffer[i]);
+        if(buffer[i] != 0)
+        {
+            pLinkBlock[Link.TxLength++] = buffer[i];
+        }
+        if((buffer[i] == 0) || (Link.TxLength == LINK_COBS_FULL))
+        {
+            pLinkBlock[0] = (uint8_t)Link.TxLength;
+            HAL_UART_Tx_DMA_Write(&UartHandle, pLinkBlock, Link.TxLength);
+            Link.TxLength = 1;
+        }
+    }
+}
+
+/*! \brief Closes the frame of a message: the CRC, the last block and the
+ *  delimiter.
+ */
+static void Link_End(void)
+{
+    uint8_t crc[LINK_CRC_SIZE];
+    uint8_t delimiter = LINK_DELIMITER;
+    
+    if(Link.Framed == 0)
+    {
+        return;
+    }
+    
+    crc[0] = (uint8_t)Link.TxCrc;
+    crc[1] = (uint8_t)(Link.TxCrc >> 8);
+    Link_Put(crc, LINK_CRC_SIZE);
+    
+    pLinkBlock[0] = (uint8_t)Link.TxLength;
+    HAL_UART_Tx_DMA_Write(&UartHandle, pLinkBlock, Link.TxLength);
+    HAL_UART_Tx_DMA_Write(&UartHandle, &delimiter, 1);
+}
+
+/*! \brief Returns the bytes a message takes on the line, at most: COBS
+ *  adds one code byte per 254 bytes, and the frame adds its length, CRC and
+ *  two delimiters.
+ *
+ *  \param  length      The length of the message
+ *  \retval uint32_t    The bytes written to the transmit ring
+ */
+static uint32_t Link_LineBytes(uint32_t length)
+{
+    uint32_t encoded = length + LINK_HEADER_SIZE + LINK_CRC_SIZE;
+    
+    if(Link.Framed == 0)
+    {
+        return length;
+    }
+    return encoded + (encoded / (LINK_COBS_FULL - 1U)) + 1U + 2U;
+}
+
+/*! \brief Updates a CRC-16/CCITT-FALSE (polynomial 0x1021, no reflection)
+ *  with one byte, without a table
+ *
+ *  \param  crc         The CRC so far, 0xFFFF for the first byte
+ *  \param  byte        The byte
+ *  \retval uint16_t    The updated CRC
+ */
+static uint16_t Link_Crc16(uint16_t crc, uint8_t byte)
+{
+    uint16_t x = (uint16_t)((crc >> 8) ^ byte);
+    
+    x ^= x >> 4;
+    return (uint16_t)((crc << 8) ^ (x << 12) ^ (x << 5) ^ x);
+}
+
+/*! \brief Checks that a range to program lies in a slot that is not
+ *  active.
+ *  Frames may arrive for any address in any order, so every frame is checked
+ *  before it is programmed to keep the bootloader, the boot metadata and the
+ *  running application safe.
+ *
+ *  \param  address     The first address of the range
+ *  \param  len         The length of the range
+ *  \retval uint8_t     1 if the range can be programmed, 0 otherwise
+ */
+static uint8_t IsWritableRange(uint32_t address, uint32_t len)
+{
+    uint32_t slot = Slot_Find(address, len);
+    
+    if((slot == SLOT_NONE) || (slot == ActiveSlot))
+    {
+        return 0;
+    }
+    return 1;
+}
+
+/*! \brief Reads the boot metadata log.
+ *  The records are appended in order, so the last committed record of a
+ *  slot is its token and the first erased record is where the next record
+ *  goes.
+ */
+static void Slot_Load(void)
+{
+    const BOOT_RECORD *record = (const BOOT_RECORD *)BOOT_METADATA_ADDRESS;
+    const BOOT_RECORD *end = (const BOOT_RECORD *)BOOT_METADATA_END;
+    SLOT_TOKEN *token;
+    uint32_t slot;
+    
+    for(slot = 0; slot < SLOT_COUNT; slot++)
+    {
+        Tokens[slot].State = TOKEN_MISSING;
+        Tokens[slot].Generation = 0;
+    }
+    Generation = 0;
+    
+    for(; (record + 1) <= end; record++)
+    {
+        if((record->Generation == BOOT_RECORD_ERASED) && (record->Slot == BOOT_RECORD_ERASED) &&
+           (record->Check == BOOT_RECORD_ERASED) && (record->Magic == BOOT_RECORD_ERASED))
+        {
+            break;
+        }
+        if(((record->Magic != BOOT_RECORD_VERIFIED) && (record->Magic != BOOT_RECORD_INVALIDATED)) ||
+           (record->Slot >= SLOT_COUNT) ||
+           (record->Check != ~(record->Generation ^ record->Slot ^ record->Length ^ record->Crc)))
+        {
+            continue;
+        }
+        
+        token = &Tokens[record->Slot];
+        token->State = (record->Magic == BOOT_RECORD_VERIFIED) ? TOKEN_VERIFIED : TOKEN_INVALIDATED;
+        token->Generation = record->Generation;
+        token->Length = record->Length;
+        token->Crc = record->Crc;
+        Generation = record->Generation;
+    }
+    
+    NextRecordAddress = (uint32_t)(uintptr_t)record;
+}
+
+/*! \brief Returns the slot to start: the bootable slot with the newest
+ *  token. The slot that was checked last is tried first, then the other
+ *  one, and a slot without a token last.
+ *
+ *  \retval uint32_t    The slot, or SLOT_NONE
+ */
+static uint32_t Slot_Select(void)
+{
+    uint32_t tried = 0;
+    uint32_t slot;
+    uint32_t newest;
+    
+    Slot_Load();
+    while(tried != ((1U << SLOT_COUNT) - 1U))
+    {
+        newest = SLOT_NONE;
+        for(slot = 0; slot < SLOT_COUNT; slot++)
+        {
+            if(((tried & (1U << slot)) == 0) && 
+               ((newest == SLOT_NONE) || (Slot_IsNewer(slot, newest) == 1)))
+            {
+                newest = slot;
+            }
+        }
+        
+        tried |= 1U << newest;
+        if(Slot_IsBootable(newest) == 1)
+        {
+            return newest;
+        }
+    }
+    return SLOT_NONE;
+}
+
+/*! \brief Orders two slots for Slot_Select: the newer token first. Tokens
+ *  only have the same generation when both are missing, after a reset lost
+ *  the log, and then the image with the higher header version is first.
+ *
+ *  \param  slot        The slot
+ *  \param  other       The slot to compare with
+ *  \retval uint8_t     1 if slot is to be tried before other, 0 otherwise
+ */
+static uint8_t Slot_IsNewer(uint32_t slot, uint32_t other)
+{
+    const IMAGE_HEADER *header;
+    const IMAGE_HEADER *otherHeader;
+    
+    if(Tokens[slot].Generation != Tokens[other].Generation)
+    {
+        return (Tokens[slot].Generation > Tokens[other].Generation) ? 1 : 0;
+    }
+    
+    header = Image_GetHeader(slot);
+    otherHeader = Image_GetHeader(other);
+    if((header != 0) && ((otherHeader == 0) || (header->Version > otherHeader->Version)))
+    {
+        return 1;
+    }
+    return 0;
+}
+
+/*! \brief Checks that a slot can be started.
+ *  A verified token is trusted as it is, so a checked image boots in
+ *  constant time. An image with a header is otherwise CRC checked against
+ *  its header, and an image without one against its invalidated token. A
+ *  slot without a token or header holds an image flashed before both, and
+ *  only its vector table is checked. An image that passes its CRC is
+ *  verified again, so the next boots skip the CRC, unless the log is full:
+ *  the record would erase the log on the boot path, where a reset loses
+ *  every token, so the next CHECK compacts it instead.
+ *
+ *  \param  slot        The slot
+ *  \retval uint8_t     1 if the slot can be started, 0 otherwise
+ */
+static uint8_t Slot_IsBootable(uint32_t slot)
+{
+    const SLOT_TOKEN *token = &Tokens[slot];
+    const IMAGE_HEADER *header;
+    uint32_t words = (token->Length + 3U) / 4U;
+    uint32_t length = token->Length;
+    uint32_t crc = token->Crc;
+    
+    if(Slot_IsValid(slot) != 1)
+    {
+        return 0;
+    }
+    
+    header = Image_GetHeader(slot);
+    if(header != 0)
+    {
+        // The token is only trusted for the image the header describes
+        if((token->State == TOKEN_VERIFIED) && 
+           (token->Length == header->Length) && (token->Crc == header->Crc))
+        {
+            return 1;
+        }
+        if(Image_Verify(header) != 1)
+        {
+            return 0;
+        }
+        length = header->Length;
+        crc = header->Crc;
+    }
+    else
+    {
+        if(token->State != TOKEN_INVALIDATED)
+        {
+            return 1;
+        }
+        
+        if((words == 0) || (words > ((SlotTable[slot].End - SlotTable[slot].Start) / 4U)) ||
+           (*(__IO uint32_t *)(SlotTable[slot].Start + (4U * words) - 4U) != token->Crc))
+        {
+            return 0;
+        }
+        HAL_RCC_CRC_CLK_ENABLE();
+        crc = HAL_CRC_Calculate((uint32_t *)SlotTable[slot].Start, words);
+        HAL_RCC_CRC_CLK_DISABLE();
+        if(crc != 0)
+        {
+            return 0;
+        }
+        crc = token->Crc;
+    }
+    
+    // Still the checked image: the next boots skip the CRC
+    if((NextRecordAddress + sizeof(BOOT_RECORD)) <= BOOT_METADATA_END)
+    {
+        HAL_Flash_Unlock();
+        Slot_Record(slot, TOKEN_VERIFIED, length, crc);
+        HAL_Flash_Lock();
+    }
+    return 1;
+}
+
+/*! \brief Checks the vector table of a slot: the initial stack pointer is
+ *  in SRAM, up to its top, and the reset handler is Thumb code in the slot.
+ *  With an image header, the reset handler is its entry point, inside the
+ *  image.
+ *
+ *  \param  slot        The slot
+ *  \retval uint8_t     1 if the slot holds an application, 0 otherwise
+ */
+static uint8_t Slot_IsValid(uint32_t slot)
+{
+    const IMAGE_HEADER *header = Image_GetHeader(slot);
+    uint32_t vectors = SlotTable[slot].Start;
+    uint32_t end = SlotTable[slot].End;
+    uint32_t msp;
+    uint32_t reset;
+    
+    if(header != 0)
+    {
+        vectors += header->HeaderSize;
+        end = SlotTable[slot].Start + header->Length;
+    }
+    msp = *(__IO uint32_t *)vectors;
+    reset = *(__IO uint32_t *)(vectors + 4);
+    
+    if((msp <= SRAM_BASE) || (msp > APPLICATION_RAM_END) || ((msp & 0x3U) != 0))
+    {
+        return 0;
+    }
+    if(((reset & 0x1U) == 0) || (reset < vectors) || (reset >= end))
+    {
+        return 0;
+    }
+    if((header != 0) && (reset != header->EntryPoint))
+    {
+        return 0;
+    }
+    return 1;
+}
+
+/*! \brief Returns the address of the vector table of a slot: after the
+ *  image header, or at the start of an image without one.
+ *
+ *  \param  slot        The slot
+ *  \retval uint32_t    The address of the vector table
+ */
+static uint32_t Slot_GetVectorTable(uint32_t slot)
+{
+    const IMAGE_HEADER *header = Image_GetHeader(slot);
+    
+    return (header != 0) ? (SlotTable[slot].Start + header->HeaderSize) : SlotTable[slot].Start;
+}
+
+/*! \brief Returns the image header of a slot. The header is valid when its
+ *  own CRC matches, it was linked for the slot, and the image it describes
+ *  fits in the slot with the vector table aligned for VTOR.
+ *
+ *  \param  slot        The slot
+ *  \retval IMAGE_HEADER* The header, or 0 when the slot has no valid header
+ */
+static const IMAGE_HEADER *Image_GetHeader(uint32_t slot)
+{
+    const IMAGE_HEADER *header = (const IMAGE_HEADER *)SlotTable[slot].Start;
+    uint32_t crc;
+    
+    if(header->Magic != IMAGE_HEADER_MAGIC)
+    {
+        return 0;
+    }
+    
+    HAL_RCC_CRC_CLK_ENABLE();
+    crc = HAL_CRC_Calculate((uint32_t *)header, (sizeof(IMAGE_HEADER) / 4U) - 1U);
+    HAL_RCC_CRC_CLK_DISABLE();
+    if((crc != header->HeaderCrc) || (header->LoadAddress != SlotTable[slot].Start))
+    {
+        return 0;
+    }
+    if((header->HeaderSize < sizeof(IMAGE_HEADER)) || ((header->HeaderSize % IMAGE_VECTOR_ALIGN) != 0) ||
+       (header->Length <= header->HeaderSize) || ((header->Length & 0x3U) != 0) ||
+       (header->Length > (SlotTable[slot].End - SlotTable[slot].Start)))
+    {
+        return 0;
+    }
+    return header;
+}
+
+/*! \brief Checks the CRC of the image described by a header, over the
+ *  bytes after the header. The header bounds it to its slot.
+ *
+ *  \param  *pHeader    The header
+ *  \retval uint8_t     1 if the image matches its header, 0 otherwise
+ */
+static uint8_t Image_Verify(const IMAGE_HEADER *pHeader)
+{
+    uint32_t crc;
+    
+    HAL_RCC_CRC_CLK_ENABLE();
+    crc = HAL_CRC_Calculate((uint32_t *)((uint32_t)(uintptr_t)pHeader + pHeader->HeaderSize),
+                            (pHeader->Length - pHeader->HeaderSize) / 4U);
+    HAL_RCC_CRC_CLK_DISABLE();
+    
+    return (crc == pHeader->Crc) ? 1 : 0;
+}
+
+/*! \brief Records a verified token for a checked slot, which makes it the
+ *  slot to boot. The token keeps the CRC of the image header, or the CRC
+ *  an image without a header ends with.
+ *
+ *  \param  slot        The slot
+ *  \param  length      The length of the checked image
+ *  \retval uint8_t     1 if the token is committed, 0 otherwise
+ */
+static uint8_t Slot_Commit(uint32_t slot, uint32_t length)
+{
+    const IMAGE_HEADER *header = Image_GetHeader(slot);
+    uint32_t words = (length + 3U) / 4U;
+    uint32_t crc;
+    uint32_t error;
+    
+    if((words == 0) || (Slot_IsValid(slot) != 1))
+    {
+        return 0;
+    }
+    crc = (header != 0) ? header->Crc : *(__IO uint32_t *)(SlotTable[slot].Start + (4U * words) - 4U);
+    
+    HAL_Flash_Unlock();
+    error = Slot_Record(slot, TOKEN_VERIFIED, length, crc);
+    HAL_Flash_Lock();
+    
+    return (error == HAL_FLASH_ERROR_NONE) ? 1 : 0;
+}
+
+/*! \brief Records an invalidated token for a slot about to be modified, so
+ *  that a partly updated slot is never taken for the image it held. The
+ *  record is only written once per modification of the slot.
+ *
+ *  \param  slot        The slot, or SLOT_NONE
+ *  \retval uint32_t    The error code
+ */
+static uint32_t Slot_Invalidate(uint32_t slot)
+{
+    if((slot == SLOT_NONE) || (Tokens[slot].State == TOKEN_INVALIDATED))
+    {
+        return HAL_FLASH_ERROR_NONE;
+    }
+    return Slot_Record(slot, TOKEN_INVALIDATED, Tokens[slot].Length, Tokens[slot].Crc);
+}
+
+/*! \brief Appends the token of a slot to the boot metadata.
+ *  When the metadata sector is full, it is erased and the log starts over
+ *  with the tokens of the other slots. This blocks for the erase time once
+ *  every few hundred records, and a reset during the erase loses the
+ *  tokens: the slots then boot as images without a token.
+ *
+ *  \param  slot        The slot
+ *  \param  state       TOKEN_VERIFIED or TOKEN_INVALIDATED
+ *  \param  length      The length of the image
+ *  \param  crc         The CRC of the image
+ *  \retval uint32_t    The error code
+ */
+static uint32_t Slot_Record(uint32_t slot, TOKEN_STATE state, uint32_t length, uint32_t crc)
+{
+    SLOT_TOKEN token;
+    uint32_t error = HAL_FLASH_ERROR_NONE;
+    uint32_t i;
+    
+    if((NextRecordAddress + sizeof(BOOT_RECORD)) > BOOT_METADATA_END)
+    {
+        HAL_Flash_EraseSector_Start(BOOT_METADATA_SECTOR);
+        error = HAL_Flash_EraseSector_End();
+        NextRecordAddress = BOOT_METADATA_ADDRESS;
+        for(i = 0; (i < SLOT_COUNT) && (error == HAL_FLASH_ERROR_NONE); i++)
+        {
+            if((i != slot) && (Tokens[i].State != TOKEN_MISSING))
+            {
+                error = Record_Program(i, &Tokens[i]);
+            }
+        }
+    }
+    
+    token.State = state;
+    token.Generation = Generation + 1U;
+    token.Length = length;
+    token.Crc = crc;
+    if(error == HAL_FLASH_ERROR_NONE)
+    {
+        error = Record_Program(slot, &token);
+    }
+    if(error == HAL_FLASH_ERROR_NONE)
+    {
+        Tokens[slot] = token;
+        Generation = token.Generation;
+    }
+    return error;
+}
+
+/*! \brief Programs one record at NextRecordAddress: everything but the
+ *  magic, then the magic alone, which commits the record.
+ *
+ *  \param  slot        The slot
+ *  \param  *pToken     The token of the slot
+ *  \retval uint32_t    The error code
+ */
+static uint32_t Record_Program(uint32_t slot, const SLOT_TOKEN *pToken)
+{
+    BOOT_RECORD record;
+    uint32_t error;
+    
+    record.Generation = pToken->Generation;
+    record.Slot = slot;
+    record.Length = pToken->Length;
+    record.Crc = pToken->Crc;
+    record.Check = ~(record.Generation ^ record.Slot ^ record.Length ^ record.Crc);
+    record.Magic = (pToken->State == TOKEN_VERIFIED) ? BOOT_RECORD_VERIFIED : BOOT_RECORD_INVALIDATED;
+    
+    error = HAL_Flash_ProgramBuffer(NextRecordAddress, (const uint8_t *)&record,
+                                    sizeof(record) - 4U, FLASH_PROGRAM_PSIZE);
+    if(error == HAL_FLASH_ERROR_NONE)
+    {
+        error = HAL_Flash_ProgramBuffer(NextRecordAddress + sizeof(record) - 4U, 
+                                        (const uint8_t *)&record.Magic, 4U, FLASH_PROGRAM_PSIZE);
+    }
+    
+    // A failed record is skipped by Slot_Load
+    NextRecordAddress += sizeof(record);
+    return error;
+}
+
+/*! \brief Returns the slot holding a range of flash.
+ *
+ *  \param  address     The first address of the range
+ *  \param  len         The length of the range
+ *  \retval uint32_t    The slot, or SLOT_NONE
+ */
+static uint32_t Slot_Find(uint32_t address, uint32_t len)
+{
+    uint32_t slot;
+    
+    for(slot = 0; slot < SLOT_COUNT; slot++)
+    {
+        if((address >= SlotTable[slot].Start) && (address < SlotTable[slot].End) &&
+           (len <= (SlotTable[slot].End - address)))
+        {
+            return slot;
+        }
+    }
+    return SLOT_NONE;
+}
+
+/*! \brief Programs one write frame and profiles it. The token of the slot
+ *  is invalidated first. The flash must be unlocked.
+ *
+ *  \param  address     The first address to program
+ *  \param  *pData      The data
+ *  \param  len         The length of the data
+ *  \retval uint32_t    The error code
+ */
+static uint32_t ProgramFrame(uint32_t address, const uint8_t *pData, uint32_t len)
+{
+    uint32_t start = HAL_DWT_CYCLES();
+    uint32_t error = Slot_Invalidate(Slot_Find(address, len));
+    
+    if(error == HAL_FLASH_ERROR_NONE)
+    {
+        error = HAL_Flash_ProgramBuffer(address, pData, len, FLASH_PROGRAM_PSIZE);
+    }
+    Stats_Record(STATS_PROGRAM, start);
+    return error;
+}
+
+/*! \brief Adds one duration to the profile of a phase.
+ *  The histogram bins are in microseconds of the current core clock, so
+ *  they stay comparable when the PLL did not lock.
+ *
+ *  \param  phase       The phase
+ *  \param  start       HAL_DWT_CYCLES when the phase started
+ */
+static void Stats_Record(STATS_PHASE phase, uint32_t start)
+{
+    PHASE_STATS *stats = &Stats[phase];
+    uint32_t cycles = HAL_DWT_Elapsed(start);
+    uint32_t us = cycles / (SystemCoreClock / 1000000U);
+    uint32_t limit = STATS_FIRST_BIN_US;
+    uint32_t bin = 0;
+    
+    while((bin < (STATS_HISTOGRAM_BINS - 1U)) && (us >= limit))
+    {
+        bin++;
+        limit <<= 2;
+    }
+    
+    if((stats->Count == 0) || (cycles < stats->MinCycles))
+    {
+        stats->MinCycles = cycles;
+    }
+    if(cycles > stats->MaxCycles)
+    {
+        stats->MaxCycles = cycles;
+    }
+    stats->Count++;
+    stats->TotalCycles += cycles;
+    stats->Histogram[bin]++;
+}
+
+/*! \brief Clears the profile.
+ */
+static void Stats_Clear(void)
+{
+    memset(Stats, 0, sizeof(Stats));
+    StatsIdleCycles = 0;
+    HAL_Flash_WaitCycles = 0;
+}
+
+/*! \brief Default timeout: drops the partial message and NACKs it.
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Timeout_Default(void)
+{
+    Link_Flush();
+    Send_NACK(&UartHandle);
+    return STATE_COMMAND;
+}
+
+/*! \brief Completes the hookup, or gives up on the host and jumps to the
+ *  application when the reply is not a valid ACK.
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_Hookup(void)
+{
+    Stats_Record(STATS_HOOKUP, StateEnterCycles);
+    
+    if(CheckChecksum(pRxBuffer, 2) != 1 || pRxBuffer[0] != ACK)
+    {
+        Send_NACK(&UartHandle);
+        return STATE_JUMP;
+    }
+    
+    /* At this point, hookup communication is complete */
+    return STATE_COMMAND;
+}
+
+/*! \brief No host: jump to the application.
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Timeout_Hookup(void)
+{
+    Send_NACK(&UartHandle);
+    return STATE_JUMP;
+}
+
+/*! \brief Decodes a command and ACKs it
+ *
+ *  \retval STATE       The first state of the command
+ */
+static STATE Step_Command(void)
+{
+    uint32_t i;
+    
+    // The rest of the frame of a rejected command is not taken for commands
+    if(CheckChecksum(pRxBuffer, 2) != 1)
+    {
+        Link_DropFrame();
+        Send_NACK(&UartHandle);
+        return STATE_COMMAND;
+    }
+    
+    for(i = 0; i < (sizeof(CommandTable) / sizeof(CommandTable[0])); i++)
+    {
+        if(CommandTable[i].Command == pRxBuffer[0])
+        {
+            Send_ACK(&UartHandle);
+            return CommandTable[i].State;
+        }
+    }
+    
+    // Unsupported command
+    Link_DropFrame();
+    Send_NACK(&UartHandle);
+    return STATE_COMMAND;
+}
+
+/*! \brief Erase flash function
+ *  Erases NbSectors sectors from the initial sector. Every sector is erased
+ *  on its own and answered with an ACK, or a NACK that ends the erase.
+ *  The CPU stalls on its flash fetches while a sector is erased, but the
+ *  receive DMA keeps filling the RX ring in SRAM, so the host may send the
+ *  next command and its data ahead of the last ACK. The ring holds a full
+ *  write window, the most the host sends ahead.
+ *
+ *  Request: | Number of sectors (1) | Initial sector (1) | Checksum (1) |
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_EraseRequest(void)
+{
+    uint32_t slot;
+    
+    // validate checksum
+    if(CheckChecksum(pRxBuffer, 3) != 1)
+    {
+        Send_NACK(&UartHandle);
+        return STATE_COMMAND;
+    }
+    
+    if(pRxBuffer[0] == 0xFF)
+    {
+        // global erase: not supported
+        Send_NACK(&UartHandle);
+        return STATE_COMMAND;
+    }
+    if((pRxBuffer[0] == 0) || (pRxBuffer[1] >= HAL_FLASH_SECTOR_COUNT) ||
+       (pRxBuffer[0] > (HAL_FLASH_SECTOR_COUNT - pRxBuffer[1])))
+    {
+        Send_NACK(&UartHandle);
+        return STATE_COMMAND;
+    }
+    
+    // Sector erase, one sector at a time so that each sector is
+    // confirmed with its own ACK or NACK
+    Command.Sector = pRxBuffer[1];
+    Command.EndSector = (uint32_t)pRxBuffer[1] + pRxBuffer[0];
+    
+    // The bootloader, the boot metadata and the active slot are never
+    // erased
+    slot = Slot_Find(HAL_Flash_GetSectorAddress(Command.Sector), 
+                     HAL_Flash_GetSectorAddress(Command.EndSector - 1U) + 
+                     HAL_Flash_GetSectorSize(Command.EndSector - 1U) - 
+                     HAL_Flash_GetSectorAddress(Command.Sector));
+    if((slot == SLOT_NONE) || (slot == ActiveSlot))
+    {
+        Send_NACK(&UartHandle);
+        return STATE_COMMAND;
+    }
+    
+    HAL_Flash_Unlock();
+    if(Slot_Invalidate(slot) != HAL_FLASH_ERROR_NONE)
+    {
+        HAL_Flash_Lock();
+        Send_NACK(&UartHandle);
+        return STATE_COMMAND;
+    }
+    Command.OperationStart = HAL_DWT_CYCLES();
+    HAL_Flash_EraseSector_Start(Command.Sector);
+    return STATE_ERASE_SECTOR;
+}
+
+/*! \brief Waits for the running sector erase, then starts the next one.
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_EraseSector(void)
+{
+    if(HAL_Flash_IsBusy() == 1)
+    {
+        return STATE_ERASE_SECTOR;
+    }
+    Stats_Record(STATS_ERASE, Command.OperationStart);
+    
+    if(HAL_Flash_EraseSector_End() != HAL_FLASH_ERROR_NONE)
+    {
+        HAL_Flash_Lock();
+        Send_NACK(&UartHandle);
+        return STATE_COMMAND;
+    }
+    Send_ACK(&UartHandle);
+    
+    Command.Sector++;
+    if(Command.Sector < Command.EndSector)
+    {
+        // Every sector gets the full erase time
+        Command.OperationStart = HAL_DWT_CYCLES();
+        HAL_Flash_EraseSector_Start(Command.Sector);
+        StateDeadline = HAL_SysTick_Deadline(ERASE_TIMEOUT_MS);
+        return STATE_ERASE_SECTOR;
+    }
+    
+    HAL_Flash_Lock();
+    return STATE_COMMAND;
+}
+
+/*! \brief The erase did not complete in time. A running erase cannot be
+ *  aborted, so it is waited for before the sector is NACKed.
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Timeout_EraseSector(void)
+{
+    HAL_Flash_EraseSector_End();
+    Stats_Record(STATS_ERASE, Command.OperationStart);
+    HAL_Flash_Lock();
+    Send_NACK(&UartHandle);
+    return STATE_COMMAND;
+}
+
+/*! \brief Write flash function: receives the starting address
+ *  Address = 4 bytes
+ *  Checksum = 1 byte
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_WriteAddress(void)
+{
+    Command.FrameStart = StateEnterCycles;
+    
+    // Check checksum
+    if(CheckChecksum(pRxBuffer, 5) != 1)
+    {
+        // invalid checksum
+        Send_NACK(&UartHandle);
+        return STATE_COMMAND;
+    }
+    Send_ACK(&UartHandle);
+    
+    // Set the starting address
+    Command.Address = pRxBuffer[0] + (pRxBuffer[1] << 8) 
+                    + (pRxBuffer[2] << 16) + (pRxBuffer[3] << 24);
+    return STATE_WRITE_LENGTH;
+}
+
+/*! \brief Write flash function: receives the number of bytes to be written
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_WriteLength(void)
+{
+    Command.NumBytes = pRxBuffer[0];
+    Command.RxLength = Command.NumBytes + 1;
+    return STATE_WRITE_DATA;
+}
+
+/*! \brief Write flash function: receives and programs the data
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_WriteData(void)
+{
+    uint32_t error;
+    
+    Stats_Record(STATS_RECEIVE, Command.FrameStart);
+    
+    // Check checksum of received data
+    if(CheckChecksum(pRxBuffer, Command.NumBytes + 1) != 1)
+    {
+        // invalid checksum
+        Send_NACK(&UartHandle);
+        return STATE_COMMAND;
+    }
+    
+    if(IsWritableRange(Command.Address, Command.NumBytes) != 1)
+    {
+        Send_NACK(&UartHandle);
+        return STATE_COMMAND;
+    }
+    
+    // valid checksum at this point
+    // Program flash with the data
+    HAL_Flash_Unlock();
+    error = ProgramFrame(Command.Address, pRxBuffer, Command.NumBytes);
+    HAL_Flash_Lock();
+    
+    // Send ACK
+    if(error != HAL_FLASH_ERROR_NONE)
+    {
+        Send_NACK(&UartHandle);
+    }
+    else
+    {
+        Send_ACK(&UartHandle);
+    }
+    return STATE_COMMAND;
+}
+
+/*! \brief Bulk write flash function: receives the frame header
+ *  Receives the starting address, the number of bytes and up to
+ *  WRITE_BULK_MAX_BYTES of data as a single frame, guarded by one checksum,
+ *  and answers with a single ACK once the data is programmed.
+ *
+ *  Frame: | Address (4) | Number of bytes - 1 (1) | Data (N) | Checksum (1) |
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_BulkHeader(void)
+{
+    Command.FrameStart = StateEnterCycles;
+    Command.NumBytes = (uint32_t)pRxBuffer[4] + 1;
+    
+    // Receive the data and the checksum of the whole frame
+    Command.RxLength = Command.NumBytes + 1;
+    return STATE_BULK_DATA;
+}
+
+/*! \brief Bulk write flash function: programs the frame
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_BulkData(void)
+{
+    uint32_t error;
+    
+    Stats_Record(STATS_RECEIVE, Command.FrameStart);
+    
+    // Check checksum of the whole frame
+    if(CheckChecksum(pRxBuffer, WRITE_BULK_HEADER_SIZE + Command.NumBytes + 1) != 1)
+    {
+        // invalid checksum
+        Send_NACK(&UartHandle);
+        return STATE_COMMAND;
+    }
+    
+    // Set the starting address
+    Command.Address = pRxBuffer[0] + (pRxBuffer[1] << 8) 
+                    + (pRxBuffer[2] << 16) + (pRxBuffer[3] << 24);
+    if(IsWritableRange(Command.Address, Command.NumBytes) != 1)
+    {
+        Send_NACK(&UartHandle);
+        return STATE_COMMAND;
+    }
+    
+    // valid checksum at this point
+    // Program flash with the data
+    HAL_Flash_Unlock();
+    error = ProgramFrame(Command.Address, &pRxBuffer[WRITE_BULK_HEADER_SIZE], 
+                         Command.NumBytes);
+    HAL_Flash_Lock();
+    
+    // Send ACK
+    if(error != HAL_FLASH_ERROR_NONE)
+    {
+        Send_NACK(&UartHandle);
+    }
+    else
+    {
+        Send_ACK(&UartHandle);
+    }
+    return STATE_COMMAND;
+}
+
+/*! \brief Windowed write flash function
+ *  Receives up to WRITE_WINDOW_MAX_FRAMES frames back to back, each tagged
+ *  with a sequence number, so the host does not wait for a reply between
+ *  frames. Each frame is programmed as soon as it is validated while the DMA
+ *  keeps receiving the next ones, and a single status reply is sent at the
+ *  end of the window.
+ *
+ *  Header: | Number of frames (1) | Checksum (1) |
+ *  Frames: | Seq (1) | ... see Step_FrameData, Step_Lz4FrameData and
+ *          Step_DeltaFrameData
+ *  Reply:  | ACK/NACK (1) | NACK bitmap (1) | Checksum (1) |
+ *
+ *  The NACK bitmap is the acknowledgement: bit i is set when the i-th frame
+ *  of the window was rejected or lost and has to be sent again, every frame
+ *  with a clear bit is programmed. A retransmit window mixes resent and new
+ *  frames, so the sequence numbers are not contiguous and are not reported.
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_WindowHeader(void)
+{
+    return Window_Start(STATE_FRAME_HEADER);
+}
+
+/*! \brief Receives the header of one bulk frame of a write window
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_FrameHeader(void)
+{
+    Command.FrameStart = StateEnterCycles;
+    Command.NumBytes = (uint32_t)pRxBuffer[5] + 1;
+    Command.RxLength = Command.NumBytes + 1;
+    return STATE_FRAME_DATA;
+}
+
+/*! \brief Programs one bulk frame of a write window
+ *
+ *  Frame: | Seq (1) | Address (4) | Number of bytes - 1 (1) | Data (N) |
+ *         | Checksum (1) |
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_FrameData(void)
+{
+    Stats_Record(STATS_RECEIVE, Command.FrameStart);
+    
+    if(CheckChecksum(pRxBuffer, WRITE_WINDOW_HEADER_SIZE + Command.NumBytes + 1) != 1)
+    {
+        return Window_FrameDone(FRAME_REJECTED, STATE_FRAME_HEADER);
+    }
+    
+    // Program the frame while the next one is being received
+    Command.Address = pRxBuffer[1] + (pRxBuffer[2] << 8) 
+                    + (pRxBuffer[3] << 16) + (pRxBuffer[4] << 24);
+    if(IsWritableRange(Command.Address, Command.NumBytes) != 1)
+    {
+        return Window_FrameDone(FRAME_REJECTED, STATE_FRAME_HEADER);
+    }
+    if(ProgramFrame(Command.Address, &pRxBuffer[WRITE_WINDOW_HEADER_SIZE], 
+                    Command.NumBytes) != HAL_FLASH_ERROR_NONE)
+    {
+        return Window_FrameDone(FRAME_REJECTED, STATE_FRAME_HEADER);
+    }
+    
+    return Window_FrameDone(FRAME_OK, STATE_FRAME_HEADER);
+}
+
+/*! \brief Compressed windowed write flash function. Same window as
+ *  Step_WindowHeader, with LZ4 frames.
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_Lz4WindowHeader(void)
+{
+    return Window_Start(STATE_LZ4_FRAME_HEADER);
+}
+
+/*! \brief Receives the header of one LZ4 frame of a write window
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_Lz4FrameHeader(void)
+{
+    Command.FrameStart = StateEnterCycles;
+    Command.NumBytes = pRxBuffer[5] + (pRxBuffer[6] << 8);
+    if(Command.NumBytes > LZ4_MAX_COMPRESSED_SIZE)
+    {
+        // Corrupted length: the rest of the frame cannot be located
+        return Timeout_Frame();
+    }
+    Command.RxLength = Command.NumBytes + 1;
+    return STATE_LZ4_FRAME_DATA;
+}
+
+/*! \brief Decompresses and programs one LZ4 frame of a write window. Each
+ *  frame carries one independently decodable LZ4 block of at most
+ *  LZ4_BLOCK_SIZE bytes, so only one block is ever held in RAM.
+ *
+ *  Frame: | Seq (1) | Address (4) | Compressed length (2) | Raw length (2) |
+ *         | LZ4 block (Compressed length) | Checksum (1) |
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_Lz4FrameData(void)
+{
+    uint32_t rawLen = pRxBuffer[7] + (pRxBuffer[8] << 8);
+    
+    Stats_Record(STATS_RECEIVE, Command.FrameStart);
+    
+    if((CheckChecksum(pRxBuffer, LZ4_HEADER_SIZE + Command.NumBytes + 1) != 1) ||
+       (rawLen == 0) || (rawLen > LZ4_BLOCK_SIZE))
+    {
+        return Window_FrameDone(FRAME_REJECTED, STATE_LZ4_FRAME_HEADER);
+    }
+    
+    Command.Address = pRxBuffer[1] + (pRxBuffer[2] << 8) 
+                    + (pRxBuffer[3] << 16) + (pRxBuffer[4] << 24);
+    if(IsWritableRange(Command.Address, rawLen) != 1)
+    {
+        return Window_FrameDone(FRAME_REJECTED, STATE_LZ4_FRAME_HEADER);
+    }
+    
+    // Decompress into the decompression window, then program it
+    if(Lz4_Decompress(&pRxBuffer[LZ4_HEADER_SIZE], Command.NumBytes, 
+                      pDecompressBuffer, rawLen) != rawLen)
+    {
+        return Window_FrameDone(FRAME_REJECTED, STATE_LZ4_FRAME_HEADER);
+    }
+    
+    if(ProgramFrame(Command.Address, pDecompressBuffer, rawLen) != HAL_FLASH_ERROR_NONE)
+    {
+        return Window_FrameDone(FRAME_REJECTED, STATE_LZ4_FRAME_HEADER);
+    }
+    
+    return Window_FrameDone(FRAME_OK, STATE_LZ4_FRAME_HEADER);
+}
+
+/*! \brief Delta windowed write flash function. Same window as
+ *  Step_WindowHeader, with frames patching the image of the active slot.
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_DeltaWindowHeader(void)
+{
+    return Window_Start(STATE_DELTA_FRAME_HEADER);
+}
+
+/*! \brief Receives the header of one delta frame of a write window
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_DeltaFrameHeader(void)
+{
+    Command.FrameStart = StateEnterCycles;
+    Command.NumBytes = pRxBuffer[5] + (pRxBuffer[6] << 8);
+    if(Command.NumBytes > LZ4_MAX_COMPRESSED_SIZE)
+    {
+        // Corrupted length: the rest of the frame cannot be located
+        return Timeout_Frame();
+    }
+    Command.RxLength = Command.NumBytes + 1;
+    return STATE_DELTA_FRAME_DATA;
+}
+
+/*! \brief Rebuilds and programs one delta frame of a write window. The
+ *  patch rebuilds one block of at most LZ4_BLOCK_SIZE bytes from the image
+ *  of the active slot, which updates cannot modify, so the old image is
+ *  read in place and only the block is held in RAM.
+ *
+ *  Frame: | Seq (1) | Address (4) | Patch length (2) | Raw length (2) |
+ *         | Patch (Patch length) | Checksum (1) |
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_DeltaFrameData(void)
+{
+    uint32_t rawLen = pRxBuffer[7] + (pRxBuffer[8] << 8);
+    
+    Stats_Record(STATS_RECEIVE, Command.FrameStart);
+    
+    if((CheckChecksum(pRxBuffer, LZ4_HEADER_SIZE + Command.NumBytes + 1) != 1) ||
+       (rawLen == 0) || (rawLen > LZ4_BLOCK_SIZE) || (ActiveSlot == SLOT_NONE))
+    {
+        return Window_FrameDone(FRAME_REJECTED, STATE_DELTA_FRAME_HEADER);
+    }
+    
+    Command.Address = pRxBuffer[1] + (pRxBuffer[2] << 8) 
+                    + (pRxBuffer[3] << 16) + (pRxBuffer[4] << 24);
+    if(IsWritableRange(Command.Address, rawLen) != 1)
+    {
+        return Window_FrameDone(FRAME_REJECTED, STATE_DELTA_FRAME_HEADER);
+    }
+    
+    // Rebuild the block into the decompression window, then program it
+    if(Delta_Apply(&pRxBuffer[LZ4_HEADER_SIZE], Command.NumBytes, pDecompressBuffer, rawLen,
+                   ActiveSlot, Slot_Find(Command.Address, rawLen)) != rawLen)
+    {
+        return Window_FrameDone(FRAME_REJECTED, STATE_DELTA_FRAME_HEADER);
+    }
+    
+    if(ProgramFrame(Command.Address, pDecompressBuffer, rawLen) != HAL_FLASH_ERROR_NONE)
+    {
+        return Window_FrameDone(FRAME_REJECTED, STATE_DELTA_FRAME_HEADER);
+    }
+    
+    return Window_FrameDone(FRAME_OK, STATE_DELTA_FRAME_HEADER);
+}
+
+/*! \brief A frame did not arrive in time: the window ends, and the frame
+ *  and every frame after it are NACKed.
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Timeout_Frame(void)
+{
+    // Drop the partial frame so it is not taken for a command
+    Link_Flush();
+    return Window_Reply();
+}
+
+/*! \brief A frame of the window was lost: the link frame carrying it
+ *  failed its check. The host sends every frame of a window in a link frame
+ *  of its own, so only this frame is NACKed and the window goes on with the
+ *  next one.
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Lost_Frame(void)
+{
+    Command.NackBitmap |= (1U << Command.Frame);
+    Command.Frame++;
+    if(Command.Frame < Command.NumFrames)
+    {
+        return Command.FrameState;
+    }
+    return Window_Reply();
+}
+
+/*! \brief Starts a write window from its header
+ *
+ *  \param  frameState  The state receiving the frames of the window
+ *  \retval STATE       The next state
+ */
+static STATE Window_Start(STATE frameState)
+{
+    uint8_t msg[3];
+    
+    Command.NumFrames = pRxBuffer[0];
+    if((CheckChecksum(pRxBuffer, 2) != 1) || 
+       (Command.NumFrames == 0) || (Command.NumFrames > WRITE_WINDOW_MAX_FRAMES))
+    {
+        // Reject the whole window with a regular window reply
+        msg[0] = NACK;
+        msg[1] = 0xFF;
+        msg[2] = CalculateChecksum(msg, 2);
+        Link_Send(msg, 3);
+        return STATE_COMMAND;
+    }
+    
+    Command.Frame = 0;
+    Command.NackBitmap = 0;
+    Command.FrameState = frameState;
+    HAL_Flash_Unlock();
+    return frameState;
+}
+
+/*! \brief Accounts for one frame of a write window
+ *
+ *  \param  status      The outcome for the frame
+ *  \param  frameState  The state receiving the next frame
+ *  \retval STATE       The next state
+ */
+static STATE Window_FrameDone(FRAME_STATUS status, STATE frameState)
+{
+    if(status == FRAME_REJECTED)
+    {
+        Command.NackBitmap |= (1U << Command.Frame);
+    }
+    
+    Command.Frame++;
+    if(Command.Frame < Command.NumFrames)
+    {
+        return frameState;
+    }
+    return Window_Reply();
+}
+
+/*! \brief Ends a write window and sends its reply
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Window_Reply(void)
+{
+    uint8_t msg[3];
+    
+    HAL_Flash_Lock();
+    
+    // Frames that never arrived are NACKed
+    for(; Command.Frame < Command.NumFrames; Command.Frame++)
+    {
+        Command.NackBitmap |= (1U << Command.Frame);
+    }
+    
+    // Reply with the selective NACKs
+    msg[0] = (Command.NackBitmap == 0) ? ACK : NACK;
+    msg[1] = Command.NackBitmap;
+    msg[2] = CalculateChecksum(msg, 2);
+    Link_Send(msg, 3);
+    return STATE_COMMAND;
+}
+
+/*! \brief Decompresses one LZ4 block (raw block format, no frame header).
+ *  Every length and match offset is bounds checked, so a corrupted block
+ *  cannot write outside of the destination buffer.
+ *
+ *  \param  *pSrc       The compressed block
+ *  \param  srcLen      The length of the compressed block
+ *  \param  *pDst       The destination buffer
+ *  \param  dstLen      The size of the destination buffer
+ *  \retval uint32_t    The decompressed length or LZ4_ERROR
+ */
+static uint32_t Lz4_Decompress(const uint8_t *pSrc, uint32_t srcLen, 
+                               uint8_t *pDst, uint32_t dstLen)
+{
+    const uint8_t *pSrcEnd = pSrc + srcLen;
+    uint32_t dstPos = 0;
+    uint32_t token;
+    uint32_t len;
+    uint32_t offset;
+    uint8_t  extra;
+    
+    while(pSrc < pSrcEnd)
+    {
+        token = *pSrc++;
+        
+        // Literals, with the length extended by 255 bytes when it is 15
+        len = token >> 4;
+        if(len == 15U)
+        {
+            do
+            {
+                if(pSrc >= pSrcEnd)
+                {
+                    return LZ4_ERROR;
+                }
+                extra = *pSrc++;
+                len += extra;
+            } while(extra == 255U);
+        }
+        if((len > (uint32_t)(pSrcEnd - pSrc)) || (len > (dstLen - dstPos)))
+        {
+            return LZ4_ERROR;
+        }
+        while(len--)
+        {
+            pDst[dstPos++] = *pSrc++;
+        }
+        
+        // The last sequence only has literals
+        if(pSrc >= pSrcEnd)
+        {
+            break;
+        }
+        
+        // Match: 2 byte offset back into the block, then the length
+        if((pSrcEnd - pSrc) < 2)
+        {
+            return LZ4_ERROR;
+        }
+        offset = pSrc[0] + (pSrc[1] << 8);
+        pSrc += 2;
+        if((offset == 0) || (offset > dstPos))
+        {
+            return LZ4_ERROR;
+        }
+        
+        len = token & 0x0FU;
+        if(len == 15U)
+        {
+            do
+            {
+                if(pSrc >= pSrcEnd)
+                {
+                    return LZ4_ERROR;
+                }
+                extra = *pSrc++;
+                len += extra;
+            } while(extra == 255U);
+        }
+        len += 4U;
+        if(len > (dstLen - dstPos))
+        {
+            return LZ4_ERROR;
+        }
+        
+        // Byte by byte: the match may overlap the bytes it produces
+        while(len--)
+        {
+            pDst[dstPos] = pDst[dstPos - offset];
+            dstPos++;
+        }
+    }
+    
+    return dstPos;
+}
+
+/*! \brief Rebuilds one block of a new image from a patch against the image
+ *  of a base slot. The patch is a sequence of ops, each appending Length
+ *  bytes to the block:
+ *
+ *  COPY:       | DELTA_OP_COPY (1) | Length (2) | Base offset (4) |
+ *  COPY_RELOC: | DELTA_OP_COPY_RELOC (1) | Length (2) | Base offset (4) |
+ *  ADD:        | DELTA_OP_ADD (1) | Length (2) | Bytes (Length) |
+ *
+ *  COPY takes the bytes at an offset of the base slot. The slots are linked
+ *  for their own addresses, so COPY_RELOC takes whole words instead, and
+ *  moves those that point into the base slot to the same offset of the new
+ *  slot: code that did not change copies over even where it holds
+ *  addresses. Every length and offset is bounds checked, so a corrupted
+ *  patch cannot read outside of the base slot or write outside of the
+ *  destination buffer.
+ *
+ *  \param  *pSrc       The patch
+ *  \param  srcLen      The length of the patch
+ *  \param  *pDst       The destination buffer
+ *  \param  dstLen      The size of the destination buffer
+ *  \param  baseSlot    The slot holding the base image
+ *  \param  newSlot     The slot the block is programmed to
+ *  \retval uint32_t    The length of the block or DELTA_ERROR
+ */
+static uint32_t Delta_Apply(const uint8_t *pSrc, uint32_t srcLen, uint8_t *pDst, 
+                            uint32_t dstLen, uint32_t baseSlot, uint32_t newSlot)
+{
+    const uint8_t *pSrcEnd = pSrc + srcLen;
+    const SLOT_ENTRY *base = &SlotTable[baseSlot];
+    uint32_t baseSize = base->End - base->Start;
+    uint32_t relocation = SlotTable[newSlot].Start - base->Start;
+    uint32_t dstPos = 0;
+    uint32_t op;
+    uint32_t len;
+    uint32_t offset;
+    uint32_t word;
+    uint32_t i;
+    
+    while(pSrc < pSrcEnd)
+    {
+        if((uint32_t)(pSrcEnd - pSrc) < DELTA_OP_SIZE)
+        {
+            return DELTA_ERROR;
+        }
+        op = pSrc[0];
+        len = pSrc[1] + (pSrc[2] << 8);
+        pSrc += DELTA_OP_SIZE;
+        if(len > (dstLen - dstPos))
+        {
+            return DELTA_ERROR;
+        }
+        
+        if(op == DELTA_OP_ADD)
+        {
+            if(len > (uint32_t)(pSrcEnd - pSrc))
+            {
+                return DELTA_ERROR;
+            }
+            memcpy(&pDst[dstPos], pSrc, len);
+            pSrc += len;
+        }
+        else if((op == DELTA_OP_COPY) || (op == DELTA_OP_COPY_RELOC))
+        {
+            if((pSrcEnd - pSrc) < 4)
+            {
+                return DELTA_ERROR;
+            }
+            offset = pSrc[0] + (pSrc[1] << 8) + (pSrc[2] << 16) + (pSrc[3] << 24);
+            pSrc += 4;
+            if((offset > baseSize) || (len > (baseSize - offset)))
+            {
+                return DELTA_ERROR;
+            }
+            
+            if(op == DELTA_OP_COPY)
+            {
+                memcpy(&pDst[dstPos], (const uint8_t *)(base->Start + offset), len);
+            }
+            else
+            {
+                if(((offset | len | dstPos) & 0x3U) != 0)
+                {
+                    return DELTA_ERROR;
+                }
+                for(i = 0; i < len; i += 4U)
+                {
+                    word = *(__IO uint32_t *)(base->Start + offset + i);
+                    if((word >= base->Start) && (word < base->End))
+                    {
+                        word += relocation;
+                    }
+                    memcpy(&pDst[dstPos + i], &word, 4U);
+                }
+            }
+        }
+        else
+        {
+            return DELTA_ERROR;
+        }
+        dstPos += len;
+    }
+    
+    return dstPos;
+}
+
+/*! \brief Check flashed image: receives the starting address
+ *  Address = 4 bytes
+ *  Checksum = 1 byte
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_CheckStart(void)
+{
+    // Check checksum
+    if(CheckChecksum(pRxBuffer, 5) != 1)
+    {
+        // invalid checksum
+        Send_NACK(&UartHandle);
+        return STATE_COMMAND;
+    }
+    Send_ACK(&UartHandle);
+    
+    // Set the starting address
+    Command.Address = pRxBuffer[0] + (pRxBuffer[1] << 8) 
+                    + (pRxBuffer[2] << 16) + (pRxBuffer[3] << 24);
+    return STATE_CHECK_END;
+}
+
+/*! \brief Check flashed image: receives the ending address and starts the
+ *  CRC of the range
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_CheckEnd(void)
+{
+    const IMAGE_HEADER *header;
+    uint32_t endingAddress;
+    uint32_t crcAddress;
+    
+    // Check checksum
+    if(CheckChecksum(pRxBuffer, 5) != 1)
+    {
+        // invalid checksum
+        Send_NACK(&UartHandle);
+        return STATE_COMMAND;
+    }
+    Send_ACK(&UartHandle);
+    
+    // Set the ending address
+    endingAddress = pRxBuffer[0] + (pRxBuffer[1] << 8) 
+                  + (pRxBuffer[2] << 16) + (pRxBuffer[3] << 24);
+    
+    if(endingAddress < Command.Address)
+    {
+        Send_NACK(&UartHandle);
+        return STATE_COMMAND;
+    }
+    Command.NumBytes = endingAddress - Command.Address;
+    Command.Slot = Slot_Find(Command.Address, Command.NumBytes);
+    if(Command.Slot == SLOT_NONE)
+    {
+        Send_NACK(&UartHandle);
+        return STATE_COMMAND;
+    }
+    
+    // An image checked from a slot start with a header is checked against
+    // the header, over the extent the header gives. Any other range has to
+    // end with its CRC
+    header = (Command.Address == SlotTable[Command.Slot].Start) ? Image_GetHeader(Command.Slot) : 0;
+    crcAddress = Command.Address;
+    Command.ExpectedCrc = 0;
+    if(header != 0)
+    {
+        Command.NumBytes = header->Length;
+        Command.ExpectedCrc = header->Crc;
+        crcAddress += header->HeaderSize;
+    }
+    
+    // DMA2 Stream 0 feeds the CRC unit from flash, so the CPU only polls
+    // for completion while the UART reception keeps running
+    HAL_RCC_CRC_CLK_ENABLE();
+    HAL_RCC_DMA2_CLK_ENABLE();
+    DmaCrcHandle.Instance = DMA2_Stream0;
+    Command.OperationStart = HAL_DWT_CYCLES();
+    HAL_CRC_Calculate_DMA(&DmaCrcHandle, (const uint32_t *)crcAddress, 
+                          (Command.Address + Command.NumBytes - crcAddress + 3) / 4);
+    return STATE_CHECK_CRC;
+}
+
+/*! \brief Check flashed image: reports the CRC once it is computed, then
+ *  jumps to the application.
+ *  A good image checked from the start of its slot gets a verified token
+ *  first, so the jump starts it and later boots skip its CRC. The CRC is
+ *  only ACKed once the token is recorded.
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_CheckCrc(void)
+{
+    uint32_t crcResult = 0;
+    uint8_t  crcStatus = HAL_CRC_DMA_Poll(&crcResult);
+    
+    if(crcStatus == HAL_CRC_DMA_BUSY)
+    {
+        return STATE_CHECK_CRC;
+    }
+    Stats_Record(STATS_CRC, Command.OperationStart);
+    
+    HAL_RCC_DMA2_CLK_DISABLE();
+    HAL_RCC_CRC_CLK_DISABLE();
+    if((crcStatus == HAL_CRC_DMA_DONE) && (crcResult == Command.ExpectedCrc) &&
+       ((Command.Address != SlotTable[Command.Slot].Start) || 
+        (Slot_Commit(Command.Slot, Command.NumBytes) == 1)))
     {
-        Send_NACK(&UartHandle);
-        JumpToApplication();
+        Send_ACK(&UartHandle);
     }
-    if(CheckChecksum(pRxBuffer, 2) != 1 || pRxBuffer[0] != ACK)
+    else
     {
         Send_NACK(&UartHandle);
-        JumpToApplication();
     }
     
-    /* At this point, hookup communication is complete */
-    /* Wait for commands and execute accordingly       */
-    
-	for(;;)
-	{
-        // wait for a command
-        while(HAL_UART_Rx(&UartHandle, pRxBuffer, 2, TIMEOUT_VALUE) == HAL_UART_TIMEOUT);
-        
-        if(CheckChecksum(pRxBuffer, 2) != 1)
-        {
-            Send_NACK(&UartHandle);
-        }
-        else
-        {
-            switch(pRxBuffer[0])
-            {
-                case ERASE:
-                    Send_ACK(&UartHandle);
-                    Erase();
-                    break;
-                case WRITE:
-                    Send_ACK(&UartHandle);
-                    Write();
-                    break;
-                case CHECK:
-                    Send_ACK(&UartHandle);
-                    Check();
-                    break;
-                case JUMP:
-                    Send_ACK(&UartHandle);
-                    JumpToApplication();
-                    break;
-                default: // Unsupported command
-                    Send_NACK(&UartHandle);
-                    break;
-            }
-        }
-        
-	}
-    
-    for(;;);
-    
-	return 0;
+    return STATE_JUMP;
 }
 
-/*! \brief Jumps to the main application.
+/*! \brief The CRC did not complete in time: the image is reported as bad.
+ *
+ *  \retval STATE       The next state
  */
-static void JumpToApplication(void)
+static STATE Timeout_CheckCrc(void)
 {
-    if (((*(__IO uint32_t*)APPLICATION_START_ADDRESS) & 0x2FFE0000 ) == 0x20000000)
-    {
-        /* First, disable all IRQs */
-        __disable_irq();
-
-        /* Get the main application start address */
-        uint32_t jump_address = *(__IO uint32_t *)(APPLICATION_START_ADDRESS + 4);
-
-        /* Set the main stack pointer to to the application start address */
-        __set_MSP(*(__IO uint32_t *)APPLICATION_START_ADDRESS);
-
-        // Create function pointer for the main application
-        void (*pmain_app)(void) = (void (*)(void))(jump_address);
+    HAL_DMA_Abort(&DmaCrcHandle);
+    HAL_RCC_DMA2_CLK_DISABLE();
+    HAL_RCC_CRC_CLK_DISABLE();
+    Send_NACK(&UartHandle);
+    return STATE_JUMP;
+}
 
-        // Now jump to the main application
-        pmain_app();
+/*! \brief Sector CRC manifest function
+ *  Returns the hardware CRC of each sector of a range of flash sectors in a
+ *  single reply, so the host can compare them with the new image and only
+ *  erase and write the sectors that differ. A sector whose CRC could not be
+ *  computed is reported as 0, which the host treats as a difference.
+ *
+ *  Request: | First sector (1) | Number of sectors (1) | Checksum (1) |
+ *  Reply:   | ACK (2) | CRC of each sector (4 x N) | Checksum (1) |
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_SectorCrcRequest(void)
+{
+    uint32_t firstSector = pRxBuffer[0];
+    uint32_t numSectors = pRxBuffer[1];
+    
+    if((CheckChecksum(pRxBuffer, 3) != 1) || (numSectors == 0) ||
+       (firstSector >= HAL_FLASH_SECTOR_COUNT) ||
+       (numSectors > (HAL_FLASH_SECTOR_COUNT - firstSector)))
+    {
+        Send_NACK(&UartHandle);
+        return STATE_COMMAND;
     }
+    Send_ACK(&UartHandle);
     
+    Command.Sector = firstSector;
+    Command.EndSector = firstSector + numSectors;
+    Command.ReplyLength = 0;
+    
+    HAL_RCC_CRC_CLK_ENABLE();
+    HAL_RCC_DMA2_CLK_ENABLE();
+    DmaCrcHandle.Instance = DMA2_Stream0;
+    Command.OperationStart = HAL_DWT_CYCLES();
+    HAL_CRC_Calculate_DMA(&DmaCrcHandle, 
+                          (const uint32_t *)HAL_Flash_GetSectorAddress(Command.Sector), 
+                          HAL_Flash_GetSectorSize(Command.Sector) / 4);
+    return STATE_SECTOR_CRC;
 }
 
-/*! \brief  Initializes the bootloader for host communication.
- *          Communication will be done through the UART peripheral.
+/*! \brief Collects the CRC of a sector once it is computed, then starts the
+ *  next sector
+ *
+ *  \retval STATE       The next state
  */
-static void Bootloader_Init(void)
+static STATE Step_SectorCrc(void)
 {
-    GPIO_InitTypeDef gpio_uart;
+    uint32_t crcResult = 0;
+    uint8_t  crcStatus = HAL_CRC_DMA_Poll(&crcResult);
     
-    gpio_uart.Pin = GPIO_PIN_2 | GPIO_PIN_3;
-    gpio_uart.Mode = GPIO_MODE_AF_PP;
-    gpio_uart.Pull = GPIO_PULL_NONE;
-    gpio_uart.Speed = GPIO_SPEED_LOW;
-    gpio_uart.Alternate = GPIO_AF7_USART2;
+    if(crcStatus == HAL_CRC_DMA_BUSY)
+    {
+        return STATE_SECTOR_CRC;
+    }
+    Stats_Record(STATS_CRC, Command.OperationStart);
+    if(crcStatus != HAL_CRC_DMA_DONE)
+    {
+        crcResult = 0;
+    }
     
-    HAL_RCC_GPIOA_CLK_ENABLE();
-    HAL_GPIO_Init(GPIOA, &gpio_uart);
+    pReply[Command.ReplyLength++] = (uint8_t)(crcResult);
+    pReply[Command.ReplyLength++] = (uint8_t)(crcResult >> 8);
+    pReply[Command.ReplyLength++] = (uint8_t)(crcResult >> 16);
+    pReply[Command.ReplyLength++] = (uint8_t)(crcResult >> 24);
     
-    UartHandle.Init.BaudRate = 115200;
-    UartHandle.Init.Mode = HAL_UART_MODE_TX_RX;
-    UartHandle.Init.OverSampling = HAL_UART_OVERSAMPLING_16;
-    UartHandle.Init.Parity = HAL_UART_PARITY_NONE;
-    UartHandle.Init.StopBits = HAL_UART_STOP_1;
-    UartHandle.Init.WordLength = HAL_UART_WORD8;
-    UartHandle.Instance = USART2;
+    Command.Sector++;
+    if(Command.Sector < Command.EndSector)
+    {
+        // Every sector gets the full CRC time
+        Command.OperationStart = HAL_DWT_CYCLES();
+        HAL_CRC_Calculate_DMA(&DmaCrcHandle, 
+                              (const uint32_t *)HAL_Flash_GetSectorAddress(Command.Sector), 
+                              HAL_Flash_GetSectorSize(Command.Sector) / 4);
+        StateDeadline = HAL_SysTick_Deadline(CRC_TIMEOUT_MS);
+        return STATE_SECTOR_CRC;
+    }
     
-    HAL_RCC_USART2_CLK_ENABLE();
-    HAL_UART_Init(&UartHandle);
+    return SectorCrc_Reply();
 }
 
-/*! \brief Sends an ACKnowledge byte to the host.
- *  
- *  \param  *UartHandle The UART handle
+/*! \brief The CRC did not complete in time: the remaining sectors are
+ *  reported as 0.
+ *
+ *  \retval STATE       The next state
  */
-static void Send_ACK(UART_HandleTypeDef *handle)
+static STATE Timeout_SectorCrc(void)
 {
-    uint8_t msg[2] = {ACK, ACK};
+    HAL_DMA_Abort(&DmaCrcHandle);
+    for(; Command.Sector < Command.EndSector; Command.Sector++)
+    {
+        pReply[Command.ReplyLength++] = 0;
+        pReply[Command.ReplyLength++] = 0;
+        pReply[Command.ReplyLength++] = 0;
+        pReply[Command.ReplyLength++] = 0;
+    }
     
-    HAL_UART_Tx(handle, msg, 2);
+    return SectorCrc_Reply();
 }
 
-/*! \brief Sends an NACKnowledge byte to the host.
- *  
- *  \param  *UartHandle The UART handle
+/*! \brief Sends the sector CRC reply
+ *
+ *  \retval STATE       The next state
  */
-static void Send_NACK(UART_HandleTypeDef *handle)
+static STATE SectorCrc_Reply(void)
 {
-    uint8_t msg[2] = {NACK, NACK};
+    HAL_RCC_DMA2_CLK_DISABLE();
+    HAL_RCC_CRC_CLK_DISABLE();
     
-    HAL_UART_Tx(handle, msg, 2);
+    pReply[Command.ReplyLength] = CalculateChecksum(pReply, Command.ReplyLength);
+    Link_Send(pReply, Command.ReplyLength + 1);
+    return STATE_COMMAND;
 }
 
-/*! \brief Validates the checksum of the message.
- *  Validates the received message through a simple checksum.
+/*! \brief Read: receives the range to read and starts the CRC of its first
+ *  frame
  *
- *  Each byte of the message (including the received checksum) is XOR'd with 
- *  the previously calculated checksum value. The result should be 0x00.
- *  Note: The first byte of the message is XOR'd with an initial value of 0xFF
- *  
- *  \param  *pBuffer    The buffer where the message is stored.
- *  \param  len         The length of the message;
- *  \retval uint8_t     The result of the validation. 1 = OK. 0 = FAIL
+ *  Request: | Address (4) | Length (4) | Checksum (1) |
+ *  Reply:   | ACK (2) | Frames ... |
+ *  Frame:   | Data (1 to READ_FRAME_SIZE) | CRC (4) |
+ *
+ *  The range is word aligned and inside the flash. Every frame but the last
+ *  holds READ_FRAME_SIZE bytes, and ends with the hardware CRC of its data,
+ *  0 when the CRC could not be computed. The host reads a frame whose CRC
+ *  does not match again with another command.
+ *
+ *  \retval STATE       The next state
  */
-static uint8_t CheckChecksum(uint8_t *pBuffer, uint32_t len)
+static STATE Step_ReadRequest(void)
 {
-    uint8_t initial = 0xFF;
-    uint8_t result = 0x7F; /* some random result value */
+    uint32_t address = pRxBuffer[0] + (pRxBuffer[1] << 8) 
+                     + (pRxBuffer[2] << 16) + (pRxBuffer[3] << 24);
+    uint32_t length = pRxBuffer[4] + (pRxBuffer[5] << 8) 
+                    + (pRxBuffer[6] << 16) + (pRxBuffer[7] << 24);
     
-    result = initial ^ *pBuffer++;
-    len--;
-    while(len--)
+    if((CheckChecksum(pRxBuffer, 9) != 1) || (length == 0) ||
+       ((address % 4) != 0) || ((length % 4) != 0) ||
+       (address < FLASH_BASE) || (address > FLASH_END) ||
+       (length > (FLASH_END + 1U - address)))
     {
-        result ^= *pBuffer++;
+        Send_NACK(&UartHandle);
+        return STATE_COMMAND;
     }
+    Send_ACK(&UartHandle);
     
-    result ^= 0xFF;
+    Command.Address = address;
+    Command.NumBytes = length;
     
-    if(result == 0x00)
-    {
-        return 1;
-    }
-    else
-    {
-        return 0;
-    }
+    HAL_RCC_CRC_CLK_ENABLE();
+    HAL_RCC_DMA2_CLK_ENABLE();
+    DmaCrcHandle.Instance = DMA2_Stream0;
+    Read_StartFrame();
+    return STATE_READ_FRAME;
 }
 
-/*! \brief Erase flash function
+/*! \brief Sends a read frame once its CRC is computed, then starts the next
+ *  frame. One frame per pass keeps every step bounded however long the
+ *  range is.
+ *
+ *  \retval STATE       The next state
  */
-static void Erase(void)
+static STATE Step_ReadFrame(void)
 {
-    Flash_EraseInitTypeDef flashEraseConfig;
-    uint32_t sectorError;
+    uint32_t crcResult = 0;
+    uint8_t  crcStatus;
+    uint32_t frameBytes = (Command.NumBytes < READ_FRAME_SIZE) ? Command.NumBytes : READ_FRAME_SIZE;
     
-    // Receive the number of pages to be erased (1 byte)
-    // the initial sector to erase  (1 byte)
-    // and the checksum             (1 byte)
-    while(HAL_UART_Rx(&UartHandle, pRxBuffer, 3, TIMEOUT_VALUE) == HAL_UART_TIMEOUT);
-    // validate checksum
-    if(CheckChecksum(pRxBuffer, 3) != 1)
+    // The previous frame is still on its way, the frame waits for room
+    // rather than for the line. The line drains at any baud rate, so the
+    // deadline only counts the CRC
+    if(HAL_UART_Tx_DMA_Free(&UartHandle) < Link_LineBytes(frameBytes + 4U))
     {
-        Send_NACK(&UartHandle);
-        return;
+        StateDeadline = HAL_SysTick_Deadline(CRC_TIMEOUT_MS);
+        return STATE_READ_FRAME;
     }
     
-    if(pRxBuffer[0] == 0xFF)
+    crcStatus = HAL_CRC_DMA_Poll(&crcResult);
+    if(crcStatus == HAL_CRC_DMA_BUSY)
     {
-        // global erase: not supported
-        Send_NACK(&UartHandle);
+        return STATE_READ_FRAME;
     }
-    else
+    Stats_Record(STATS_CRC, Command.OperationStart);
+    if(crcStatus != HAL_CRC_DMA_DONE)
     {
-        // Sector erase:
-        flashEraseConfig.TypeErase = HAL_FLASH_TYPEERASE_SECTOR;
-        
-        // Set the number of sectors to erase
-        flashEraseConfig.NbSectors = pRxBuffer[0];
-        
-        // Set the initial sector to erase
-        flashEraseConfig.Sector = pRxBuffer[1];
-        
-        // perform erase
-        HAL_Flash_Unlock();
-        HAL_Flash_Erase(&flashEraseConfig, &sectorError);
-        HAL_Flash_Lock();
-        
-        Send_ACK(&UartHandle);
+        crcResult = 0;
+    }
+    
+    Link_Begin(frameBytes + 4U);
+    Link_Put((const uint8_t *)Command.Address, frameBytes);
+    Link_Put(pReply, Reply_PutWord(0, crcResult));
+    Link_End();
+    
+    Command.Address += frameBytes;
+    Command.NumBytes -= frameBytes;
+    if(Command.NumBytes > 0)
+    {
+        // Every frame gets the full CRC time
+        Read_StartFrame();
+        StateDeadline = HAL_SysTick_Deadline(CRC_TIMEOUT_MS);
+        return STATE_READ_FRAME;
     }
+    
+    HAL_RCC_DMA2_CLK_DISABLE();
+    HAL_RCC_CRC_CLK_DISABLE();
+    return STATE_COMMAND;
+}
+
+/*! \brief The CRC of a frame did not complete in time: the read stops, the
+ *  host times out on the missing frames and reads them again.
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Timeout_ReadFrame(void)
+{
+    HAL_DMA_Abort(&DmaCrcHandle);
+    HAL_RCC_DMA2_CLK_DISABLE();
+    HAL_RCC_CRC_CLK_DISABLE();
+    return STATE_COMMAND;
 }
 
+/*! \brief Starts the CRC of the next read frame
+ */
+static void Read_StartFrame(void)
+{
+    uint32_t frameBytes = (Command.NumBytes < READ_FRAME_SIZE) ? Command.NumBytes : READ_FRAME_SIZE;
+    
+    Command.OperationStart = HAL_DWT_CYCLES();
+    HAL_CRC_Calculate_DMA(&DmaCrcHandle, (const uint32_t *)Command.Address, frameBytes / 4);
+}
 
-/*! \brief Write flash function
+/*! \brief Baud rate negotiation function
+ *  Receives the baud rate proposed by the host. When it can be generated,
+ *  the proposal is ACKed at the current rate and both sides switch. The host
+ *  then confirms with a fresh handshake (ACK + checksum) at the new rate,
+ *  which is ACKed back. If the handshake fails or does not arrive within
+ *  BAUD_CONFIRM_TIMEOUT_MS, the bootloader falls back to DEFAULT_BAUD_RATE.
+ *
+ *  Proposal: | Baud rate (4) | Checksum (1) |
+ *
+ *  \retval STATE       The next state
  */
-static void Write(void)
+static STATE Step_BaudRequest(void)
 {
-    uint8_t numBytes;
-    uint32_t startingAddress = 0;
-    uint8_t i;
-    // Receive the starting address and checksum
-    // Address = 4 bytes
-    // Checksum = 1 byte
-    while(HAL_UART_Rx(&UartHandle, pRxBuffer, 5, TIMEOUT_VALUE) == HAL_UART_TIMEOUT);
+    uint32_t baud;
     
     // Check checksum
     if(CheckChecksum(pRxBuffer, 5) != 1)
     {
         // invalid checksum
         Send_NACK(&UartHandle);
-        return;
-    }
-    else
-    {
-        Send_ACK(&UartHandle);
+        return STATE_COMMAND;
     }
     
-    // Set the starting address
-    startingAddress = pRxBuffer[0] + (pRxBuffer[1] << 8) 
-                    + (pRxBuffer[2] << 16) + (pRxBuffer[3] << 24);
-    
-    // Receive the number of bytes to be written
-    while(HAL_UART_Rx(&UartHandle, pRxBuffer, 2, TIMEOUT_VALUE) == HAL_UART_TIMEOUT);
-    numBytes = pRxBuffer[0];
+    baud = pRxBuffer[0] + (pRxBuffer[1] << 8) 
+         + (pRxBuffer[2] << 16) + (pRxBuffer[3] << 24);
     
-    // Receive the data
-    while(HAL_UART_Rx(&UartHandle, pRxBuffer, numBytes+1, TIMEOUT_VALUE) == HAL_UART_TIMEOUT);
-    
-    // Check checksum of received data
-    if(CheckChecksum(pRxBuffer, 5) != 1)
+    if(HAL_UART_CheckBaudRate(&UartHandle, baud) != HAL_OK)
     {
-        // invalid checksum
+        // Rate cannot be generated from the USART clock
         Send_NACK(&UartHandle);
-        return;
+        return STATE_COMMAND;
     }
     
-    // valid checksum at this point
-    // Program flash with the data
-    i = 0;
-    HAL_Flash_Unlock();
-    while(numBytes--)
+    // Accept at the current rate, then switch
+    Send_ACK(&UartHandle);
+    HAL_UART_ChangeBaudRate(&UartHandle, baud);
+    Link_Reset();
+    return STATE_BAUD_CONFIRM;
+}
+
+/*! \brief Baud rate negotiation function: checks the handshake at the new
+ *  rate
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_BaudConfirm(void)
+{
+    if((CheckChecksum(pRxBuffer, 2) != 1) || (pRxBuffer[0] != ACK))
     {
-        HAL_Flash_Program(FLASH_TYPEPROGRAM_BYTE, startingAddress, pRxBuffer[i]);
-        startingAddress++;
-        i++; 
+        return Timeout_BaudConfirm();
     }
-    HAL_Flash_Lock();
     
-    // Send ACK
     Send_ACK(&UartHandle);
+    return STATE_COMMAND;
 }
 
-/*! \brief Check flashed image
+/*! \brief No valid handshake at the new rate: fall back to the default rate
+ *
+ *  \retval STATE       The next state
  */
-static void Check(void)
+static STATE Timeout_BaudConfirm(void)
 {
-    uint32_t startingAddress = 0;
-    uint32_t endingAddress = 0;
-    uint32_t address;
-    uint32_t *data;
-    uint32_t crcResult;
-    
-    // Receive the starting address and checksum
-    // Address = 4 bytes
-    // Checksum = 1 byte
-    while(HAL_UART_Rx(&UartHandle, pRxBuffer, 5, TIMEOUT_VALUE) == HAL_UART_TIMEOUT);
+    HAL_UART_ChangeBaudRate(&UartHandle, DEFAULT_BAUD_RATE);
+    Link_Reset();
+    return STATE_COMMAND;
+}
+
+/*! \brief Selects the frame layer for the rest of the session. The ACK
+ *  of the command is the last unframed message: from here on, every
+ *  message of both sides travels in a frame with its length and CRC, see
+ *  Link_Receive.
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_SetFraming(void)
+{
+    Link_Reset();
+    Link.Framed = 1;
+    return STATE_COMMAND;
+}
+
+/*! \brief Jumps to the application, or returns to the command state when
+ *  there is none
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_Jump(void)
+{
+    JumpToApplication();
+    return STATE_COMMAND;
+}
+
+/*! \brief Reports the protocol timeouts, so the host can size its own
+ *  timers from the target's deadlines
+ *
+ *  Reply: | ACK (2) | Hookup (2) | Message receive (2) | Sector erase (2) |
+ *         | CRC (2) | Baud rate confirmation (2) | Checksum (1) |
+ *
+ *  Each timeout is in milliseconds, least significant byte first.
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_GetTimeouts(void)
+{
+    uint32_t i;
+    uint32_t len = 0;
     
-    // Check checksum
-    if(CheckChecksum(pRxBuffer, 5) != 1)
-    {
-        // invalid checksum
-        Send_NACK(&UartHandle);
-        return;
-    }
-    else
+    for(i = 0; i < (sizeof(ProtocolTimeouts) / sizeof(ProtocolTimeouts[0])); i++)
     {
-        Send_ACK(&UartHandle);
+        pReply[len++] = (uint8_t)(ProtocolTimeouts[i]);
+        pReply[len++] = (uint8_t)(ProtocolTimeouts[i] >> 8);
     }
     
-    // Set the starting address
-    startingAddress = pRxBuffer[0] + (pRxBuffer[1] << 8) 
-                    + (pRxBuffer[2] << 16) + (pRxBuffer[3] << 24);
-    
-    // Receive the ending address and checksum
-    // Address = 4 bytes
-    // Checksum = 1 byte
-    while(HAL_UART_Rx(&UartHandle, pRxBuffer, 5, TIMEOUT_VALUE) == HAL_UART_TIMEOUT);
+    pReply[len] = CalculateChecksum(pReply, len);
+    Link_Send(pReply, len + 1);
+    return STATE_COMMAND;
+}
+
+/*! \brief Reports the profile of the bootloader phases, so the host can
+ *  see where the time of an update goes. The profile covers the session
+ *  since the bootloader started or since it was last cleared.
+ *
+ *  Request: | Clear after reading (1) | Checksum (1) |
+ *  Reply:   | ACK (2) | Core clock in Hz (4) | Idle cycles (8) |
+ *           | Flash wait cycles (4) | Number of phases (1) |
+ *           | Phases ... | Checksum (1) |
+ *  Phase:   | Count (4) | Total cycles (8) | Min cycles (4) |
+ *           | Max cycles (4) | Histogram (4 x STATS_HISTOGRAM_BINS) |
+ *
+ *  The phases are in STATS_PHASE order, every value is least significant
+ *  byte first. The idle cycles are the passes spent waiting for the host.
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_GetStats(void)
+{
+    uint32_t i;
+    uint32_t bin;
+    uint32_t len = 0;
     
-    // Check checksum
-    if(CheckChecksum(pRxBuffer, 5) != 1)
+    if(CheckChecksum(pRxBuffer, 2) != 1)
     {
-        // invalid checksum
         Send_NACK(&UartHandle);
-        return;
-    }
-    else
-    {
-        Send_ACK(&UartHandle);
+        return STATE_COMMAND;
     }
     
-    // Set the starting address
-    endingAddress = pRxBuffer[0] + (pRxBuffer[1] << 8) 
-                    + (pRxBuffer[2] << 16) + (pRxBuffer[3] << 24);
+    len = Reply_PutWord(len, SystemCoreClock);
+    len = Reply_PutWord(len, (uint32_t)StatsIdleCycles);
+    len = Reply_PutWord(len, (uint32_t)(StatsIdleCycles >> 32));
+    len = Reply_PutWord(len, HAL_Flash_WaitCycles);
+    pReply[len++] = STATS_PHASE_COUNT;
     
-    HAL_RCC_CRC_CLK_ENABLE();
-    data = (uint32_t *)((__IO uint32_t*) startingAddress);
-    for(address = startingAddress; address < endingAddress; address += 4)
+    for(i = 0; i < STATS_PHASE_COUNT; i++)
     {
-        data = (uint32_t *)((__IO uint32_t*) address);
-        crcResult = HAL_CRC_Accumulate(data, 1);
+        len = Reply_PutWord(len, Stats[i].Count);
+        len = Reply_PutWord(len, (uint32_t)Stats[i].TotalCycles);
+        len = Reply_PutWord(len, (uint32_t)(Stats[i].TotalCycles >> 32));
+        len = Reply_PutWord(len, Stats[i].MinCycles);
+        len = Reply_PutWord(len, Stats[i].MaxCycles);
+        for(bin = 0; bin < STATS_HISTOGRAM_BINS; bin++)
+        {
+            len = Reply_PutWord(len, Stats[i].Histogram[bin]);
+        }
     }
     
-    HAL_RCC_CRC_CLK_DISABLE();
-    if(crcResult == 0x00)
+    if(pRxBuffer[0] != 0)
     {
-        Send_ACK(&UartHandle);
+        Stats_Clear();
     }
-    else
+    
+    pReply[len] = CalculateChecksum(pReply, len);
+    Link_Send(pReply, len + 1);
+    return STATE_COMMAND;
+}
+
+/*! \brief Appends a little endian word to pReply
+ *
+ *  \param  len         Bytes of pReply filled so far
+ *  \param  value       The word
+ *  \retval uint32_t    Bytes of pReply filled with the word
+ */
+static uint32_t Reply_PutWord(uint32_t len, uint32_t value)
+{
+    pReply[len++] = (uint8_t)(value);
+    pReply[len++] = (uint8_t)(value >> 8);
+    pReply[len++] = (uint8_t)(value >> 16);
+    pReply[len++] = (uint8_t)(value >> 24);
+    return len;
+}
+
+/*! \brief Reports the application slots, so the host can send an image
+ *  linked for a slot that is not active
+ *
+ *  Reply: | ACK (2) | Active slot (1) | Number of slots (1) |
+ *         | Slots ... | Checksum (1) |
+ *  Slot:  | Start address (4) | End address (4) | Valid (1) |
+ *
+ *  The active slot is the one started on reset, 0xFF when no slot holds
+ *  an application. Valid is 1 when the slot holds an application.
+ *
+ *  \retval STATE       The next state
+ */
+static STATE Step_GetSlots(void)
+{
+    uint32_t slot;
+    uint32_t len = 0;
+    
+    pReply[len++] = (uint8_t)ActiveSlot;
+    pReply[len++] = SLOT_COUNT;
+    for(slot = 0; slot < SLOT_COUNT; slot++)
     {
-        Send_NACK(&UartHandle);
+        len = Reply_PutWord(len, SlotTable[slot].Start);
+        len = Reply_PutWord(len, SlotTable[slot].End);
+        pReply[len++] = Slot_IsValid(slot);
     }
     
-    JumpToApplication();
+    pReply[len] = CalculateChecksum(pReply, len);
+    Link_Send(pReply, len + 1);
+    return STATE_COMMAND;
 }
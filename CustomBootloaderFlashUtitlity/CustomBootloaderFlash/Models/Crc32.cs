@@ -0,0 +1,66 @@
+﻿using System;
+
+namespace CustomBootloaderFlash.Models
+{
+    /// <summary>
+    /// CRC-32 as computed by the STM32 CRC unit: polynomial 0x04C11DB7, initial
+    /// value 0xFFFFFFFF, 32-bit words fed most significant bit first, no
+    /// reflection and no final XOR
+    /// </summary>
+    public static class Crc32
+    {
+        #region Private Fields
+        private const uint Polynomial = 0x04C11DB7;
+
+        /// <summary>
+        /// CRC of every byte value, for byte-wise processing
+        /// </summary>
+        private static readonly uint[] _table = CreateTable();
+        #endregion
+
+        #region Public Functions
+        /// <summary>
+        /// Computes the CRC the target computes over the same flash words
+        /// </summary>
+        /// <param name="data"></param>
+        /// <param name="offset"></param>
+        /// <param name="count">number of bytes, a multiple of 4</param>
+        /// <returns>the 32-bit CRC</returns>
+        public static uint Stm32(byte[] data, int offset, int count)
+        {
+            uint crc = 0xFFFFFFFF;
+
+            for (int i = offset; i < offset + count; i += 4)
+            {
+                // Words are read little endian from flash and fed MSB first
+                uint word = BitConverter.ToUInt32(data, i);
+                for (int shift = 24; shift >= 0; shift -= 8)
+                {
+                    crc = (crc << 8) ^ _table[((crc >> 24) ^ (word >> shift)) & 0xFF];
+                }
+            }
+
+            return crc;
+        }
+        #endregion
+
+        #region Private Functions
+        private static uint[] CreateTable()
+        {
+            uint[] table = new uint[256];
+
+            for (uint i = 0; i < 256; i++)
+            {
+                uint crc = i << 24;
+                for (int bit = 0; bit < 8; bit++)
+                {
+                    crc = ((crc & 0x80000000) != 0) ? (crc << 1) ^ Polynomial : crc << 1;
+                }
+                table[i] = crc;
+            }
+
+            return table;
+        }
+        #endregion
+    }
+}
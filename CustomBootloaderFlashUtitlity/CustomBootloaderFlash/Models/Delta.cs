@@ -0,0 +1,251 @@
+﻿using System;
+using System.Collections.Generic;
+
+namespace CustomBootloaderFlash.Models
+{
+    /// <summary>
+    /// Delta encoder: describes each block of a new image as copies from the image the
+    /// target already runs (the base) and added bytes. The target rebuilds a block from
+    /// its patch alone, reading the base from its active slot.
+    /// The new image goes to another slot than the base and is linked for it, so the
+    /// base is also matched with the words that point into its slot relocated to the
+    /// new slot, which the target reproduces with COPY_RELOC.
+    /// </summary>
+    public class Delta
+    {
+        #region Public Fields
+        /// <summary>
+        /// Op (1), length (2), base offset (4): bytes of the base
+        /// </summary>
+        public const byte OpCopy = 0x00;
+
+        /// <summary>
+        /// Op (1), length (2), base offset (4): words of the base, relocated
+        /// </summary>
+        public const byte OpCopyReloc = 0x01;
+
+        /// <summary>
+        /// Op (1), length (2), bytes
+        /// </summary>
+        public const byte OpAdd = 0x02;
+        #endregion
+
+        #region Private Fields
+        /// <summary>
+        /// Size of the op and length of every op
+        /// </summary>
+        private const int OpSize = 3;
+
+        /// <summary>
+        /// Size of a copy op
+        /// </summary>
+        private const int CopySize = OpSize + 4;
+
+        /// <summary>
+        /// Bytes hashed to find a match, shorter matches cost more than they save
+        /// </summary>
+        private const int MinMatch = 8;
+
+        /// <summary>
+        /// Candidates kept for each hashed sequence of the base
+        /// </summary>
+        private const int MaxCandidates = 8;
+
+        private readonly byte[] _base;
+        private readonly byte[] _relocated;
+        private readonly Dictionary<ulong, List<int>> _baseIndex;
+        private readonly Dictionary<ulong, List<int>> _relocatedIndex;
+
+        /// <summary>
+        /// Base offset following the last copy, tried first: unchanged code is usually
+        /// copied in order
+        /// </summary>
+        private int _nextOffset = 0;
+        private byte _nextOp = OpCopy;
+        #endregion
+
+        #region Constructors
+        /// <summary>
+        /// Indexes the base image
+        /// </summary>
+        /// <param name="baseImage">The image of the base slot</param>
+        /// <param name="baseStart">Start address of the base slot</param>
+        /// <param name="baseEnd">End address of the base slot</param>
+        /// <param name="newStart">Start address of the slot the new image goes to</param>
+        public Delta(byte[] baseImage, Int32 baseStart, Int32 baseEnd, Int32 newStart)
+        {
+            _base = baseImage;
+            _relocated = (byte[])baseImage.Clone();
+            for (int offset = 0; offset + 4 <= _relocated.Length; offset += 4)
+            {
+                UInt32 word = BitConverter.ToUInt32(_relocated, offset);
+                if (word >= (UInt32)baseStart && word < (UInt32)baseEnd)
+                {
+                    BitConverter.GetBytes(word - (UInt32)baseStart + (UInt32)newStart).CopyTo(_relocated, offset);
+                }
+            }
+
+            _baseIndex = CreateIndex(_base);
+            _relocatedIndex = CreateIndex(_relocated);
+        }
+        #endregion
+
+        #region Public Functions
+        /// <summary>
+        /// Encodes one block of the new image. Blocks are encoded in order, so
+        /// copies can follow on from the previous block.
+        /// </summary>
+        /// <param name="image">The new image</param>
+        /// <param name="offset">Offset of the block, a multiple of 4</param>
+        /// <param name="count">Length of the block</param>
+        /// <returns>the patch, never longer than the block in one ADD</returns>
+        public byte[] Encode(byte[] image, int offset, int count)
+        {
+            List<byte> patch = new List<byte>();
+            int end = offset + count;
+            int addStart = offset;
+            int pos = offset;
+
+            while (pos < end)
+            {
+                byte op;
+                int baseOffset;
+                int length = FindMatch(image, pos, end, out op, out baseOffset);
+                if (length == 0)
+                {
+                    pos = Math.Min(pos + 4, end);
+                    continue;
+                }
+
+                AddBytes(patch, image, addStart, pos - addStart);
+                patch.Add(op);
+                patch.AddRange(BitConverter.GetBytes((UInt16)length));
+                patch.AddRange(BitConverter.GetBytes(baseOffset));
+                pos += length;
+                addStart = pos;
+                _nextOffset = baseOffset + length;
+                _nextOp = op;
+            }
+            AddBytes(patch, image, addStart, end - addStart);
+
+            if (patch.Count > OpSize + count)
+            {
+                patch.Clear();
+                AddBytes(patch, image, offset, count);
+            }
+            return patch.ToArray();
+        }
+        #endregion
+
+        #region Private Functions
+        /// <summary>
+        /// Indexes every word aligned sequence of MinMatch bytes
+        /// </summary>
+        private static Dictionary<ulong, List<int>> CreateIndex(byte[] data)
+        {
+            Dictionary<ulong, List<int>> index = new Dictionary<ulong, List<int>>();
+
+            for (int offset = 0; offset + MinMatch <= data.Length; offset += 4)
+            {
+                ulong key = BitConverter.ToUInt64(data, offset);
+                List<int> candidates;
+                if (!index.TryGetValue(key, out candidates))
+                {
+                    candidates = new List<int>();
+                    index.Add(key, candidates);
+                }
+                if (candidates.Count < MaxCandidates)
+                {
+                    candidates.Add(offset);
+                }
+            }
+
+            return index;
+        }
+
+        /// <summary>
+        /// Finds the longest copy of the base or relocated base at a position of the
+        /// new image. Copies are whole words, except for the end of the block.
+        /// </summary>
+        /// <returns>the length of the copy, 0 if there is none worth an op</returns>
+        private int FindMatch(byte[] image, int pos, int end, out byte op, out int baseOffset)
+        {
+            op = OpCopy;
+            baseOffset = 0;
+            int best = 0;
+
+            // Continuing the last copy is tried first, then the indexed sequences
+            TryMatch(image, pos, end, _nextOp, _nextOffset, ref best, ref op, ref baseOffset);
+            if (pos + MinMatch <= end)
+            {
+                ulong key = BitConverter.ToUInt64(image, pos);
+                List<int> candidates;
+                if (_baseIndex.TryGetValue(key, out candidates))
+                {
+                    foreach (int candidate in candidates)
+                    {
+                        TryMatch(image, pos, end, OpCopy, candidate, ref best, ref op, ref baseOffset);
+                    }
+                }
+                if (_relocatedIndex.TryGetValue(key, out candidates))
+                {
+                    foreach (int candidate in candidates)
+                    {
+                        TryMatch(image, pos, end, OpCopyReloc, candidate, ref best, ref op, ref baseOffset);
+                    }
+                }
+            }
+
+            return best >= MinMatch || (best > 0 && pos + best == end && best > CopySize) ? best : 0;
+        }
+
+        /// <summary>
+        /// Measures a copy from one base offset and keeps it if it is the longest
+        /// </summary>
+        private void TryMatch(byte[] image, int pos, int end, byte candidateOp, int candidateOffset,
+                              ref int best, ref byte op, ref int baseOffset)
+        {
+            byte[] source = (candidateOp == OpCopyReloc) ? _relocated : _base;
+            int length = 0;
+            int max = Math.Min(Math.Min(end - pos, source.Length - candidateOffset), UInt16.MaxValue);
+
+            while (length < max && image[pos + length] == source[candidateOffset + length])
+            {
+                length++;
+            }
+
+            // Relocated copies are whole words, other copies only end mid-word at the
+            // end of the block, so the next position stays word aligned
+            if (candidateOp == OpCopyReloc || pos + length != end)
+            {
+                length &= ~3;
+            }
+
+            if (length > best)
+            {
+                best = length;
+                op = candidateOp;
+                baseOffset = candidateOffset;
+            }
+        }
+
+        /// <summary>
+        /// Appends an ADD op for a range of the new image, if it is not empty
+        /// </summary>
+        private static void AddBytes(List<byte> patch, byte[] image, int offset, int count)
+        {
+            if (count == 0)
+            {
+                return;
+            }
+
+            patch.Add(OpAdd);
+            patch.AddRange(BitConverter.GetBytes((UInt16)count));
+            for (int i = offset; i < offset + count; i++)
+            {
+                patch.Add(image[i]);
+            }
+        }
+        #endregion
+    }
+}
@@ -0,0 +1,127 @@
+﻿using System;
+
+namespace CustomBootloaderFlash.Models
+{
+    /// <summary>
+    /// The header at the start of an application image: magic, header size, version,
+    /// length, CRC, entry point, load address and the CRC of these words. The vector
+    /// table follows at HeaderSize. The application links the header with the magic,
+    /// header size, version and load address, and the post-link tool fills in the rest.
+    /// </summary>
+    public class ImageHeader
+    {
+        #region Public Fields
+        /// <summary>
+        /// "IMGH"
+        /// </summary>
+        public const uint Magic = 0x48474D49;
+
+        /// <summary>
+        /// Bytes of the header fields
+        /// </summary>
+        public const int Size = 32;
+
+        /// <summary>
+        /// VTOR alignment of the vector table that follows the header
+        /// </summary>
+        public const int VectorAlign = 0x200;
+        #endregion
+
+        #region Public Properties
+        public int HeaderSize { get; private set; }
+        public uint Version { get; private set; }
+
+        /// <summary>
+        /// Bytes of the image, header included
+        /// </summary>
+        public int Length { get; private set; }
+
+        /// <summary>
+        /// CRC of the bytes after the header
+        /// </summary>
+        public uint Crc { get; private set; }
+        public uint EntryPoint { get; private set; }
+        public Int32 LoadAddress { get; private set; }
+        #endregion
+
+        #region Public Functions
+        /// <summary>
+        /// Reads the header of an image, as the target validates it
+        /// </summary>
+        /// <param name="bin">The image</param>
+        /// <returns>the header, or null for an image without a valid header</returns>
+        public static ImageHeader Parse(byte[] bin)
+        {
+            ImageHeader header = ParseHeaderOnly(bin);
+            return (header != null && header.Length <= bin.Length) ? header : null;
+        }
+
+        /// <summary>
+        /// Reads a header without the image it describes, as read back from the start
+        /// of a slot
+        /// </summary>
+        /// <param name="bin">The header, or the start of an image</param>
+        /// <returns>the header, or null for a header that is not valid</returns>
+        public static ImageHeader ParseHeaderOnly(byte[] bin)
+        {
+            if (bin.Length < Size || BitConverter.ToUInt32(bin, 0) != Magic ||
+                BitConverter.ToUInt32(bin, Size - 4) != Crc32.Stm32(bin, 0, Size - 4))
+            {
+                return null;
+            }
+
+            var header = new ImageHeader
+            {
+                HeaderSize = BitConverter.ToInt32(bin, 4),
+                Version = BitConverter.ToUInt32(bin, 8),
+                Length = BitConverter.ToInt32(bin, 12),
+                Crc = BitConverter.ToUInt32(bin, 16),
+                EntryPoint = BitConverter.ToUInt32(bin, 20),
+                LoadAddress = BitConverter.ToInt32(bin, 24),
+            };
+            if (header.HeaderSize < Size || header.HeaderSize % VectorAlign != 0 ||
+                header.Length <= header.HeaderSize || header.Length % 4 != 0)
+            {
+                return null;
+            }
+
+            return header;
+        }
+
+        /// <summary>
+        /// Fills in the header the application linked at the start of its image: the
+        /// length, the CRC of the bytes after the header, the entry point from the vector
+        /// table and the header CRC. The image is padded with 0xFF to whole words.
+        /// </summary>
+        /// <param name="bin">The linked image</param>
+        /// <returns>the image with its header filled in</returns>
+        public static byte[] Fill(byte[] bin)
+        {
+            if (bin.Length < Size || BitConverter.ToUInt32(bin, 0) != Magic)
+            {
+                throw new ArgumentException("The image does not start with an image header");
+            }
+
+            int headerSize = BitConverter.ToInt32(bin, 4);
+            if (headerSize < Size || headerSize % VectorAlign != 0 || bin.Length < headerSize + 8)
+            {
+                throw new ArgumentException($"Invalid header size 0x{headerSize:X}");
+            }
+
+            byte[] image = new byte[(bin.Length + 3) & ~3];
+            Array.Copy(bin, image, bin.Length);
+            for (int i = bin.Length; i < image.Length; i++)
+            {
+                image[i] = 0xFF;
+            }
+
+            BitConverter.GetBytes(image.Length).CopyTo(image, 12);
+            BitConverter.GetBytes(Crc32.Stm32(image, headerSize, image.Length - headerSize)).CopyTo(image, 16);
+            BitConverter.GetBytes(BitConverter.ToUInt32(image, headerSize + 4)).CopyTo(image, 20);
+            BitConverter.GetBytes(Crc32.Stm32(image, 0, Size - 4)).CopyTo(image, Size - 4);
+
+            return image;
+        }
+        #endregion
+    }
+}
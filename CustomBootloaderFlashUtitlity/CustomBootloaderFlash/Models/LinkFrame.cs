@@ -0,0 +1,138 @@
+﻿using System;
+using System.Collections.Generic;
+
+namespace CustomBootloaderFlash.Models
+{
+    /// <summary>
+    /// Frame layer of the link once framing is on: every message is sent as
+    /// 0x00 | COBS(length (2) | payload | CRC-16 (2)) | 0x00. COBS leaves no zero
+    /// inside a frame, so a receiver always finds the start of the next frame,
+    /// and the CRC-16/CCITT-FALSE of the length and payload drops a damaged one.
+    /// </summary>
+    public static class LinkFrame
+    {
+        #region Public Fields
+        /// <summary>
+        /// Byte between frames, never found inside one
+        /// </summary>
+        public const byte Delimiter = 0x00;
+        #endregion
+
+        #region Private Fields
+        /// <summary>
+        /// Code of a block of 254 bytes not followed by a zero
+        /// </summary>
+        private const byte CobsFull = 0xFF;
+
+        /// <summary>
+        /// Size of the length and of the CRC
+        /// </summary>
+        private const int HeaderSize = 2;
+        private const int CrcSize = 2;
+        #endregion
+
+        #region Public Functions
+        /// <summary>
+        /// Encodes a message into a frame, delimiters included
+        /// </summary>
+        /// <param name="data"></param>
+        /// <param name="offset"></param>
+        /// <param name="count"></param>
+        /// <returns>the frame to send</returns>
+        public static byte[] Encode(byte[] data, int offset, int count)
+        {
+            byte[] raw = new byte[HeaderSize + count + CrcSize];
+            BitConverter.GetBytes((UInt16)count).CopyTo(raw, 0);
+            Array.Copy(data, offset, raw, HeaderSize, count);
+            BitConverter.GetBytes(Crc16(raw, 0, HeaderSize + count)).CopyTo(raw, HeaderSize + count);
+
+            List<byte> frame = new List<byte>(raw.Length + raw.Length / 254 + 3);
+            frame.Add(Delimiter);
+            int codeIndex = frame.Count;
+            frame.Add(0);
+            foreach (byte b in raw)
+            {
+                if (b != 0)
+                {
+                    frame.Add(b);
+                }
+                if (b == 0 || frame.Count - codeIndex == CobsFull)
+                {
+                    frame[codeIndex] = (byte)(frame.Count - codeIndex);
+                    codeIndex = frame.Count;
+                    frame.Add(0);
+                }
+            }
+            frame[codeIndex] = (byte)(frame.Count - codeIndex);
+            frame.Add(Delimiter);
+
+            return frame.ToArray();
+        }
+
+        /// <summary>
+        /// Decodes the bytes between two delimiters
+        /// </summary>
+        /// <param name="encoded">The frame without its delimiters</param>
+        /// <returns>the message, or null for a frame that fails its check</returns>
+        public static byte[] Decode(byte[] encoded)
+        {
+            List<byte> raw = new List<byte>(encoded.Length);
+            int i = 0;
+
+            while (i < encoded.Length)
+            {
+                int code = encoded[i++];
+                if (code == 0 || i + code - 1 > encoded.Length)
+                {
+                    return null;
+                }
+                for (int j = 1; j < code; j++)
+                {
+                    raw.Add(encoded[i++]);
+                }
+                if (code != CobsFull && i < encoded.Length)
+                {
+                    raw.Add(0);
+                }
+            }
+
+            if (raw.Count < HeaderSize + CrcSize)
+            {
+                return null;
+            }
+
+            byte[] frame = raw.ToArray();
+            int count = BitConverter.ToUInt16(frame, 0);
+            if (count != frame.Length - HeaderSize - CrcSize ||
+                BitConverter.ToUInt16(frame, HeaderSize + count) != Crc16(frame, 0, HeaderSize + count))
+            {
+                return null;
+            }
+
+            byte[] message = new byte[count];
+            Array.Copy(frame, HeaderSize, message, 0, count);
+            return message;
+        }
+        #endregion
+
+        #region Private Functions
+        /// <summary>
+        /// CRC-16/CCITT-FALSE: polynomial 0x1021, initial value 0xFFFF, no
+        /// reflection and no final XOR, computed without a table as the target does
+        /// </summary>
+        private static UInt16 Crc16(byte[] data, int offset, int count)
+        {
+            int crc = 0xFFFF;
+
+            for (int i = offset; i < offset + count; i++)
+            {
+                int x = ((crc >> 8) ^ data[i]) & 0xFF;
+                x ^= x >> 4;
+                crc = ((crc << 8) ^ (x << 12) ^ (x << 5) ^ x) & 0xFFFF;
+            }
+
+            return (UInt16)crc;
+        }
+        #endregion
+    }
+}
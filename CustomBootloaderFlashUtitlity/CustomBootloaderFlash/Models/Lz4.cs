@@ -0,0 +1,149 @@
+﻿using System;
+using System.Collections.Generic;
+
+namespace CustomBootloaderFlash.Models
+{
+    /// <summary>
+    /// LZ4 block compressor (raw block format, no frame header).
+    /// Every block is compressed on its own so the target can decode it with a
+    /// buffer of one block.
+    /// </summary>
+    public static class Lz4
+    {
+        #region Private Fields
+        /// <summary>
+        /// Minimum length of a match
+        /// </summary>
+        private const int MinMatch = 4;
+
+        /// <summary>
+        /// The last bytes of a block are always literals
+        /// </summary>
+        private const int LastLiterals = 5;
+
+        /// <summary>
+        /// The last match has to start at least this many bytes before the end of the block
+        /// </summary>
+        private const int MatchFindLimit = 12;
+
+        /// <summary>
+        /// Number of bits of the hash table index
+        /// </summary>
+        private const int HashLog = 12;
+
+        /// <summary>
+        /// Largest offset a match can refer back to
+        /// </summary>
+        private const int MaxOffset = 65535;
+        #endregion
+
+        #region Public Functions
+        /// <summary>
+        /// Returns the worst case compressed size of a block
+        /// </summary>
+        /// <param name="count">size of the uncompressed block</param>
+        public static int MaxCompressedSize(int count)
+        {
+            return count + count / 255 + 16;
+        }
+
+        /// <summary>
+        /// Compresses one block with a greedy single-probe hash match finder
+        /// </summary>
+        /// <param name="src"></param>
+        /// <param name="offset"></param>
+        /// <param name="count"></param>
+        /// <returns>the compressed block</returns>
+        public static byte[] Compress(byte[] src, int offset, int count)
+        {
+            List<byte> dst = new List<byte>(MaxCompressedSize(count));
+            int[] hashTable = new int[1 << HashLog];
+            int end = offset + count;
+            int matchLimit = end - LastLiterals;
+            int anchor = offset;
+            int pos = offset;
+
+            for (int i = 0; i < hashTable.Length; i++)
+            {
+                hashTable[i] = -1;
+            }
+
+            while (pos <= end - MatchFindLimit)
+            {
+                uint sequence = BitConverter.ToUInt32(src, pos);
+                int hash = (int)((sequence * 2654435761U) >> (32 - HashLog));
+                int candidate = hashTable[hash];
+                hashTable[hash] = pos;
+
+                if (candidate < 0 || pos - candidate > MaxOffset ||
+                    BitConverter.ToUInt32(src, candidate) != sequence)
+                {
+                    pos++;
+                    continue;
+                }
+
+                int matchLength = MinMatch;
+                while (pos + matchLength < matchLimit && src[candidate + matchLength] == src[pos + matchLength])
+                {
+                    matchLength++;
+                }
+
+                // Sequence: token, literals, offset, match length
+                WriteToken(dst, pos - anchor, matchLength - MinMatch);
+                WriteLength(dst, pos - anchor);
+                AddRange(dst, src, anchor, pos - anchor);
+                dst.Add((byte)(pos - candidate));
+                dst.Add((byte)((pos - candidate) >> 8));
+                WriteLength(dst, matchLength - MinMatch);
+
+                pos += matchLength;
+                anchor = pos;
+            }
+
+            // Last sequence: literals only
+            WriteToken(dst, end - anchor, 0);
+            WriteLength(dst, end - anchor);
+            AddRange(dst, src, anchor, end - anchor);
+
+            return dst.ToArray();
+        }
+        #endregion
+
+        #region Private Functions
+        /// <summary>
+        /// Writes the token with both 4-bit length fields
+        /// </summary>
+        private static void WriteToken(List<byte> dst, int literalLength, int matchLength)
+        {
+            dst.Add((byte)((Math.Min(literalLength, 15) << 4) | Math.Min(matchLength, 15)));
+        }
+
+        /// <summary>
+        /// Writes the extension bytes of a length that does not fit in its token field
+        /// </summary>
+        private static void WriteLength(List<byte> dst, int length)
+        {
+            if (length < 15)
+            {
+                return;
+            }
+
+            length -= 15;
+            while (length >= 255)
+            {
+                dst.Add(255);
+                length -= 255;
+            }
+            dst.Add((byte)length);
+        }
+
+        private static void AddRange(List<byte> dst, byte[] src, int offset, int count)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                dst.Add(src[offset + i]);
+            }
+        }
+        #endregion
+    }
+}
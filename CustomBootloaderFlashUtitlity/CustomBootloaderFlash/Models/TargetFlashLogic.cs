@@ -4,6 +4,7 @@ using System.Collections.Generic;
 using System.IO.Ports;
 using System.Linq;
 using System.Text;
+using System.Threading;
 using System.Threading.Tasks;
 using System.Linq;
 using System.ComponentModel;
@@ -56,6 +57,23 @@ namespace CustomBootloaderFlash.Models
         public bool IsFlashInProgress { get; set; } = false;
 
         public string FileLocation { get; set; }
+
+        /// <summary>
+        /// Sends the image as LZ4 compressed blocks that the target decompresses
+        /// </summary>
+        public bool UseCompression { get; set; } = true;
+
+        /// <summary>
+        /// The image the target currently runs. When it is set and the target still
+        /// holds it, the new image is sent as a patch against it.
+        /// </summary>
+        public string BaseFileLocation { get; set; }
+
+        /// <summary>
+        /// Where the image the target runs is saved before it is updated, no backup
+        /// when it is not set
+        /// </summary>
+        public string BackupFileLocation { get; set; }
         #endregion
 
         #region Public Functions
@@ -87,15 +105,25 @@ namespace CustomBootloaderFlash.Models
 
             return new List<int>()
             {
-                115200
+                115200,
+                230400,
+                460800,
+                921600,
+                1000000,
+                2000000
             };
         }
 
+        /// <summary>
+        /// Flashes the target. The target always starts at the default baud rate,
+        /// the requested baud rate is negotiated after the hookup.
+        /// </summary>
         public void StartFlash(string portName, int baud)
         {
             IsFlashInProgress = true;
             FlashedBytes = 0;
-            TargetConnect(portName, baud);
+            _targetBaudRate = baud;
+            TargetConnect(portName, DefaultBaudRate);
             while (IsFlashInProgress == true)
             {
                 ExecuteState(_command);
@@ -117,11 +145,13 @@ namespace CustomBootloaderFlash.Models
 
             Logger = Logger.Instance;
 
-            _stateAction = new Action[7, 2]
+            _stateAction = new Action[9, 2]
             {
                 //Next Success, Next Fail
                 { Hookup, TargetDisconnectFailure},  // Connect State
-                { Erase, TargetDisconnectFailure},  // Hookup State
+                { SetBaud, TargetDisconnectFailure},  // Hookup State
+                { ReadSectorCrc, TargetDisconnectFailure},  // Set Baud State
+                { Erase, TargetDisconnectFailure},  // Sector CRC State
                 { Write, TargetDisconnectFailure},  // Erase State
                 { Check, TargetDisconnectFailure},  // Write State
                 { TargetDisconnectSuccess, TargetDisconnectFailure }, // Check state
@@ -174,10 +204,235 @@ namespace CustomBootloaderFlash.Models
         {
             Erase = 0x43,
             Write = 0x31,
+            WriteBulk = 0x32,
+            WriteWindow = 0x33,
+            WriteLz4 = 0x34,
+            WriteDelta = 0x35,
             Check = 0x51,
+            SectorCrc = 0x52,
             Jump = 0xA1,
+            SetBaud = 0x71,
+            GetTimeouts = 0x11,
+            GetStats = 0x12,
+            GetSlots = 0x13,
+            Read = 0x21,
+            SetFraming = 0x72,
+            UpdateRequest = 0x55,   // Handled by the application, not the bootloader
+        };
+
+        /// <summary>
+        /// True once the target takes every message in a frame of the link layer
+        /// </summary>
+        private bool _isFramed = false;
+
+        /// <summary>
+        /// Bytes read from the port and not decoded yet
+        /// </summary>
+        private byte[] _rxChunk = new byte[256];
+        private int _rxChunkNext = 0;
+        private int _rxChunkCount = 0;
+
+        /// <summary>
+        /// Encoded bytes of the frame being received
+        /// </summary>
+        private List<byte> _rxFrame = new List<byte>();
+
+        /// <summary>
+        /// Message bytes of the received frames that have not been read yet
+        /// </summary>
+        private Queue<byte> _rxPayload = new Queue<byte>();
+
+        /// <summary>
+        /// Baud rate the target starts with and falls back to
+        /// </summary>
+        private const int DefaultBaudRate = 115200;
+
+        /// <summary>
+        /// Baud rate requested by the user, negotiated after the hookup
+        /// </summary>
+        private int _targetBaudRate = DefaultBaudRate;
+
+        /// <summary>
+        /// Time in ms added to the target timeouts to cover the transfer delays
+        /// </summary>
+        private const int TimeoutMargin = 250;
+
+        /// <summary>
+        /// Number of attempts to resynchronize at the default baud rate
+        /// </summary>
+        private const int BaudFallbackRetries = 20;
+
+        /// <summary>
+        /// Size of the bulk write frame header: address (4) + number of bytes - 1 (1)
+        /// </summary>
+        private const int WriteBulkHeaderSize = 5;
+
+        /// <summary>
+        /// Maximum number of data bytes carried by one bulk write frame
+        /// </summary>
+        private const int WriteBulkMaxBytes = 256;
+
+        /// <summary>
+        /// Size of the windowed write frame header: seq (1) + bulk frame header
+        /// </summary>
+        private const int WriteWindowHeaderSize = 1 + WriteBulkHeaderSize;
+
+        /// <summary>
+        /// Maximum number of frames in flight in one write window
+        /// </summary>
+        private const int WriteWindowMaxFrames = 8;
+
+        /// <summary>
+        /// Number of consecutive windows without progress before giving up
+        /// </summary>
+        private const int WriteWindowMaxRetries = 3;
+
+        /// <summary>
+        /// Size of the LZ4 write frame header: seq (1) + address (4) +
+        /// compressed length (2) + raw length (2)
+        /// </summary>
+        private const int WriteLz4HeaderSize = 9;
+
+        /// <summary>
+        /// Size of the blocks compressed independently, the target decompresses one
+        /// block at a time
+        /// </summary>
+        private const int Lz4BlockSize = 1024;
+
+        /// <summary>
+        /// Maximum number of frame bytes in one write window, keeps a window within
+        /// the receive buffer of the target
+        /// </summary>
+        private const int WriteWindowMaxBytes = 4096;
+
+        /// <summary>
+        /// Runs of erased (0xFF) bytes shorter than this are sent anyway, a new frame
+        /// costs more than the bytes it skips
+        /// </summary>
+        private const int SparseMinGap = 16;
+
+        /// <summary>
+        /// Maximum number of data bytes in one frame of a read, each frame is
+        /// followed by its CRC
+        /// </summary>
+        private const int ReadFrameSize = 1024;
+
+        /// <summary>
+        /// Number of consecutive reads without progress before giving up
+        /// </summary>
+        private const int ReadMaxRetries = 3;
+
+        /// <summary>
+        /// A range of the image that holds data, everything outside of the extents
+        /// reads as erased flash and is not sent
+        /// </summary>
+        private class ImageExtent
+        {
+            public int Offset { get; set; }
+            public int Length { get; set; }
+        }
+
+        /// <summary>
+        /// Frames of the image that have not been sent yet
+        /// </summary>
+        private Queue<WindowFrame> _pendingFrames = new Queue<WindowFrame>();
+
+        /// <summary>
+        /// Frames that have been sent but not acknowledged yet
+        /// </summary>
+        private List<WindowFrame> _inFlightFrames = new List<WindowFrame>();
+
+        /// <summary>
+        /// Sequence number of the next new frame
+        /// </summary>
+        private byte _nextSeq = 0;
+
+        /// <summary>
+        /// True when the window in flight was sent and its reply not read yet
+        /// </summary>
+        private bool _isWindowSent = false;
+
+        /// <summary>
+        /// Number of bytes of the image that are not sent because they read as
+        /// erased flash
+        /// </summary>
+        private int _skippedBytes = 0;
+
+        /// <summary>
+        /// Protocol timeouts of the target in ms, read after the hookup. The defaults
+        /// apply to targets that cannot report them.
+        /// </summary>
+        private class TargetTimeouts
+        {
+            public int Hookup { get; set; } = 1000;
+            public int Receive { get; set; } = 1000;
+            public int Erase { get; set; } = 4000;
+            public int Crc { get; set; } = 1000;
+            public int BaudConfirm { get; set; } = 250;
+        }
+
+        /// <summary>
+        /// Protocol timeouts of the connected target
+        /// </summary>
+        private TargetTimeouts _targetTimeouts = new TargetTimeouts();
+
+        /// <summary>
+        /// A frame of the image that is in flight in a write window
+        /// </summary>
+        private class WindowFrame
+        {
+            public byte Seq { get; set; }
+            public int Length { get; set; }
+            /// <summary>
+            /// Frame content between the seq and the checksum
+            /// </summary>
+            public byte[] Body { get; set; }
+        }
+
+        /// <summary>
+        /// Start address of the target flash
+        /// </summary>
+        private const Int32 FlashBaseAddress = 0x08000000;
+
+        /// <summary>
+        /// Address the application image is flashed to: the start of the slot the
+        /// image is linked for. Targets without slots only have the one at 0x08008000.
+        /// </summary>
+        private Int32 _applicationStartAddress = 0x08008000;
+
+        /// <summary>
+        /// The slot the target runs from, which holds the base of a delta update.
+        /// The start is -1 when the target runs no slot.
+        /// </summary>
+        private Int32 _baseSlotStart = -1;
+        private Int32 _baseSlotEnd = -1;
+
+        /// <summary>
+        /// Encoder of the delta frames, null when the image is sent whole
+        /// </summary>
+        private Delta _delta = null;
+
+        /// <summary>
+        /// Size of each flash sector of the STM32F411xE: 4x16 KB, 1x64 KB, 3x128 KB
+        /// </summary>
+        private static readonly int[] SectorSizes = new int[]
+        {
+            0x4000, 0x4000, 0x4000, 0x4000, 0x10000, 0x20000, 0x20000, 0x20000
         };
 
+        /// <summary>
+        /// First sector and number of sectors covered by the image, set by the
+        /// erase planner
+        /// </summary>
+        private int _firstSector = (int)TargetSectors.SECTOR_2;
+        private int _numSectors = 0;
+
+        /// <summary>
+        /// Sectors covered by the image that differ from it and have to be erased
+        /// and written, indexed from _firstSector
+        /// </summary>
+        private bool[] _sectorDirty = new bool[0];
+
         private enum TargetSectors
         {
             SECTOR_0 = 0,
@@ -201,11 +456,15 @@ namespace CustomBootloaderFlash.Models
             _serialPort.PortName = portName;
             _serialPort.BaudRate = baud;
             _currentState = ProcessState.Connect;
+            _isFramed = false;
+
+            // The hookup waits for the user to reset the target
+            _serialPort.ReadTimeout = SerialPort.InfiniteTimeout;
 
             try
             {
                 _serialPort.Open();
-                _serialPort.DiscardInBuffer();
+                SerialDiscard();
                 _serialPort.DiscardOutBuffer();
                 Logger.Log("Target connected");
                 IsTargetConnected = true;
@@ -266,10 +525,18 @@ namespace CustomBootloaderFlash.Models
             byte[] tx = new byte[2];
             byte[] tmp = new byte[2];
 
-            // TODO: Send reset command
+            // A running application resets into the bootloader on the update request
+            tx[0] = (byte)TargetCommands.UpdateRequest;
+            tx[1] = CalculateChecksum(tx, 1);
+            SerialWrite(tx, 0, 2);
 
-            // Wait for ACK from target device
-            SerialRead(tmp, 0, 2);
+            // Wait for ACK from target device. An application without the update
+            // request, or a target without one, needs the button held at reset.
+            if (!SerialTryRead(tmp, 0, 2, _targetTimeouts.Hookup + TimeoutMargin))
+            {
+                Logger.Log("Reset the target while holding the user button...");
+                SerialRead(tmp, 0, 2);
+            }
             if (tmp[0] != (byte)TargetResponse.ACK)
             {
                 _command = Command.Next_Fail;
@@ -280,158 +547,179 @@ namespace CustomBootloaderFlash.Models
                 tx[1] = CalculateChecksum(tx, 1);
                 SerialWrite(tx, 0, 2);
                 _command = Command.Next_Sucess;
+                ReadTimeouts();
+                StartFraming();
             }
         }
 
         /// <summary>
-        /// Communicates to the target device to perform a FLASH erase operation
+        /// Asks the target to take every following message in a frame with a length
+        /// and a CRC, so a frame damaged on the line only costs its retransmit.
+        /// Messages stay unframed if the target does not support the command.
         /// </summary>
-        private void Erase()
+        private void StartFraming()
         {
-            _currentState = ProcessState.Erase;
-            Logger.Log("Erasing flash...");
-
-            //return;
-
-            byte[] tx = new byte[3];
+            byte[] tx = new byte[2];
             byte[] tmp = new byte[2];
 
-            // Send the Erase command
-            tx[0] = (byte)TargetCommands.Erase;
+            tx[0] = (byte)TargetCommands.SetFraming;
             tx[1] = CalculateChecksum(tx, 1);
             SerialWrite(tx, 0, 2);
 
-            // Wait for ACK or NACK
+            // Wait for ACK or NACK, still unframed
             SerialRead(tmp, 0, 2);
             if (tmp[0] != (byte)TargetResponse.ACK)
             {
-                // Invalid ACK received
-                Logger.Log("Error erasing flash!");
-                _command = Command.Next_Fail;
+                Logger.Log("Target framing not supported, messages are sent unframed");
                 return;
             }
 
-            tx[0] = 6;                              // Erase 6 sectors (Sector 2 - 7)
-            tx[1] = (byte)TargetSectors.SECTOR_2;   // Initial sector to begin erase
-            tx[2] = CalculateChecksum(tx, 2);       // Checksum
-            SerialWrite(tx, 0, 3);
+            _isFramed = true;
+
+            // A frame lost on the line must not block the reply forever. No reply
+            // takes longer than a sector erase or a CRC run of the target.
+            _serialPort.ReadTimeout = Math.Max(_targetTimeouts.Erase, _targetTimeouts.Crc) + TimeoutMargin;
+        }
+
+        /// <summary>
+        /// Reads the protocol timeouts of the target. The defaults are kept if the
+        /// target does not support the command.
+        /// </summary>
+        private void ReadTimeouts()
+        {
+            byte[] tx = new byte[2];
+            byte[] tmp = new byte[11];
+
+            _targetTimeouts = new TargetTimeouts();
+
+            tx[0] = (byte)TargetCommands.GetTimeouts;
+            tx[1] = CalculateChecksum(tx, 1);
+            SerialWrite(tx, 0, 2);
 
             // Wait for ACK or NACK
             SerialRead(tmp, 0, 2);
             if (tmp[0] != (byte)TargetResponse.ACK)
             {
-                // Invalid ACK received
-                Logger.Log("Error erasing flash!");
-                _command = Command.Next_Fail;
+                Logger.Log("Target timeouts not supported, using the defaults");
+                return;
             }
-            else
+
+            // Reply: hookup, receive, erase, CRC and baud confirmation timeouts, checksum
+            SerialRead(tmp, 0, tmp.Length);
+            if (tmp[tmp.Length - 1] != CalculateChecksum(tmp, tmp.Length - 1))
             {
-                Logger.Log("Flash erase success!");
-                _command = Command.Next_Sucess;
+                Logger.Log("Error reading the target timeouts, using the defaults");
+                return;
             }
 
+            _targetTimeouts.Hookup = BitConverter.ToUInt16(tmp, 0);
+            _targetTimeouts.Receive = BitConverter.ToUInt16(tmp, 2);
+            _targetTimeouts.Erase = BitConverter.ToUInt16(tmp, 4);
+            _targetTimeouts.Crc = BitConverter.ToUInt16(tmp, 6);
+            _targetTimeouts.BaudConfirm = BitConverter.ToUInt16(tmp, 8);
         }
 
-        // Write to the target device
-        private void Write()
+        /// <summary>
+        /// Finds the slot the image is linked for from its header, or from the reset
+        /// vector of an image without one, and checks that it is not the slot the
+        /// target runs from. The running application
+        /// stays bootable until the new one is checked, which commits its slot.
+        /// Targets without slots take the image at 0x08008000.
+        /// </summary>
+        /// <param name="bin">The image</param>
+        /// <returns>true if the image can be flashed</returns>
+        private bool SelectSlot(byte[] bin)
         {
-            _currentState = ProcessState.Write;
-            Logger.Log("Writing to flash...");
-
-            //return;
-
-            // Read bin file
-            byte[] bin = ReadFile();
-            int totalBytes = bin.Length; // the total number of bytes to flash
-            int totalBytesFlashed = 0;     // the total number of bytes flashed to the target
-
-            byte[] tx = new byte[5];
+            byte[] tx = new byte[2];
             byte[] tmp = new byte[2];
+            Int32 slotEnd = GetSectorAddress(SectorSizes.Length);
+            _baseSlotStart = -1;
+            _baseSlotEnd = -1;
 
-            Int32 startAddress = 0x08008000;
+            tx[0] = (byte)TargetCommands.GetSlots;
+            tx[1] = CalculateChecksum(tx, 1);
+            SerialWrite(tx, 0, 2);
 
-            while (totalBytesFlashed < totalBytes)
+            // Wait for ACK or NACK
+            SerialRead(tmp, 0, 2);
+            if (tmp[0] == (byte)TargetResponse.ACK)
             {
-                #region Establishing Write Command
-                // Send the Write command
-                tx[0] = (byte)TargetCommands.Write;
-                tx[1] = CalculateChecksum(tx, 1);
-                SerialWrite(tx, 0, 2);
-
-                // Wait for ACK or NACK
+                // Reply: active slot, number of slots, then start, end and valid
+                // of each slot, checksum
                 SerialRead(tmp, 0, 2);
-                if (tmp[0] != (byte)TargetResponse.ACK)
+                int activeSlot = tmp[0];
+                int numSlots = tmp[1];
+                byte[] rx = new byte[2 + 9 * numSlots + 1];
+                tmp.CopyTo(rx, 0);
+                SerialRead(rx, 2, rx.Length - 2);
+                if (rx[rx.Length - 1] != CalculateChecksum(rx, rx.Length - 1))
                 {
-                    // Invalid ACK received
-                    Logger.Log("Error writing to flash!");
-                    _command = Command.Next_Fail;
-                    return;
+                    Logger.Log("Error reading the target slots!");
+                    return false;
                 }
-                #endregion
 
-                #region Establishing and sending write address
-                //Send start address and checksum
-                byte[] startAddressByte = BitConverter.GetBytes(startAddress);
-                startAddressByte.CopyTo(tx, 0);
-                tx[4] = CalculateChecksum(tx, 4);
-
-                SerialWrite(tx, 0, 5);
-                #endregion
-
-                #region Sending Number of Bytes to send
-                tx[0] = 4;
-                tx[1] = CalculateChecksum(tx, 1);
-                SerialWrite(tx, 0, 2);
-                #endregion
-
-                #region Establishing and sending data to be sent
-                // Will be sending 4 bytes of data at a time
-                for (int i = 0; i < 4; i++)
+                ImageHeader header = ImageHeader.Parse(bin);
+                UInt32 resetVector = bin.Length >= 8 ? BitConverter.ToUInt32(bin, 4) : 0;
+                int imageSlot = -1;
+                for (int i = 0; i < numSlots; i++)
                 {
-                    tx[i] = bin[i + totalBytesFlashed];
+                    Int32 start = BitConverter.ToInt32(rx, 2 + 9 * i);
+                    Int32 end = BitConverter.ToInt32(rx, 6 + 9 * i);
+                    if (header != null ? header.LoadAddress == start : 
+                        (resetVector >= (UInt32)start && resetVector < (UInt32)end))
+                    {
+                        imageSlot = i;
+                        _applicationStartAddress = start;
+                        slotEnd = end;
+                    }
+                    if (i == activeSlot)
+                    {
+                        _baseSlotStart = start;
+                        _baseSlotEnd = end;
+                    }
                 }
-                tx[4] = CalculateChecksum(tx, 4); //Get the checksum
-
-                SerialWrite(tx, 0, 5);
-                #endregion
 
-                #region Determining if write was successful or not
-                // Wait for ACK or NACK
-                SerialRead(tmp, 0, 2);
-                if (tmp[0] != (byte)TargetResponse.ACK)
+                if (imageSlot < 0)
                 {
-                    // Invalid ACK received
-                    // Write was not successful
-                    Logger.Log("Error writing to flash!");
-                    _command = Command.Next_Fail;
-                    return;
+                    Logger.Log("Image is not linked for an application slot!");
+                    return false;
                 }
-                else
+                if (imageSlot == activeSlot)
                 {
-                    // Successful: update the starting address and the totalbytesflashed
-                    startAddress += 4;
-                    totalBytesFlashed += 4;
-                    FlashedBytes = totalBytesFlashed;
+                    Logger.Log($"Image is linked for slot {(char)('A' + imageSlot)}, which the target runs from. " +
+                               "Link it for another slot.");
+                    return false;
+                }
+                Logger.Log($"Flashing slot {(char)('A' + imageSlot)} at 0x{_applicationStartAddress:X8}");
+                if (header != null)
+                {
+                    Logger.Log($"Image version {header.Version}, {header.Length} bytes");
                 }
-                #endregion
             }
 
-            Logger.Log("Flash write success!");
-            _command = Command.Next_Sucess;
-
+            if (_applicationStartAddress + bin.Length > slotEnd)
+            {
+                Logger.Log("Image does not fit in flash!");
+                return false;
+            }
+            return true;
         }
 
-        private void Check()
+        /// <summary>
+        /// Phases profiled by the target, in the order of the stats reply
+        /// </summary>
+        private static readonly string[] StatsPhases = { "Hookup", "Erase", "Receive", "Program", "CRC" };
+
+        /// <summary>
+        /// Reads and clears the profile of the target's phases and logs it. Only
+        /// informative: nothing is logged if the target does not support the command.
+        /// </summary>
+        private void ReadStats()
         {
-            byte[] tx = new byte[5];
+            byte[] tx = new byte[2];
             byte[] tmp = new byte[2];
 
-            _currentState = ProcessState.Check;
-            Logger.Log("Checking flash...");
-
-            #region Establishing Check Command
-            // Send the Write command
-            tx[0] = (byte)TargetCommands.Check;
+            tx[0] = (byte)TargetCommands.GetStats;
             tx[1] = CalculateChecksum(tx, 1);
             SerialWrite(tx, 0, 2);
 
@@ -439,39 +727,925 @@ namespace CustomBootloaderFlash.Models
             SerialRead(tmp, 0, 2);
             if (tmp[0] != (byte)TargetResponse.ACK)
             {
-                // Invalid ACK received
-                Logger.Log("Error checking flash!");
-                _command = Command.Next_Fail;
                 return;
             }
-            #endregion
-
-            #region Establishing and sending start address
-            Int32 startAddress = 0x08008000;
-            //Send start address and checksum
-            byte[] startAddressByte = BitConverter.GetBytes(startAddress);
-            startAddressByte.CopyTo(tx, 0);
-            tx[4] = CalculateChecksum(tx, 4);
 
-            SerialWrite(tx, 0, 5);
+            // Clear after reading, so the next update starts a new profile
+            tx[0] = 1;
+            tx[1] = CalculateChecksum(tx, 1);
+            SerialWrite(tx, 0, 2);
 
-            // Wait for ACK or NACK
-            SerialRead(tmp, 0, 2);
-            if (tmp[0] != (byte)TargetResponse.ACK)
+            // Reply: core clock, idle cycles, flash wait cycles, number of phases,
+            // then count, total, min, max and 8 histogram bins per phase, checksum
+            byte[] rx = new byte[17 + 52 * StatsPhases.Length + 1];
+            SerialRead(rx, 0, rx.Length);
+            if (rx[rx.Length - 1] != CalculateChecksum(rx, rx.Length - 1) ||
+                rx[16] != StatsPhases.Length)
             {
-                // Invalid ACK received
-                Logger.Log("Error checking flash!");
-                _command = Command.Next_Fail;
+                Logger.Log("Error reading the target stats");
                 return;
             }
-            #endregion
 
-            #region Establishing and ending start address
-            byte[] bin = ReadFile();
-            Int32 endAddress = startAddress + bin.Length;
-            //Send start address and checksum
-            byte[] endAddressByte = BitConverter.GetBytes(endAddress);
-            endAddressByte.CopyTo(tx, 0);
+            double cyclesPerMs = BitConverter.ToUInt32(rx, 0) / 1000.0;
+            Logger.Log($"Target idle {BitConverter.ToUInt64(rx, 4) / cyclesPerMs:F1} ms, " +
+                       $"flash wait {BitConverter.ToUInt32(rx, 12) / cyclesPerMs:F1} ms");
+            for (int i = 0; i < StatsPhases.Length; i++)
+            {
+                int offset = 17 + 52 * i;
+                uint count = BitConverter.ToUInt32(rx, offset);
+                if (count == 0)
+                {
+                    continue;
+                }
+                double total = BitConverter.ToUInt64(rx, offset + 4) / cyclesPerMs;
+                double max = BitConverter.ToUInt32(rx, offset + 16) / cyclesPerMs;
+                Logger.Log($"{StatsPhases[i]}: {count} x {total / count:F3} ms, " +
+                           $"max {max:F3} ms, total {total:F1} ms");
+            }
+        }
+
+        /// <summary>
+        /// Negotiates the baud rate selected by the user with the target.
+        /// Falls back to the default baud rate if the target refuses it or if the
+        /// confirmation handshake fails at the new rate.
+        /// </summary>
+        private void SetBaud()
+        {
+            _currentState = ProcessState.SetBaud;
+            _command = Command.Next_Sucess;
+
+            if (_targetBaudRate == DefaultBaudRate)
+            {
+                return;
+            }
+
+            Logger.Log($"Switching to {_targetBaudRate} baud...");
+
+            byte[] tx = new byte[5];
+            byte[] tmp = new byte[2];
+
+            // Send the Set Baud command
+            tx[0] = (byte)TargetCommands.SetBaud;
+            tx[1] = CalculateChecksum(tx, 1);
+            SerialWrite(tx, 0, 2);
+
+            // Wait for ACK or NACK
+            SerialRead(tmp, 0, 2);
+            if (tmp[0] != (byte)TargetResponse.ACK)
+            {
+                Logger.Log("Error switching baud rate!");
+                _command = Command.Next_Fail;
+                return;
+            }
+
+            // Propose the baud rate
+            BitConverter.GetBytes(_targetBaudRate).CopyTo(tx, 0);
+            tx[4] = CalculateChecksum(tx, 4);
+            SerialWrite(tx, 0, 5);
+
+            SerialRead(tmp, 0, 2);
+            if (tmp[0] != (byte)TargetResponse.ACK)
+            {
+                Logger.Log($"Target does not support {_targetBaudRate} baud, staying at {DefaultBaudRate}");
+                return;
+            }
+
+            // Both sides switch, then confirm with a fresh handshake
+            _serialPort.BaudRate = _targetBaudRate;
+            SerialDiscard();
+            tx[0] = (byte)TargetResponse.ACK;
+            tx[1] = CalculateChecksum(tx, 1);
+            SerialWrite(tx, 0, 2);
+
+            if (SerialTryRead(tmp, 0, 2, _targetTimeouts.BaudConfirm + TimeoutMargin) && tmp[0] == (byte)TargetResponse.ACK)
+            {
+                Logger.Log($"Baud rate switched to {_targetBaudRate}");
+                return;
+            }
+
+            // Fall back to the default rate. The target rejects the handshake
+            // as an unknown command once it is back at the default rate.
+            Logger.Log($"Baud rate switch failed, falling back to {DefaultBaudRate}");
+            _serialPort.BaudRate = DefaultBaudRate;
+            for (int i = 0; i < BaudFallbackRetries; i++)
+            {
+                SerialDiscard();
+                SerialWrite(tx, 0, 2);
+                if (SerialTryRead(tmp, 0, 2, _targetTimeouts.BaudConfirm + TimeoutMargin) && 
+                    tmp[0] == (byte)TargetResponse.NACK && tmp[1] == (byte)TargetResponse.NACK)
+                {
+                    return;
+                }
+            }
+
+            Logger.Log("Lost communication with the target!");
+            _command = Command.Next_Fail;
+        }
+
+        /// <summary>
+        /// Reads the CRC of each application sector and compares it with the new image
+        /// to find the sectors that have to be erased and written. Every sector is
+        /// considered different if the target does not support the command.
+        /// </summary>
+        private void ReadSectorCrc()
+        {
+            _currentState = ProcessState.SectorCrc;
+            _command = Command.Next_Sucess;
+            _delta = null;
+
+            byte[] bin = ReadFile();
+            if (!SelectSlot(bin) || !BackupRunningImage())
+            {
+                _command = Command.Next_Fail;
+                return;
+            }
+
+            PlanSectors(_applicationStartAddress, bin.Length);
+            if (_numSectors == 0)
+            {
+                return;
+            }
+
+            Logger.Log("Reading sector CRCs...");
+
+            UInt32[] crcs;
+            if (!RequestSectorCrcs(_firstSector, _numSectors, out crcs))
+            {
+                Logger.Log("Error reading sector CRCs!");
+                _command = Command.Next_Fail;
+                return;
+            }
+            if (crcs == null)
+            {
+                Logger.Log("Sector CRC not supported, writing every sector");
+                return;
+            }
+
+            // The new image, padded with erased flash over the whole planned sectors
+            UInt32[] imageCrcs = SectorCrcs(bin, _applicationStartAddress, _firstSector, _numSectors);
+            int numDirty = 0;
+            for (int i = 0; i < _numSectors; i++)
+            {
+                _sectorDirty[i] = (crcs[i] != imageCrcs[i]);
+                numDirty += _sectorDirty[i] ? 1 : 0;
+            }
+
+            Logger.Log($"{numDirty} of {_numSectors} sectors differ");
+            _delta = PrepareDelta();
+        }
+
+        /// <summary>
+        /// Saves the image of the slot the target runs from, before the update
+        /// replaces it as the active slot. The image header gives its length, an image
+        /// without one is saved with its whole slot.
+        /// </summary>
+        /// <returns>false if the image could not be read</returns>
+        private bool BackupRunningImage()
+        {
+            if (string.IsNullOrEmpty(BackupFileLocation))
+            {
+                return true;
+            }
+            if (_baseSlotStart < 0)
+            {
+                Logger.Log("Target runs no application, nothing to back up");
+                return true;
+            }
+
+            Logger.Log("Backing up the running image...");
+
+            byte[] image;
+            if (!ReadMemory(_baseSlotStart, ImageHeader.Size, out image))
+            {
+                Logger.Log("Error reading the running image!");
+                return false;
+            }
+
+            ImageHeader header = ImageHeader.ParseHeaderOnly(image);
+            int length = (header != null && header.Length <= _baseSlotEnd - _baseSlotStart) ? 
+                         header.Length : _baseSlotEnd - _baseSlotStart;
+            if (!ReadMemory(_baseSlotStart, length, out image))
+            {
+                Logger.Log("Error reading the running image!");
+                return false;
+            }
+
+            File.WriteAllBytes(BackupFileLocation, image);
+            Logger.Log($"Saved {length} bytes to {BackupFileLocation}");
+            return true;
+        }
+
+        /// <summary>
+        /// Reads a range of the target's flash. The target streams the range in frames
+        /// that each end with their CRC. A frame that is lost or does not match its CRC
+        /// is read again with the rest of the range.
+        /// </summary>
+        /// <param name="address">The start address, a multiple of 4</param>
+        /// <param name="length">The number of bytes, a multiple of 4</param>
+        /// <param name="data">The bytes read</param>
+        /// <returns>false if the target does not support the command or the range
+        /// could not be read</returns>
+        private bool ReadMemory(Int32 address, int length, out byte[] data)
+        {
+            byte[] tx = new byte[9];
+            byte[] tmp = new byte[2];
+            byte[] frame = new byte[ReadFrameSize + 4];
+            int offset = 0;
+            int retries = 0;
+            data = new byte[length];
+
+            // The target computes the CRC of a frame, then sends it
+            int frameTimeout = _targetTimeouts.Crc + TimeoutMargin + 
+                               frame.Length * 10 * 1000 / _serialPort.BaudRate;
+
+            while (offset < length && retries < ReadMaxRetries)
+            {
+                // Send the Read command
+                tx[0] = (byte)TargetCommands.Read;
+                tx[1] = CalculateChecksum(tx, 1);
+                SerialWrite(tx, 0, 2);
+
+                // Wait for ACK or NACK
+                SerialRead(tmp, 0, 2);
+                if (tmp[0] != (byte)TargetResponse.ACK)
+                {
+                    return false;
+                }
+
+                BitConverter.GetBytes(address + offset).CopyTo(tx, 0);      // Address
+                BitConverter.GetBytes(length - offset).CopyTo(tx, 4);       // Length
+                tx[8] = CalculateChecksum(tx, 8);                           // Checksum
+                SerialWrite(tx, 0, 9);
+
+                // Wait for ACK or NACK
+                SerialRead(tmp, 0, 2);
+                if (tmp[0] != (byte)TargetResponse.ACK)
+                {
+                    return false;
+                }
+
+                // Frames: data and CRC
+                int start = offset;
+                while (offset < length)
+                {
+                    int count = Math.Min(ReadFrameSize, length - offset);
+                    if (!SerialTryRead(frame, 0, count + 4, frameTimeout) ||
+                        BitConverter.ToUInt32(frame, count) != Crc32.Stm32(frame, 0, count))
+                    {
+                        // The target keeps sending the rest of the range, wait until it
+                        // is done before reading again
+                        SerialDrain(frameTimeout);
+                        break;
+                    }
+
+                    Array.Copy(frame, 0, data, offset, count);
+                    offset += count;
+                }
+
+                retries = (offset > start) ? 0 : retries + 1;
+            }
+
+            return offset == length;
+        }
+
+        /// <summary>
+        /// Reads the hardware CRC of a range of sectors from the target
+        /// </summary>
+        /// <param name="firstSector">The first sector</param>
+        /// <param name="numSectors">The number of sectors</param>
+        /// <param name="crcs">The CRC of each sector, null if the target does not
+        /// support the command</param>
+        /// <returns>false on a communication error</returns>
+        private bool RequestSectorCrcs(int firstSector, int numSectors, out UInt32[] crcs)
+        {
+            byte[] tx = new byte[3];
+            byte[] tmp = new byte[4 * numSectors + 1];
+            crcs = null;
+
+            // Send the Sector CRC command
+            tx[0] = (byte)TargetCommands.SectorCrc;
+            tx[1] = CalculateChecksum(tx, 1);
+            SerialWrite(tx, 0, 2);
+
+            // Wait for ACK or NACK
+            SerialRead(tmp, 0, 2);
+            if (tmp[0] != (byte)TargetResponse.ACK)
+            {
+                return true;
+            }
+
+            tx[0] = (byte)firstSector;              // Initial sector
+            tx[1] = (byte)numSectors;               // Number of sectors
+            tx[2] = CalculateChecksum(tx, 2);       // Checksum
+            SerialWrite(tx, 0, 3);
+
+            // Wait for ACK or NACK
+            SerialRead(tmp, 0, 2);
+            if (tmp[0] != (byte)TargetResponse.ACK)
+            {
+                return false;
+            }
+
+            // Reply: CRC of each sector and checksum
+            SerialRead(tmp, 0, tmp.Length);
+            if (tmp[tmp.Length - 1] != CalculateChecksum(tmp, tmp.Length - 1))
+            {
+                return false;
+            }
+
+            crcs = new UInt32[numSectors];
+            for (int i = 0; i < numSectors; i++)
+            {
+                crcs[i] = BitConverter.ToUInt32(tmp, 4 * i);
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// Computes the CRC the target reports for each sector of a range holding an
+        /// image, with the rest of the sectors erased
+        /// </summary>
+        /// <param name="bin">The image</param>
+        /// <param name="startAddress">The address of the image</param>
+        /// <param name="firstSector">The first sector</param>
+        /// <param name="numSectors">The number of sectors</param>
+        /// <returns>the CRC of each sector</returns>
+        private UInt32[] SectorCrcs(byte[] bin, Int32 startAddress, int firstSector, int numSectors)
+        {
+            int imageOffset = startAddress - GetSectorAddress(firstSector);
+            int offset = 0;
+            UInt32[] crcs = new UInt32[numSectors];
+            byte[] image = Enumerable.Repeat((byte)0xFF, SectorSizes.Skip(firstSector).Take(numSectors).Sum()).ToArray();
+            Array.Copy(bin, 0, image, imageOffset, bin.Length);
+
+            for (int i = 0; i < numSectors; i++)
+            {
+                int size = SectorSizes[firstSector + i];
+                crcs[i] = Crc32.Stm32(image, offset, size);
+                offset += size;
+            }
+            return crcs;
+        }
+
+        /// <summary>
+        /// Sets up a delta update when a base image is given and the slot the target
+        /// runs from still holds it, which its sector CRCs tell
+        /// </summary>
+        /// <returns>the delta encoder, null to send the image whole</returns>
+        private Delta PrepareDelta()
+        {
+            if (string.IsNullOrEmpty(BaseFileLocation) || _baseSlotStart < 0)
+            {
+                return null;
+            }
+
+            byte[] baseBin = ReadFile(BaseFileLocation);
+            ImageHeader header = ImageHeader.Parse(baseBin);
+            if ((header != null && header.LoadAddress != _baseSlotStart) || 
+                _baseSlotStart + baseBin.Length > _baseSlotEnd)
+            {
+                Logger.Log("Base image is not linked for the running slot, sending the whole image");
+                return null;
+            }
+
+            // The sectors of the running slot the base covers
+            int firstSector = -1;
+            int numSectors = 0;
+            for (int sector = 0; sector < SectorSizes.Length; sector++)
+            {
+                Int32 sectorStart = GetSectorAddress(sector);
+                if (sectorStart + SectorSizes[sector] > _baseSlotStart && sectorStart < _baseSlotStart + baseBin.Length)
+                {
+                    firstSector = (firstSector < 0) ? sector : firstSector;
+                    numSectors++;
+                }
+            }
+
+            UInt32[] crcs;
+            if (numSectors == 0 || !RequestSectorCrcs(firstSector, numSectors, out crcs) || crcs == null ||
+                !crcs.SequenceEqual(SectorCrcs(baseBin, _baseSlotStart, firstSector, numSectors)))
+            {
+                Logger.Log("Target does not hold the base image, sending the whole image");
+                return null;
+            }
+
+            Logger.Log("Sending a patch against the base image");
+            return new Delta(baseBin, _baseSlotStart, _baseSlotEnd, _applicationStartAddress);
+        }
+
+        /// <summary>
+        /// Communicates to the target device to perform a FLASH erase operation on
+        /// the sectors that differ from the new image
+        /// </summary>
+        private void Erase()
+        {
+            _currentState = ProcessState.Erase;
+            Logger.Log("Erasing flash...");
+
+            PrepareFrames();
+            int lastDirty = Array.LastIndexOf(_sectorDirty, true);
+
+            // Erase each run of consecutive dirty sectors with one command
+            for (int i = 0; i < _numSectors; i++)
+            {
+                if (!_sectorDirty[i])
+                {
+                    continue;
+                }
+
+                int count = 1;
+                while (i + count < _numSectors && _sectorDirty[i + count])
+                {
+                    count++;
+                }
+
+                if (!EraseSectors(_firstSector + i, count, i + count - 1 == lastDirty))
+                {
+                    // Invalid ACK received
+                    Logger.Log("Error erasing flash!");
+                    _command = Command.Next_Fail;
+                    return;
+                }
+                i += count - 1;
+            }
+
+            Logger.Log("Flash erase success!");
+            _command = Command.Next_Sucess;
+        }
+
+        /// <summary>
+        /// Erases a range of sectors, the target confirms each sector individually
+        /// </summary>
+        /// <param name="firstSector"></param>
+        /// <param name="count"></param>
+        /// <param name="sendWindowAhead">sends the first write window during the erase</param>
+        /// <returns>true if the target acknowledged the erase of every sector</returns>
+        private bool EraseSectors(int firstSector, int count, bool sendWindowAhead)
+        {
+            byte[] tx = new byte[3];
+            byte[] tmp = new byte[2];
+
+            // Send the Erase command
+            tx[0] = (byte)TargetCommands.Erase;
+            tx[1] = CalculateChecksum(tx, 1);
+            SerialWrite(tx, 0, 2);
+
+            // Wait for ACK or NACK
+            SerialRead(tmp, 0, 2);
+            if (tmp[0] != (byte)TargetResponse.ACK)
+            {
+                return false;
+            }
+
+            tx[0] = (byte)count;                    // Number of sectors to erase
+            tx[1] = (byte)firstSector;              // Initial sector to begin erase
+            tx[2] = CalculateChecksum(tx, 2);       // Checksum
+            SerialWrite(tx, 0, 3);
+
+            // The target erases from SRAM while its DMA keeps receiving, so the
+            // first window is buffered on the target instead of waiting for the erase
+            if (sendWindowAhead && _pendingFrames.Count > 0)
+            {
+                SendWindow();
+            }
+
+            // Wait for ACK or NACK of each sector
+            for (int sector = firstSector; sector < firstSector + count; sector++)
+            {
+                SerialRead(tmp, 0, 2);
+                if (tmp[0] != (byte)TargetResponse.ACK)
+                {
+                    Logger.Log($"Error erasing sector {sector}!");
+                    return false;
+                }
+                Logger.Log($"Sector {sector} erased");
+            }
+
+            return true;
+        }
+
+        /// <summary>
+        /// Erase planner: maps the address range of the image to the minimal set of
+        /// sectors. Every sector of the set is considered different from the image.
+        /// </summary>
+        /// <param name="startAddress"></param>
+        /// <param name="length"></param>
+        private void PlanSectors(Int32 startAddress, int length)
+        {
+            _firstSector = (int)TargetSectors.SECTOR_2;
+            _numSectors = 0;
+
+            for (int sector = 0; sector < SectorSizes.Length; sector++)
+            {
+                Int32 sectorStart = GetSectorAddress(sector);
+                if (sectorStart + SectorSizes[sector] > startAddress && sectorStart < startAddress + length)
+                {
+                    if (_numSectors == 0)
+                    {
+                        _firstSector = sector;
+                    }
+                    _numSectors++;
+                }
+            }
+
+            _sectorDirty = Enumerable.Repeat(true, _numSectors).ToArray();
+        }
+
+        /// <summary>
+        /// Returns the start address of a flash sector
+        /// </summary>
+        private Int32 GetSectorAddress(int sector)
+        {
+            return FlashBaseAddress + SectorSizes.Take(sector).Sum();
+        }
+
+        // Write to the target device
+        private void Write()
+        {
+            _currentState = ProcessState.Write;
+            Logger.Log("Writing to flash...");
+
+            //return;
+
+            int totalBytesFlashed = _skippedBytes;  // the total number of bytes flashed to the target
+            int failedWindows = 0;                  // consecutive windows without progress
+            byte[] tmp = new byte[3];
+
+            while (_pendingFrames.Count > 0 || _inFlightFrames.Count > 0)
+            {
+                // The first window may already have been sent during the erase
+                if (!_isWindowSent)
+                {
+                    SendWindow();
+                }
+                _isWindowSent = false;
+
+                #region Processing the selective NACKs
+                // The command is sent together with the window, so a NACKed command
+                // means the target parsed the window as commands
+                bool isWindowReceived;
+                try
+                {
+                    SerialRead(tmp, 0, 2);
+                    isWindowReceived = (tmp[0] == (byte)TargetResponse.ACK);
+
+                    // Reply: ACK/NACK, NACK bitmap, checksum. The bitmap is the
+                    // acknowledgement: every frame with a clear bit is programmed.
+                    if (isWindowReceived)
+                    {
+                        SerialRead(tmp, 0, 3);
+                        if (tmp[2] != CalculateChecksum(tmp, 2))
+                        {
+                            Logger.Log("Error writing to flash!");
+                            _command = Command.Next_Fail;
+                            return;
+                        }
+                    }
+                }
+                catch (TimeoutException)
+                {
+                    // A damaged or lost reply counts as a NACK of the whole window
+                    Logger.Log("Window reply lost");
+                    isWindowReceived = false;
+                }
+
+                List<WindowFrame> nacked = new List<WindowFrame>();
+                for (int i = 0; i < _inFlightFrames.Count; i++)
+                {
+                    if (!isWindowReceived || (tmp[1] & (1 << i)) != 0)
+                    {
+                        nacked.Add(_inFlightFrames[i]);
+                    }
+                    else
+                    {
+                        totalBytesFlashed += _inFlightFrames[i].Length;
+                    }
+                }
+
+                if (nacked.Count == _inFlightFrames.Count)
+                {
+                    // No progress at all
+                    if (++failedWindows >= WriteWindowMaxRetries)
+                    {
+                        Logger.Log("Error writing to flash!");
+                        _command = Command.Next_Fail;
+                        return;
+                    }
+
+                    // The target may have lost the window header and be parsing the
+                    // frames as commands: let its receive timeout drop the partial
+                    // message, then drop its replies. A framed target that replied
+                    // to the window has dropped the damaged frames already.
+                    if (!_isFramed || !isWindowReceived)
+                    {
+                        Thread.Sleep(_targetTimeouts.Receive + TimeoutMargin);
+                        SerialDiscard();
+                    }
+                }
+                else
+                {
+                    failedWindows = 0;
+                }
+
+                if (nacked.Count > 0 && isWindowReceived)
+                {
+                    Logger.Log($"Resending {nacked.Count} frame(s)");
+                }
+
+                _inFlightFrames = nacked;
+                FlashedBytes = totalBytesFlashed;
+                #endregion
+            }
+
+            Logger.Log("Flash write success!");
+            _command = Command.Next_Sucess;
+            ReadStats();
+
+        }
+
+        /// <summary>
+        /// Splits the image into the frames to send. Called before the erase so the
+        /// first window can be sent while the target is erasing.
+        /// </summary>
+        private void PrepareFrames()
+        {
+            // Read bin file
+            byte[] bin = ReadFile();
+            Int32 startAddress = _applicationStartAddress;
+
+            // Sectors that already hold the new image were not erased and are
+            // skipped like erased flash
+            for (int i = 0; i < _numSectors; i++)
+            {
+                int sectorStart = Math.Max(GetSectorAddress(_firstSector + i) - _applicationStartAddress, 0);
+                int sectorEnd = Math.Min(GetSectorAddress(_firstSector + i + 1) - _applicationStartAddress, bin.Length);
+                if (!_sectorDirty[i])
+                {
+                    for (int j = sectorStart; j < sectorEnd; j++)
+                    {
+                        bin[j] = 0xFF;
+                    }
+                }
+            }
+
+            // Only the ranges that differ from erased flash are sent
+            List<ImageExtent> extents = FindExtents(bin);
+            _skippedBytes = bin.Length - extents.Sum(e => e.Length);
+            if (_skippedBytes > 0)
+            {
+                Logger.Log($"Skipping {_skippedBytes} erased bytes");
+            }
+
+            if (_delta != null)
+            {
+                _pendingFrames = BuildDeltaFrames(bin, extents, startAddress);
+            }
+            else
+            {
+                _pendingFrames = UseCompression ? 
+                    BuildLz4Frames(bin, extents, startAddress) : BuildFrames(bin, extents, startAddress);
+            }
+            _inFlightFrames = new List<WindowFrame>();
+            _nextSeq = 0;
+            _isWindowSent = false;
+        }
+
+        /// <summary>
+        /// Fills the write window and sends it, together with its command, without
+        /// waiting for a reply
+        /// </summary>
+        private void SendWindow()
+        {
+            TargetCommands command = (_delta != null) ? TargetCommands.WriteDelta :
+                                     UseCompression ? TargetCommands.WriteLz4 : TargetCommands.WriteWindow;
+            byte[] tx = new byte[4 + WriteWindowMaxFrames * (WriteLz4HeaderSize + Lz4.MaxCompressedSize(Lz4BlockSize) + 1)];
+
+            #region Filling the window
+            // Frames NACKed in the last window are resent with their sequence numbers,
+            // the remaining slots are filled with new frames
+            int windowBytes = _inFlightFrames.Sum(f => f.Body.Length + 2);
+            while (_inFlightFrames.Count < WriteWindowMaxFrames && _pendingFrames.Count > 0 &&
+                   (_inFlightFrames.Count == 0 || windowBytes + _pendingFrames.Peek().Body.Length + 2 <= WriteWindowMaxBytes))
+            {
+                WindowFrame frame = _pendingFrames.Dequeue();
+                frame.Seq = _nextSeq++;
+                windowBytes += frame.Body.Length + 2;
+                _inFlightFrames.Add(frame);
+            }
+            #endregion
+
+            #region Sending the window
+            // Write Window command, window header (number of frames and checksum) and
+            // every frame of the window without waiting for a reply in between. A
+            // framed target takes each frame of the window in a link frame of its own,
+            // so a damaged link frame only loses that one.
+            int count = 0;
+            tx[count++] = (byte)command;
+            tx[count] = CalculateChecksum(tx, count);
+            count++;
+            tx[count++] = (byte)_inFlightFrames.Count;
+            tx[count] = CalculateChecksum(tx, 2, 1);
+            count++;
+            SerialWrite(tx, 0, count);
+
+            foreach (WindowFrame frame in _inFlightFrames)
+            {
+                count = 0;
+                tx[count++] = frame.Seq;
+                frame.Body.CopyTo(tx, count);
+                count += frame.Body.Length;
+                tx[count] = CalculateChecksum(tx, count);
+                count++;
+                SerialWrite(tx, 0, count);
+            }
+            _isWindowSent = true;
+            #endregion
+        }
+
+        /// <summary>
+        /// Splits the image into the word aligned ranges that are not erased (0xFF).
+        /// Ranges separated by less than SparseMinGap erased bytes are merged.
+        /// </summary>
+        private List<ImageExtent> FindExtents(byte[] bin)
+        {
+            List<ImageExtent> extents = new List<ImageExtent>();
+            ImageExtent current = null;
+            int gap = 0;
+
+            for (int offset = 0; offset < bin.Length; offset += 4)
+            {
+                int numBytes = Math.Min(4, bin.Length - offset);
+                bool erased = true;
+                for (int i = 0; i < numBytes; i++)
+                {
+                    erased &= (bin[offset + i] == 0xFF);
+                }
+
+                if (erased)
+                {
+                    gap += numBytes;
+                    continue;
+                }
+
+                if (current != null && gap < SparseMinGap)
+                {
+                    // Short gap: keep sending it as part of the current extent
+                    current.Length += gap + numBytes;
+                }
+                else
+                {
+                    current = new ImageExtent() { Offset = offset, Length = numBytes };
+                    extents.Add(current);
+                }
+                gap = 0;
+            }
+
+            return extents;
+        }
+
+        /// <summary>
+        /// Splits the extents of the image into write window frames:
+        /// address (4), number of bytes - 1 (1), data
+        /// </summary>
+        private Queue<WindowFrame> BuildFrames(byte[] bin, List<ImageExtent> extents, Int32 startAddress)
+        {
+            Queue<WindowFrame> frames = new Queue<WindowFrame>();
+
+            foreach (ImageExtent extent in extents)
+            {
+                int end = extent.Offset + extent.Length;
+                for (int offset = extent.Offset; offset < end; offset += WriteBulkMaxBytes)
+                {
+                    int numBytes = Math.Min(WriteBulkMaxBytes, end - offset);
+                    byte[] body = new byte[WriteBulkHeaderSize + numBytes];
+                    BitConverter.GetBytes(startAddress + offset).CopyTo(body, 0);
+                    body[4] = (byte)(numBytes - 1);
+                    Array.Copy(bin, offset, body, WriteBulkHeaderSize, numBytes);
+
+                    frames.Enqueue(new WindowFrame() { Length = numBytes, Body = body });
+                }
+            }
+
+            return frames;
+        }
+
+        /// <summary>
+        /// Splits the extents of the image into independently compressed LZ4 frames:
+        /// address (4), compressed length (2), raw length (2), LZ4 block
+        /// </summary>
+        private Queue<WindowFrame> BuildLz4Frames(byte[] bin, List<ImageExtent> extents, Int32 startAddress)
+        {
+            Queue<WindowFrame> frames = new Queue<WindowFrame>();
+            int rawBytes = 0;
+            int compressedBytes = 0;
+
+            foreach (ImageExtent extent in extents)
+            {
+                int end = extent.Offset + extent.Length;
+                for (int offset = extent.Offset; offset < end; offset += Lz4BlockSize)
+                {
+                    int numBytes = Math.Min(Lz4BlockSize, end - offset);
+                    byte[] block = Lz4.Compress(bin, offset, numBytes);
+                    byte[] body = new byte[WriteLz4HeaderSize - 1 + block.Length];
+                    BitConverter.GetBytes(startAddress + offset).CopyTo(body, 0);
+                    BitConverter.GetBytes((UInt16)block.Length).CopyTo(body, 4);
+                    BitConverter.GetBytes((UInt16)numBytes).CopyTo(body, 6);
+                    block.CopyTo(body, WriteLz4HeaderSize - 1);
+                    rawBytes += numBytes;
+                    compressedBytes += body.Length + 2;
+
+                    frames.Enqueue(new WindowFrame() { Length = numBytes, Body = body });
+                }
+            }
+
+            Logger.Log($"Compressed {rawBytes} bytes to {compressedBytes} bytes");
+            return frames;
+        }
+
+        /// <summary>
+        /// Splits the extents of the image into delta frames, each patching one block
+        /// against the base image: address (4), patch length (2), raw length (2), patch
+        /// </summary>
+        private Queue<WindowFrame> BuildDeltaFrames(byte[] bin, List<ImageExtent> extents, Int32 startAddress)
+        {
+            Queue<WindowFrame> frames = new Queue<WindowFrame>();
+            int rawBytes = 0;
+            int patchBytes = 0;
+
+            foreach (ImageExtent extent in extents)
+            {
+                int end = extent.Offset + extent.Length;
+                for (int offset = extent.Offset; offset < end; offset += Lz4BlockSize)
+                {
+                    int numBytes = Math.Min(Lz4BlockSize, end - offset);
+                    byte[] patch = _delta.Encode(bin, offset, numBytes);
+                    byte[] body = new byte[WriteLz4HeaderSize - 1 + patch.Length];
+                    BitConverter.GetBytes(startAddress + offset).CopyTo(body, 0);
+                    BitConverter.GetBytes((UInt16)patch.Length).CopyTo(body, 4);
+                    BitConverter.GetBytes((UInt16)numBytes).CopyTo(body, 6);
+                    patch.CopyTo(body, WriteLz4HeaderSize - 1);
+                    rawBytes += numBytes;
+                    patchBytes += body.Length + 2;
+
+                    frames.Enqueue(new WindowFrame() { Length = numBytes, Body = body });
+                }
+            }
+
+            Logger.Log($"Patched {rawBytes} bytes with {patchBytes} bytes");
+            return frames;
+        }
+
+        private void Check()
+        {
+            byte[] tx = new byte[5];
+            byte[] tmp = new byte[2];
+
+            _currentState = ProcessState.Check;
+            Logger.Log("Checking flash...");
+
+            #region Establishing Check Command
+            // Send the Write command
+            tx[0] = (byte)TargetCommands.Check;
+            tx[1] = CalculateChecksum(tx, 1);
+            SerialWrite(tx, 0, 2);
+
+            // Wait for ACK or NACK
+            SerialRead(tmp, 0, 2);
+            if (tmp[0] != (byte)TargetResponse.ACK)
+            {
+                // Invalid ACK received
+                Logger.Log("Error checking flash!");
+                _command = Command.Next_Fail;
+                return;
+            }
+            #endregion
+
+            #region Establishing and sending start address
+            Int32 startAddress = _applicationStartAddress;
+            //Send start address and checksum
+            byte[] startAddressByte = BitConverter.GetBytes(startAddress);
+            startAddressByte.CopyTo(tx, 0);
+            tx[4] = CalculateChecksum(tx, 4);
+
+            SerialWrite(tx, 0, 5);
+
+            // Wait for ACK or NACK
+            SerialRead(tmp, 0, 2);
+            if (tmp[0] != (byte)TargetResponse.ACK)
+            {
+                // Invalid ACK received
+                Logger.Log("Error checking flash!");
+                _command = Command.Next_Fail;
+                return;
+            }
+            #endregion
+
+            #region Establishing and ending start address
+            byte[] bin = ReadFile();
+            Int32 endAddress = startAddress + bin.Length;
+            //Send start address and checksum
+            byte[] endAddressByte = BitConverter.GetBytes(endAddress);
+            endAddressByte.CopyTo(tx, 0);
             tx[4] = CalculateChecksum(tx, 4);
 
             SerialWrite(tx, 0, 5);
@@ -516,11 +1690,17 @@ namespace CustomBootloaderFlash.Models
             SerialWrite(tx, 0, 2);
         }
 
-        // Reads the firmware file and returns it
+        // Reads the firmware file and returns it, up to the length in its image header
         private byte[] ReadFile()
+        {
+            return ReadFile(FileLocation);
+        }
+
+        // Reads a firmware file and returns it, up to the length in its image header
+        private byte[] ReadFile(string fileLocation)
         {
             byte[] bin;
-            using (var s = new FileStream(FileLocation, FileMode.Open, FileAccess.Read))
+            using (var s = new FileStream(fileLocation, FileMode.Open, FileAccess.Read))
             {
                 /* allocate memory */
                 bin = new byte[s.Length];
@@ -529,6 +1709,13 @@ namespace CustomBootloaderFlash.Models
                 s.Read(bin, 0, bin.Length);
             }
 
+            // The erase, the transfer and the check are planned from the length
+            ImageHeader header = ImageHeader.Parse(bin);
+            if (header != null && header.Length < bin.Length)
+            {
+                Array.Resize(ref bin, header.Length);
+            }
+
             return bin;
         }
 
@@ -544,12 +1731,135 @@ namespace CustomBootloaderFlash.Models
             var bs = _serialPort.BaseStream;
             int br = 0;
 
+            if (_isFramed)
+            {
+                for (int i = 0; i < count; i++)
+                {
+                    while (_rxPayload.Count == 0)
+                    {
+                        SerialReadFrame();
+                    }
+                    buffer[offset + i] = _rxPayload.Dequeue();
+                }
+                return;
+            }
+
             while (br < count)
             {
                 br += bs.Read(buffer, offset + br, count - br);
             }
         }
 
+        /// <summary>
+        /// Reads up to the end of the next frame and queues its message
+        /// </summary>
+        private void SerialReadFrame()
+        {
+            var bs = _serialPort.BaseStream;
+
+            while (true)
+            {
+                if (_rxChunkNext == _rxChunkCount)
+                {
+                    _rxChunkCount = bs.Read(_rxChunk, 0, _rxChunk.Length);
+                    _rxChunkNext = 0;
+                }
+
+                byte b = _rxChunk[_rxChunkNext++];
+                if (b != LinkFrame.Delimiter)
+                {
+                    _rxFrame.Add(b);
+                    continue;
+                }
+
+                // Every frame starts with a delimiter too
+                if (_rxFrame.Count == 0)
+                {
+                    continue;
+                }
+
+                byte[] message = LinkFrame.Decode(_rxFrame.ToArray());
+                _rxFrame.Clear();
+                if (message == null)
+                {
+                    // A damaged frame counts as a message that did not arrive
+                    throw new TimeoutException("Frame failed its check");
+                }
+                foreach (byte m in message)
+                {
+                    _rxPayload.Enqueue(m);
+                }
+                return;
+            }
+        }
+
+        /// <summary>
+        /// Drops everything received, bytes and frames not read yet
+        /// </summary>
+        private void SerialDiscard()
+        {
+            _serialPort.DiscardInBuffer();
+            _rxChunkNext = 0;
+            _rxChunkCount = 0;
+            _rxFrame.Clear();
+            _rxPayload.Clear();
+        }
+
+        /// <summary>
+        /// Drops everything received until the target stops sending
+        /// </summary>
+        /// <param name="timeout">time in ms without a byte</param>
+        private void SerialDrain(int timeout)
+        {
+            int readTimeout = _serialPort.ReadTimeout;
+            byte[] tmp = new byte[_rxChunk.Length];
+
+            try
+            {
+                _serialPort.ReadTimeout = timeout;
+                while (true)
+                {
+                    _serialPort.BaseStream.Read(tmp, 0, tmp.Length);
+                }
+            }
+            catch (TimeoutException)
+            {
+            }
+            finally
+            {
+                _serialPort.ReadTimeout = readTimeout;
+                SerialDiscard();
+            }
+        }
+
+        /// <summary>
+        /// Read from serial port that gives up after a timeout
+        /// </summary>
+        /// <param name="buffer"></param>
+        /// <param name="offset"></param>
+        /// <param name="count"></param>
+        /// <param name="timeout">timeout in ms</param>
+        /// <returns>true if count bytes were read</returns>
+        private bool SerialTryRead(byte[] buffer, int offset, int count, int timeout)
+        {
+            int readTimeout = _serialPort.ReadTimeout;
+
+            try
+            {
+                _serialPort.ReadTimeout = timeout;
+                SerialRead(buffer, offset, count);
+                return true;
+            }
+            catch (TimeoutException)
+            {
+                return false;
+            }
+            finally
+            {
+                _serialPort.ReadTimeout = readTimeout;
+            }
+        }
+
         /// <summary>
         /// Asycnhronously writes to the target
         /// </summary>
@@ -560,6 +1870,14 @@ namespace CustomBootloaderFlash.Models
         private void SerialWrite(byte[] data, int offset, int count)
         {
             var bs = _serialPort.BaseStream;
+
+            if (_isFramed)
+            {
+                byte[] frame = LinkFrame.Encode(data, offset, count);
+                bs.Write(frame, 0, frame.Length);
+                return;
+            }
+
             bs.Write(data, offset, count);
         }
 
@@ -570,9 +1888,21 @@ namespace CustomBootloaderFlash.Models
         /// <param name="count"></param>
         /// <returns></returns>
         private byte CalculateChecksum(byte[] data, int count)
+        {
+            return CalculateChecksum(data, 0, count);
+        }
+
+        /// <summary>
+        /// Returns an 8-bit two's complement XOR checksum of a part of the buffer
+        /// </summary>
+        /// <param name="data"></param>
+        /// <param name="offset"></param>
+        /// <param name="count"></param>
+        /// <returns></returns>
+        private byte CalculateChecksum(byte[] data, int offset, int count)
         {
             byte checksum = 0xFF;
-            for (int i = 0; i < count; i++)
+            for (int i = offset; i < offset + count; i++)
             {
                 checksum ^= data[i];
             }
@@ -591,6 +1921,8 @@ namespace CustomBootloaderFlash.Models
         {
             Connect,
             Hookup,
+            SetBaud,
+            SectorCrc,
             Erase,
             Write,
             Check,
@@ -621,7 +1953,16 @@ namespace CustomBootloaderFlash.Models
 
         private void ExecuteState(Command command)
         {
-            _stateAction[(int)_currentState, (int)command].Invoke();
+            try
+            {
+                _stateAction[(int)_currentState, (int)command].Invoke();
+            }
+            catch (TimeoutException)
+            {
+                // A reply that did not arrive or failed its frame check
+                Logger.Log("Target stopped responding!");
+                _command = Command.Next_Fail;
+            }
         }
         #endregion
     }
@@ -47,6 +47,10 @@ namespace CustomBootloaderFlash.ViewModels
 
         private string _filepath;
 
+        private string _baseFilepath;
+
+        private string _backupFilepath;
+
         #region Progress Bar
         /// <summary>
         /// The maximum value for the progress bar
@@ -165,6 +169,30 @@ namespace CustomBootloaderFlash.ViewModels
                 UpdateFileSize();
             }
         }
+        /// <summary>
+        /// Delegate command for the browse base file
+        /// </summary>
+        public DelegateCommand BrowseBaseFile_Command { get; private set; }
+        /// <summary>
+        /// The file path of the image the target runs, to send a patch against
+        /// </summary>
+        public string BaseFilePath
+        {
+            get { return _baseFilepath; }
+            private set { SetProperty(ref _baseFilepath, value); }
+        }
+        /// <summary>
+        /// Delegate command for the browse backup file
+        /// </summary>
+        public DelegateCommand BrowseBackupFile_Command { get; private set; }
+        /// <summary>
+        /// The file path the image the target runs is backed up to before the update
+        /// </summary>
+        public string BackupFilePath
+        {
+            get { return _backupFilepath; }
+            private set { SetProperty(ref _backupFilepath, value); }
+        }
         #endregion
 
         #region Flash Button
@@ -189,6 +217,8 @@ namespace CustomBootloaderFlash.ViewModels
             #region Delegate Commands
             TestConnect_Command = new DelegateCommand(TestConnect_CommandExecute, TestConnect_CommandCanExecute);
             BrowseFile_Command = new DelegateCommand(BrowseFile_CommandExecute).ObservesCanExecute(() => BrowseFile_IsEnabled);
+            BrowseBaseFile_Command = new DelegateCommand(BrowseBaseFile_CommandExecute).ObservesCanExecute(() => BrowseFile_IsEnabled);
+            BrowseBackupFile_Command = new DelegateCommand(BrowseBackupFile_CommandExecute).ObservesCanExecute(() => BrowseFile_IsEnabled);
             Flash_Command = new DelegateCommand(Flash_CommandExecute, Flash_CommandCanExecute);
             #endregion
 
@@ -238,6 +268,30 @@ namespace CustomBootloaderFlash.ViewModels
             }
         }
 
+        private void BrowseBaseFile_CommandExecute()
+        {
+            OpenFileDialog fileDialog = new OpenFileDialog()
+            {
+                Filter = ".bin | *.bin"
+            };
+
+            // Cancelling clears the base, so the image is sent whole
+            BaseFilePath = (fileDialog.ShowDialog() == true) ? fileDialog.FileName : null;
+            TargetFlashLogic.BaseFileLocation = BaseFilePath;
+        }
+
+        private void BrowseBackupFile_CommandExecute()
+        {
+            SaveFileDialog fileDialog = new SaveFileDialog()
+            {
+                Filter = ".bin | *.bin"
+            };
+
+            // Cancelling clears the backup, so the running image is not read
+            BackupFilePath = (fileDialog.ShowDialog() == true) ? fileDialog.FileName : null;
+            TargetFlashLogic.BackupFileLocation = BackupFilePath;
+        }
+
         private void UpdateFileSize()
         {
             FileInfo fileInfo = new FileInfo(FilePath);
@@ -0,0 +1,41 @@
+﻿using System;
+using System.IO;
+using CustomBootloaderFlash.Models;
+
+namespace ImageHeaderTool
+{
+    /// <summary>
+    /// Post-link tool: fills in the image header of a linked application binary, so
+    /// the bootloader can validate the image and the flash utility can plan its update
+    /// from the header alone.
+    /// Usage: ImageHeaderTool input.bin [output.bin]
+    /// The input is overwritten when no output is given.
+    /// </summary>
+    public static class Program
+    {
+        public static int Main(string[] args)
+        {
+            if (args.Length < 1 || args.Length > 2)
+            {
+                Console.Error.WriteLine("Usage: ImageHeaderTool input.bin [output.bin]");
+                return 2;
+            }
+
+            try
+            {
+                byte[] image = ImageHeader.Fill(File.ReadAllBytes(args[0]));
+                ImageHeader header = ImageHeader.Parse(image);
+                File.WriteAllBytes(args.Length > 1 ? args[1] : args[0], image);
+
+                Console.WriteLine($"Image version {header.Version} at 0x{header.LoadAddress:X8}: " +
+                                  $"{header.Length} bytes, CRC 0x{header.Crc:X8}, entry point 0x{header.EntryPoint:X8}");
+                return 0;
+            }
+            catch (Exception ex) when (ex is IOException || ex is ArgumentException || ex is UnauthorizedAccessException)
+            {
+                Console.Error.WriteLine($"ImageHeaderTool: {ex.Message}");
+                return 1;
+            }
+        }
+    }
+}
@@ -50,6 +50,48 @@
 #define USERLED_GPIO_Port GPIOA
 
 /* USER CODE BEGIN Private defines */
+#include <stdint.h>
+
+#define APP_VERSION         1U
+
+/* Update request: the application writes the boot flag to RTC->BKP0R and
+   resets, the bootloader then waits for the flash utility. It is requested
+   with B1, or by the flash utility on USART2 with the request byte followed
+   by its checksum (the same byte). */
+#define BOOT_FLAG_UPDATE    0x55504454U   /* "UPDT" */
+#define UPDATE_REQUEST      0x55U
+#define UPDATE_BAUDRATE     115200U       /* The bootloader's default rate */
+#define USERBUTTON_Pin GPIO_PIN_13        /* B1, active low, external pull-up */
+#define USERBUTTON_GPIO_Port GPIOC
+#define IMAGE_HEADER_MAGIC  0x48474D49U   /* "IMGH" */
+#define IMAGE_HEADER_SIZE   0x200U        /* The vector table follows, VTOR aligned */
+/* The Reg_Blinky_SlotB target defines IMAGE_SLOT_B and links for slot B */
+#if defined(IMAGE_SLOT_B)
+#define IMAGE_LOAD_ADDRESS  0x08020000U   /* Slot B */
+#else
+#define IMAGE_LOAD_ADDRESS  0x08008000U   /* Slot A */
+#endif
+
+/* The image header the bootloader validates the application with. The
+   application links the magic, header size, version and load address, the
+   post-link tool ImageHeaderTool fills in the rest */
+typedef struct
+{
+  uint32_t Magic;
+  uint32_t HeaderSize;
+  uint32_t Version;
+  uint32_t Length;        /* Bytes of the image, header included */
+  uint32_t Crc;           /* CRC of the bytes after the header */
+  uint32_t EntryPoint;
+  uint32_t LoadAddress;
+  uint32_t HeaderCrc;     /* CRC of the words above */
+} IMAGE_HEADER;
+
+extern const IMAGE_HEADER ImageHeader;
+
+void Update_Init(void);
+uint8_t Update_IsRequested(void);
+void Update_Request(void);
 
 /* USER CODE END Private defines */
 
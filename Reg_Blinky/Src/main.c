@@ -47,6 +47,18 @@
 
 /* USER CODE BEGIN PV */
 /* Private variables ---------------------------------------------------------*/
+/* Placed at the start of the image by the scatter file */
+const IMAGE_HEADER ImageHeader __attribute__((section("ImageHeader"), used)) =
+{
+  IMAGE_HEADER_MAGIC,
+  IMAGE_HEADER_SIZE,
+  APP_VERSION,
+  0xFFFFFFFFU,            /* Filled in after the link */
+  0xFFFFFFFFU,
+  0xFFFFFFFFU,
+  IMAGE_LOAD_ADDRESS,
+  0xFFFFFFFFU,
+};
 
 /* USER CODE END PV */
 
@@ -63,8 +75,8 @@ static void MX_GPIO_Init(void);
 uint32_t CrcRom(void)
 {
   uint32_t Crc = 100;
-  uint32_t *Buffer = (uint32_t *)0x08000000;
-  uint32_t Size = 0x4000 / sizeof(uint32_t);
+  uint32_t *Buffer = (uint32_t *)(ImageHeader.LoadAddress + ImageHeader.HeaderSize);
+  uint32_t Size = (ImageHeader.Length - ImageHeader.HeaderSize) / sizeof(uint32_t);
  
   // Enable the CRC peripheral clock
   __HAL_RCC_CRC_CLK_ENABLE();
@@ -76,7 +88,7 @@ uint32_t CrcRom(void)
   while(Size--)
     CRC->DR = *Buffer++;
  
-  // Final CRC32 should resolved to ZERO
+  // Final CRC32 should match the image header
   Crc = CRC->DR;
  
   // Disable the CRC peripheral clock
@@ -84,12 +96,76 @@ uint32_t CrcRom(void)
  
   return(Crc);
 }
+
+/* B1 and USART2 (PA2/PA3, the ST-LINK virtual COM port), polled from the
+   main loop */
+void Update_Init(void)
+{
+  GPIO_InitTypeDef GPIO_InitStruct;
+
+  __HAL_RCC_GPIOA_CLK_ENABLE();
+  __HAL_RCC_GPIOC_CLK_ENABLE();
+  __HAL_RCC_USART2_CLK_ENABLE();
+
+  GPIO_InitStruct.Pin = USERBUTTON_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+  HAL_GPIO_Init(USERBUTTON_GPIO_Port, &GPIO_InitStruct);
+
+  GPIO_InitStruct.Pin = GPIO_PIN_2 | GPIO_PIN_3;
+  GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+  GPIO_InitStruct.Pull = GPIO_PULLUP;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+  GPIO_InitStruct.Alternate = GPIO_AF7_USART2;
+  HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+
+  /* 16x oversampling: BRR is the clock over the baud rate */
+  USART2->BRR = (HAL_RCC_GetPCLK1Freq() + (UPDATE_BAUDRATE / 2U)) / UPDATE_BAUDRATE;
+  USART2->CR1 = USART_CR1_UE | USART_CR1_TE | USART_CR1_RE;
+}
+
+/* Returns 1 while B1 is pressed, or once the request and its checksum
+   were received */
+uint8_t Update_IsRequested(void)
+{
+  static uint8_t previous = 0;
+  uint8_t data;
+  uint8_t requested;
+
+  if(HAL_GPIO_ReadPin(USERBUTTON_GPIO_Port, USERBUTTON_Pin) == GPIO_PIN_RESET)
+  {
+    return 1;
+  }
+
+  /* Reading SR then DR also clears an overrun */
+  if((USART2->SR & USART_SR_RXNE) == 0)
+  {
+    return 0;
+  }
+  data = (uint8_t)USART2->DR;
+  requested = ((previous == UPDATE_REQUEST) && (data == UPDATE_REQUEST)) ? 1 : 0;
+  previous = data;
+
+  return requested;
+}
+
+/* Sets the boot flag and resets into the bootloader. The backup registers
+   keep the flag over the reset. */
+void Update_Request(void)
+{
+  __HAL_RCC_PWR_CLK_ENABLE();
+  HAL_PWR_EnableBkUpAccess();
+  RTC->BKP0R = BOOT_FLAG_UPDATE;
+  NVIC_SystemReset();
+}
 /* USER CODE END 0 */
 
 int main(void)
 {
   uint8_t val;
-  uint32_t flash_crc = (uint8_t)(*(volatile uint32_t *)0x0800BFFCU);
+  uint32_t flash_crc = ImageHeader.Crc;
+  uint32_t toggle_tick;
   
    
   HAL_Init();
@@ -98,15 +174,24 @@ int main(void)
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
-   
+  Update_Init();
   
+  toggle_tick = HAL_GetTick();
   while (1)
   {
   /* USER CODE END WHILE */
-    HAL_GPIO_TogglePin(USERLED_GPIO_Port, USERLED_Pin);
-    HAL_Delay(1000);
+    if((HAL_GetTick() - toggle_tick) >= 1000U)
+    {
+      toggle_tick += 1000U;
+      HAL_GPIO_TogglePin(USERLED_GPIO_Port, USERLED_Pin);
+    }
     
   /* USER CODE BEGIN 3 */
+    /* The flash utility updates the application without a hand on the board */
+    if(Update_IsRequested() == 1)
+    {
+      Update_Request();
+    }
 
   }
   /* USER CODE END 3 */
@@ -108,8 +108,15 @@
 /*!< Uncomment the following line if you need to relocate your vector Table in
      Internal SRAM. */
 /* #define VECT_TAB_SRAM */
-#define VECT_TAB_OFFSET  0x8000 /*!< Vector Table base offset field. 
-                                   This value must be a multiple of 0x200. */
+#if defined(IMAGE_SLOT_B)
+#define VECT_TAB_OFFSET  0x20200 /*!< Vector Table base offset field. 
+                                   This value must be a multiple of 0x200.
+                                   Slot B, the image header comes first. */
+#else
+#define VECT_TAB_OFFSET  0x8200 /*!< Vector Table base offset field. 
+                                   This value must be a multiple of 0x200.
+                                   The image header comes first.        */
+#endif
 /******************************************************************************/
 
 /**